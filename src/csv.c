@@ -0,0 +1,407 @@
+/*
+  CSV and TSV input
+
+  Copyright (C) 2011 Someone <someone@example.com>
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <config.h>
+#include <stdbool.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "freeq/libfreeq.h"
+#include "libfreeq-private.h"
+#include "csv.h"
+
+/**
+ * csv_open:
+ * @rd: reader to set up
+ * @ctx: freeq library context, for logging
+ * @fn: file to read
+ * @map: map @fn if it is a regular file rather than read it
+ *
+ * Open @fn for reading records.  A file something else may truncate
+ * while it is being read shouldn't be mapped, touching the pages it
+ * lost raises SIGBUS.  The separator is rd->delim, which the caller
+ * sets and may change between records.
+ *
+ * Returns: 0 on success, -errno if @fn can't be opened
+ **/
+int csv_open(struct csv_reader *rd, struct freeq_ctx *ctx, const char *fn, bool map)
+{
+        int err;
+
+        memset(rd, 0, sizeof(*rd));
+        rd->ctx = ctx;
+        rd->fn = fn;
+        rd->nextline = 1;
+        if ((rd->fd = open(fn, O_RDONLY)) < 0 || fstat(rd->fd, &rd->st) != 0)
+        {
+                err = -errno;
+                err(ctx, "unable to open %s: %s\n", fn, strerror(errno));
+                if (rd->fd >= 0)
+                        close(rd->fd);
+                return err;
+        }
+
+        if (map && S_ISREG(rd->st.st_mode) && rd->st.st_size > 0)
+        {
+                rd->buf = mmap(NULL, rd->st.st_size, PROT_READ, MAP_PRIVATE, rd->fd, 0);
+                if (rd->buf != MAP_FAILED)
+                {
+                        madvise(rd->buf, rd->st.st_size, MADV_SEQUENTIAL);
+                        rd->len = rd->st.st_size;
+                        rd->mapped = true;
+                        rd->eof = true;
+                        return 0;
+                }
+                dbg(ctx, "unable to map %s, reading it instead\n", fn);
+        }
+
+        rd->size = CSV_BUF_SIZE;
+        rd->buf = g_malloc(rd->size);
+        return 0;
+}
+
+/**
+ * csv_close:
+ * @rd: reader
+ *
+ * Close the file and release what @rd holds.  Fields read from it
+ * are no longer valid.
+ **/
+void csv_close(struct csv_reader *rd)
+{
+        if (rd->mapped)
+                munmap(rd->buf, rd->len);
+        else
+                g_free(rd->buf);
+        g_free(rd->fields);
+        g_free(rd->scratch);
+        close(rd->fd);
+}
+
+/* moves what is left of the window to its start and reads more after
+ * it, a record longer than the window makes it grow */
+static int csv_fill(struct csv_reader *rd)
+{
+        ssize_t n;
+
+        if (rd->pos > 0)
+        {
+                memmove(rd->buf, rd->buf + rd->pos, rd->len - rd->pos);
+                rd->len -= rd->pos;
+                rd->offset += rd->pos;
+                rd->pos = 0;
+        }
+        if (rd->len == rd->size)
+        {
+                rd->size *= 2;
+                rd->buf = g_realloc(rd->buf, rd->size);
+        }
+
+        do {
+                n = read(rd->fd, rd->buf + rd->len, rd->size - rd->len);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0)
+        {
+                err(rd->ctx, "unable to read %s: %s\n", rd->fn, strerror(errno));
+                return -1;
+        }
+        if (n == 0)
+                rd->eof = true;
+        rd->len += n;
+        return 0;
+}
+
+/**
+ * csv_expect:
+ * @rd: reader
+ * @n: most fields a record may have
+ *
+ * Records may have up to @n fields from here on, a record with more
+ * fails to split.
+ **/
+void csv_expect(struct csv_reader *rd, int n)
+{
+        if (n > rd->maxfields)
+                rd->fields = g_renew(struct csv_field, rd->fields, n);
+        rd->maxfields = n;
+}
+
+/**
+ * csv_release:
+ * @rd: reader
+ *
+ * Hand the mapped pages before the next record back to the kernel.
+ * Fields already read from them are no longer valid.
+ **/
+void csv_release(struct csv_reader *rd)
+{
+        size_t upto;
+
+        if (!rd->mapped)
+                return;
+        upto = rd->pos & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+        if (upto > rd->released)
+        {
+                madvise(rd->buf + rd->released, upto - rd->released, MADV_DONTNEED);
+                rd->released = upto;
+        }
+}
+
+/* the newline ending the record at @p, NULL if the record runs past
+ * @end.  by the rules csv_split() reads fields with, only a quote at
+ * the start of a field opens a quoted one, and the first quote in it
+ * that isn't doubled closes it */
+static const char *record_end(const char *p, const char *end, char delim, unsigned long *lines)
+{
+        const char *nl, *q;
+        bool start = true;
+
+        /* most records hold no quotes at all */
+        *lines = 1;
+        if ((nl = memchr(p, '\n', end - p)) == NULL)
+                return NULL;
+        if (memchr(p, '"', nl - p) == NULL)
+                return nl;
+
+        for (; p < end; p++)
+        {
+                if (start && *p == '"')
+                {
+                        for (p++; ; p += 2)
+                        {
+                                if ((q = memchr(p, '"', end - p)) == NULL)
+                                        return NULL;
+                                for (; (nl = memchr(p, '\n', q - p)) != NULL; p = nl + 1)
+                                        (*lines)++;
+                                p = q;
+                                /* a doubled quote may be cut in two */
+                                if (p + 1 == end)
+                                        return NULL;
+                                if (p[1] != '"')
+                                        break;
+                        }
+                        start = false;
+                        continue;
+                }
+                if (*p == '\n')
+                        return p;
+                start = *p == delim;
+        }
+        return NULL;
+}
+
+/**
+ * csv_next:
+ * @rd: reader
+ * @rec: returns the start of the record
+ * @recend: returns its end, before the line ending
+ *
+ * Find the next record, reading more of the file if needed.  The
+ * record stays valid until the next call.
+ *
+ * Returns: 1 if there is a record, 0 at the end of the input and -1
+ * on errors
+ **/
+int csv_next(struct csv_reader *rd, const char **rec, const char **recend)
+{
+        const char *p, *nl;
+        unsigned long lines;
+
+        for (;;)
+        {
+                p = rd->buf + rd->pos;
+                if ((nl = record_end(p, rd->buf + rd->len, rd->delim, &lines)) != NULL)
+                {
+                        rd->pos = nl + 1 - rd->buf;
+                        break;
+                }
+                if (rd->eof)
+                {
+                        /* the last line needn't end in a newline */
+                        if (rd->pos == rd->len)
+                                return 0;
+                        nl = rd->buf + rd->len;
+                        rd->pos = rd->len;
+                        break;
+                }
+                if (csv_fill(rd))
+                        return -1;
+        }
+
+        rd->line = rd->nextline;
+        rd->nextline += lines;
+        if (nl > p && nl[-1] == '\r')
+                nl--;
+        *rec = p;
+        *recend = nl;
+        return 1;
+}
+
+/**
+ * csv_split:
+ * @rd: reader
+ * @p: start of a record from csv_next()
+ * @end: its end
+ *
+ * Split a record into rd->fields.  Unquoted fields point into the
+ * input and quoted ones into a scratch buffer as long as the record,
+ * so it never moves under the fields already split.
+ *
+ * Returns: the number of fields, -1 if the record can't be split
+ **/
+int csv_split(struct csv_reader *rd, const char *p, const char *end)
+{
+        struct csv_field *f;
+        const char *q;
+        char *out;
+        int n = 0;
+
+        if (rd->scratchsize < (size_t)(end - p))
+        {
+                g_free(rd->scratch);
+                rd->scratchsize = MAX((size_t)(end - p), 2 * rd->scratchsize);
+                rd->scratch = g_malloc(rd->scratchsize);
+        }
+        out = rd->scratch;
+
+        for (;;)
+        {
+                if (n == rd->maxfields)
+                {
+                        err(rd->ctx, "%s:%lu: more than %d fields\n", rd->fn, rd->line, rd->maxfields);
+                        return -1;
+                }
+                f = &(rd->fields[n++]);
+
+                if (p < end && *p == '"')
+                {
+                        f->s = out;
+                        for (p++; ; p++)
+                        {
+                                if ((q = memchr(p, '"', end - p)) == NULL)
+                                {
+                                        err(rd->ctx, "%s:%lu: unterminated quote\n", rd->fn, rd->line);
+                                        return -1;
+                                }
+                                memcpy(out, p, q - p);
+                                out += q - p;
+                                p = q + 1;
+                                if (p == end || *p != '"')
+                                        break;
+                                *out++ = '"';
+                        }
+                        f->len = out - f->s;
+                        if (p < end && *p != rd->delim)
+                        {
+                                err(rd->ctx, "%s:%lu: text after a quoted field\n", rd->fn, rd->line);
+                                return -1;
+                        }
+                }
+                else
+                {
+                        if ((q = memchr(p, rd->delim, end - p)) == NULL)
+                                q = end;
+                        f->s = p;
+                        f->len = q - p;
+                        p = q;
+                }
+
+                if (p == end)
+                        return n;
+                p++;
+        }
+}
+
+/**
+ * csv_read_fields:
+ * @rd: reader
+ *
+ * Read the next record that isn't blank into rd->fields, see
+ * csv_next() and csv_split().
+ *
+ * Returns: the number of fields, 0 at the end of the input and -1 on
+ * errors
+ **/
+int csv_read_fields(struct csv_reader *rd)
+{
+        const char *rec, *end;
+        int r;
+
+        do {
+                if ((r = csv_next(rd, &rec, &end)) <= 0)
+                        return r;
+        } while (rec == end);
+
+        if ((r = csv_split(rd, rec, end)) < 0)
+                return -1;
+        return r;
+}
+
+/* drops the blanks around a field */
+void csv_trim(struct csv_field *f)
+{
+        while (f->len > 0 && (*f->s == ' ' || *f->s == '\t'))
+                f->s++, f->len--;
+        while (f->len > 0 && (f->s[f->len - 1] == ' ' || f->s[f->len - 1] == '\t'))
+                f->len--;
+}
+
+/* a field that is a decimal integer in the range of int64_t */
+bool csv_number(const struct csv_field *f, int64_t *val)
+{
+        const char *p = f->s, *end = f->s + f->len;
+        bool neg = false;
+        uint64_t v = 0;
+
+        if (p < end && (*p == '-' || *p == '+'))
+                neg = *p++ == '-';
+        if (p == end)
+                return false;
+        for (; p < end; p++)
+        {
+                unsigned d = (unsigned char)*p - '0';
+                if (d > 9 || v > (UINT64_MAX - d) / 10)
+                        return false;
+                v = v * 10 + d;
+        }
+        if (v > (uint64_t)INT64_MAX + neg)
+                return false;
+        *val = neg ? (int64_t)(0 - v) : (int64_t)v;
+        return true;
+}
+
+/* strtod and inet_pton want a terminated string */
+bool csv_cstr(const struct csv_field *f, char *buf, size_t size)
+{
+        if (f->len == 0 || f->len >= size)
+                return false;
+        memcpy(buf, f->s, f->len);
+        buf[f->len] = '\0';
+        return true;
+}
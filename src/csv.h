@@ -0,0 +1,92 @@
+/*
+  CSV and TSV input
+
+  Copyright (C) 2011 Someone <someone@example.com>
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _FREEQ_CSV_H_
+#define _FREEQ_CSV_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <freeq/libfreeq.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * csv_reader
+ *
+ * records of fields separated by delim, quoted as in RFC 4180: a
+ * field that starts with a quote runs to the matching quote and can
+ * hold the separator, newlines and quotes, doubled.  a quote anywhere
+ * else in a field is just a character.  lines may end in CRLF, and
+ * the last one needn't end at all.
+ *
+ * a regular file opened with map is mapped and read front to back,
+ * anything else is read through a window that starts at
+ * CSV_BUF_SIZE and grows to hold the longest record.
+ */
+#define CSV_BUF_SIZE (1024 * 1024)
+
+struct csv_field {
+	const char *s;
+	size_t len;
+};
+
+struct csv_reader {
+	struct freeq_ctx *ctx;
+	const char *fn;
+	int fd;
+	struct stat st;
+	char *buf;		/* the mapped file, or a window of it */
+	size_t len;		/* bytes in buf */
+	size_t size;		/* of the window */
+	size_t offset;		/* of the window in the file */
+	size_t pos;		/* start of the next record */
+	size_t released;	/* mapped bytes handed back */
+	bool mapped;
+	bool eof;		/* nothing past buf + len */
+	unsigned long line;	/* of the current record */
+	unsigned long nextline;
+	char delim;
+	struct csv_field *fields;
+	int maxfields;
+	char *scratch;		/* quoted fields of the record */
+	size_t scratchsize;
+};
+
+int csv_open(struct csv_reader *rd, struct freeq_ctx *ctx, const char *fn, bool map);
+void csv_close(struct csv_reader *rd);
+void csv_expect(struct csv_reader *rd, int n);
+void csv_release(struct csv_reader *rd);
+int csv_next(struct csv_reader *rd, const char **rec, const char **recend);
+int csv_split(struct csv_reader *rd, const char *p, const char *end);
+int csv_read_fields(struct csv_reader *rd);
+void csv_trim(struct csv_field *f);
+bool csv_number(const struct csv_field *f, int64_t *val);
+bool csv_cstr(const struct csv_field *f, char *buf, size_t size);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -40,6 +40,59 @@ extern "C" {
 
 #define FREEQ_ERR 1
 #define FREEQ_OK 0
+#define FREEQ_EOF 2
+#define FREEQ_REFUSED 3
+
+/*
+ * wire framing
+ *
+ * every table travels as one frame: a fixed 12 byte prefix of magic,
+ * version, flags, two reserved bytes and the big-endian length of the
+ * body, followed by the body and, if FREEQ_FRAME_CRC32C is set, a
+ * big-endian CRC32C of the body.
+ *
+ * a query result, or a table too large to publish at once, may span
+ * several frames, all but the last flagged FREEQ_FRAME_MORE.  FREEQ_FRAME_ERROR marks an error frame, which
+ * ends a result in place of its last frame.  a table sent with
+ * FREEQ_FRAME_ACK is answered by an ack, or by an error frame if the
+ * receiver read it but could not take it.
+ *
+ * FREEQ_FRAME_DELTA marks a table keyed on one of its columns.  after
+ * the column blocks it carries the key column, whether the rows are
+ * only the ones that changed since the last table of the same name on
+ * the stream, and the keys of the rows that went away since.
+ */
+#define FREEQ_FRAME_MAGIC "FRQT"
+#define FREEQ_FRAME_VERSION 1
+#define FREEQ_FRAME_HEADER_LEN 12
+#define FREEQ_FRAME_MAX (256 * 1024 * 1024)
+#define FREEQ_FRAME_CRC32C 0x01
+#define FREEQ_FRAME_DICT 0x02
+#define FREEQ_FRAME_ACK 0x04
+#define FREEQ_FRAME_MORE 0x08
+#define FREEQ_FRAME_ERROR 0x10
+#define FREEQ_FRAME_DELTA 0x20
+
+/*
+ * frame compression
+ *
+ * byte 6 of the prefix names the codec the body is compressed with,
+ * FREEQ_CODEC_NONE for a plain body.  a compressed body is the varint
+ * length of the plain body followed by the codec's output, and the
+ * CRC32C covers the body as sent.  byte 7 of an ack is a mask, bit
+ * 1 << codec, of the codecs its sender is willing to read; that is
+ * how a sender learns what it may use.
+ */
+#define FREEQ_CODEC_NONE 0
+#define FREEQ_CODEC_LZ4 1
+#define FREEQ_CODEC_ZSTD 2
+#define FREEQ_COMPRESS_MIN 512
+#define FREEQ_COMPRESS_PARALLEL (1024 * 1024)
+
+#define FREEQ_RESULT_CHUNK_ROWS 1024
+#define FREEQ_RESULT_CHUNK_BYTES (1024 * 1024)
+
+#define FREEQ_MAX_COLUMNS 4096
 
 /*
  * freeq_ctx
@@ -61,8 +114,9 @@ typedef enum
 typedef struct freeq_generation_t freeq_generation_t;
 struct freeq_generation_t
 {
-	unsigned int refcount;
+	volatile gint refcount;
 	time_t era;
+	bool sealed;
 	GHashTable *tables;
 	GStringChunk *strings;
 	GRWLock rw_lock;
@@ -78,7 +132,15 @@ int freeq_get_log_priority(struct freeq_ctx *ctx);
 void freeq_set_log_priority(struct freeq_ctx *ctx, int priority);
 const char *freeq_get_identity(struct freeq_ctx *ctx);
 void freeq_set_identity(struct freeq_ctx *ctx, const char *identity);
+uint8_t freeq_get_frame_flags(struct freeq_ctx *ctx);
+void freeq_set_frame_flags(struct freeq_ctx *ctx, uint8_t flags);
+uint8_t freeq_codecs(void);
+uint8_t freeq_get_compression(struct freeq_ctx *ctx);
+int freeq_set_compression(struct freeq_ctx *ctx, uint8_t codec, int level);
+int freeq_set_zstd_dict(struct freeq_ctx *ctx, const char *name, const void *dict, size_t len);
 int freeq_generation_new(freeq_generation_t **gen);
+freeq_generation_t *freeq_generation_ref(freeq_generation_t *gen);
+void freeq_generation_unref(freeq_generation_t *gen);
 /*
  * freeq_list
  *
@@ -92,6 +154,7 @@ typedef uint8_t freeq_coltype_t;
 #define FREEQ_COL_TIME 3
 #define FREEQ_COL_IPV4ADDR 4
 #define FREEQ_COL_IPV6ADDR 5
+#define FREEQ_COL_DOUBLE 6
 
 
 /* typedef enum */
@@ -104,14 +167,62 @@ typedef uint8_t freeq_coltype_t;
 /*	FREEQ_COL_IPV6ADDR, */
 /* } freeq_coltype_t; */
 
+/*
+ * column storage
+ *
+ * cells are kept in one contiguous GArray per column.  the element
+ * type depends on the column type:
+ *
+ *   FREEQ_COL_NUMBER, FREEQ_COL_TIME   int64_t
+ *   FREEQ_COL_DOUBLE                   double
+ *   FREEQ_COL_STRING                   freeq_str_t
+ *   FREEQ_COL_IPV4ADDR                 uint32_t (network byte order)
+ *   FREEQ_COL_IPV6ADDR                 struct in6_addr
+ *
+ * string cells point into the owning table's GStringChunk, a NULL
+ * str is a null cell.
+ */
+typedef struct {
+	const char *str;
+	uint32_t len;
+} freeq_str_t;
+
 struct freeq_column {
 	freeq_coltype_t coltype;
 	char *name;
-	GSList *data;
+	GArray *values;
 };
 
+#define freeq_column_number(c, i) g_array_index((c)->values, int64_t, (i))
+#define freeq_column_time(c, i) g_array_index((c)->values, int64_t, (i))
+#define freeq_column_double(c, i) g_array_index((c)->values, double, (i))
+#define freeq_column_string(c, i) g_array_index((c)->values, freeq_str_t, (i))
+#define freeq_column_ipv4(c, i) g_array_index((c)->values, uint32_t, (i))
+#define freeq_column_ipv6(c, i) g_array_index((c)->values, struct in6_addr, (i))
+
+/*
+ * table segments
+ *
+ * a merged table is the concatenation of the rows each sender
+ * reported.  senders maps a sender's identity to its segment, and
+ * the segment keeps the string chunk its cells point into.  when a
+ * sender reports again its old segment is marked dead and the new
+ * rows are appended; dead rows stay in the columns until the table
+ * is compacted.
+ */
+struct freeq_segment {
+	uint32_t start;
+	uint32_t numrows;
+	bool dead;
+	GStringChunk *strings;
+};
+
+struct freeq_arena;
+struct freeq_delta;
+
 struct freeq_table {
 	struct freeq_ctx *ctx;
+	struct freeq_arena *arena;
 	int refcount;
 	uint32_t numrows;
 	uint32_t serial;
@@ -121,7 +232,11 @@ struct freeq_table {
 	bool destroy_data;
 	GStringChunk *strings;
 	GHashTable *senders;
+	GPtrArray *segments;
+	uint32_t deadrows;
 	GRWLock *rw_lock;
+	int keycol;
+	struct freeq_delta *delta;
 	struct freeq_table *next;
 	struct freeq_column columns[];
 };
@@ -167,6 +282,15 @@ int freeq_table_column_new(struct freeq_ctx *ctx,
 /*	     column != NULL; \ */
 /*	     column = freeq_column_get_next(column)) */
 
+/*
+ * freeq_dict
+ *
+ * string dictionary shared by the tables sent over one stream
+ */
+struct freeq_dict;
+int freeq_dict_new(struct freeq_dict **dict);
+void freeq_dict_free(struct freeq_dict *dict);
+
 /*
  * freeq_table
  *
@@ -175,19 +299,54 @@ int freeq_table_column_new(struct freeq_ctx *ctx,
 
 struct freeq_table *freeq_table_ref(struct freeq_table *table);
 struct freeq_table *freeq_table_unref(struct freeq_table *table);
+char *freeq_table_strdup(struct freeq_table *table, const char *s);
 struct freeq_ctx *freeq_table_get_ctx(struct freeq_table *table);
 
 int freeq_table_write(struct freeq_ctx *c, struct freeq_table *table, int sock);
 int freeq_table_bio_write(struct freeq_ctx *c, struct freeq_table *table, BIO *b);
+int freeq_table_bio_write_dict(struct freeq_ctx *c, struct freeq_table *table, BIO *b, struct freeq_dict *dict);
+int freeq_table_encode(struct freeq_ctx *c, struct freeq_table *table, GByteArray *out, uint8_t flags, struct freeq_dict *dict);
 int freeq_table_read(struct freeq_ctx *c, struct freeq_table **table, int sock);
 int freeq_table_bio_read(struct freeq_ctx *c, struct freeq_table **table, BIO *b, GStringChunk *strchunk);
+int freeq_table_bio_read_dict(struct freeq_ctx *c, struct freeq_table **table, BIO *b, GStringChunk *strchunk, struct freeq_dict *dict, uint8_t *flags);
+int freeq_bio_write_ack(struct freeq_ctx *c, BIO *b);
+int freeq_bio_read_ack(struct freeq_ctx *c, BIO *b);
+int freeq_bio_write_offer(struct freeq_ctx *c, BIO *b, uint8_t codecs);
+int freeq_frame_compress(struct freeq_ctx *c, GByteArray *frame, guint start, uint8_t codec);
+int freeq_table_mem_read(struct freeq_ctx *c, struct freeq_table **table, const void *buf, size_t len, GStringChunk *strchunk, struct freeq_dict *dict);
 int freeq_table_bio_read_header(struct freeq_ctx *ctx, struct freeq_table **t, BIO *b);
 int freeq_table_bio_read_tabledata(struct freeq_ctx *ctx, struct freeq_table *t, BIO *b, GStringChunk *strchnk);
 int freeq_init_ssl(struct freeq_ctx *ctx, freeq_mode_t mode);
 SSL *freeq_ssl_new(struct freeq_ctx *ctx);
 int freeq_table_ssl_read(struct freeq_ctx *ctx, struct freeq_table **tbl, SSL *ssl);
 int freeq_table_sendto_ssl(struct freeq_ctx *freeqctx, struct freeq_table *t);
+
+/*
+ * freeq_conn
+ *
+ * persistent publisher connection to an aggregator
+ */
+#define FREEQ_SERVER_DEFAULT "localhost:13001"
+
+struct freeq_conn;
+int freeq_conn_new(struct freeq_ctx *ctx, const char *server, struct freeq_conn **conn);
+void freeq_conn_free(struct freeq_conn *conn);
+int freeq_conn_send(struct freeq_conn *conn, struct freeq_table *t);
+int freeq_conn_send_more(struct freeq_conn *conn, struct freeq_table *t);
+int freeq_conn_set_compression(struct freeq_conn *conn, uint8_t codec);
+
+/*
+ * query results
+ *
+ * results are produced a chunk at a time and handed to a
+ * freeq_emit_fn, which returns nonzero to stop the query.
+ */
+typedef int (*freeq_emit_fn)(struct freeq_ctx *ctx, const uint8_t *buf, size_t len, void *arg);
+int freeq_sqlite_encode(struct freeq_ctx *ctx, sqlite4_stmt *pStmt, uint32_t chunkrows, freeq_emit_fn emit, void *arg);
+int freeq_table_encode_chunks(struct freeq_ctx *ctx, struct freeq_table *t, uint32_t chunkrows, freeq_emit_fn emit, void *arg);
 int freeq_sqlite_to_bio(struct freeq_ctx *freeqctx, BIO *b, sqlite4_stmt *pStmt);
+int freeq_error_encode(struct freeq_ctx *ctx, const char *errmsg, GByteArray *out);
+int freeq_error_write_sock(struct freeq_ctx *ctx, const char *errmsg, BIO *b);
 
 int freeq_table_new(struct freeq_ctx *ctx,
 		    const char *name,
@@ -205,8 +364,50 @@ int freeq_table_new_fromcols(struct freeq_ctx *ctx,
 			     GStringChunk *strchnk,
 			     bool destroy_data);
 
+int freeq_table_new_empty(struct freeq_ctx *ctx,
+			  const char *name,
+			  int numcols,
+			  freeq_coltype_t coltypes[],
+			  const char *colnames[],
+			  struct freeq_table **table);
+
+int freeq_table_new_merge(struct freeq_ctx *ctx,
+			  struct freeq_table *schema,
+			  GStringChunk *strchnk,
+			  struct freeq_table **table);
+int freeq_table_merge(struct freeq_ctx *ctx, struct freeq_table *dst, struct freeq_table *src);
+void freeq_table_compact(struct freeq_table *table);
+int freeq_table_copy(struct freeq_ctx *ctx, struct freeq_table *table, struct freeq_table **copy);
+int freeq_table_append_rows(struct freeq_ctx *ctx, struct freeq_table *dst, struct freeq_table *src);
+
+/*
+ * inter-report deltas
+ *
+ * a table with a key column declared can go over a stream as the
+ * difference from the last table of the same name sent on it.
+ */
+void freeq_table_set_key(struct freeq_table *table, int col);
+int freeq_table_delta(struct freeq_ctx *ctx, struct freeq_table *prev, struct freeq_table *table, struct freeq_table **delta);
+int freeq_table_apply_delta(struct freeq_ctx *ctx, struct freeq_table *base, struct freeq_table *delta, struct freeq_table **table);
+
+/*
+ * column builders
+ *
+ * append one cell to column @col, a row is complete once every
+ * column has been appended to and freeq_table_end_row is called.
+ */
+void freeq_table_append_number(struct freeq_table *t, int col, int64_t val);
+void freeq_table_append_time(struct freeq_table *t, int col, int64_t val);
+void freeq_table_append_double(struct freeq_table *t, int col, double val);
+void freeq_table_append_string(struct freeq_table *t, int col, const char *s, ssize_t len);
+void freeq_table_append_ipv4(struct freeq_table *t, int col, uint32_t addr);
+void freeq_table_append_ipv6(struct freeq_table *t, int col, const struct in6_addr *addr);
+void freeq_table_end_row(struct freeq_table *t);
+int freeq_table_clear(struct freeq_table *t);
+
 int freeq_table_header_from_msgpack(struct freeq_ctx *ctx, char *buf, size_t bufsize, struct freeq_table **table);
 int freeq_ssl_query(struct freeq_ctx *ctx, const char *server, const char *sql, struct freeq_table **t);
+int freeq_result_bio_read(struct freeq_ctx *ctx, struct freeq_table **t, BIO *b);
 //struct freeq_column *freeq_table_get_some_column(struct freeq_table *table);
 
 #ifdef __cplusplus
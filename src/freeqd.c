@@ -6,6 +6,13 @@
 
 #include <signal.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
@@ -13,6 +20,8 @@
 #include "sqlite4.h"
 #include "freeq/libfreeq.h"
 #include "libfreeq-private.h"
+#include "query.h"
+#include "stats.h"
 
 #include <arpa/inet.h>
 
@@ -40,22 +49,43 @@ thread_info_t pthread_info;
 
 sqlite4 *pDb;
 
+/*
+ * generations
+ *
+ * current is the generation tables are merged into.  anyone using a
+ * generation holds a reference to it, taken with
+ * current_generation().  status_logger swaps in a new generation and
+ * queues the old one on retired, where the publisher seals it,
+ * writes it out and drops the state's reference.  the generation is
+ * freed once the last merge or reader still holding it lets go.
+ *
+ * previous keeps the last retired generation around, queries are
+ * answered from it once it is sealed rather than from the partly
+ * reported current one.
+ */
 struct freeqd_state {
         freeq_generation_t *current;
+        freeq_generation_t *previous;
         GRWLock rw_lock;
+        GAsyncQueue *retired;
 };
 
+static freeq_generation_t *current_generation(struct freeqd_state *fst)
+{
+        freeq_generation_t *gen;
+
+        g_rw_lock_reader_lock(&fst->rw_lock);
+        gen = freeq_generation_ref(fst->current);
+        g_rw_lock_reader_unlock(&fst->rw_lock);
+        return gen;
+}
+
 struct srv_ctx {
         sqlite4 *pDb;
         struct freeq_ctx *freeqctx;
         struct freeqd_state *fst;
 };
 
-struct conn_ctx {
-        struct srv_ctx *srvctx;
-        BIO *client;
-};
-
 void handle_table(struct freeq_ctx *ctx, SSL *ssl)
 {
         BIO  *buf_io, *ssl_bio;
@@ -83,52 +113,61 @@ void g_hash_destroy_freeq_table(gpointer data) {
         freeq_table_unref(tbl);
 }
 
-int generation_table_merge(struct freeq_ctx *ctx, struct freeqd_state *fst, BIO *bio)
+int generation_table_merge(struct freeq_ctx *ctx, freeq_generation_t *gen, struct freeq_table *tbl)
 {
-        struct freeq_table *tbl;
-        struct freeq_table *curtbl;
-        freeq_generation_t *gen = fst->current;
+        struct freeq_table *curtbl, *newtbl;
+        gint64 start = g_get_monotonic_time();
         int err;
 
-        /* this needs to be moved outside this function */
-        err = freeq_table_bio_read(ctx, &tbl, bio, gen->strings);
-        if (err)
+        /* every sender's rows for a table name go into one merged
+         * table per generation, a sender reporting twice replaces
+         * its earlier rows.
+         *
+         * the generation's map is only read locked while merging,
+         * each merged table has its own lock, so tables with
+         * different names merge in parallel.  the map is write
+         * locked just to add a name nobody has sent yet. */
+        g_rw_lock_reader_lock(&(gen->rw_lock));
+        freeq_stats_observe(FREEQ_HIST_MERGE_WAIT, g_get_monotonic_time() - start);
+        if (gen->sealed)
         {
-                dbg(ctx, "unable to read tabledata\n");
-                return err;
+                /* the publisher got here first, the caller retries
+                 * with the next generation */
+                g_rw_lock_reader_unlock(&(gen->rw_lock));
+                return -EAGAIN;
         }
 
-        freeq_table_print(ctx, tbl, stdout);
-
-        /* if we need to be able to replace node/tables in a
-         * generation, another option would be to use a tree instead
-         * of a linked list. Or we could store a pointer to the head
-         * and tail of each senders segment of the list and remove
-         * it */
-
-        g_rw_lock_writer_lock(&(gen->rw_lock));
         curtbl = (struct freeq_table *)g_hash_table_lookup(gen->tables, tbl->name);
-        if (curtbl != NULL)
+        if (curtbl == NULL)
         {
-                dbg(ctx, "at least one host has sent %s for this generation\n", tbl->name);
-                if (curtbl->senders != NULL && g_hash_table_contains(curtbl->senders, tbl->identity))
-                {
-                        /* we already put a table from this sender into this generation
-                           what should we do?
-                         */
-                        dbg(ctx, "uh oh, we heard from this sender twice in a generation :(\n");
-                }
+                g_rw_lock_reader_unlock(&(gen->rw_lock));
+                if ((err = freeq_table_new_merge(ctx, tbl, gen->strings, &newtbl)))
+                        return err;
+
+                g_rw_lock_writer_lock(&(gen->rw_lock));
+                if (!gen->sealed && g_hash_table_lookup(gen->tables, tbl->name) == NULL)
+                        g_hash_table_insert(gen->tables, g_strdup(tbl->name), newtbl);
                 else
+                        freeq_table_unref(newtbl);
+                g_rw_lock_writer_unlock(&(gen->rw_lock));
+
+                g_rw_lock_reader_lock(&(gen->rw_lock));
+                if (gen->sealed)
                 {
-                        /* merge the tables */
-                        dbg(ctx, "would be merging tables here!\n");
+                        g_rw_lock_reader_unlock(&(gen->rw_lock));
+                        return -EAGAIN;
                 }
-                g_rw_lock_writer_unlock(&(gen->rw_lock));
-                return 1;
+                curtbl = (struct freeq_table *)g_hash_table_lookup(gen->tables, tbl->name);
         }
+        else
+                dbg(ctx, "at least one host has sent %s for this generation\n", tbl->name);
+
+        err = freeq_table_merge(ctx, curtbl, tbl);
+        g_rw_lock_reader_unlock(&(gen->rw_lock));
+        if (err)
+                return err;
 
-        g_hash_table_insert(gen->tables, tbl->name, tbl);
-        g_rw_lock_writer_unlock(&(gen->rw_lock));
+        freeq_table_unref(tbl);
         return FREEQ_OK;
 }
 
@@ -152,109 +191,20 @@ int generation_table_merge(struct freeq_ctx *ctx, struct freeqd_state *fst, BIO
 /*	g_hash_table_insert(gen->tables, tbl->name, hash); */
 /* } */
 
-int bio_peername(BIO *bio, char **hostname)
-{
-        int sock_fd;
-        if (BIO_get_fd(bio, &sock_fd) == -1)
-        {
-                fprintf(stderr, "Uninitialized socket passed to worker");
-                return 1;
-        }
-
-        printf("socket fd: %i\n", sock_fd);
-        struct sockaddr addr;
-        socklen_t addr_len;
-
-        char *hn = malloc(sizeof(char) * 80);
-        if (!hostname)
-        {
-                fprintf(stderr, "Out of memory\n");
-                return 1;
-        }
-
-        addr_len = sizeof(addr);
-        getpeername(sock_fd, &addr, &addr_len);
-        if (addr.sa_family == AF_INET)
-                inet_ntop(AF_INET,
-                          &((struct sockaddr_in *)&addr)->sin_addr,
-                          hn, 40);
-        else if (addr.sa_family == AF_INET6)
-                inet_ntop(AF_INET6,
-                          &((struct sockaddr_in6 *)&addr)->sin6_addr,
-                          hn, 40);
-        else
-        {
-                fprintf(stderr, "Unknown socket type passed to worker(): %i\n",
-                        addr.sa_family);
-        }
-
-        *hostname = hn;
-        return 0;
-}
-
-void* conn_handler(void *arg)
-{
-        long err;
-        SSL *ssl;
-        struct conn_ctx *ctx = (struct conn_ctx *)arg;
-        struct freeq_ctx *freeqctx = ctx->srvctx->freeqctx;
-        struct freeqd_state *fst = ctx->srvctx->fst;
-        BIO *client = ctx->client;
-
-        pthread_detach(pthread_self());
-
-        ssl = freeq_ssl_new(freeqctx);
-        SSL_set_bio(ssl, client, client);
-        if (SSL_accept(ssl) <= 0)
-        {
-                int_error("Error accepting SSL connection");
-                return NULL;
-        }
-
-        if ((err = post_connection_check(freeqctx, ssl, "localhost")) != X509_V_OK)
-        {
-                err(freeqctx, "error: peer certificate: %s\n", X509_verify_cert_error_string(err));
-                int_error("Error checking SSL object after connection");
-        }
-
-        BIO  *buf_io, *ssl_bio;
-        buf_io = BIO_new(BIO_f_buffer());
-        ssl_bio = BIO_new(BIO_f_ssl());
-        BIO_set_ssl(ssl_bio, ssl, BIO_CLOSE);
-        BIO_push(buf_io, ssl_bio);
-
-        dbg(freeqctx, "ssl client connection opened\n");
-        if (generation_table_merge(freeqctx, fst, buf_io))
-        {
-                err(freeqctx, "table merge failed\n");
-                SSL_shutdown(ssl);
-        }
-        else
-        {
-                dbg(freeqctx, "table merged ok\n");
-                SSL_clear(ssl);
-        }
-
-        dbg(freeqctx, "ssl client connection closed\n");
-        SSL_free(ssl);
-
-        ERR_remove_state(0);
-        return 0;
-}
-
 const char *freeq_sqlite_typexpr[] = {
         "NULL",
         "VARCHAR(255)",
         "INTEGER",
         "INTEGER",
         "INTEGER",
-        "INTEGER"
+        "INTEGER",
+        "REAL"
 };
 
 const freeq_coltype_t sqlite_to_freeq_coltype[] = {
         FREEQ_COL_NULL,   // 0 undefined
         FREEQ_COL_NUMBER, // 1 SQLITE_INTEGER,
-        FREEQ_COL_NUMBER, // 2 SQLITE_FLOAT,
+        FREEQ_COL_DOUBLE, // 2 SQLITE_FLOAT,
         FREEQ_COL_STRING, // 3 SQLITE_TEXT,
         FREEQ_COL_STRING, // 4 SQLITE_BLOB,
         FREEQ_COL_NULL,   // 5 SQLITE_NULL
@@ -282,119 +232,232 @@ int table_ddl(struct freeq_ctx *ctx, struct freeq_table *tbl, GString *stm)
         return 0;
 }
 
-int ddl_insert(struct freeq_ctx *ctx, struct freeq_table *tbl, GString *stm)
+int ddl_insert(struct freeq_ctx *ctx, struct freeq_table *tbl, uint32_t rows, GString *stm)
 {
-        g_string_printf(stm, "INSERT INTO %s VALUES (", tbl->name);
-        for (int i = 1; i < tbl->numcols; i++)
-                g_string_append_printf(stm, "?%d,", i);
-        g_string_append_printf(stm, "?%d);", tbl->numcols);
+        uint32_t n = 1;
+
+        g_string_printf(stm, "INSERT INTO %s VALUES ", tbl->name);
+        for (uint32_t r = 0; r < rows; r++)
+        {
+                g_string_append_c(stm, '(');
+                for (uint32_t i = 0; i < tbl->numcols; i++, n++)
+                        g_string_append_printf(stm, "?%u%s", n, i < tbl->numcols - 1 ? "," : "");
+                g_string_append(stm, r < rows - 1 ? ")," : ");");
+        }
         dbg(ctx, "statement: %s\n", stm->str);
         return 0;
 }
 
-int tbl_to_db(struct freeq_ctx *ctx, struct freeq_table *tbl, sqlite4 *mDb)
+/*
+ * table loaders
+ *
+ * the publisher remembers the DDL it last created each table with,
+ * along with insert statements prepared against it.  a table whose
+ * columns haven't changed is emptied and refilled instead of dropped
+ * and created, and keeps its statements from one generation to the
+ * next.  rows go in LOAD_BATCH at a time through a multi-row INSERT,
+ * strings are bound in place since the generation outlives the load.
+ */
+#define LOAD_BATCH 64
+#define LOAD_MAX_VARIABLES 999
+
+struct table_loader {
+        GString *ddl;
+        uint32_t batch;
+        sqlite4_stmt *insert_batch;
+        sqlite4_stmt *insert_row;
+};
+
+void table_loader_free(gpointer data)
 {
-        sqlite4_stmt *stmt;
+        struct table_loader *l = (struct table_loader *)data;
+
+        if (l->insert_batch != NULL)
+                sqlite4_finalize(l->insert_batch);
+        if (l->insert_row != NULL)
+                sqlite4_finalize(l->insert_row);
+        g_string_free(l->ddl, TRUE);
+        free(l);
+}
+
+static struct table_loader *table_loader_new(struct freeq_ctx *ctx, struct freeq_table *tbl, sqlite4 *mDb, GString *ddl)
+{
+        struct table_loader *l;
         GString *sql = g_string_sized_new(255);
-        GSList *colp[tbl->numcols];
+        int res;
 
-        memset(colp, 0, tbl->numcols * sizeof(GSList *) );
-        for (int j = 0; j < tbl->numcols; j++)
-                colp[j] = tbl->columns[j].data;
+        l = calloc(1, sizeof(struct table_loader));
+        l->ddl = g_string_new(ddl->str);
+        l->batch = MAX(1, MIN(LOAD_BATCH, LOAD_MAX_VARIABLES / tbl->numcols));
 
-        int res;
+        ddl_insert(ctx, tbl, l->batch, sql);
+        res = sqlite4_prepare(mDb, sql->str, sql->len, &l->insert_batch, NULL);
+        if (res == SQLITE4_OK)
+        {
+                ddl_insert(ctx, tbl, 1, sql);
+                res = sqlite4_prepare(mDb, sql->str, sql->len, &l->insert_row, NULL);
+        }
+        g_string_free(sql, TRUE);
 
-        freeq_table_print(ctx, tbl, stdout);
+        if (res != SQLITE4_OK)
+        {
+                dbg(ctx, "failed to create statement (%d): %s\n", res, sqlite4_errmsg(mDb));
+                table_loader_free(l);
+                return NULL;
+        }
+        return l;
+}
 
-        if (sqlite4_exec(mDb, "BEGIN TRANSACTION;", NULL, NULL) != SQLITE4_OK)
+static void bind_row(struct freeq_ctx *ctx, sqlite4_stmt *stmt, struct freeq_table *tbl, uint32_t row, int base, sqlite4 *mDb)
+{
+        freeq_str_t sv;
+        int res;
+
+        for (uint32_t j = 0; j < tbl->numcols; j++)
         {
-                dbg(ctx, "unable to start transaction: %s\n", sqlite4_errmsg(mDb));
-                return 1;
+                struct freeq_column *col = &(tbl->columns[j]);
+                switch (col->coltype)
+                {
+                case FREEQ_COL_STRING:
+                        /* NULL as the in-memory engine sees it, not "" */
+                        sv = freeq_column_string(col, row);
+                        if (sv.str == NULL)
+                                res = sqlite4_bind_null(stmt, base+j+1);
+                        else
+                                res = sqlite4_bind_text(stmt,
+                                                        base+j+1,
+                                                        sv.str,
+                                                        sv.len,
+                                                        SQLITE4_STATIC, NULL);
+                        if (res != SQLITE4_OK)
+                                dbg(ctx, "row %d failed binding string column %d %.*s: %s (%d)\n", row, j, (int)sv.len, sv.str, sqlite4_errmsg(mDb), res);
+                        break;
+                case FREEQ_COL_NUMBER:
+                case FREEQ_COL_TIME:
+                        res = sqlite4_bind_int64(stmt, base+j+1, freeq_column_number(col, row));
+                        if (res != SQLITE4_OK)
+                                dbg(ctx, "row %d failed bind: %s\n", row, sqlite4_errmsg(mDb));
+                        break;
+                case FREEQ_COL_DOUBLE:
+                        res = sqlite4_bind_double(stmt, base+j+1, freeq_column_double(col, row));
+                        if (res != SQLITE4_OK)
+                                dbg(ctx, "row %d failed bind: %s\n", row, sqlite4_errmsg(mDb));
+                        break;
+                default:
+                        break;
+                }
         }
+}
 
-        g_string_printf(sql, "DROP TABLE %s;", tbl->name);
-        if (sqlite4_exec(mDb, sql->str, NULL, NULL) != SQLITE4_OK)
-                dbg(ctx, "failed to drop table, ignoring\n");
+static int load_step(struct freeq_ctx *ctx, sqlite4_stmt *stmt, sqlite4 *mDb)
+{
+        int res = sqlite4_step(stmt);
 
-        table_ddl(ctx, tbl, sql);
-        if (sqlite4_exec(mDb, sql->str, NULL, NULL) != SQLITE4_OK)
+        sqlite4_reset(stmt);
+        if (res != SQLITE4_DONE)
         {
-                dbg(ctx, "failed to create table, rolling back\n");
-                sqlite4_exec(mDb, "ROLLBACK;", NULL, NULL);
-                g_string_free(sql, 1);
+                dbg(ctx, "execute failed: %s\n", sqlite4_errmsg(mDb));
                 return 1;
         }
+        return 0;
+}
+
+int tbl_to_db(struct freeq_ctx *ctx, struct freeq_table *tbl, sqlite4 *mDb, GHashTable *loaders)
+{
+        struct table_loader *l;
+        GString *ddl, *sql;
+        uint32_t i;
+        int res;
+
+        if (tbl->numcols == 0)
+                return 1;
 
-        ddl_insert(ctx, tbl, sql);
-        if ((res = sqlite4_prepare(mDb, sql->str, sql->len, &stmt, NULL)) != SQLITE4_OK)
+        if (sqlite4_exec(mDb, "BEGIN TRANSACTION;", NULL, NULL) != SQLITE4_OK)
         {
-                dbg(ctx, "failed to create statement (%d), rolling back\n", res);
-                sqlite4_exec(mDb, "ROLLBACK;", NULL, NULL);
-                g_string_free(sql,1);
+                dbg(ctx, "unable to start transaction: %s\n", sqlite4_errmsg(mDb));
                 return 1;
         }
 
-        g_string_free(sql,1);
-        for (uint32_t i = 0; i < tbl->numrows; i++)
+        ddl = g_string_sized_new(255);
+        sql = g_string_sized_new(255);
+        table_ddl(ctx, tbl, ddl);
+
+        l = (struct table_loader *)g_hash_table_lookup(loaders, tbl->name);
+        if (l != NULL && strcmp(l->ddl->str, ddl->str) == 0)
         {
-                for (uint32_t j = 0; j < tbl->numcols; j++)
+                g_string_printf(sql, "DELETE FROM %s;", tbl->name);
+                if (sqlite4_exec(mDb, sql->str, NULL, NULL) != SQLITE4_OK)
                 {
-                        switch (tbl->columns[j].coltype)
-                        {
-                        case FREEQ_COL_STRING:
-                                res = sqlite4_bind_text(stmt,
-                                                        j+1,
-                                                        colp[j]->data == NULL ? "" : colp[j]->data,
-                                                        colp[j]->data == NULL ? 0 : strlen(colp[j]->data),
-                                                        SQLITE4_TRANSIENT, NULL);
-                                if (res != SQLITE4_OK)
-                                {
-                                        dbg(ctx, "stmt: %s\n", (char *)stmt);
-                                        dbg(ctx, "row %d failed binding string column %d %s: %s (%d)\n", i, j, (char *)colp[j]->data, sqlite4_errmsg(mDb), res);
-                                }
-                                break;
-                        case FREEQ_COL_NUMBER:
-                                res = sqlite4_bind_int(stmt, j, GPOINTER_TO_INT(colp[j]->data));
-                                if (res != SQLITE4_OK)
-                                {
-                                        dbg(ctx, "row %d failed bind: %s\n", i, sqlite4_errmsg(mDb));
-                                }
-                                break;
-                        default:
-                                break;
-                        }
-                        colp[j] = g_slist_next(colp[j]);
+                        dbg(ctx, "failed to empty table, rolling back\n");
+                        goto rollback;
                 }
-                if (sqlite4_step(stmt) != SQLITE4_DONE)
+        }
+        else
+        {
+                /* new table, or its columns changed: statements
+                 * prepared against the old one can't be reused */
+                g_hash_table_remove(loaders, tbl->name);
+
+                g_string_printf(sql, "DROP TABLE %s;", tbl->name);
+                if (sqlite4_exec(mDb, sql->str, NULL, NULL) != SQLITE4_OK)
+                        dbg(ctx, "failed to drop table, ignoring\n");
+
+                if (sqlite4_exec(mDb, ddl->str, NULL, NULL) != SQLITE4_OK)
                 {
-                        dbg(ctx, "execute failed: %s\n", sqlite4_errmsg(mDb));
-                        sqlite4_exec(mDb, "ROLLBACK;", NULL, NULL);
-                        sqlite4_finalize(stmt);
-                        return -1;
-                } else {
-                        sqlite4_reset(stmt);
+                        dbg(ctx, "failed to create table, rolling back\n");
+                        goto rollback;
                 }
+
+                if ((l = table_loader_new(ctx, tbl, mDb, ddl)) == NULL)
+                        goto rollback;
+                g_hash_table_insert(loaders, g_strdup(tbl->name), l);
+        }
+
+        for (i = 0; i + l->batch <= tbl->numrows; i += l->batch)
+        {
+                for (uint32_t r = 0; r < l->batch; r++)
+                        bind_row(ctx, l->insert_batch, tbl, i + r, r * tbl->numcols, mDb);
+                if (load_step(ctx, l->insert_batch, mDb))
+                        goto rollback;
+        }
+
+        for (; i < tbl->numrows; i++)
+        {
+                bind_row(ctx, l->insert_row, tbl, i, 0, mDb);
+                if (load_step(ctx, l->insert_row, mDb))
+                        goto rollback;
         }
 
         dbg(ctx, "committing transaction\n");
         res = sqlite4_exec(mDb, "COMMIT TRANSACTION;", NULL, NULL);
         dbg(ctx, "result of commit was %d\n", res);
-        sqlite4_finalize(stmt);
+        g_string_free(ddl, TRUE);
+        g_string_free(sql, TRUE);
         return 0;
+
+rollback:
+        /* the rollback may have put back an older table */
+        sqlite4_exec(mDb, "ROLLBACK;", NULL, NULL);
+        g_hash_table_remove(loaders, tbl->name);
+        g_string_free(ddl, TRUE);
+        g_string_free(sql, TRUE);
+        return 1;
 }
 
-int gen_to_db(struct freeq_ctx *ctx, freeq_generation_t *g, sqlite4 *mDb)
+int gen_to_db(struct freeq_ctx *ctx, freeq_generation_t *g, sqlite4 *mDb, GHashTable *loaders)
 {
         GHashTableIter iter;
         gpointer key, val;
         struct freeq_table *t;
+        gint64 start;
 
         g_hash_table_iter_init(&iter, g->tables);
         while (g_hash_table_iter_next(&iter, &key, &val))
         {
                 dbg(ctx, "replacing table %s\n", (char *)key);
                 t = (struct freeq_table *)val;
-                if (tbl_to_db(ctx, t, mDb))
+                start = g_get_monotonic_time();
+                if (tbl_to_db(ctx, t, mDb, loaders))
                 {
                         err(ctx, "gen_to_db failed to publish %s", (char *)key);
                 }
@@ -402,48 +465,164 @@ int gen_to_db(struct freeq_ctx *ctx, freeq_generation_t *g, sqlite4 *mDb)
                 {
                         dbg(ctx, "published %s\n", (char *)key);
                 }
+                freeq_stats_published((char *)key, g_get_monotonic_time() - start);
         }
         return 0;
 }
 
+/* the size and age of the current generation, for the stats */
+static void generation_gauges(struct freeqd_state *fst)
+{
+        freeq_generation_t *gen = current_generation(fst);
+        GHashTableIter iter;
+        gpointer val;
+        int64_t rows = 0;
+
+        g_rw_lock_reader_lock(&gen->rw_lock);
+        g_hash_table_iter_init(&iter, gen->tables);
+        while (g_hash_table_iter_next(&iter, NULL, &val))
+        {
+                struct freeq_table *t = (struct freeq_table *)val;
+                if (t->rw_lock != NULL)
+                        g_rw_lock_reader_lock(t->rw_lock);
+                rows += t->numrows - t->deadrows;
+                if (t->rw_lock != NULL)
+                        g_rw_lock_reader_unlock(t->rw_lock);
+        }
+        freeq_stats_gauge_set(FREEQ_GAUGE_GENERATION_TABLES, g_hash_table_size(gen->tables));
+        g_rw_lock_reader_unlock(&gen->rw_lock);
+
+        freeq_stats_gauge_set(FREEQ_GAUGE_GENERATION_ROWS, rows);
+        freeq_stats_gauge_set(FREEQ_GAUGE_GENERATION_AGE, time(NULL) - gen->era);
+        freeq_generation_unref(gen);
+}
+
 void *status_logger (void *arg)
 {
         struct srv_ctx *srv = (struct srv_ctx *)arg;
         struct freeq_ctx *freeqctx = srv->freeqctx;
         struct freeqd_state *fst = srv->fst;
-        freeq_generation_t *curgen;
+        freeq_generation_t *curgen, *newgen, *oldgen;
+        struct freeq_table *stats;
+        time_t era;
 
         dbg(freeqctx, "status_logger starting\n");
-        time_t dt;
         while (1)
         {
                 sleep(5);
-                curgen = fst->current;
-                dt = time(NULL) - curgen->era;
-                if (dt > 10)
+                generation_gauges(fst);
+                g_rw_lock_reader_lock(&(fst->rw_lock));
+                era = fst->current->era;
+                g_rw_lock_reader_unlock(&(fst->rw_lock));
+                if (time(NULL) - era <= 10)
+                        continue;
+
+                if (freeq_generation_new(&newgen))
                 {
-                        freeq_generation_t *newgen;
-                        //dbg(freeqctx, "generation is ready to publish\n");
-                        if (freeq_generation_new(&newgen))
-                        {
-                                dbg(freeqctx, "unable to allocate generation\n");
-                                continue;
-                        }
+                        dbg(freeqctx, "unable to allocate generation\n");
+                        continue;
+                }
+
+                /* advance generation, the state's reference to the
+                 * previous one goes to the publisher */
+                g_rw_lock_writer_lock(&(fst->rw_lock));
+                curgen = fst->current;
+                oldgen = fst->previous;
+                fst->current = newgen;
+                fst->previous = freeq_generation_ref(curgen);
+                g_rw_lock_writer_unlock(&(fst->rw_lock));
+
+                /* every generation carries the stats as they were
+                 * when it was retired */
+                if (freeq_stats_table(freeqctx, &stats) == 0 &&
+                    generation_table_merge(freeqctx, curgen, stats) != FREEQ_OK)
+                        freeq_table_unref(stats);
+
+                g_async_queue_push(fst->retired, curgen);
+                if (oldgen != NULL)
+                        freeq_generation_unref(oldgen);
+        }
+}
 
-                        /* advance generation, take pointer to previous generation */
-                        g_rw_lock_writer_lock(&(fst->rw_lock));
-                        fst->current = newgen;
-                        g_rw_lock_writer_unlock(&(fst->rw_lock));
+/* one row about the generation just published, merged into the
+ * current one so it can be queried and is published like any table
+ * an agent reports */
+static void generation_stats(struct freeq_ctx *ctx, struct freeqd_state *fst,
+                             freeq_generation_t *pub, gint64 usecs)
+{
+        freeq_coltype_t coltypes[] = { FREEQ_COL_TIME, FREEQ_COL_NUMBER, FREEQ_COL_NUMBER, FREEQ_COL_NUMBER };
+        const char *colnames[] = { "era", "tables", "rows", "publish_us" };
+        freeq_generation_t *gen;
+        struct freeq_table *tbl, *t;
+        GHashTableIter iter;
+        gpointer val;
+        int64_t rows = 0;
+        int err;
 
-                        /* to_db on previous generation */
-                        g_rw_lock_writer_lock(&(curgen->rw_lock));
-                        gen_to_db(freeqctx, curgen, srv->pDb);
-                        g_rw_lock_writer_unlock(&(curgen->rw_lock));
-                        /* free previous generation */
+        if (freeq_table_new_empty(ctx, "freeq_generations", 4, coltypes, colnames, &tbl))
+                return;
 
-                } else {
-                        //dbg(freeqctx, "generation age is %d\n", (int)dt);
-                }
+        g_hash_table_iter_init(&iter, pub->tables);
+        while (g_hash_table_iter_next(&iter, NULL, &val))
+        {
+                t = (struct freeq_table *)val;
+                rows += t->numrows;
+        }
+
+        freeq_table_append_time(tbl, 0, pub->era);
+        freeq_table_append_number(tbl, 1, g_hash_table_size(pub->tables));
+        freeq_table_append_number(tbl, 2, rows);
+        freeq_table_append_number(tbl, 3, usecs);
+        freeq_table_end_row(tbl);
+
+        do {
+                gen = current_generation(fst);
+                err = generation_table_merge(ctx, gen, tbl);
+                freeq_generation_unref(gen);
+        } while (err == -EAGAIN);
+
+        if (err)
+                freeq_table_unref(tbl);
+}
+
+void *publisher (void *arg)
+{
+        struct srv_ctx *srv = (struct srv_ctx *)arg;
+        struct freeq_ctx *freeqctx = srv->freeqctx;
+        struct freeqd_state *fst = srv->fst;
+        freeq_generation_t *gen;
+        GHashTable *loaders;
+        GHashTableIter iter;
+        gpointer val;
+        gint64 start, usecs;
+
+        loaders = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, table_loader_free);
+        dbg(freeqctx, "publisher starting\n");
+        while (1)
+        {
+                gen = g_async_queue_pop(fst->retired);
+
+                /* wait out merges already under way, later ones see
+                 * the seal and go to the current generation.  the
+                 * tables are compacted before anyone can read them
+                 * sealed, after that nothing changes them, so they
+                 * are written out and queried without their locks */
+                g_rw_lock_writer_lock(&(gen->rw_lock));
+                g_hash_table_iter_init(&iter, gen->tables);
+                while (g_hash_table_iter_next(&iter, NULL, &val))
+                        freeq_table_compact((struct freeq_table *)val);
+                gen->sealed = true;
+                g_rw_lock_writer_unlock(&(gen->rw_lock));
+
+                start = g_get_monotonic_time();
+                gen_to_db(freeqctx, gen, srv->pDb, loaders);
+                usecs = g_get_monotonic_time() - start;
+                freeq_stats_observe(FREEQ_HIST_PUBLISH, usecs);
+                freeq_stats_count(FREEQ_STAT_GENERATIONS, 1);
+                info(freeqctx, "published generation %ld, %u tables in %" PRId64 "us\n",
+                     (long)gen->era, g_hash_table_size(gen->tables), (int64_t)usecs);
+                generation_stats(freeqctx, fst, gen, usecs);
+                freeq_generation_unref(gen);
         }
 }
 
@@ -481,165 +660,1052 @@ void cleanup(int server)
         return;
 }
 
-void* sqlhandler(void *arg) {
-        char sql[MAX_MSG];
-        int ret, err;
+/*
+ * agents and query clients are served by a single reactor thread
+ * that owns every socket and SSL object and drives them
+ * non-blocking from epoll.  complete frames and queries are handed
+ * to a pool of workers sized to the machine, which decode and merge
+ * or run them and pass back whatever should be written to the
+ * client.  a connection has at most one job in flight at a time,
+ * which keeps its frames (and its string dictionary) in order.
+ *
+ * query results are streamed: the worker hands each chunk back as
+ * soon as it is encoded and waits once QUERY_BACKLOG bytes are
+ * queued but not yet written, until the client catches up or goes
+ * away, which cancels the query.
+ */
+
+#define REACTOR_EVENTS 256
+#define REACTOR_READ 16384
+#define REACTOR_PAUSE_MS 100
+#define QUERY_BACKLOG (4 * FREEQ_RESULT_CHUNK_BYTES)
+/* a table sent in parts is put back together in memory before it is
+ * merged, these bound what one connection can make us hold */
+#define PENDING_BYTES_MAX (1024 * 1024 * 1024)
+#define PENDING_CELLS_MAX (128 * 1024 * 1024)
+
+typedef enum {
+        CONN_AGG,
+        CONN_SQL
+} conn_kind_t;
+
+struct conn {
+        int fd;
+        conn_kind_t kind;
+        bool listener;
+        bool paused;            /* listeners only, out of descriptors */
+        BIO *acc;               /* listeners only */
         SSL *ssl;
-        sqlite4_stmt *pStmt;
+        bool established;       /* handshake complete */
+        gint64 accepted;        /* when, for the handshake time */
+        bool want_write;        /* ssl is waiting for the socket to drain */
+        bool busy;              /* a job is queued or running */
+        bool eof;               /* peer has finished sending */
+        bool closing;           /* close once the output is written */
+        bool closed;
+        GByteArray *in;
+        GByteArray *out;
+        guint out_pos;
+        struct freeq_dict *dict;
+        GHashTable *bases;      /* last keyed table of each name */
+        struct freeq_table *pending;    /* parts of a table so far */
+        size_t pending_bytes;   /* of the frames they came in */
+        uint8_t codec;          /* results are compressed with */
+        GMutex lock;            /* backlog and cancelled */
+        GCond drained;
+        size_t backlog;         /* streamed bytes not yet written */
+        size_t streamed;        /* streamed bytes sitting in out */
+        bool cancelled;
+};
+
+struct job {
+        struct reactor *reactor;
+        struct conn *conn;
+        GByteArray *data;       /* one frame, or one query line */
+        GByteArray *reply;
+        bool partial;           /* one chunk of a streamed reply */
+        bool close;
+};
+
+struct reactor {
+        struct srv_ctx *srv;
+        int epfd;
+        int wakefd;
+        uint32_t chunkrows;
+        GThreadPool *pool;      /* tables */
+        GThreadPool *querypool; /* queries, which wait on slow readers */
+        GAsyncQueue *done;
+        GSList *graveyard;
+        GSList *paused;         /* listeners waiting for descriptors */
+        bool starved;           /* accepting failed for them */
+};
 
-        struct conn_ctx *conn = (struct conn_ctx *)arg;
-        struct freeq_ctx *freeqctx = conn->srvctx->freeqctx;
-        BIO *client = conn->client;
+static int reactor_watch(struct reactor *r, struct conn *c, int op)
+{
+        struct epoll_event ev;
 
-        if (!(ssl = freeq_ssl_new(freeqctx)))
+        memset(&ev, 0, sizeof(ev));
+        ev.data.ptr = c;
+        if (c->listener)
+                ev.events = c->paused ? 0 : EPOLLIN;
+        else
         {
-                err(freeqctx, "couldn't allocate new ssl instance");
-                BIO_free_all(client);
-                free(conn);
-                pthread_exit(NULL);
+                /* stop reading while a job is in flight and a
+                 * whole request is already waiting, so a fast
+                 * sender can't make us buffer without bound */
+                if (!c->eof && !c->closing && !(c->busy && c->in->len > 0))
+                        ev.events |= EPOLLIN;
+                if (c->want_write || c->out_pos < c->out->len)
+                        ev.events |= EPOLLOUT;
         }
+        return epoll_ctl(r->epfd, op, c->fd, &ev);
+}
 
-        SSL_set_bio(ssl, client, client);
-        if (SSL_accept(ssl) <= 0)
+static void conn_close(struct reactor *r, struct conn *c)
+{
+        if (c->closed)
+                return;
+
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        if (c->ssl != NULL)
         {
-                int_error("Error accepting SSL connection");
-                BIO_free_all(client);
-                free(conn);
-                pthread_exit(NULL);
+                if (c->established && (c->eof || c->closing))
+                        SSL_shutdown(c->ssl);
+                SSL_free(c->ssl);
+                c->ssl = NULL;
         }
+        close(c->fd);
+        c->closed = true;
+        freeq_stats_gauge_add(FREEQ_GAUGE_CONNECTIONS, -1);
+
+        g_mutex_lock(&c->lock);
+        c->cancelled = true;
+        g_cond_broadcast(&c->drained);
+        g_mutex_unlock(&c->lock);
+
+        /* a worker may still hold the connection, it is freed
+         * when the job comes back */
+        if (!c->busy)
+                r->graveyard = g_slist_prepend(r->graveyard, c);
+}
 
-        if ((err = post_connection_check(freeqctx, ssl, "localhost")) != X509_V_OK)
+static void conn_free(struct conn *c)
+{
+        g_byte_array_free(c->in, TRUE);
+        g_byte_array_free(c->out, TRUE);
+        freeq_dict_free(c->dict);
+        g_hash_table_destroy(c->bases);
+        if (c->pending != NULL)
+                freeq_table_unref(c->pending);
+        g_mutex_clear(&c->lock);
+        g_cond_clear(&c->drained);
+        free(c);
+}
+
+/* length of the first complete request buffered on c, 0 if there
+ * isn't one yet and -1 if the buffered data can never become one */
+static ssize_t conn_request_len(struct conn *c)
+{
+        const uint8_t *p = c->in->data;
+        uint32_t len;
+        ssize_t need;
+
+        if (c->in->len == 0)
+                return 0;
+
+        /* a query may be preceded by a frame offering codecs */
+        if (c->kind == CONN_SQL && (c->in->len < 4 || memcmp(p, FREEQ_FRAME_MAGIC, 4) != 0))
         {
-                err(freeqctx, "error: peer certificate: %s\n", X509_verify_cert_error_string(err));
-                BIO_free_all(client);
-                free(conn);
-                pthread_exit(NULL);
+                uint8_t *nl = memchr(p, '\n', c->in->len);
+                if (nl != NULL)
+                        return nl - p + 1;
+                if (c->in->len >= MAX_MSG - 1 || (c->eof && c->in->len > 0))
+                        return MIN(c->in->len, MAX_MSG - 1);
+                return 0;
         }
 
-        BIO *b, *ssl_bio;
-        b = BIO_new(BIO_f_buffer());
-        ssl_bio = BIO_new(BIO_f_ssl());
-        BIO_set_ssl(ssl_bio, ssl, BIO_CLOSE);
-        BIO_push(b, ssl_bio);
+        if (c->in->len < FREEQ_FRAME_HEADER_LEN)
+                return 0;
+        if (memcmp(p, FREEQ_FRAME_MAGIC, 4) != 0)
+                return -1;
+        len = (uint32_t)p[8] << 24 | (uint32_t)p[9] << 16 | (uint32_t)p[10] << 8 | p[11];
+        if (len > FREEQ_FRAME_MAX || (c->kind == CONN_SQL && len != 0))
+                return -1;
+        need = FREEQ_FRAME_HEADER_LEN + len + (p[5] & FREEQ_FRAME_CRC32C ? 4 : 0);
+        return (ssize_t)c->in->len >= need ? need : 0;
+}
 
-        memset(sql, 0, MAX_MSG);
-        ret = BIO_gets(b, sql, MAX_MSG);
+static void conn_dispatch(struct reactor *r, struct conn *c)
+{
+        struct job *j;
+        ssize_t len;
+
+        if (c->busy || c->closing || c->closed)
+                return;
 
-        ret = sqlite4_prepare(pDb, sql, strlen(sql), &pStmt, 0);
+        if ((len = conn_request_len(c)) < 0)
+        {
+                err(r->srv->freeqctx, "malformed request, dropping connection\n");
+                conn_close(r, c);
+                return;
+        }
+
+        if (len == 0)
+        {
+                if (c->eof)
+                        c->closing = true;
+                return;
+        }
+
+        j = calloc(1, sizeof(struct job));
+        j->reactor = r;
+        j->conn = c;
+        j->data = g_byte_array_sized_new(len);
+        g_byte_array_append(j->data, c->in->data, len);
+        g_byte_array_remove_range(c->in, 0, len);
+        c->busy = true;
+        g_thread_pool_push(c->kind == CONN_AGG ? r->pool : r->querypool, j, NULL);
+}
+
+static int conn_flush(struct conn *c)
+{
+        int n;
+
+        c->want_write = false;
+        while (c->out_pos < c->out->len)
+        {
+                n = SSL_write(c->ssl, c->out->data + c->out_pos, c->out->len - c->out_pos);
+                if (n > 0)
+                {
+                        c->out_pos += n;
+                        continue;
+                }
+                switch (SSL_get_error(c->ssl, n))
+                {
+                case SSL_ERROR_WANT_WRITE:
+                        c->want_write = true;
+                        return 0;
+                case SSL_ERROR_WANT_READ:
+                        return 0;
+                default:
+                        return -1;
+                }
+        }
+
+        g_byte_array_set_size(c->out, 0);
+        c->out_pos = 0;
+
+        if (c->streamed > 0)
+        {
+                g_mutex_lock(&c->lock);
+                c->backlog -= c->streamed;
+                g_cond_signal(&c->drained);
+                g_mutex_unlock(&c->lock);
+                c->streamed = 0;
+        }
+        return 0;
+}
+
+static int conn_fill(struct conn *c)
+{
+        uint8_t buf[REACTOR_READ];
+        int n;
+
+        while (!c->eof)
+        {
+                /* one request waiting behind a busy connection is
+                 * enough, leave the rest in the socket */
+                if (c->busy && c->in->len > 0)
+                        return 0;
+
+                n = SSL_read(c->ssl, buf, sizeof(buf));
+                if (n > 0)
+                {
+                        g_byte_array_append(c->in, buf, n);
+                        if (c->in->len > FREEQ_FRAME_HEADER_LEN + FREEQ_FRAME_MAX + 4)
+                                return -1;
+                        continue;
+                }
+                switch (SSL_get_error(c->ssl, n))
+                {
+                case SSL_ERROR_WANT_READ:
+                        return 0;
+                case SSL_ERROR_WANT_WRITE:
+                        c->want_write = true;
+                        return 0;
+                case SSL_ERROR_ZERO_RETURN:
+                        c->eof = true;
+                        return 0;
+                default:
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+static void conn_pump(struct reactor *r, struct conn *c)
+{
+        struct freeq_ctx *freeqctx = r->srv->freeqctx;
+        long err;
+        int ret;
+
+        if (c->closed)
+                return;
+
+        if (!c->established)
+        {
+                ret = SSL_accept(c->ssl);
+                if (ret <= 0)
+                {
+                        switch (SSL_get_error(c->ssl, ret))
+                        {
+                        case SSL_ERROR_WANT_READ:
+                                c->want_write = false;
+                                reactor_watch(r, c, EPOLL_CTL_MOD);
+                                return;
+                        case SSL_ERROR_WANT_WRITE:
+                                c->want_write = true;
+                                reactor_watch(r, c, EPOLL_CTL_MOD);
+                                return;
+                        default:
+                                dbg(freeqctx, "ssl handshake failed\n");
+                                freeq_stats_count(FREEQ_STAT_HANDSHAKE_FAILED, 1);
+                                conn_close(r, c);
+                                return;
+                        }
+                }
+
+                if ((err = post_connection_check(freeqctx, c->ssl, "localhost")) != X509_V_OK)
+                {
+                        err(freeqctx, "error: peer certificate: %s\n", X509_verify_cert_error_string(err));
+                        freeq_stats_count(FREEQ_STAT_HANDSHAKE_FAILED, 1);
+                        conn_close(r, c);
+                        return;
+                }
+                c->established = true;
+                c->want_write = false;
+                freeq_stats_observe(FREEQ_HIST_HANDSHAKE, g_get_monotonic_time() - c->accepted);
+                dbg(freeqctx, "ssl client connection opened\n");
+        }
+
+        if (conn_flush(c) || conn_fill(c))
+        {
+                dbg(freeqctx, "connection error, dropping connection\n");
+                conn_close(r, c);
+                return;
+        }
+
+        conn_dispatch(r, c);
+        if (c->closed)
+                return;
+
+        if (c->closing && !c->busy && c->out->len == 0)
+        {
+                dbg(freeqctx, "ssl client connection closed\n");
+                conn_close(r, c);
+                return;
+        }
+
+        reactor_watch(r, c, EPOLL_CTL_MOD);
+}
+
+/* hand a finished job, or a chunk of one, back to the reactor */
+static void reactor_post(struct reactor *r, struct job *j)
+{
+        uint64_t one = 1;
+
+        g_async_queue_push(r->done, j);
+        if (write(r->wakefd, &one, sizeof(one)) < 0)
+                err(r->srv->freeqctx, "unable to wake reactor\n");
+}
+
+/* freeq_emit_fn for query results, runs on the worker */
+static int job_chunk(struct freeq_ctx *ctx, const uint8_t *buf, size_t len, void *arg)
+{
+        struct job *j = (struct job *)arg;
+        struct conn *c = j->conn;
+        struct job *part;
+
+        part = calloc(1, sizeof(struct job));
+        part->conn = c;
+        part->partial = true;
+        part->reply = g_byte_array_sized_new(len);
+        g_byte_array_append(part->reply, buf, len);
+        /* compressed while the last chunk is still being written,
+         * the backlog counts what goes on the wire */
+        freeq_frame_compress(ctx, part->reply, 0, c->codec);
+
+        g_mutex_lock(&c->lock);
+        while (c->backlog >= QUERY_BACKLOG && !c->cancelled)
+                g_cond_wait(&c->drained, &c->lock);
+        if (c->cancelled)
+        {
+                g_mutex_unlock(&c->lock);
+                g_byte_array_free(part->reply, TRUE);
+                free(part);
+                return FREEQ_ERR;
+        }
+        c->backlog += part->reply->len;
+        g_mutex_unlock(&c->lock);
+
+        reactor_post(j->reactor, part);
+        return FREEQ_OK;
+}
+
+static void job_reply(struct job *j, BIO *mem)
+{
+        char *p;
+        long n = BIO_get_mem_data(mem, &p);
+
+        if (n > 0)
+        {
+                j->reply = g_byte_array_sized_new(n);
+                g_byte_array_append(j->reply, (uint8_t *)p, n);
+        }
+}
+
+/* turns a keyed table into the whole table it stands for.  the
+ * connection keeps that as the base for the next one, and the merge
+ * gets a copy since it takes over the strings of what it is given */
+static int table_resolve(struct freeq_ctx *ctx, struct conn *c, struct freeq_table **tbl)
+{
+        struct freeq_table *full;
+        int err;
+
+        err = freeq_table_apply_delta(ctx, g_hash_table_lookup(c->bases, (*tbl)->name), *tbl, &full);
+        freeq_table_unref(*tbl);
+        *tbl = NULL;
+        if (err)
+                return err;
+
+        g_hash_table_replace(c->bases, g_strdup(full->name), full);
+        return freeq_table_copy(ctx, full, tbl);
+}
+
+/* a table too large for one frame comes in parts, all but the last
+ * flagged FREEQ_FRAME_MORE.  the connection collects them, later
+ * parts decoding straight into the strings of the first, and *tbl is
+ * left NULL until the last part has made the table whole */
+static int table_assemble(struct freeq_ctx *ctx, struct conn *c, struct freeq_table **tbl,
+                          uint8_t flags, size_t len)
+{
+        struct freeq_table *part = *tbl;
+        uint64_t rows = (uint64_t)part->numrows + (c->pending ? c->pending->numrows : 0);
+        int err = 0;
+
+        c->pending_bytes += len;
+        if (part->delta != NULL)
+        {
+                err(ctx, "part of %s is keyed\n", part->name);
+                err = FREEQ_ERR;
+        }
+        else if (c->pending_bytes > PENDING_BYTES_MAX || rows * part->numcols > PENDING_CELLS_MAX)
+        {
+                err(ctx, "%s from %s is too large, %" PRIu64 " rows in %zu bytes so far\n",
+                    part->name, part->identity, rows, c->pending_bytes);
+                err = FREEQ_ERR;
+        }
+        else if (c->pending == NULL)
+                c->pending = freeq_table_ref(part);
+        else if (strcmp(c->pending->name, part->name) != 0)
+        {
+                err(ctx, "part of %s sent in the middle of %s\n", part->name, c->pending->name);
+                err = FREEQ_ERR;
+        }
+        else
+                err = freeq_table_append_rows(ctx, c->pending, part);
+
+        freeq_table_unref(part);
+        *tbl = NULL;
+        if (!err && !(flags & FREEQ_FRAME_MORE))
+        {
+                *tbl = c->pending;
+                c->pending = NULL;
+                c->pending_bytes = 0;
+        }
+        return err;
+}
+
+static void job_table(struct reactor *r, struct job *j)
+{
+        struct freeq_ctx *freeqctx = r->srv->freeqctx;
+        struct freeqd_state *fst = r->srv->fst;
+        freeq_generation_t *gen;
+        struct freeq_table *tbl, *pending = j->conn->pending;
+        uint8_t flags = j->data->data[5];
+        gint64 start;
+        BIO *mem;
+        int err;
+
+        if (freeq_table_mem_read(freeqctx, &tbl, j->data->data, j->data->len,
+                                 pending ? pending->strings : NULL, j->conn->dict))
+        {
+                err(freeqctx, "unable to read table, dropping connection\n");
+                freeq_stats_count(FREEQ_STAT_DECODE_FAILED, 1);
+                j->close = true;
+                return;
+        }
+
+        /* without the table a delta applies to, the sender has to
+         * start over on a new connection */
+        if (tbl->delta != NULL && pending == NULL && !(flags & FREEQ_FRAME_MORE) &&
+            table_resolve(freeqctx, j->conn, &tbl))
+        {
+                err(freeqctx, "unable to rebuild keyed table, dropping connection\n");
+                freeq_stats_count(FREEQ_STAT_DECODE_FAILED, 1);
+                j->close = true;
+                return;
+        }
+
+        freeq_stats_decoded(tbl->name, tbl->numrows, j->data->len);
+
+        if ((pending != NULL || (flags & FREEQ_FRAME_MORE)) &&
+            table_assemble(freeqctx, j->conn, &tbl, flags, j->data->len))
+        {
+                err(freeqctx, "unable to put table back together, dropping connection\n");
+                freeq_stats_count(FREEQ_STAT_DECODE_FAILED, 1);
+                j->close = true;
+                return;
+        }
+        err = 0;
+        if (tbl == NULL)
+                goto ack;
+
+        /* a table that can't be merged is dropped and the sender told
+         * so, the connection stays usable for the next one */
+        start = g_get_monotonic_time();
+        do {
+                gen = current_generation(fst);
+                err = generation_table_merge(freeqctx, gen, tbl);
+                freeq_generation_unref(gen);
+        } while (err == -EAGAIN);
+        freeq_stats_observe(FREEQ_HIST_MERGE, g_get_monotonic_time() - start);
+
+        if (err)
+        {
+                err(freeqctx, "table merge failed, dropping %s\n", tbl->name);
+                freeq_stats_count(FREEQ_STAT_MERGE_FAILED, 1);
+                freeq_table_unref(tbl);
+        }
+        else
+                dbg(freeqctx, "table merged ok\n");
+
+ack:
+        if ((flags & FREEQ_FRAME_ACK) && err)
+        {
+                j->reply = g_byte_array_new();
+                freeq_error_encode(freeqctx, "table merge failed", j->reply);
+        }
+        else if (flags & FREEQ_FRAME_ACK)
+        {
+                mem = BIO_new(BIO_s_mem());
+                if (freeq_bio_write_ack(freeqctx, mem) == 0)
+                        job_reply(j, mem);
+                else
+                        j->close = true;
+                BIO_free(mem);
+        }
+}
+
+/* answer from the tables of the last generation retired when the
+ * query is simple enough, returns -ENOENT when it isn't and sqlite
+ * has to.  the current generation has only some of each table while
+ * senders are reporting.  the publisher compacts the retired one's
+ * tables as it seals it, after that they don't change and need no
+ * locking */
+static int query_memory(struct reactor *r, struct job *j, const char *sql)
+{
+        struct freeq_ctx *freeqctx = r->srv->freeqctx;
+        struct freeqd_state *fst = r->srv->fst;
+        struct freeq_query *q;
+        struct freeq_table *tbl = NULL, *res;
+        freeq_generation_t *gen;
+        int err = -ENOENT;
+
+        if (freeq_query_parse(freeqctx, sql, &q))
+                return -ENOENT;
+
+        g_rw_lock_reader_lock(&fst->rw_lock);
+        gen = fst->previous ? freeq_generation_ref(fst->previous) : NULL;
+        g_rw_lock_reader_unlock(&fst->rw_lock);
+
+        if (gen != NULL)
+        {
+                g_rw_lock_reader_lock(&gen->rw_lock);
+                if (gen->sealed)
+                        tbl = g_hash_table_lookup(gen->tables, freeq_query_table(q));
+                g_rw_lock_reader_unlock(&gen->rw_lock);
+        }
+
+        /* result strings point into tbl, which the generation
+         * reference keeps until the last chunk is out.  once the
+         * first chunk has gone the query is answered, even if the
+         * client goes away before the rest */
+        if (tbl != NULL && freeq_query_run(freeqctx, q, tbl, &res) == 0)
+        {
+                if (freeq_table_encode_chunks(freeqctx, res, r->chunkrows, job_chunk, j))
+                {
+                        dbg(freeqctx, "query was cancelled: %s\n", sql);
+                        freeq_stats_count(FREEQ_STAT_QUERIES_FAILED, 1);
+                }
+                freeq_table_unref(res);
+                err = 0;
+        }
+
+        if (gen != NULL)
+                freeq_generation_unref(gen);
+        freeq_query_free(q);
+        return err;
+}
+
+/* takes the best codec both ends have from the offer in @hdr */
+static void offer_codec(struct freeq_ctx *ctx, struct conn *c, const uint8_t *hdr)
+{
+        uint8_t codecs = hdr[7] & freeq_codecs();
+
+        c->codec = FREEQ_CODEC_NONE;
+        if (!(hdr[5] & FREEQ_FRAME_ACK))
+                return;
+        if (codecs & (1 << FREEQ_CODEC_ZSTD))
+                c->codec = FREEQ_CODEC_ZSTD;
+        else if (codecs & (1 << FREEQ_CODEC_LZ4))
+                c->codec = FREEQ_CODEC_LZ4;
+        dbg(ctx, "client offered codecs %#x, using %d\n", hdr[7], c->codec);
+}
+
+static void job_query(struct reactor *r, struct job *j)
+{
+        struct freeq_ctx *freeqctx = r->srv->freeqctx;
+        sqlite4_stmt *pStmt;
+        char sql[MAX_MSG];
+        gint64 start;
+        int ret;
+
+        /* an offer of codecs for the result, the query follows */
+        if (j->data->len >= FREEQ_FRAME_HEADER_LEN &&
+            memcmp(j->data->data, FREEQ_FRAME_MAGIC, 4) == 0)
+        {
+                offer_codec(freeqctx, j->conn, j->data->data);
+                return;
+        }
+
+        memcpy(sql, j->data->data, j->data->len);
+        sql[j->data->len] = 0;
+        j->close = true;
+        start = g_get_monotonic_time();
+
+        if (query_memory(r, j, sql) == 0)
+        {
+                dbg(freeqctx, "answered from memory: %s\n", sql);
+                freeq_stats_count(FREEQ_STAT_QUERIES_MEMORY, 1);
+                freeq_stats_observe(FREEQ_HIST_QUERY, g_get_monotonic_time() - start);
+                return;
+        }
+
+        freeq_stats_count(FREEQ_STAT_QUERIES_SQLITE, 1);
+        ret = sqlite4_prepare(r->srv->pDb, sql, strlen(sql), &pStmt, 0);
         if (ret != SQLITE4_OK)
         {
-                dbg(freeqctx, "prepare failed for %s sending error, ret was %d\n", sql, ret);
-                //freeq_error_write_sock(freeqctx, sqlite4_errmsg(pDb), b);
-                dbg(freeqctx, sqlite4_errmsg(pDb));
-                //BIO_printf(b, "error: %s\n", sqlite4_errmsg(pDb));
-                sqlite4_finalize(pStmt);
-                //pthread_exit(FREEQ_ERR);
+                dbg(freeqctx, "prepare failed for %s, ret was %d\n", sql, ret);
+                freeq_stats_count(FREEQ_STAT_QUERIES_FAILED, 1);
+                j->reply = g_byte_array_new();
+                freeq_error_encode(freeqctx, sqlite4_errmsg(r->srv->pDb), j->reply);
+                return;
+        }
+
+        if (freeq_sqlite_encode(freeqctx, pStmt, r->chunkrows, job_chunk, j))
+        {
+                dbg(freeqctx, "query failed or was cancelled: %s\n", sql);
+                freeq_stats_count(FREEQ_STAT_QUERIES_FAILED, 1);
         }
+        sqlite4_finalize(pStmt);
+        freeq_stats_observe(FREEQ_HIST_QUERY, g_get_monotonic_time() - start);
+}
+
+static void job_run(gpointer data, gpointer user_data)
+{
+        struct job *j = (struct job *)data;
+        struct reactor *r = (struct reactor *)user_data;
+
+        freeq_stats_gauge_add(FREEQ_GAUGE_WORKERS_BUSY, 1);
+        if (j->conn->kind == CONN_AGG)
+                job_table(r, j);
+        else
+                job_query(r, j);
+        freeq_stats_gauge_add(FREEQ_GAUGE_WORKERS_BUSY, -1);
 
-        freeq_sqlite_to_bio(freeqctx, b, pStmt);
+        reactor_post(r, j);
+}
 
-        SSL_shutdown(ssl);
-        SSL_free(ssl);
+static void reactor_done(struct reactor *r)
+{
+        struct job *j;
+        struct conn *c;
+        uint64_t n;
 
-        BIO_free_all(client);
-        free(conn);
-        pthread_exit(FREEQ_OK);
+        if (read(r->wakefd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+                err(r->srv->freeqctx, "unable to read reactor wakeup\n");
 
+        while ((j = g_async_queue_try_pop(r->done)) != NULL)
+        {
+                c = j->conn;
+                if (j->partial)
+                {
+                        /* the job is still running, c stays busy */
+                        if (!c->closed)
+                        {
+                                g_byte_array_append(c->out, j->reply->data, j->reply->len);
+                                c->streamed += j->reply->len;
+                                conn_pump(r, c);
+                        }
+                        g_byte_array_free(j->reply, TRUE);
+                        free(j);
+                        continue;
+                }
+
+                c->busy = false;
+                if (c->closed)
+                        r->graveyard = g_slist_prepend(r->graveyard, c);
+                else
+                {
+                        if (j->reply != NULL)
+                                g_byte_array_append(c->out, j->reply->data, j->reply->len);
+                        if (j->close)
+                                c->closing = true;
+                        conn_pump(r, c);
+                }
+
+                g_byte_array_free(j->data, TRUE);
+                if (j->reply != NULL)
+                        g_byte_array_free(j->reply, TRUE);
+                free(j);
+        }
 }
 
-void *cliserver(void *arg) {
+static void reactor_accept(struct reactor *r, struct conn *l)
+{
+        struct freeq_ctx *freeqctx = r->srv->freeqctx;
+        struct conn *c;
+        int fd;
 
-        struct srv_ctx *srv = (struct srv_ctx *)arg;
-        struct freeq_ctx *freeqctx = srv->freeqctx;
-        struct conn_ctx *conn_ctx;
-        int res;
-        pthread_t tid;
-        BIO *acc, *client;
+        while ((fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+        {
+                c = calloc(1, sizeof(struct conn));
+                c->fd = fd;
+                c->kind = l->kind;
+                c->accepted = g_get_monotonic_time();
+                c->in = g_byte_array_new();
+                c->out = g_byte_array_new();
+                c->bases = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                 (GDestroyNotify)freeq_table_unref);
+                g_mutex_init(&c->lock);
+                g_cond_init(&c->drained);
+                if (freeq_dict_new(&c->dict) || !(c->ssl = freeq_ssl_new(freeqctx)))
+                {
+                        err(freeqctx, "couldn't allocate new connection\n");
+                        close(fd);
+                        conn_free(c);
+                        continue;
+                }
+
+                SSL_set_fd(c->ssl, fd);
+                SSL_set_accept_state(c->ssl);
+                SSL_set_mode(c->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+                if (reactor_watch(r, c, EPOLL_CTL_ADD))
+                {
+                        err(freeqctx, "unable to watch connection\n");
+                        SSL_free(c->ssl);
+                        close(fd);
+                        conn_free(c);
+                        continue;
+                }
+                if (r->starved)
+                        info(freeqctx, "accepting connections again\n");
+                r->starved = false;
+                dbg(freeqctx, "accepted connection, setting up ssl\n");
+                freeq_stats_count(c->kind == CONN_AGG ? FREEQ_STAT_ACCEPTED_AGG : FREEQ_STAT_ACCEPTED_SQL, 1);
+                freeq_stats_gauge_add(FREEQ_GAUGE_CONNECTIONS, 1);
+                conn_pump(r, c);
+        }
 
-        static stralloc aggport = {0};
+        if (errno == EMFILE || errno == ENFILE)
+        {
+                /* the connection stays queued and the listener
+                 * readable, stop watching it for a while rather than
+                 * spin on it */
+                if (!r->starved)
+                        err(freeqctx, "accept failed: %s\n", strerror(errno));
+                r->starved = true;
+                l->paused = true;
+                reactor_watch(r, l, EPOLL_CTL_MOD);
+                r->paused = g_slist_prepend(r->paused, l);
+        }
+        else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                err(freeqctx, "accept failed: %s\n", strerror(errno));
+}
 
-        res = control_readline(&aggport, "control/aggport");
-        if (!res)
+/* listeners paused for want of descriptors are watched again */
+static void reactor_resume(struct reactor *r)
+{
+        for (GSList *l = r->paused; l != NULL; l = l->next)
         {
-                err(freeqctx, "unable to read control/aggport");
-                exit(FREEQ_ERR);
+                struct conn *c = l->data;
+                c->paused = false;
+                reactor_watch(r, c, EPOLL_CTL_MOD);
         }
+        g_slist_free(r->paused);
+        r->paused = NULL;
+}
+
+static int reactor_listen(struct reactor *r, conn_kind_t kind, const char *file)
+{
+        struct freeq_ctx *freeqctx = r->srv->freeqctx;
+        stralloc port = {0};
+        struct conn *l;
+        BIO *acc;
+        int fd;
 
-        stralloc_0(&aggport);
+        if (!control_readline(&port, (char *)file))
+        {
+                err(freeqctx, "unable to read %s\n", file);
+                return FREEQ_ERR;
+        }
+        stralloc_0(&port);
 
-        dbg(freeqctx, "starting aggregation listener on %s\n", (char *)aggport.s);
-        acc = BIO_new_accept((char *)aggport.s);
+        dbg(freeqctx, "starting %s listener on %s\n", kind == CONN_AGG ? "aggregation" : "query", port.s);
+        acc = BIO_new_accept(port.s);
         if (!acc)
         {
                 int_error("Error creating server socket");
-                exit(FREEQ_ERR);
+                return FREEQ_ERR;
         }
 
-        if (BIO_do_accept(acc) <= 0)
+        BIO_set_bind_mode(acc, BIO_BIND_REUSEADDR);
+        if (BIO_do_accept(acc) <= 0 || BIO_get_fd(acc, &fd) < 0)
+        {
                 int_error("Error binding server socket");
+                BIO_free(acc);
+                return FREEQ_ERR;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        l = calloc(1, sizeof(struct conn));
+        l->fd = fd;
+        l->kind = kind;
+        l->listener = true;
+        l->acc = acc;
+        return reactor_watch(r, l, EPOLL_CTL_ADD);
+}
+
+void *reactor(void *arg)
+{
+        struct reactor r;
+        struct epoll_event events[REACTOR_EVENTS];
+        struct epoll_event ev;
+        struct conn *c;
+        struct freeq_ctx *freeqctx;
+        int querythreads;
+        int n;
+
+        memset(&r, 0, sizeof(r));
+        r.srv = (struct srv_ctx *)arg;
+        freeqctx = r.srv->freeqctx;
+
+        r.epfd = epoll_create1(EPOLL_CLOEXEC);
+        r.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (r.epfd < 0 || r.wakefd < 0)
+        {
+                err(freeqctx, "unable to set up event loop: %s\n", strerror(errno));
+                exit(FREEQ_ERR);
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(r.epfd, EPOLL_CTL_ADD, r.wakefd, &ev);
+
+        /* rows per result chunk, optional */
+        if (control_readint((int *)&r.chunkrows, "control/querychunk") != 1)
+                r.chunkrows = FREEQ_RESULT_CHUNK_ROWS;
+
+        /* query workers, optional.  a result streamed to a client
+         * that reads slowly holds its worker until the client has
+         * caught up, so queries get workers of their own and can't
+         * hold up the tables coming in */
+        if (control_readint(&querythreads, "control/querythreads") != 1 || querythreads < 1)
+                querythreads = g_get_num_processors();
+
+        r.done = g_async_queue_new();
+        r.pool = g_thread_pool_new(job_run, &r, g_get_num_processors(), TRUE, NULL);
+        r.querypool = g_thread_pool_new(job_run, &r, querythreads, TRUE, NULL);
+        if (r.pool == NULL || r.querypool == NULL)
+        {
+                err(freeqctx, "unable to start worker pool\n");
+                exit(FREEQ_ERR);
+        }
+        dbg(freeqctx, "started %u workers and %d query workers\n", g_get_num_processors(), querythreads);
+        freeq_stats_gauge_set(FREEQ_GAUGE_WORKERS, g_get_num_processors() + querythreads);
+
+        if (reactor_listen(&r, CONN_SQL, "control/sqlport") ||
+            reactor_listen(&r, CONN_AGG, "control/aggport"))
+                exit(FREEQ_ERR);
 
         for (;;)
         {
-                dbg(freeqctx, "waiting for connection\n");
-                if (BIO_do_accept(acc) <= 0)
-                        int_error("Error accepting connection");
-                dbg(freeqctx, "accepted connection, setting up ssl\n");
+                n = epoll_wait(r.epfd, events, REACTOR_EVENTS, r.paused ? REACTOR_PAUSE_MS : -1);
+                if (n < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        err(freeqctx, "epoll_wait failed: %s\n", strerror(errno));
+                        exit(FREEQ_ERR);
+                }
 
-                //bio_peername(acc);
+                for (int i = 0; i < n; i++)
+                {
+                        c = (struct conn *)events[i].data.ptr;
+                        if (c == NULL)
+                                reactor_done(&r);
+                        else if (c->listener)
+                                reactor_accept(&r, c);
+                        else if (events[i].events & (EPOLLERR | EPOLLHUP) &&
+                                 !(events[i].events & EPOLLIN))
+                                conn_close(&r, c);
+                        else
+                                conn_pump(&r, c);
+                }
 
-                client = BIO_pop(acc);
-                conn_ctx = malloc(sizeof(struct conn_ctx));
-                conn_ctx->srvctx = srv;
-                conn_ctx->client = client;
-                pthread_create(&tid, 0, &conn_handler, (void *)conn_ctx);
+                /* try again once a while has passed or a connection
+                 * has gone and freed a descriptor */
+                if (r.paused != NULL && (n == 0 || r.graveyard != NULL))
+                        reactor_resume(&r);
+
+                /* connections closed in this pass may still have
+                 * had events queued behind them */
+                g_slist_free_full(r.graveyard, (GDestroyNotify)conn_free);
+                r.graveyard = NULL;
+        }
+
+        return NULL;
+}
+
+/*
+ * stats scrape endpoint
+ *
+ * plain text over plain TCP for monitoring to scrape.  whatever a
+ * client asks for it gets the current stats as an HTTP response and
+ * the connection is closed.  the address is read from
+ * control/statsport, a bare port listens on loopback only, and
+ * without the file there is no endpoint.
+ */
+#define STATS_TIMEOUT 2
+#define STATS_BACKOFF_MAX G_USEC_PER_SEC
+
+static void stats_reply(struct srv_ctx *srv, BIO *client)
+{
+        struct timeval tv = { STATS_TIMEOUT, 0 };
+        char buf[4096];
+        GString *text, *reply;
+        size_t got = 0;
+        int fd, n;
+
+        if (BIO_get_fd(client, &fd) >= 0)
+        {
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        }
+
+        /* read the request head so closing doesn't reset the
+         * connection under the reply */
+        while (got < sizeof(buf) - 1 && (n = BIO_read(client, buf + got, sizeof(buf) - 1 - got)) > 0)
+        {
+                got += n;
+                buf[got] = 0;
+                if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n"))
+                        break;
         }
+
+        generation_gauges(srv->fst);
+        text = freeq_stats_text();
+        reply = g_string_sized_new(text->len + 128);
+        g_string_printf(reply,
+                        "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\n"
+                        "\r\n", text->len);
+        g_string_append_len(reply, text->str, text->len);
+
+        for (size_t off = 0; off < reply->len; off += n)
+                if ((n = BIO_write(client, reply->str + off, reply->len - off)) <= 0)
+                        break;
+
+        g_string_free(text, TRUE);
+        g_string_free(reply, TRUE);
 }
 
-void *sqlserver(void *arg) {
+void *stats_server(void *arg)
+{
         struct srv_ctx *srv = (struct srv_ctx *)arg;
         struct freeq_ctx *freeqctx = srv->freeqctx;
-        int res;
-        pthread_t thread;
+        stralloc addr = {0};
         BIO *acc, *client;
+        gulong backoff = 0;
+        unsigned long failed = 0;
 
-        signal(SIGINT, cleanup);
-        signal(SIGTERM, cleanup);
-        signal(SIGPIPE, SIG_IGN);
-
-        static stralloc sqlport = {0};
-
-        res = control_readline(&sqlport, "control/sqlport");
-        if (!res)
+        if (control_readline(&addr, "control/statsport") != 1)
         {
-                err(freeqctx, "unable to read control/sqlport\n");
-                exit(FREEQ_ERR);
+                dbg(freeqctx, "no control/statsport, stats endpoint disabled\n");
+                return NULL;
         }
+        stralloc_0(&addr);
 
-        stralloc_0(&sqlport);
-        dbg(freeqctx, "starting query listener on %s\n", (char *)sqlport.s);
-        acc = BIO_new_accept((char *)sqlport.s);
-        if (!acc)
+        if (strchr(addr.s, ':') == NULL)
         {
-                int_error("Error creating server socket");
-                exit(FREEQ_ERR);
+                stralloc port = {0};
+                stralloc_copy(&port, &addr);
+                stralloc_copys(&addr, "127.0.0.1:");
+                stralloc_cat(&addr, &port);
+                stralloc_0(&addr);
         }
 
+        acc = BIO_new_accept(addr.s);
+        if (acc == NULL)
+        {
+                err(freeqctx, "unable to create stats socket\n");
+                return NULL;
+        }
+        BIO_set_bind_mode(acc, BIO_BIND_REUSEADDR);
         if (BIO_do_accept(acc) <= 0)
-                int_error("Error binding server socket");
+        {
+                err(freeqctx, "unable to listen for stats on %s\n", addr.s);
+                BIO_free(acc);
+                return NULL;
+        }
+        info(freeqctx, "serving stats on %s\n", addr.s);
 
         for (;;)
         {
+                /* a client gone before it was accepted fails once, but
+                 * running out of descriptors fails until some close */
                 if (BIO_do_accept(acc) <= 0)
-                        int_error("Error accepting connection");
+                {
+                        if (failed++ == 0)
+                                err(freeqctx, "unable to accept stats client: %s\n", strerror(errno));
+                        ERR_clear_error();
+                        backoff = MIN(MAX(2 * backoff, 1000), STATS_BACKOFF_MAX);
+                        g_usleep(backoff);
+                        continue;
+                }
+                if (failed > 1)
+                        info(freeqctx, "accepting stats clients again after %lu failures\n", failed);
+                failed = 0;
+                backoff = 0;
                 client = BIO_pop(acc);
-                struct conn_ctx *conn = malloc(sizeof(struct conn_ctx));
-                conn->srvctx = srv;
-                conn->client = client;
-                pthread_create(&thread, 0, &sqlhandler, (void *)conn);
+                stats_reply(srv, client);
+                BIO_free_all(client);
         }
-
-        BIO_free(acc);
-        pthread_exit(FREEQ_OK);;
+        return NULL;
 }
 
 int init_freeqd_state(struct freeq_ctx *freeqctx, struct freeqd_state *s)
@@ -652,6 +1718,8 @@ int init_freeqd_state(struct freeq_ctx *freeqctx, struct freeqd_state *s)
         }
         g_rw_lock_init(&(s->rw_lock));
         s->current = fgen;
+        s->previous = NULL;
+        s->retired = g_async_queue_new();
         return 0;
 }
 
@@ -669,8 +1737,9 @@ main (int argc, char *argv[])
 
         pthread_t t_monitor;
         pthread_t t_status_logger;
-        pthread_t t_sqlserver;
-        pthread_t t_cliserver;
+        pthread_t t_publisher;
+        pthread_t t_reactor;
+        pthread_t t_stats;
         static stralloc clients = {0};
 
         err = freeq_new(&freeqctx, "appname", "identity", FREEQ_SERVER);
@@ -715,20 +1784,19 @@ main (int argc, char *argv[])
         struct srv_ctx *sctx = &status_ctx;
 
         pthread_create(&t_status_logger, 0, &status_logger, (void *)sctx);
+        pthread_create(&t_publisher, 0, &publisher, (void *)sctx);
 
         //if (control_readfile(&clients,"",1) != 1)
         //	pthread_create(&t_receiver, 0, &receiver, (void *)&ri);
         //	pthread_create(&t_recvinvite, 0, &recvinvite, (void *)recvinvite_nnuri);
         //}
 
-        res = sqlite4_exec(pDb, "create table if not exists freeq_stats(int last);", NULL, NULL);
-        if (res != SQLITE4_OK)
-        {
-                printf("creating freeq_stats failed: %d %s\n", res, sqlite4_errmsg(pDb));
-        }
+        signal(SIGINT, cleanup);
+        signal(SIGTERM, cleanup);
+        signal(SIGPIPE, SIG_IGN);
 
-        pthread_create(&t_sqlserver, 0, &sqlserver, (void *)sctx);
-        pthread_create(&t_cliserver, 0, &cliserver, (void *)sctx);
+        pthread_create(&t_reactor, 0, &reactor, (void *)sctx);
+        pthread_create(&t_stats, 0, &stats_server, (void *)sctx);
 
         while (1) {
                 sleep(1);
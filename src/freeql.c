@@ -26,13 +26,15 @@ main (int argc, char *argv[])
   freeq_set_identity(freeqctx, node_name);
   asprintf(&sql, "%s\r\n", argv[1]);
 
-  if (freeq_ssl_query(freeqctx, "localhost:13000", sql, &tbl))
+  err = freeq_ssl_query(freeqctx, "localhost:13000", sql, &tbl);
+  if (err)
   {
     err(freeqctx, "some kind of error during query...\n");
   } else {
     freeq_table_print(freeqctx, tbl, stdout);
+    freeq_table_unref(tbl);
   }
 
   free(sql);
-  exit (EXIT_SUCCESS);
+  exit (err ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -0,0 +1,544 @@
+/*
+ * freeqload - load generator for freeqd
+ *
+ * simulates a fleet of agents reporting tables to a local freeqd.
+ * agents are spread over a few worker threads, each worker sends its
+ * agents' tables when they fall due and times every send from the
+ * first byte to the server's ack.  by default agents report just after
+ * each interval boundary, within the jitter, the way a fleet with
+ * synchronized clocks does at generation boundaries.
+ *
+ * while the load runs freeqd's memory use is sampled from /proc and
+ * the freeq_generations table freeqd keeps about the generations it
+ * published is polled over the query port.  when the run ends one
+ * line is printed per published generation and then the totals, as
+ * tab separated name and value.
+ *
+ * run it from a directory holding freeqd's control/ files, the
+ * certificates are the ones every freeq client loads from there.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include <glib.h>
+
+#include "freeq/libfreeq.h"
+
+#include "control/stralloc.h"
+#include "control/control.h"
+
+struct options {
+        int agents;
+        int workers;
+        int tables;
+        int rows;
+        int numcols;
+        int strcols;
+        int cardinality;
+        int interval;
+        int jitter_ms;
+        int duration;
+        bool aligned;
+        bool reuse;
+        bool keyed;
+        pid_t pid;
+        char *server;
+        char *query;
+};
+
+struct agent {
+        char identity[32];
+        struct freeq_conn *conn;
+        struct freeq_table **tables;
+        gint64 slot;            /* start of the current interval */
+        gint64 due;             /* slot plus this report's jitter */
+        int64_t reports;
+};
+
+struct worker {
+        pthread_t thread;
+        struct freeq_ctx *ctx;
+        const struct options *opt;
+        struct agent *agents;
+        int numagents;
+        GArray *latency;        /* gint64 microseconds per table */
+        int64_t sent;
+        int64_t failed;
+        gint64 lag;             /* worst delay past an agent's due time */
+};
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s [options]\n"
+                "  -a agents       simulated agents (1000)\n"
+                "  -w workers      sending threads (16)\n"
+                "  -T tables       tables per agent (1)\n"
+                "  -r rows         rows per table (100)\n"
+                "  -n columns      number columns besides the key (4)\n"
+                "  -S columns      string columns (2)\n"
+                "  -c card         distinct strings per string column, 0 for all (32)\n"
+                "  -i seconds      reporting interval (10)\n"
+                "  -j millis       jitter after the interval boundary (2000)\n"
+                "  -d seconds      length of the run (60)\n"
+                "  -u              spread agents uniformly over the interval\n"
+                "                  instead of at its boundary\n"
+                "  -R              reconnect for every report instead of\n"
+                "                  keeping each agent's connection\n"
+                "  -K              declare the key column, sending deltas\n"
+                "  -p pid          freeqd to sample RSS of (found by name)\n"
+                "  -s host:port    aggregation port (localhost:control/aggport)\n"
+                "  -q host:port    query port (localhost:control/sqlport)\n",
+                prog);
+}
+
+/* host:port from the port in a control file, the way freeqd finds
+ * where to listen */
+static char *control_server(const char *file, const char *fallback)
+{
+        stralloc port = {0};
+        char *server;
+
+        if (control_readline(&port, (char *)file) != 1)
+                return strdup(fallback);
+        stralloc_0(&port);
+        if (asprintf(&server, "localhost:%s", port.s) < 0)
+                server = NULL;
+        return server;
+}
+
+static struct freeq_table *agent_table(struct freeq_ctx *ctx, const struct options *opt, int n)
+{
+        int numcols = 1 + opt->numcols + opt->strcols;
+        freeq_coltype_t coltypes[numcols];
+        const char *colnames[numcols];
+        char names[numcols][16];
+        struct freeq_table *t;
+        char name[32], buf[32];
+
+        for (int c = 0; c < numcols; c++)
+        {
+                if (c == 0)
+                        snprintf(names[c], sizeof names[c], "id");
+                else if (c <= opt->numcols)
+                        snprintf(names[c], sizeof names[c], "n%d", c);
+                else
+                        snprintf(names[c], sizeof names[c], "s%d", c - opt->numcols);
+                coltypes[c] = c <= opt->numcols ? FREEQ_COL_NUMBER : FREEQ_COL_STRING;
+                colnames[c] = names[c];
+        }
+
+        snprintf(name, sizeof name, "load%d", n);
+        if (freeq_table_new_empty(ctx, name, numcols, coltypes, colnames, &t))
+                return NULL;
+
+        for (int r = 0; r < opt->rows; r++)
+        {
+                freeq_table_append_number(t, 0, r);
+                for (int c = 1; c <= opt->numcols; c++)
+                        freeq_table_append_number(t, c, (int64_t)r * 7919 + c);
+                for (int c = opt->numcols + 1; c < numcols; c++)
+                {
+                        int v = opt->cardinality ? (r * 31 + c) % opt->cardinality : r;
+                        snprintf(buf, sizeof buf, "value-%d-%d", c, v);
+                        freeq_table_append_string(t, c, buf, -1);
+                }
+                freeq_table_end_row(t);
+        }
+
+        if (opt->keyed)
+                freeq_table_set_key(t, 0);
+        return t;
+}
+
+static gint64 jitter(const struct options *opt, unsigned int *seed)
+{
+        if (opt->jitter_ms <= 0)
+                return 0;
+        return (gint64)(rand_r(seed) % opt->jitter_ms) * 1000;
+}
+
+/* one report: every table of the agent, each timed to its ack */
+static void agent_report(struct worker *w, struct agent *a)
+{
+        const struct options *opt = w->opt;
+        gint64 start, elapsed;
+
+        freeq_set_identity(w->ctx, a->identity);
+        if (a->conn == NULL && freeq_conn_new(w->ctx, opt->server, &a->conn))
+        {
+                w->failed += opt->tables;
+                return;
+        }
+
+        for (int i = 0; i < opt->tables; i++)
+        {
+                struct freeq_table *t = a->tables[i];
+
+                /* one changed cell per report, as a counter would */
+                if (opt->numcols > 0 && t->numrows > 0)
+                        freeq_column_number(&t->columns[1], a->reports % t->numrows) = a->reports;
+
+                start = g_get_monotonic_time();
+                if (freeq_conn_send(a->conn, t))
+                {
+                        w->failed++;
+                        continue;
+                }
+                elapsed = g_get_monotonic_time() - start;
+                g_array_append_val(w->latency, elapsed);
+                w->sent++;
+        }
+        a->reports++;
+
+        if (!opt->reuse)
+        {
+                freeq_conn_free(a->conn);
+                a->conn = NULL;
+        }
+}
+
+static void *worker_run(void *arg)
+{
+        struct worker *w = (struct worker *)arg;
+        const struct options *opt = w->opt;
+        gint64 interval = (gint64)opt->interval * G_USEC_PER_SEC;
+        gint64 end = g_get_real_time() + (gint64)opt->duration * G_USEC_PER_SEC;
+        unsigned int seed = (unsigned int)(uintptr_t)w;
+
+        for (;;)
+        {
+                struct agent *next = NULL;
+                gint64 now;
+
+                for (int i = 0; i < w->numagents; i++)
+                        if (next == NULL || w->agents[i].due < next->due)
+                                next = &w->agents[i];
+                if (next == NULL || next->due >= end)
+                        break;
+
+                now = g_get_real_time();
+                if (next->due > now)
+                {
+                        g_usleep(MIN(next->due - now, G_USEC_PER_SEC / 10));
+                        continue;
+                }
+                if (now - next->due > w->lag)
+                        w->lag = now - next->due;
+
+                agent_report(w, next);
+                next->slot += interval;
+                next->due = next->slot + jitter(opt, &seed);
+        }
+        return NULL;
+}
+
+static int64_t rss_kb(pid_t pid)
+{
+        char path[64], line[256];
+        int64_t kb = -1;
+        FILE *f;
+
+        snprintf(path, sizeof path, "/proc/%d/status", (int)pid);
+        if ((f = fopen(path, "r")) == NULL)
+                return -1;
+        while (fgets(line, sizeof line, f))
+                if (sscanf(line, "VmRSS: %" SCNd64, &kb) == 1)
+                        break;
+        fclose(f);
+        return kb;
+}
+
+/* the first live process whose name starts with freeqd */
+static pid_t find_freeqd(void)
+{
+        char path[300], comm[64];
+        struct dirent *de;
+        pid_t pid = 0;
+        DIR *d;
+        FILE *f;
+
+        if ((d = opendir("/proc")) == NULL)
+                return 0;
+        while (pid == 0 && (de = readdir(d)) != NULL)
+        {
+                if (de->d_name[0] < '0' || de->d_name[0] > '9')
+                        continue;
+                snprintf(path, sizeof path, "/proc/%s/comm", de->d_name);
+                if ((f = fopen(path, "r")) == NULL)
+                        continue;
+                if (fgets(comm, sizeof comm, f) && strncmp(comm, "freeqd", 6) == 0 &&
+                    rss_kb(atoi(de->d_name)) >= 0)
+                        pid = atoi(de->d_name);
+                fclose(f);
+        }
+        closedir(d);
+        return pid;
+}
+
+struct genstat {
+        int64_t tables;
+        int64_t rows;
+        int64_t publish_us;
+};
+
+/* picks up the generations published since the last poll */
+static void poll_generations(struct freeq_ctx *ctx, const char *server, GHashTable *gens)
+{
+        struct freeq_table *t;
+        int era = -1, tables = -1, rows = -1, publish = -1;
+
+        if (freeq_ssl_query(ctx, server, "SELECT era, tables, rows, publish_us FROM freeq_generations\r\n", &t))
+                return;
+
+        for (uint32_t c = 0; c < t->numcols; c++)
+        {
+                const char *name = t->columns[c].name;
+                if (strcmp(name, "era") == 0)
+                        era = c;
+                else if (strcmp(name, "tables") == 0)
+                        tables = c;
+                else if (strcmp(name, "rows") == 0)
+                        rows = c;
+                else if (strcmp(name, "publish_us") == 0)
+                        publish = c;
+        }
+
+        if (era >= 0 && tables >= 0 && rows >= 0 && publish >= 0)
+        {
+                for (uint32_t i = 0; i < t->numrows; i++)
+                {
+                        struct genstat *g = g_new(struct genstat, 1);
+                        gint64 *key = g_new(gint64, 1);
+                        *key = freeq_column_time(&t->columns[era], i);
+                        g->tables = freeq_column_number(&t->columns[tables], i);
+                        g->rows = freeq_column_number(&t->columns[rows], i);
+                        g->publish_us = freeq_column_number(&t->columns[publish], i);
+                        g_hash_table_replace(gens, key, g);
+                }
+        }
+        freeq_table_unref(t);
+}
+
+static gint compare_int64(gconstpointer a, gconstpointer b)
+{
+        gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+        return x < y ? -1 : x > y;
+}
+
+static gint64 percentile(GArray *sorted, double p)
+{
+        if (sorted->len == 0)
+                return 0;
+        return g_array_index(sorted, gint64, (guint)((sorted->len - 1) * p));
+}
+
+int
+main (int argc, char *argv[])
+{
+        struct options opt = {
+                .agents = 1000, .workers = 16, .tables = 1, .rows = 100,
+                .numcols = 4, .strcols = 2, .cardinality = 32,
+                .interval = 10, .jitter_ms = 2000, .duration = 60,
+                .aligned = true, .reuse = true,
+        };
+        struct freeq_ctx *qctx;
+        struct worker *workers;
+        struct agent *agents;
+        GHashTable *gens;
+        GHashTableIter iter;
+        gpointer key;
+        GArray *latency, *eras;
+        int64_t sent = 0, failed = 0, rss, maxrss = -1, lastrss = -1;
+        gint64 start, elapsed, first, lag = 0;
+        int o;
+
+        while ((o = getopt(argc, argv, "a:w:T:r:n:S:c:i:j:d:uRKp:s:q:h")) != -1)
+        {
+                switch (o)
+                {
+                case 'a': opt.agents = atoi(optarg); break;
+                case 'w': opt.workers = atoi(optarg); break;
+                case 'T': opt.tables = atoi(optarg); break;
+                case 'r': opt.rows = atoi(optarg); break;
+                case 'n': opt.numcols = atoi(optarg); break;
+                case 'S': opt.strcols = atoi(optarg); break;
+                case 'c': opt.cardinality = atoi(optarg); break;
+                case 'i': opt.interval = atoi(optarg); break;
+                case 'j': opt.jitter_ms = atoi(optarg); break;
+                case 'd': opt.duration = atoi(optarg); break;
+                case 'u': opt.aligned = false; break;
+                case 'R': opt.reuse = false; break;
+                case 'K': opt.keyed = true; break;
+                case 'p': opt.pid = atoi(optarg); break;
+                case 's': opt.server = strdup(optarg); break;
+                case 'q': opt.query = strdup(optarg); break;
+                default:
+                        usage(argv[0]);
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        if (opt.agents < 1 || opt.workers < 1 || opt.tables < 1 || opt.rows < 0 ||
+            opt.numcols < 0 || opt.strcols < 0 || opt.cardinality < 0 ||
+            opt.interval < 1 || opt.duration < 1)
+        {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+        if (opt.workers > opt.agents)
+                opt.workers = opt.agents;
+        if (opt.server == NULL)
+                opt.server = control_server("control/aggport", FREEQ_SERVER_DEFAULT);
+        if (opt.query == NULL)
+                opt.query = control_server("control/sqlport", "localhost:13000");
+        if (opt.pid == 0)
+                opt.pid = find_freeqd();
+
+        /* an agent whose connection freeqd dropped counts a failed
+         * report rather than killing the run */
+        signal(SIGPIPE, SIG_IGN);
+
+        if (freeq_new(&qctx, "freeqload", "freeqload", FREEQ_CLIENT) < 0)
+                exit(EXIT_FAILURE);
+        freeq_set_log_priority(qctx, 0);
+
+        /* every worker has a context of its own, the identity of the
+         * agent being sent for is switched in before each report */
+        agents = calloc(opt.agents, sizeof(struct agent));
+        workers = calloc(opt.workers, sizeof(struct worker));
+        start = g_get_real_time();
+        first = opt.aligned
+                ? (start / (opt.interval * G_USEC_PER_SEC) + 1) * opt.interval * G_USEC_PER_SEC
+                : start;
+
+        for (int i = 0; i < opt.workers; i++)
+        {
+                struct worker *w = &workers[i];
+                unsigned int seed = i;
+
+                if (freeq_new(&w->ctx, "freeqload", NULL, FREEQ_CLIENT) < 0)
+                        exit(EXIT_FAILURE);
+                freeq_set_log_priority(w->ctx, 0);
+                w->opt = &opt;
+                w->latency = g_array_new(FALSE, FALSE, sizeof(gint64));
+                w->agents = &agents[(int64_t)opt.agents * i / opt.workers];
+                w->numagents = (int64_t)opt.agents * (i + 1) / opt.workers -
+                        (int64_t)opt.agents * i / opt.workers;
+
+                for (int k = 0; k < w->numagents; k++)
+                {
+                        struct agent *a = &w->agents[k];
+                        int n = a - agents;
+
+                        snprintf(a->identity, sizeof a->identity, "agent%05d", n);
+                        a->tables = calloc(opt.tables, sizeof(struct freeq_table *));
+                        for (int t = 0; t < opt.tables; t++)
+                                if ((a->tables[t] = agent_table(w->ctx, &opt, t)) == NULL)
+                                        exit(EXIT_FAILURE);
+                        a->slot = first;
+                        if (!opt.aligned)
+                                a->slot += (gint64)opt.interval * G_USEC_PER_SEC * n / opt.agents;
+                        a->due = a->slot + jitter(&opt, &seed);
+                }
+        }
+
+        fprintf(stderr, "%d agents on %d workers reporting to %s every %ds for %ds\n",
+                opt.agents, opt.workers, opt.server, opt.interval, opt.duration);
+
+        start = g_get_real_time();
+        for (int i = 0; i < opt.workers; i++)
+                pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+
+        gens = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+        while (g_get_real_time() - start < (gint64)opt.duration * G_USEC_PER_SEC)
+        {
+                sleep(1);
+                if (opt.pid > 0 && (rss = rss_kb(opt.pid)) >= 0)
+                {
+                        lastrss = rss;
+                        if (rss > maxrss)
+                                maxrss = rss;
+                }
+                poll_generations(qctx, opt.query, gens);
+        }
+
+        for (int i = 0; i < opt.workers; i++)
+                pthread_join(workers[i].thread, NULL);
+        elapsed = g_get_real_time() - start;
+        poll_generations(qctx, opt.query, gens);
+
+        latency = g_array_new(FALSE, FALSE, sizeof(gint64));
+        for (int i = 0; i < opt.workers; i++)
+        {
+                struct worker *w = &workers[i];
+                g_array_append_vals(latency, w->latency->data, w->latency->len);
+                sent += w->sent;
+                failed += w->failed;
+                if (w->lag > lag)
+                        lag = w->lag;
+        }
+        g_array_sort(latency, compare_int64);
+
+        printf("era\ttables\trows\tpublish_us\n");
+        eras = g_array_new(FALSE, FALSE, sizeof(gint64));
+        g_hash_table_iter_init(&iter, gens);
+        while (g_hash_table_iter_next(&iter, &key, NULL))
+                g_array_append_val(eras, *(gint64 *)key);
+        g_array_sort(eras, compare_int64);
+        for (guint i = 0; i < eras->len; i++)
+        {
+                gint64 era = g_array_index(eras, gint64, i);
+                struct genstat *g = g_hash_table_lookup(gens, &era);
+                printf("%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\n",
+                       era, g->tables, g->rows, g->publish_us);
+        }
+        g_array_free(eras, TRUE);
+
+        printf("\n");
+        printf("agents\t%d\n", opt.agents);
+        printf("seconds\t%.1f\n", elapsed / 1e6);
+        printf("tables_sent\t%" PRId64 "\n", sent);
+        printf("tables_failed\t%" PRId64 "\n", failed);
+        printf("tables_per_sec\t%.1f\n", sent / (elapsed / 1e6));
+        printf("latency_p50_us\t%" PRId64 "\n", percentile(latency, 0.50));
+        printf("latency_p99_us\t%" PRId64 "\n", percentile(latency, 0.99));
+        printf("latency_max_us\t%" PRId64 "\n", percentile(latency, 1.0));
+        printf("schedule_lag_max_us\t%" PRId64 "\n", lag);
+        printf("freeqd_pid\t%d\n", (int)opt.pid);
+        printf("freeqd_rss_kb\t%" PRId64 "\n", lastrss);
+        printf("freeqd_rss_max_kb\t%" PRId64 "\n", maxrss);
+
+        for (int i = 0; i < opt.agents; i++)
+        {
+                freeq_conn_free(agents[i].conn);
+                for (int t = 0; t < opt.tables; t++)
+                        freeq_table_unref(agents[i].tables[t]);
+                free(agents[i].tables);
+        }
+        for (int i = 0; i < opt.workers; i++)
+        {
+                g_array_free(workers[i].latency, TRUE);
+                freeq_unref(workers[i].ctx);
+        }
+        g_array_free(latency, TRUE);
+        g_hash_table_destroy(gens);
+        free(agents);
+        free(workers);
+        freeq_unref(qctx);
+        free(opt.server);
+        free(opt.query);
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
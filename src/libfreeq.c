@@ -34,6 +34,8 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <math.h>
+#include <time.h>
+#include <arpa/inet.h>
 
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
@@ -46,19 +48,28 @@
 #include "openssl/ssl.h"
 #include "openssl/err.h"
 
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #define CSEP(j, t) j < t->numcols - 1 ? "," : "\n"
-#define DEFAULT_STRCHUNK_LENGTH 8
+#define DEFAULT_STRCHUNK_LENGTH 4096
 
 const char *coltypes[] = { "null",
                            "string",
                            "number",
                            "time",
                            "ipv4_addr",
-                           "ipv6_addr" };
+                           "ipv6_addr",
+                           "double" };
 
 unsigned int bio_wrap(struct freeq_ctx *ctx, struct freeq_table *tbl, SSL *ssl);
 
 static bool ssl_initialized;
+static pthread_mutex_t ssl_init_lock = PTHREAD_MUTEX_INITIALIZER;
 struct CRYPTO_dynlock_value
 {
     pthread_mutex_t mutex;
@@ -91,6 +102,13 @@ struct freeq_ctx {
         const char* appname;
         SSL_CTX *sslctx;
         int log_priority;
+        uint8_t frame_flags;
+        uint8_t codec;
+        int codec_level;
+#ifdef HAVE_ZSTD
+        GHashTable *cdicts;     /* ZSTD_CDict by table name */
+        GHashTable *ddicts;     /* ZSTD_DDict by dictionary id */
+#endif
 };
 
 typedef struct {
@@ -98,24 +116,23 @@ typedef struct {
         char vibuf32[5];
 } vibuf_t;
 
-void destroy_sender_table(gpointer data) {
-        GHashTable *senders = (GHashTable*)data;
-        g_hash_table_destroy(senders);
-}
-
 FREEQ_EXPORT int freeq_generation_new(freeq_generation_t **gen)
 {
-        freeq_generation_t *g = malloc(sizeof(freeq_generation_t));
+        freeq_generation_t *g = calloc(1, sizeof(freeq_generation_t));
         if (g == NULL)
                 return 1;
 
         g->tables = g_hash_table_new_full(g_str_hash,
                                           g_str_equal,
                                           g_free,
-                                          (GDestroyNotify)destroy_sender_table);
+                                          (GDestroyNotify)freeq_table_unref);
         g->strings = g_string_chunk_new(8);
         if (g->strings == NULL)
+        {
+                g_hash_table_destroy(g->tables);
+                free(g);
                 return -ENOMEM;
+        }
 
         g_rw_lock_init(&(g->rw_lock));
         g->refcount = 1;
@@ -124,14 +141,37 @@ FREEQ_EXPORT int freeq_generation_new(freeq_generation_t **gen)
         return 0;
 }
 
+/**
+ * freeq_generation_ref:
+ * @gen: generation
+ *
+ * Take a reference to @gen, keeping its tables and strings alive
+ * until the matching freeq_generation_unref().
+ *
+ * Returns: @gen
+ **/
+FREEQ_EXPORT freeq_generation_t *freeq_generation_ref(freeq_generation_t *gen)
+{
+        g_atomic_int_inc(&gen->refcount);
+        return gen;
+}
+
+/**
+ * freeq_generation_unref:
+ * @gen: generation
+ *
+ * Drop a reference to @gen.  The last reference frees its tables
+ * and the strings they point into.
+ **/
 FREEQ_EXPORT void freeq_generation_unref(freeq_generation_t *gen)
 {
-        if (gen->refcount == 1)
-        {
-                g_hash_table_destroy(gen->tables);
-                g_rw_lock_clear(&(gen->rw_lock));
-        }
+        if (gen == NULL || !g_atomic_int_dec_and_test(&gen->refcount))
+                return;
 
+        g_hash_table_destroy(gen->tables);
+        g_string_chunk_free(gen->strings);
+        g_rw_lock_clear(&(gen->rw_lock));
+        free(gen);
 }
 
 FREEQ_EXPORT void freeq_log(struct freeq_ctx *ctx,
@@ -227,15 +267,37 @@ encode_varint(varint_buf_t *b, uint64_t number)
 static inline int
 encode_varintsigned32(varint32_buf_t *buffer, int32_t n)
 {
-        n = (n << 1) ^ (n >> 31);
-        return encode_varint32(buffer,n);
+        return encode_varint32(buffer, ((uint32_t)n << 1) ^ (n >> 31));
 }
 
 static inline int
 encode_varintsigned(varint_buf_t *buffer, int64_t n)
 {
-        n = (n << 1) ^ (n >> 63);
-        return encode_varint(buffer,n);
+        return encode_varint(buffer, ((uint64_t)n << 1) ^ (n >> 63));
+}
+
+/* doubles are sent as the xor of their bit pattern with the previous
+ * value in the column, byte swapped so that the unchanged low order
+ * mantissa bytes of slowly moving or round values end up as leading
+ * zeros and the varint stays short */
+static inline uint64_t
+encode_double(double d, uint64_t *prev)
+{
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        uint64_t x = GUINT64_SWAP_LE_BE(bits ^ *prev);
+        *prev = bits;
+        return x;
+}
+
+static inline double
+decode_double(uint64_t x, uint64_t *prev)
+{
+        double d;
+        uint64_t bits = GUINT64_SWAP_LE_BE(x) ^ *prev;
+        memcpy(&d, &bits, sizeof(d));
+        *prev = bits;
+        return d;
 }
 
 FREEQ_EXPORT int
@@ -270,6 +332,64 @@ BIO_write_varintsigned(BIO *b, int64_t number)
         return BIO_write(b, &buf, len);
 }
 
+static inline void
+bytes_varint(GByteArray *a, uint64_t number)
+{
+        varint_buf_t buf;
+        int len = encode_varint(&buf, number);
+        g_byte_array_append(a, (const guint8 *)&buf, len);
+}
+
+static inline void
+bytes_varintsigned(GByteArray *a, int64_t number)
+{
+        varint_buf_t buf;
+        int len = encode_varintsigned(&buf, number);
+        g_byte_array_append(a, (const guint8 *)&buf, len);
+}
+
+static void
+bytes_vstr(GByteArray *a, const char *s)
+{
+        size_t slen = s ? strlen(s) : 0;
+        bytes_varint(a, slen);
+        g_byte_array_append(a, (const guint8 *)s, slen);
+}
+
+/* CRC32C (Castagnoli), reflected, one table lookup per byte */
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void)
+{
+        for (uint32_t i = 0; i < 256; i++)
+        {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                        c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+                crc32c_table[i] = c;
+        }
+}
+
+static uint32_t crc32c(uint32_t crc, const uint8_t *p, size_t len)
+{
+        pthread_once(&crc32c_once, crc32c_init);
+        crc = ~crc;
+        while (len--)
+                crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        return ~crc;
+}
+
+static void frame_header(uint8_t hdr[FREEQ_FRAME_HEADER_LEN], uint8_t flags, uint32_t len)
+{
+        memset(hdr, 0, FREEQ_FRAME_HEADER_LEN);
+        memcpy(hdr, FREEQ_FRAME_MAGIC, 4);
+        hdr[4] = FREEQ_FRAME_VERSION;
+        hdr[5] = flags;
+        len = GUINT32_TO_BE(len);
+        memcpy(hdr + 8, &len, sizeof(len));
+}
+
 FREEQ_EXPORT ssize_t
 BIO_write_vstr(BIO *b, const char *s)
 {
@@ -362,6 +482,145 @@ FREEQ_EXPORT void freeq_set_identity(struct freeq_ctx *ctx, const char *identity
         ctx->identity = identity;
 }
 
+/**
+ * freeq_get_frame_flags:
+ * @ctx: freeq library context
+ *
+ * Returns: the flags set on frames written by this context
+ **/
+FREEQ_EXPORT uint8_t freeq_get_frame_flags(struct freeq_ctx *ctx)
+{
+        return ctx->frame_flags;
+}
+
+/**
+ * freeq_set_frame_flags:
+ * @ctx: freeq library context
+ * @flags: FREEQ_FRAME_* flags
+ *
+ * Set the flags used for frames written by this context.  Frames
+ * carry a CRC32C by default, pass 0 to leave it off.
+ **/
+FREEQ_EXPORT void freeq_set_frame_flags(struct freeq_ctx *ctx, uint8_t flags)
+{
+        ctx->frame_flags = flags;
+}
+
+/**
+ * freeq_codecs:
+ *
+ * Returns: the codecs this build can compress and decompress frames
+ * with, bit 1 << codec for each
+ **/
+FREEQ_EXPORT uint8_t freeq_codecs(void)
+{
+        uint8_t codecs = 1 << FREEQ_CODEC_NONE;
+#ifdef HAVE_LZ4
+        codecs |= 1 << FREEQ_CODEC_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+        codecs |= 1 << FREEQ_CODEC_ZSTD;
+#endif
+        return codecs;
+}
+
+/**
+ * freeq_get_compression:
+ * @ctx: freeq library context
+ *
+ * Returns: the codec frames written by this context are compressed with
+ **/
+FREEQ_EXPORT uint8_t freeq_get_compression(struct freeq_ctx *ctx)
+{
+        return ctx->codec;
+}
+
+/**
+ * freeq_set_compression:
+ * @ctx: freeq library context
+ * @codec: FREEQ_CODEC_* to compress frames with
+ * @level: codec specific level, 0 for its default
+ *
+ * Compress the frames written by freeq_table_bio_write() and asked
+ * for by freeq_ssl_query().  Publisher connections start out with
+ * this codec too, but only use it once the server has said it can
+ * read it.  The FREEQ_COMPRESS environment variable, "lz4", "zstd"
+ * or "none", sets the codec of a new context.
+ *
+ * Returns: 0 on success, FREEQ_ERR if @codec isn't built in
+ **/
+FREEQ_EXPORT int freeq_set_compression(struct freeq_ctx *ctx, uint8_t codec, int level)
+{
+        if (codec > 7 || !(freeq_codecs() & (1 << codec)))
+                return FREEQ_ERR;
+        ctx->codec = codec;
+        ctx->codec_level = level;
+        return 0;
+}
+
+static uint8_t codec_byname(const char *name)
+{
+        if (strcasecmp(name, "lz4") == 0)
+                return FREEQ_CODEC_LZ4;
+        if (strcasecmp(name, "zstd") == 0)
+                return FREEQ_CODEC_ZSTD;
+        if (strcasecmp(name, "none") == 0)
+                return FREEQ_CODEC_NONE;
+        return 0xff;
+}
+
+/**
+ * freeq_set_zstd_dict:
+ * @ctx: freeq library context
+ * @name: table name the dictionary is trained on
+ * @dict: dictionary, as made by zstd --train
+ * @len: length of @dict
+ *
+ * Compress frames of table @name with a zstd dictionary, and read
+ * frames compressed with it.  Both ends must load the same
+ * dictionary, frames name the dictionary they need by its id.  Set
+ * dictionaries up before the context is shared between threads.
+ *
+ * Returns: 0 on success, FREEQ_ERR without zstd or for a dictionary
+ * zstd rejects
+ **/
+FREEQ_EXPORT int freeq_set_zstd_dict(struct freeq_ctx *ctx, const char *name, const void *dict, size_t len)
+{
+#ifdef HAVE_ZSTD
+        ZSTD_CDict *cdict;
+        ZSTD_DDict *ddict;
+        unsigned id;
+
+        if ((id = ZSTD_getDictID_fromDict(dict, len)) == 0)
+        {
+                err(ctx, "zstd dictionary for %s has no id\n", name);
+                return FREEQ_ERR;
+        }
+        cdict = ZSTD_createCDict(dict, len, ctx->codec_level ? ctx->codec_level : ZSTD_CLEVEL_DEFAULT);
+        ddict = ZSTD_createDDict(dict, len);
+        if (cdict == NULL || ddict == NULL)
+        {
+                ZSTD_freeCDict(cdict);
+                ZSTD_freeDDict(ddict);
+                return FREEQ_ERR;
+        }
+
+        if (ctx->cdicts == NULL)
+        {
+                ctx->cdicts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                    (GDestroyNotify)ZSTD_freeCDict);
+                ctx->ddicts = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                                    (GDestroyNotify)ZSTD_freeDDict);
+        }
+        g_hash_table_replace(ctx->cdicts, g_strdup(name), cdict);
+        g_hash_table_replace(ctx->ddicts, GUINT_TO_POINTER(id), ddict);
+        return 0;
+#else
+        err(ctx, "no zstd, not loading a dictionary for %s\n", name);
+        return FREEQ_ERR;
+#endif
+}
+
 static int log_priority(const char *priority)
 {
         char *endptr;
@@ -442,6 +701,47 @@ static void dyn_destroy_function(struct CRYPTO_dynlock_value *l,
     free(l);
 }
 
+/*
+ * publisher connection
+ *
+ * one TLS connection to the aggregator carries every table an agent
+ * publishes.  if it drops, the next send reconnects, resuming the
+ * previous TLS session when the server still has it, and backs off
+ * while the server can't be reached.
+ */
+#define FREEQ_CONN_BACKOFF_MAX 60
+
+struct freeq_conn {
+        struct freeq_ctx *ctx;
+        char *server;
+        char *host;
+        SSL *ssl;
+        BIO *bio;
+        SSL_SESSION *session;
+        struct freeq_dict *dict;
+        GHashTable *sent;       /* last keyed table of each name */
+        uint8_t codec;
+        uint8_t peer_codecs;    /* what the server said it reads */
+        unsigned int failures;
+        time_t retry_at;
+        bool partial;           /* the server holds part of a table */
+};
+
+/* keeps the newest session of a publisher connection for resumption,
+ * with TLS 1.3 tickets arrive after the handshake so this is the only
+ * reliable place to pick them up */
+static int conn_new_session(SSL *ssl, SSL_SESSION *sess)
+{
+        struct freeq_conn *c = SSL_get_app_data(ssl);
+
+        if (c == NULL)
+                return 0;
+        if (c->session)
+                SSL_SESSION_free(c->session);
+        c->session = sess;
+        return 1;
+}
+
 SSL_CTX *setup_client_ctx(struct freeq_ctx *freeqctx)
 {
         SSL_CTX *ctx;
@@ -469,6 +769,12 @@ SSL_CTX *setup_client_ctx(struct freeq_ctx *freeqctx)
 
         SSL_CTX_set_options(ctx, SSL_OP_ALL|SSL_OP_NO_SSLv2);
 
+        /* sessions are cached per publisher connection rather than in
+         * the context */
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, conn_new_session);
+
         if (SSL_CTX_set_cipher_list(ctx, CIPHER_LIST) != 1)
                 err(freeqctx, "Error setting cipher list (no valid ciphers)");
 
@@ -499,6 +805,14 @@ SSL_CTX *setup_server_ctx(struct freeq_ctx *freeqctx)
     SSL_CTX_set_options(ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2 |
                         SSL_OP_SINGLE_DH_USE);
     SSL_CTX_set_tmp_dh_callback(ctx, tmp_dh_callback);
+
+    /* agents reconnecting after a dropped connection resume their
+     * session instead of doing a full handshake. a session id context
+     * is required for that when client certificates are verified */
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"freeqd", 6);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_timeout(ctx, 3600);
+
     if (SSL_CTX_set_cipher_list(ctx, CIPHER_LIST) != 1)
         err(freeqctx, "Error setting cipher list (no valid ciphers)");
 
@@ -548,6 +862,8 @@ freeq_ssl_query(struct freeq_ctx *ctx, const char *server, const char *sql, stru
         BIO_set_ssl(ssl_bio, ssl, BIO_CLOSE);
         BIO_push(buf_io, ssl_bio);
 
+        if (ctx->codec != FREEQ_CODEC_NONE)
+                freeq_bio_write_offer(ctx, buf_io, 1 << ctx->codec);
         err = BIO_puts(buf_io, sql);
         dbg(ctx, "wrote query \"%s\" %ld reading...\n", sql, err);
         if ((err = BIO_flush(buf_io)) < 0)
@@ -555,7 +871,7 @@ freeq_ssl_query(struct freeq_ctx *ctx, const char *server, const char *sql, stru
                 err(ctx, "Error flushing BIO");
         }
 
-        err = freeq_table_bio_read(ctx, &tbl, buf_io, NULL);
+        err = freeq_result_bio_read(ctx, &tbl, buf_io);
 
         SSL_shutdown(ssl);
         SSL_free(ssl);
@@ -589,8 +905,15 @@ FREEQ_EXPORT
 int freeq_init_ssl(struct freeq_ctx *ctx, freeq_mode_t mode)
 {
         dbg(ctx, "initializing ssl...\n");
+
+        /* the library is set up once per process, every context
+         * gets an SSL_CTX of its own */
+        pthread_mutex_lock(&ssl_init_lock);
         if (ssl_initialized)
-                return true;
+        {
+                pthread_mutex_unlock(&ssl_init_lock);
+                goto context;
+        }
 
         dbg(ctx, "registering openssl locking functions\n");
         mutex_buf = (pthread_mutex_t *)malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
@@ -613,7 +936,10 @@ int freeq_init_ssl(struct freeq_ctx *ctx, freeq_mode_t mode)
         SSL_load_error_strings();
         dbg(ctx, "openssl sseding PRNG\n");
         seed_prng();
+        ssl_initialized = true;
+        pthread_mutex_unlock(&ssl_init_lock);
 
+context:
         switch (mode) {
         case FREEQ_SERVER:
                 dbg(ctx, "openssl setting up server context\n");
@@ -625,7 +951,6 @@ int freeq_init_ssl(struct freeq_ctx *ctx, freeq_mode_t mode)
                 break;
         };
         dbg(ctx, "openssl ready\n");
-        ssl_initialized = true;
         return 0;
 }
 
@@ -652,6 +977,7 @@ FREEQ_EXPORT int freeq_new(struct freeq_ctx **ctx, const char *appname, const ch
         c->refcount = 1;
         c->log_fn = log_stderr;
         c->log_priority = LOG_ERR;
+        c->frame_flags = FREEQ_FRAME_CRC32C;
         c->appname = appname;
         c->identity = identity;
 
@@ -659,6 +985,9 @@ FREEQ_EXPORT int freeq_new(struct freeq_ctx **ctx, const char *appname, const ch
         env = secure_getenv("FREEQ_LOG");
         if (env != NULL)
                 freeq_set_log_priority(c, log_priority(env));
+        env = secure_getenv("FREEQ_COMPRESS");
+        if (env != NULL && freeq_set_compression(c, codec_byname(env), 0))
+                err(c, "compression %s is not available\n", env);
 
         if (identity == NULL)
                 identity = secure_getenv("HOSTNAME");
@@ -703,6 +1032,14 @@ FREEQ_EXPORT struct freeq_ctx *freeq_unref(struct freeq_ctx *ctx)
         if (ctx->refcount > 0)
                 return NULL;
         info(ctx, "context %p released\n", ctx);
+        if (ctx->sslctx)
+                SSL_CTX_free(ctx->sslctx);
+#ifdef HAVE_ZSTD
+        if (ctx->cdicts)
+                g_hash_table_destroy(ctx->cdicts);
+        if (ctx->ddicts)
+                g_hash_table_destroy(ctx->ddicts);
+#endif
         free(ctx);
         return NULL;
 }
@@ -755,6 +1092,130 @@ FREEQ_EXPORT void freeq_set_log_priority(struct freeq_ctx *ctx, int priority)
 //const char *freeq_column_get_name(struct freeq_column *column);
 //const char *freeq_column_get_value(struct freeq_column *column);
 
+/*
+ * arena
+ *
+ * a bump allocator for everything a table needs for as long as it
+ * lives: the table itself, its names and, for merged tables, the
+ * segments and sender identities.  nothing is freed on its own,
+ * releasing the table frees the arena's few blocks in one go.
+ */
+#define ARENA_ALIGN 16
+#define ARENA_BLOCK 1024
+
+struct arena_block {
+        struct arena_block *next;
+        size_t size;
+};
+
+struct freeq_arena {
+        struct arena_block *blocks;
+        char *p;
+        char *end;
+};
+
+/* what a keyed frame carries after its column blocks, allocated from
+ * the table's arena */
+struct freeq_delta {
+        uint32_t keycol;
+        bool chained;           /* rows are only the changed ones */
+        struct freeq_column removed;
+};
+
+#define ARENA_HDR ((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static bool arena_grow(struct freeq_arena *a, size_t size)
+{
+        struct arena_block *b;
+
+        size = MAX(size + ARENA_HDR, ARENA_BLOCK);
+        if ((b = malloc(size)) == NULL)
+                return false;
+        b->next = a->blocks;
+        b->size = size;
+        a->blocks = b;
+        a->p = (char *)b + ARENA_HDR;
+        a->end = (char *)b + size;
+        return true;
+}
+
+static struct freeq_arena *arena_new(size_t hint)
+{
+        struct freeq_arena *a = calloc(1, sizeof(struct freeq_arena));
+
+        if (a != NULL && !arena_grow(a, hint))
+        {
+                free(a);
+                return NULL;
+        }
+        return a;
+}
+
+/* zeroed, like calloc */
+static void *arena_alloc(struct freeq_arena *a, size_t size)
+{
+        void *p;
+
+        size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if ((size_t)(a->end - a->p) < size && !arena_grow(a, MAX(size, 2 * (a->end - (char *)a->blocks))))
+                return NULL;
+        p = a->p;
+        a->p += size;
+        return memset(p, 0, size);
+}
+
+static char *arena_strndup(struct freeq_arena *a, const char *s, size_t len)
+{
+        char *d;
+
+        if ((d = arena_alloc(a, len + 1)) != NULL)
+                memcpy(d, s, len);
+        return d;
+}
+
+static void arena_free(struct freeq_arena *a)
+{
+        struct arena_block *b, *next;
+
+        for (b = a->blocks; b != NULL; b = next)
+        {
+                next = b->next;
+                free(b);
+        }
+        free(a);
+}
+
+/* the table and its metadata come from one arena, its first block
+ * sized for the columns and a short name for each */
+static struct freeq_table *table_alloc(int numcols)
+{
+        struct freeq_arena *a;
+        struct freeq_table *t;
+        size_t size = sizeof(struct freeq_table) + numcols * sizeof(struct freeq_column);
+
+        if ((a = arena_new(size + ARENA_ALIGN + numcols * 32 + 128)) == NULL)
+                return NULL;
+        t = arena_alloc(a, size);
+        t->arena = a;
+        t->keycol = -1;
+        return t;
+}
+
+/**
+ * freeq_table_strdup:
+ * @table: table the string belongs to
+ * @s: string to copy
+ *
+ * Copy @s into memory that lives as long as @table, for its name,
+ * identity and column names, which are released with the table.
+ *
+ * Returns: the copy
+ **/
+FREEQ_EXPORT char *freeq_table_strdup(struct freeq_table *table, const char *s)
+{
+        return s ? arena_strndup(table->arena, s, strlen(s)) : NULL;
+}
+
 FREEQ_EXPORT struct freeq_table *freeq_table_ref(struct freeq_table *table)
 {
         if (!table)
@@ -763,6 +1224,14 @@ FREEQ_EXPORT struct freeq_table *freeq_table_ref(struct freeq_table *table)
         return table;
 }
 
+/* the segment itself belongs to the table's arena */
+static void segment_free(struct freeq_segment *seg)
+{
+        if (seg->strings != NULL)
+                g_string_chunk_free(seg->strings);
+        seg->strings = NULL;
+}
+
 FREEQ_EXPORT struct freeq_table *freeq_table_unref(struct freeq_table *table)
 {
         if (table == NULL)
@@ -772,22 +1241,25 @@ FREEQ_EXPORT struct freeq_table *freeq_table_unref(struct freeq_table *table)
         if (table->refcount > 0)
                 return NULL;
 
-        free(table->name);
+        if (table->rw_lock != NULL)
+                g_rw_lock_clear(table->rw_lock);
+        if (table->senders != NULL)
+                g_hash_table_destroy(table->senders);
+        if (table->segments != NULL)
+        {
+                for (guint i = 0; i < table->segments->len; i++)
+                        segment_free(g_ptr_array_index(table->segments, i));
+                g_ptr_array_free(table->segments, TRUE);
+        }
         for (int i=0; i < table->numcols; i++)
-                free(table->columns[i].name);
+                if (table->columns[i].values != NULL)
+                        g_array_free(table->columns[i].values, TRUE);
+        if (table->delta != NULL && table->delta->removed.values != NULL)
+                g_array_free(table->delta->removed.values, TRUE);
 
         if (table->destroy_data)
         {
-                for (int i=0; i < table->numcols; i++)
-                {
-                        dbg(table->ctx, "freeing column %d data\n", i);
-                        g_slist_free(table->columns[i].data);
-//			if (table->columns[i].coltype == FREEQ_COL_STRING)
-//			{
-//				g_slist_free_full(table->columns[i].data, g_free);
-//			}
-//			else
-                }
+                dbg(table->ctx, "freeing string data\n");
                 if (table->strings != NULL)
                         g_string_chunk_free(table->strings);
         }
@@ -795,7 +1267,7 @@ FREEQ_EXPORT struct freeq_table *freeq_table_unref(struct freeq_table *table)
                 dbg(table->ctx, "destroy_data not set, not freeing column data\n");
 
         dbg(table->ctx, "table %p released\n", table);
-        free(table);
+        arena_free(table->arena);
         return NULL;
 }
 
@@ -804,19 +1276,149 @@ FREEQ_EXPORT struct freeq_ctx *freeq_table_get_ctx(struct freeq_table *table)
         return table->ctx;
 }
 
-FREEQ_EXPORT int freeq_error_write_sock(struct freeq_ctx *ctx, const char *errmsg, BIO *b)
+static guint coltype_width(freeq_coltype_t coltype)
+{
+        switch (coltype)
+        {
+        case FREEQ_COL_NUMBER:
+        case FREEQ_COL_TIME:
+                return sizeof(int64_t);
+        case FREEQ_COL_DOUBLE:
+                return sizeof(double);
+        case FREEQ_COL_STRING:
+                return sizeof(freeq_str_t);
+        case FREEQ_COL_IPV4ADDR:
+                return sizeof(uint32_t);
+        case FREEQ_COL_IPV6ADDR:
+                return sizeof(struct in6_addr);
+        default:
+                return 0;
+        }
+}
+
+/* columns get their storage on first use so that callers which
+ * learn the column type after creating the table (tblsend, the
+ * decoder) don't need a separate allocation step */
+static GArray *column_values(struct freeq_column *c, guint reserve)
 {
-        struct freeq_table errtbl;
+        guint width;
 
-        //freeq_coltype_t coltypes[] = { FREEQ_COL_STRING };
-        //char *colnames[] = { "error" };
+        if (c->values != NULL)
+                return c->values;
+        if ((width = coltype_width(c->coltype)) == 0)
+                return NULL;
+        c->values = g_array_sized_new(FALSE, FALSE, width, reserve);
+        return c->values;
+}
 
-        errtbl.name = "error";
-        errtbl.numcols = 1;
-        errtbl.numrows = 1;
+FREEQ_EXPORT void freeq_table_append_number(struct freeq_table *t, int col, int64_t val)
+{
+        GArray *a = column_values(&(t->columns[col]), 0);
+        g_array_append_val(a, val);
+}
 
-        dbg(ctx, "generated error table, sending...\n");
-        return freeq_table_bio_write(ctx, &errtbl, b);
+FREEQ_EXPORT void freeq_table_append_time(struct freeq_table *t, int col, int64_t val)
+{
+        GArray *a = column_values(&(t->columns[col]), 0);
+        g_array_append_val(a, val);
+}
+
+FREEQ_EXPORT void freeq_table_append_double(struct freeq_table *t, int col, double val)
+{
+        GArray *a = column_values(&(t->columns[col]), 0);
+        g_array_append_val(a, val);
+}
+
+FREEQ_EXPORT void freeq_table_append_string(struct freeq_table *t, int col, const char *s, ssize_t len)
+{
+        GArray *a = column_values(&(t->columns[col]), 0);
+        freeq_str_t v = { NULL, 0 };
+
+        if (s != NULL && len < 0)
+                len = strlen(s);
+
+        /* empty strings go over the wire as nulls, store them that
+         * way too so a table survives a round trip unchanged */
+        if (s != NULL && len > 0)
+        {
+                v.str = g_string_chunk_insert_len(t->strings, s, len);
+                v.len = len;
+        }
+        g_array_append_val(a, v);
+}
+
+FREEQ_EXPORT void freeq_table_append_ipv4(struct freeq_table *t, int col, uint32_t addr)
+{
+        GArray *a = column_values(&(t->columns[col]), 0);
+        g_array_append_val(a, addr);
+}
+
+FREEQ_EXPORT void freeq_table_append_ipv6(struct freeq_table *t, int col, const struct in6_addr *addr)
+{
+        GArray *a = column_values(&(t->columns[col]), 0);
+        g_array_append_vals(a, addr, 1);
+}
+
+FREEQ_EXPORT void freeq_table_end_row(struct freeq_table *t)
+{
+        t->numrows++;
+}
+
+/**
+ * freeq_table_clear:
+ * @t: table built with the column builders
+ *
+ * Drop every row of @t, keeping its columns and the storage they
+ * grew to, so an agent can build each report into the same table.
+ * Merged tables can't be cleared, their strings belong to senders.
+ *
+ * Returns: 0 on success, FREEQ_ERR for a merged table
+ **/
+FREEQ_EXPORT int freeq_table_clear(struct freeq_table *t)
+{
+        if (t->senders != NULL)
+                return FREEQ_ERR;
+
+        for (uint32_t j = 0; j < t->numcols; j++)
+                if (t->columns[j].values != NULL)
+                        g_array_set_size(t->columns[j].values, 0);
+        if (t->destroy_data && t->strings != NULL)
+                g_string_chunk_clear(t->strings);
+        t->numrows = 0;
+        return 0;
+}
+
+/* copy a caller supplied GSList into the column arrays, numbers and
+ * addresses are carried in the list pointers themselves */
+static int column_from_slist(struct freeq_table *t, int col, GSList *l)
+{
+        struct in6_addr any = IN6ADDR_ANY_INIT;
+        int n = 0;
+
+        for (; l != NULL; l = g_slist_next(l), n++)
+        {
+                switch (t->columns[col].coltype)
+                {
+                case FREEQ_COL_NUMBER:
+                        freeq_table_append_number(t, col, (int64_t)(intptr_t)l->data);
+                        break;
+                case FREEQ_COL_TIME:
+                        freeq_table_append_time(t, col, (int64_t)(intptr_t)l->data);
+                        break;
+                case FREEQ_COL_STRING:
+                        freeq_table_append_string(t, col, (const char *)l->data, -1);
+                        break;
+                case FREEQ_COL_IPV4ADDR:
+                        freeq_table_append_ipv4(t, col, GPOINTER_TO_UINT(l->data));
+                        break;
+                case FREEQ_COL_IPV6ADDR:
+                        freeq_table_append_ipv6(t, col, l->data != NULL ? (struct in6_addr *)l->data : &any);
+                        break;
+                default:
+                        break;
+                }
+        }
+        return n;
 }
 
 bool ragged(int c, int rlens[], uint32_t *min) {
@@ -845,20 +1447,25 @@ FREEQ_EXPORT int freeq_table_new(struct freeq_ctx *ctx,
         int collens[numcols];
         struct freeq_table *t;
 
-        t = (struct freeq_table *)malloc(sizeof(struct freeq_table) + (numcols * sizeof(struct freeq_column)));
+        t = table_alloc(numcols);
 
         if (!t) {
                 err(ctx, "unable to allocate memory for table\n");
                 return -ENOMEM;
         }
 
-        t->name = strdup(name);
+        t->name = freeq_table_strdup(t, name);
         t->numcols = numcols;
         t->refcount = 1;
         t->numrows = 0;
         t->ctx = ctx;
         t->strings = g_string_chunk_new(DEFAULT_STRCHUNK_LENGTH);
 
+        /* the column data is copied, so the table always owns its
+         * strings. destroy_data now only says whether the caller's
+         * lists should be released once they've been copied */
+        t->destroy_data = true;
+
         dbg(ctx, "going to allocate columns...\n");
         va_start(argp, destroy_data);
 
@@ -872,22 +1479,52 @@ FREEQ_EXPORT int freeq_table_new(struct freeq_ctx *ctx,
                         return -1;
                 }
                 dbg(ctx, "freeq_table_new: adding column %d\n", i);
-                t->columns[i].name = strdup(colnames[i]);
+                t->columns[i].name = freeq_table_strdup(t, colnames[i]);
                 t->columns[i].coltype = coltypes[i];
-                t->columns[i].data = d;
-                collens[i] = g_slist_length(t->columns[i].data);
+                collens[i] = column_from_slist(t, i, d);
+                if (destroy_data)
+                        g_slist_free(d);
         }
 
         va_end(argp);
 
         if (ragged(numcols, (int *)&collens, &(t->numrows)))
+        {
                 dbg(ctx, "freeq_table_new: ragged table detected, using min col length %d\n", t->numrows);
+                for (int i = 0; i < t->numcols; i++)
+                        if (t->columns[i].values != NULL)
+                                g_array_set_size(t->columns[i].values, t->numrows);
+        }
 
         *table = t;
         return 0;
 }
 
-FREEQ_EXPORT int freeq_table_new_fromcols(struct freeq_ctx *ctx,
+/* an unnamed table without column storage, the decoder names it
+ * straight from the frame */
+static struct freeq_table *table_new(struct freeq_ctx *ctx,
+                                     int numcols,
+                                     GStringChunk *strchnk,
+                                     bool destroy_data)
+{
+        struct freeq_table *t;
+
+        if ((t = table_alloc(numcols)) == NULL)
+                return NULL;
+
+        t->numcols = numcols;
+        t->numrows = 0;
+        t->destroy_data = destroy_data;
+        t->refcount = 1;
+        t->ctx = ctx;
+        t->strings = strchnk;
+
+        if (t->strings == NULL)
+                t->strings = g_string_chunk_new(DEFAULT_STRCHUNK_LENGTH);
+        return t;
+}
+
+FREEQ_EXPORT int freeq_table_new_fromcols(struct freeq_ctx *ctx,
                                           const char *name,
                                           int numcols,
                                           struct freeq_table **table,
@@ -895,519 +1532,2746 @@ FREEQ_EXPORT int freeq_table_new_fromcols(struct freeq_ctx *ctx,
                                           bool destroy_data)
 {
         struct freeq_table *t;
-        t = (struct freeq_table *)malloc(sizeof(struct freeq_table) + (numcols * sizeof(struct freeq_column)));
+        t = table_new(ctx, numcols, strchnk, destroy_data);
         if (!t) {
                 err(ctx, "unable to allocate memory for table\n");
                 return -ENOMEM;
         }
 
-        t->name = strdup(name);
-        t->numcols = numcols;
-        t->numrows = 0;
-        t->destroy_data = destroy_data;
-        t->refcount = 1;
-        t->ctx = ctx;
-        t->strings = strchnk;
+        t->name = freeq_table_strdup(t, name);
+        *table = t;
+        return 0;
+}
+
+FREEQ_EXPORT int freeq_table_new_empty(struct freeq_ctx *ctx,
+                                       const char *name,
+                                       int numcols,
+                                       freeq_coltype_t coltypes[],
+                                       const char *colnames[],
+                                       struct freeq_table **table)
+{
+        struct freeq_table *t;
+        int err;
+
+        if ((err = freeq_table_new_fromcols(ctx, name, numcols, &t, NULL, true)))
+                return err;
 
         for (int i = 0; i < numcols; i++)
-                t->columns[i].data = NULL;
+        {
+                t->columns[i].name = freeq_table_strdup(t, colnames[i]);
+                t->columns[i].coltype = coltypes[i];
+                column_values(&(t->columns[i]), 0);
+        }
 
-        if (t->strings == NULL)
-                t->strings = g_string_chunk_new(DEFAULT_STRCHUNK_LENGTH);
         *table = t;
         return 0;
 }
 
-FREEQ_EXPORT int freeq_table_bio_read(ctx, t, b, strchnk)
-struct freeq_ctx *ctx;
-struct freeq_table **t;
-GStringChunk *strchnk;
-BIO *b;
+/**
+ * freeq_table_new_merge:
+ * @ctx: freeq library context
+ * @schema: table to take the name and columns from
+ * @strchnk: string chunk for the new table, or NULL
+ * @table: pointer to the new table
+ *
+ * Create an empty table with the same name and columns as @schema,
+ * for merging tables from several senders into with
+ * freeq_table_merge().
+ *
+ * Returns: 0 on success, an error code otherwise
+ **/
+FREEQ_EXPORT int freeq_table_new_merge(struct freeq_ctx *ctx,
+                                       struct freeq_table *schema,
+                                       GStringChunk *strchnk,
+                                       struct freeq_table **table)
 {
-        union {
-                int64_t i;
-                struct longlong s;
-        } r;
-
-        char *identity;
-        char *name;
-        char strbuf[1024] = {0};
-        ssize_t read;
-        int numcols = 0;
-        int more = 1;
-        int slen = 0;
-        unsigned int pos = 0;
-        struct freeq_table *tbl;
-        struct freeq_column *cols;
+        struct freeq_table *t;
+        int err;
+
+        if ((err = freeq_table_new_fromcols(ctx, schema->name, schema->numcols, &t, strchnk, strchnk == NULL)))
+                return err;
+
+        for (int i = 0; i < schema->numcols; i++)
+        {
+                t->columns[i].name = freeq_table_strdup(t, schema->columns[i].name);
+                t->columns[i].coltype = schema->columns[i].coltype;
+                column_values(&(t->columns[i]), schema->numrows);
+        }
+
+        t->senders = g_hash_table_new(g_str_hash, g_str_equal);
+        t->segments = g_ptr_array_new();
+        t->rw_lock = arena_alloc(t->arena, sizeof(GRWLock));
+        g_rw_lock_init(t->rw_lock);
+        *table = t;
+        return 0;
+}
+
+/* drop dead segments, the caller holds the table's write lock */
+static void table_compact(struct freeq_table *table)
+{
+        struct freeq_segment *seg;
+        uint32_t row = 0;
+        guint kept = 0;
+
+        if (table->segments == NULL || table->deadrows == 0)
+                return;
+
+        for (guint i = 0; i < table->segments->len; i++)
+        {
+                seg = g_ptr_array_index(table->segments, i);
+                if (seg->dead)
+                {
+                        segment_free(seg);
+                        continue;
+                }
 
-        pos += BIO_read_varint(b, &(r.s));
-        dbg(ctx, "read %d bytes , name len %" PRId64 "\n", pos, r.i);
+                if (seg->start != row)
+                {
+                        for (uint32_t j = 0; j < table->numcols; j++)
+                        {
+                                GArray *a = table->columns[j].values;
+                                guint width;
+                                if (a == NULL)
+                                        continue;
+                                width = g_array_get_element_size(a);
+                                memmove(a->data + (size_t)row * width,
+                                        a->data + (size_t)seg->start * width,
+                                        (size_t)seg->numrows * width);
+                        }
+                        seg->start = row;
+                }
+                row += seg->numrows;
+                table->segments->pdata[kept++] = seg;
+        }
 
-        pos += BIO_read(b, (char *)&strbuf, (ssize_t)r.i);
-        name = strndup((char *)&strbuf, r.i);
+        g_ptr_array_set_size(table->segments, kept);
+        for (uint32_t j = 0; j < table->numcols; j++)
+                if (table->columns[j].values != NULL)
+                        g_array_set_size(table->columns[j].values, row);
+        table->numrows = row;
+        table->deadrows = 0;
+}
 
-        dbg(ctx, "name %s pos %d\n", name, pos);
+/**
+ * freeq_table_merge:
+ * @ctx: freeq library context
+ * @dst: table created with freeq_table_new_merge()
+ * @src: table reported by one sender
+ *
+ * Append the rows of @src to @dst as the segment for @src's
+ * identity.  If that sender already has a segment in @dst it is
+ * replaced.  String cells are not copied, @dst takes over @src's
+ * string chunk instead.  The cost is proportional to the rows
+ * appended; replaced rows are reclaimed by freeq_table_compact(),
+ * which runs on its own once they outnumber the live ones.
+ *
+ * @dst is locked only while the rows are appended, merges into
+ * different tables never wait for each other.
+ *
+ * Returns: 0 on success, an error code if the tables differ in shape
+ **/
+FREEQ_EXPORT int freeq_table_merge(struct freeq_ctx *ctx, struct freeq_table *dst, struct freeq_table *src)
+{
+        struct freeq_segment *seg, *old;
+        const char *identity = src->identity != NULL ? src->identity : "";
+        gpointer key;
 
-        pos += BIO_read_varint(b, &(r.s));
-        pos += BIO_read(b, (char *)&strbuf, (ssize_t)r.i);
-        identity = strndup((char *)&strbuf, r.i);
-        dbg(ctx, "identity %s pos %d\n", identity, pos);
+        if (dst->segments == NULL || src->numcols != dst->numcols)
+        {
+                err(ctx, "%s from %s has %u columns, expected %u\n",
+                    src->name, identity, src->numcols, dst->numcols);
+                return FREEQ_ERR;
+        }
 
-        pos += BIO_read_varint(b, &(r.s));
-        numcols = r.i;
-        dbg(ctx, "numcols %d pos %d\n", numcols, pos);
+        for (uint32_t i = 0; i < src->numcols; i++)
+        {
+                if (src->columns[i].coltype != dst->columns[i].coltype ||
+                    strcmp(src->columns[i].name, dst->columns[i].name) != 0)
+                {
+                        err(ctx, "%s from %s: column %u is %s, expected %s\n",
+                            src->name, identity, i, src->columns[i].name, dst->columns[i].name);
+                        return FREEQ_ERR;
+                }
+        }
 
-        int err = freeq_table_new_fromcols(ctx,
-                                           name,
-                                           numcols,
-                                           &tbl,
-                                           strchnk,
-                                           true);
-        if (err)
+        /* dst's arena is only used under its write lock */
+        g_rw_lock_writer_lock(dst->rw_lock);
+        if ((seg = arena_alloc(dst->arena, sizeof(struct freeq_segment))) == NULL)
         {
-                dbg(ctx, "freeq_table_new_fromcols failed!\n");
-                free(identity);
-                free(name);
+                g_rw_lock_writer_unlock(dst->rw_lock);
                 return -ENOMEM;
         }
+        seg->start = dst->numrows;
+        seg->numrows = src->numrows;
+        for (uint32_t i = 0; i < src->numcols; i++)
+        {
+                GArray *a = column_values(&(dst->columns[i]), 0);
+                if (a != NULL && src->columns[i].values != NULL)
+                        g_array_append_vals(a, src->columns[i].values->data, src->numrows);
+        }
+        dst->numrows += src->numrows;
 
-        cols = tbl->columns;
-        tbl->identity = identity;
+        /* the cells now in dst point into src's strings, so the
+         * segment owns them from here on */
+        if (src->destroy_data)
+        {
+                seg->strings = src->strings;
+                src->strings = NULL;
+        }
 
-        for (int i = 0; i < numcols; i++)
+        if (g_hash_table_lookup_extended(dst->senders, identity, &key, (gpointer *)&old))
         {
-                pos += BIO_read(b, (char *)&(cols[i].coltype), 1);
-                dbg(ctx, "coltype for %d is %d, pos %d\n", i, cols[i].coltype, pos);
+                dbg(ctx, "%s sent %s twice, replacing its rows\n", identity, dst->name);
+                old->dead = true;
+                dst->deadrows += old->numrows;
         }
+        else
+                key = arena_strndup(dst->arena, identity, strlen(identity));
+        g_hash_table_insert(dst->senders, key, seg);
+        g_ptr_array_add(dst->segments, seg);
 
-        for (int i = 0; i < numcols; i++)
+        if (dst->deadrows > dst->numrows - dst->deadrows)
+                table_compact(dst);
+        g_rw_lock_writer_unlock(dst->rw_lock);
+        return 0;
+}
+
+/**
+ * freeq_table_compact:
+ * @table: merged table
+ *
+ * Drop the rows of replaced segments from @table, moving the live
+ * segments down over them.
+ **/
+FREEQ_EXPORT void freeq_table_compact(struct freeq_table *table)
+{
+        if (table->rw_lock == NULL)
+                return;
+
+        g_rw_lock_writer_lock(table->rw_lock);
+        table_compact(table);
+        g_rw_lock_writer_unlock(table->rw_lock);
+}
+
+static bool table_same_shape(struct freeq_table *a, struct freeq_table *b)
+{
+        if (a->numcols != b->numcols)
+                return false;
+        for (uint32_t j = 0; j < a->numcols; j++)
+                if (a->columns[j].coltype != b->columns[j].coltype ||
+                    strcmp(a->columns[j].name, b->columns[j].name) != 0)
+                        return false;
+        return true;
+}
+
+/* an empty table with the name, identity and columns of @t */
+static struct freeq_table *table_like(struct freeq_ctx *ctx,
+                                      struct freeq_table *t,
+                                      GStringChunk *strchnk,
+                                      bool destroy_data)
+{
+        struct freeq_table *n;
+
+        if ((n = table_new(ctx, t->numcols, strchnk, destroy_data)) == NULL)
+                return NULL;
+
+        n->name = freeq_table_strdup(n, t->name);
+        n->identity = freeq_table_strdup(n, t->identity);
+        n->serial = t->serial;
+        n->keycol = t->keycol;
+        for (uint32_t j = 0; j < t->numcols; j++)
+        {
+                n->columns[j].name = freeq_table_strdup(n, t->columns[j].name);
+                n->columns[j].coltype = t->columns[j].coltype;
+                column_values(&(n->columns[j]), t->numrows);
+        }
+        return n;
+}
+
+/* appends row @i of @src to @dst, with its strings copied into dst's
+ * chunk if @copy is set and left where they are otherwise */
+static void row_append(struct freeq_table *dst, struct freeq_table *src, uint32_t i, bool copy)
+{
+        for (uint32_t j = 0; j < src->numcols; j++)
+        {
+                struct freeq_column *c = &(src->columns[j]);
+                GArray *a = dst->columns[j].values;
+                freeq_str_t v;
+
+                if (a == NULL || c->values == NULL)
+                        continue;
+                if (copy && c->coltype == FREEQ_COL_STRING)
+                {
+                        v = freeq_column_string(c, i);
+                        if (v.str != NULL)
+                                v.str = g_string_chunk_insert_len(dst->strings, v.str, v.len);
+                        g_array_append_val(a, v);
+                }
+                else
+                        g_array_append_vals(a, c->values->data + (size_t)i * g_array_get_element_size(c->values), 1);
+        }
+        dst->numrows++;
+}
+
+/**
+ * freeq_table_copy:
+ * @ctx: freeq library context
+ * @table: table to copy
+ * @copy: returns the copy
+ *
+ * Copy the rows of @table into a new table that owns its strings,
+ * for keeping a table that something else, such as
+ * freeq_table_merge(), is going to take the strings of.
+ *
+ * Returns: 0 on success
+ **/
+FREEQ_EXPORT int freeq_table_copy(struct freeq_ctx *ctx, struct freeq_table *table, struct freeq_table **copy)
+{
+        struct freeq_table *t;
+
+        if ((t = table_like(ctx, table, NULL, true)) == NULL)
+                return -ENOMEM;
+        for (uint32_t i = 0; i < table->numrows; i++)
+                row_append(t, table, i, true);
+        *copy = t;
+        return 0;
+}
+
+/**
+ * freeq_table_append_rows:
+ * @ctx: freeq library context
+ * @dst: table to append to, not a merged one
+ * @src: table with the same columns as @dst
+ *
+ * Append the rows of @src to @dst, for putting back together a table
+ * that arrived in parts.  String cells are copied into @dst's strings
+ * unless @src was decoded into them in the first place.
+ *
+ * Returns: 0 on success, FREEQ_ERR if the tables differ in shape or
+ * there would be more than UINT32_MAX rows
+ **/
+FREEQ_EXPORT int freeq_table_append_rows(struct freeq_ctx *ctx, struct freeq_table *dst, struct freeq_table *src)
+{
+        if (dst->senders != NULL || dst->strings == NULL || !table_same_shape(dst, src) ||
+            src->numrows > UINT32_MAX - dst->numrows)
         {
-                pos += BIO_read_varint(b, &(r.s));
-                pos += BIO_read(b, (char *)&strbuf, r.i);
-                cols[i].name = strndup((char *)&strbuf, r.i);
-                dbg(ctx, "colname for %d is %s, pos %d\n", i, cols[i].name, pos);
+                err(ctx, "rows of %s can't be appended to %s\n", src->name, dst->name);
+                return FREEQ_ERR;
+        }
+
+        for (uint32_t j = 0; j < src->numcols; j++)
+        {
+                struct freeq_column *c = &(src->columns[j]);
+                GArray *a = column_values(&(dst->columns[j]), dst->numrows + src->numrows);
+                freeq_str_t v;
+
+                if (a == NULL || c->values == NULL)
+                        continue;
+                if (c->coltype != FREEQ_COL_STRING || src->strings == dst->strings)
+                {
+                        g_array_append_vals(a, c->values->data, src->numrows);
+                        continue;
+                }
+                for (uint32_t i = 0; i < src->numrows; i++)
+                {
+                        v = freeq_column_string(c, i);
+                        if (v.str != NULL)
+                                v.str = g_string_chunk_insert_len(dst->strings, v.str, v.len);
+                        g_array_append_val(a, v);
+                }
         }
+        dst->numrows += src->numrows;
+        return 0;
+}
+
+/*
+ * string dictionaries
+ *
+ * every string column has a dictionary of the distinct values seen so
+ * far.  the first occurrence of a string is sent as its length and
+ * bytes and takes the next id, repeats are sent as the id.  both ends
+ * grow the dictionary the same way, so neither ever searches it.
+ *
+ * a freeq_dict holds the dictionaries for every table and column sent
+ * over one stream, letting later tables from the same sender refer to
+ * strings sent in earlier ones.
+ */
+#define FREEQ_DICT_MAX 65536
+
+/* hashed as a freeq_str_t */
+struct str_ref {
+        freeq_str_t s;
+        uint32_t id;
+};
+
+struct string_dict {
+        GHashTable *ids;        /* encoder, str_ref by content */
+        GArray *strs;           /* decoder, freeq_str_t by id */
+        GStringChunk *chunk;    /* copies of the strings, if the
+                                 * dictionary outlives their source */
+};
+
+struct freeq_dict {
+        GHashTable *columns;
+};
+
+static guint str_hash(gconstpointer k)
+{
+        const freeq_str_t *s = k;
+        guint h = 2166136261u;
+        for (uint32_t i = 0; i < s->len; i++)
+                h = (h ^ (uint8_t)s->str[i]) * 16777619u;
+        return h;
+}
+
+static gboolean str_equal(gconstpointer a, gconstpointer b)
+{
+        const freeq_str_t *x = a, *y = b;
+        return x->len == y->len && memcmp(x->str, y->str, x->len) == 0;
+}
+
+static void string_dict_init(struct string_dict *sd, bool copy)
+{
+        sd->ids = NULL;
+        sd->strs = NULL;
+        sd->chunk = copy ? g_string_chunk_new(4096) : NULL;
+}
+
+static void string_dict_clear(struct string_dict *sd)
+{
+        if (sd->ids)
+                g_hash_table_destroy(sd->ids);
+        if (sd->strs)
+                g_array_free(sd->strs, TRUE);
+        if (sd->chunk)
+                g_string_chunk_free(sd->chunk);
+}
+
+static void string_dict_free(gpointer data)
+{
+        string_dict_clear(data);
+        g_free(data);
+}
+
+/* returns the id given to @s, or -1 if it is not in the dictionary */
+static inline int64_t string_dict_lookup(struct string_dict *sd, const char *s, uint32_t len)
+{
+        freeq_str_t key = { s, len };
+        struct str_ref *ref;
+
+        if (sd->ids == NULL || (ref = g_hash_table_lookup(sd->ids, &key)) == NULL)
+                return -1;
+        return ref->id;
+}
+
+static void string_dict_add(struct string_dict *sd, const char *s, uint32_t len)
+{
+        struct str_ref *ref;
+
+        if (sd->ids == NULL)
+                sd->ids = g_hash_table_new_full(str_hash, str_equal, g_free, NULL);
+        if (g_hash_table_size(sd->ids) >= FREEQ_DICT_MAX)
+                return;
+        ref = g_new(struct str_ref, 1);
+        ref->s.str = sd->chunk ? g_string_chunk_insert_len(sd->chunk, s, len) : s;
+        ref->s.len = len;
+        ref->id = g_hash_table_size(sd->ids);
+        g_hash_table_add(sd->ids, ref);
+}
+
+/* decoder side of string_dict_add, @sv must already live as long as
+ * the dictionary unless it keeps its own copies.  returns the id
+ * given to @sv, or -1 if the dictionary is full */
+static int64_t string_dict_push(struct string_dict *sd, const freeq_str_t *sv)
+{
+        freeq_str_t v = *sv;
+
+        if (sd->strs == NULL)
+                sd->strs = g_array_new(FALSE, FALSE, sizeof(freeq_str_t));
+        if (sd->strs->len >= FREEQ_DICT_MAX)
+                return -1;
+        if (sd->chunk)
+                v.str = g_string_chunk_insert_len(sd->chunk, v.str, v.len);
+        g_array_append_val(sd->strs, v);
+        return sd->strs->len - 1;
+}
+
+/**
+ * freeq_dict_new:
+ * @dict: returns the new dictionary
+ *
+ * Create a string dictionary for one stream of tables.  Pass it to
+ * every encode on the sending side and every read on the receiving
+ * side of the same stream, and start a fresh one whenever the stream
+ * is reopened.
+ *
+ * Returns: 0 on success
+ **/
+FREEQ_EXPORT int freeq_dict_new(struct freeq_dict **dict)
+{
+        struct freeq_dict *d;
+
+        d = calloc(1, sizeof(struct freeq_dict));
+        if (!d)
+                return -ENOMEM;
+        d->columns = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, string_dict_free);
+        *dict = d;
+        return 0;
+}
+
+/**
+ * freeq_dict_free:
+ * @dict: dictionary to free
+ **/
+FREEQ_EXPORT void freeq_dict_free(struct freeq_dict *dict)
+{
+        if (dict == NULL)
+                return;
+        g_hash_table_destroy(dict->columns);
+        free(dict);
+}
+
+static struct string_dict *freeq_dict_column(struct freeq_dict *dict,
+                                             const char *table,
+                                             const char *column)
+{
+        struct string_dict *sd;
+        char *key = g_strconcat(table, "\n", column, NULL);
 
-        dbg(ctx, "colnames, pos %d\n", pos);
-        GSList **coldata = calloc(sizeof(GSList *), tbl->numcols);
-        if (coldata == NULL)
+        if ((sd = g_hash_table_lookup(dict->columns, key)) != NULL)
         {
-                dbg(ctx, "unable to allocate coldata lists\n");
+                g_free(key);
+                return sd;
+        }
+        sd = g_new(struct string_dict, 1);
+        string_dict_init(sd, true);
+        g_hash_table_insert(dict->columns, key, sd);
+        return sd;
+}
+
+/*
+ * block decoder
+ *
+ * tables are decoded out of a contiguous buffer.  when the source is
+ * a BIO a whole frame is pulled into the buffer first, so decoding a
+ * cell costs a few pointer comparisons instead of a BIO_read per
+ * byte.
+ */
+
+#define DECODER_BLOCK 16384
+
+struct freeq_decoder {
+        const uint8_t *p;
+        const uint8_t *end;
+        BIO *b;
+        uint8_t *buf;
+        size_t cap;
+        uint8_t *inflated;      /* body of the last compressed frame */
+};
+
+static void decoder_init_mem(struct freeq_decoder *d, const void *buf, size_t len)
+{
+        d->p = (const uint8_t *)buf;
+        d->end = d->p + len;
+        d->b = NULL;
+        d->buf = NULL;
+        d->cap = 0;
+        d->inflated = NULL;
+}
+
+static int decoder_init_bio(struct freeq_decoder *d, BIO *b)
+{
+        if ((d->buf = malloc(DECODER_BLOCK)) == NULL)
                 return -ENOMEM;
+        d->cap = DECODER_BLOCK;
+        d->p = d->end = d->buf;
+        d->b = b;
+        d->inflated = NULL;
+        return 0;
+}
+
+static void decoder_free(struct freeq_decoder *d)
+{
+        free(d->buf);
+        free(d->inflated);
+        d->buf = NULL;
+        d->inflated = NULL;
+}
+
+/* make @need bytes contiguous at d->p, returns the number of bytes
+ * available, which is less than @need only at the end of the input.
+ * nothing past @need is read so that frames following on the same
+ * stream are left for the next reader */
+static size_t decoder_fill(struct freeq_decoder *d, size_t need)
+{
+        size_t avail = d->end - d->p;
+        int n;
+
+        if (avail >= need || d->b == NULL)
+                return avail;
+
+        memmove(d->buf, d->p, avail);
+        if (need > d->cap)
+        {
+                uint8_t *nbuf = realloc(d->buf, MAX(need, d->cap * 2));
+                if (nbuf == NULL)
+                        return avail;
+                d->buf = nbuf;
+                d->cap = MAX(need, d->cap * 2);
+        }
+        d->p = d->buf;
+        d->end = d->buf + avail;
+
+        while (avail < need)
+        {
+                if ((n = BIO_read(d->b, d->buf + avail, need - avail)) <= 0)
+                        break;
+                avail += n;
+                d->end += n;
+        }
+        return avail;
+}
+
+static bool decoder_varint_slow(struct freeq_decoder *d, uint64_t *v)
+{
+        size_t avail = decoder_fill(d, 10);
+        uint64_t r = 0;
+
+        for (size_t i = 0; i < avail && i < 10; i++)
+        {
+                r |= (uint64_t)(d->p[i] & 0x7f) << (7 * i);
+                if (!(d->p[i] & 0x80))
+                {
+                        d->p += i + 1;
+                        *v = r;
+                        return true;
+                }
+        }
+        return false;
+}
+
+static inline bool decoder_varint(struct freeq_decoder *d, uint64_t *v)
+{
+        const uint8_t *p = d->p;
+
+        /* deltas, string lengths and back references almost always
+         * fit in one or two bytes */
+        if (G_LIKELY(p < d->end && !(p[0] & 0x80)))
+        {
+                *v = p[0];
+                d->p = p + 1;
+                return true;
         }
+        if (G_LIKELY(d->end - p >= 2 && !(p[1] & 0x80)))
+        {
+                *v = (p[0] & 0x7f) | ((uint64_t)p[1] << 7);
+                d->p = p + 2;
+                return true;
+        }
+        return decoder_varint_slow(d, v);
+}
+
+static inline int64_t dezigzag(uint64_t v)
+{
+        return (int64_t)((v >> 1) ^ -(v & 1));
+}
+
+/* returns a pointer to the next @n bytes of input, or NULL if the
+ * input is shorter than that */
+static inline const uint8_t *decoder_bytes(struct freeq_decoder *d, size_t n)
+{
+        const uint8_t *p;
+
+        if ((size_t)(d->end - d->p) < n && decoder_fill(d, n) < n)
+                return NULL;
+        p = d->p;
+        d->p += n;
+        return p;
+}
+
+/* a length prefixed string, left in place */
+static bool decoder_view(struct freeq_decoder *d, const char **s, uint64_t *len)
+{
+        const uint8_t *p;
+
+        if (!decoder_varint(d, len) || (p = decoder_bytes(d, *len)) == NULL)
+                return false;
+        *s = (const char *)p;
+        return true;
+}
+
+static char *decoder_vstr(struct freeq_decoder *d, struct freeq_arena *a)
+{
+        const char *s;
+        uint64_t len;
+
+        if (!decoder_view(d, &s, &len))
+                return NULL;
+        return arena_strndup(a, s, len);
+}
+
+/* @local caches where the strings of a stream dictionary are in the
+ * table, it is NULL when the dictionary only lives as long as this
+ * table.
+ *
+ * string bytes are copied straight from the frame into the table's
+ * chunk, and a stream dictionary keeps a copy of its own: the table's
+ * chunk goes with its rows into a generation, which frees it long
+ * before the stream is done referring to the strings.  repeats arrive
+ * as dictionary references, copied into the table once per table, so
+ * nothing is hashed to find duplicates */
+static int decode_column(struct freeq_ctx *ctx,
+                         struct freeq_decoder *d,
+                         struct freeq_table *tbl,
+                         struct freeq_column *col,
+                         uint32_t numrows,
+                         struct string_dict *sd,
+                         GArray *local)
+{
+        const uint8_t *p;
+        uint64_t v, id;
+        int64_t prev = 0;
+        int64_t slen, pushed;
+        freeq_str_t *sv, *ls;
+
+        g_array_set_size(col->values, numrows);
+
+        for (uint32_t i = 0; i < numrows; i++)
+        {
+                if (col->coltype == FREEQ_COL_IPV6ADDR)
+                {
+                        if ((p = decoder_bytes(d, sizeof(struct in6_addr))) == NULL)
+                                return FREEQ_ERR;
+                        memcpy(&freeq_column_ipv6(col, i), p, sizeof(struct in6_addr));
+                        continue;
+                }
+
+                if (!decoder_varint(d, &v))
+                        return FREEQ_ERR;
+
+                switch (col->coltype) {
+                case FREEQ_COL_STRING:
+                        sv = &freeq_column_string(col, i);
+                        slen = dezigzag(v);
+                        if (slen > 0)
+                        {
+                                if ((p = decoder_bytes(d, slen)) == NULL)
+                                        return FREEQ_ERR;
+                                sv->str = g_string_chunk_insert_len(tbl->strings, (const char *)p, slen);
+                                sv->len = slen;
+                                if ((pushed = string_dict_push(sd, sv)) >= 0 && local != NULL)
+                                {
+                                        if ((uint64_t)pushed >= local->len)
+                                                g_array_set_size(local, sd->strs->len);
+                                        g_array_index(local, freeq_str_t, pushed) = *sv;
+                                }
+                        }
+                        else if (slen < 0)
+                        {
+                                id = -(slen + 1);
+                                if (sd->strs == NULL || id >= sd->strs->len)
+                                {
+                                        err(ctx, "row %d string id %" PRIu64 " out of range\n", i, id);
+                                        return FREEQ_ERR;
+                                }
+                                if (local == NULL)
+                                {
+                                        *sv = g_array_index(sd->strs, freeq_str_t, id);
+                                        break;
+                                }
+                                if (id >= local->len)
+                                        g_array_set_size(local, sd->strs->len);
+                                ls = &g_array_index(local, freeq_str_t, id);
+                                if (ls->str == NULL)
+                                {
+                                        *ls = g_array_index(sd->strs, freeq_str_t, id);
+                                        ls->str = g_string_chunk_insert_len(tbl->strings, ls->str, ls->len);
+                                }
+                                *sv = *ls;
+                        }
+                        else
+                        {
+                                sv->str = NULL;
+                                sv->len = 0;
+                        }
+                        break;
+                case FREEQ_COL_NUMBER:
+                case FREEQ_COL_TIME:
+                        prev = (int64_t)((uint64_t)prev + (uint64_t)dezigzag(v));
+                        freeq_column_number(col, i) = prev;
+                        break;
+                case FREEQ_COL_DOUBLE:
+                        freeq_column_double(col, i) = decode_double(v, (uint64_t *)&prev);
+                        break;
+                case FREEQ_COL_IPV4ADDR:
+                        freeq_column_ipv4(col, i) = v;
+                        break;
+                default:
+                        break;
+                }
+        }
+        return 0;
+}
+
+/* picks the string dictionary for a column block and decodes it */
+static int decode_block(struct freeq_ctx *ctx,
+                        struct freeq_table *tbl,
+                        struct freeq_column *col,
+                        const uint8_t *p,
+                        size_t blen,
+                        uint32_t numrows,
+                        struct freeq_dict *dict)
+{
+        struct freeq_decoder block;
+        struct string_dict own, *sd = &own;
+        GArray *local = NULL;
+        int err;
+
+        /* every cell takes at least a byte */
+        if (blen < numrows)
+                return FREEQ_ERR;
+
+        decoder_init_mem(&block, p, blen);
+        string_dict_init(&own, false);
+        if (dict && col->coltype == FREEQ_COL_STRING)
+        {
+                sd = freeq_dict_column(dict, tbl->name, col->name);
+                local = g_array_sized_new(FALSE, TRUE, sizeof(freeq_str_t),
+                                          sd->strs ? sd->strs->len : 0);
+        }
+
+        err = decode_column(ctx, &block, tbl, col, numrows, sd, local);
+
+        if (local)
+                g_array_free(local, TRUE);
+        string_dict_clear(&own);
+        return err;
+}
+
+/* reads what follows the column blocks of a keyed frame */
+static int delta_decode(struct freeq_ctx *ctx, struct freeq_decoder *d, struct freeq_table *tbl)
+{
+        uint64_t keycol, chained, n, blen;
+        struct freeq_delta *delta;
+        const uint8_t *p;
+
+        if (!decoder_varint(d, &keycol) || keycol >= tbl->numcols ||
+            !decoder_varint(d, &chained) ||
+            !decoder_varint(d, &n) ||
+            !decoder_varint(d, &blen) || n > blen ||
+            (p = decoder_bytes(d, blen)) == NULL)
+                return FREEQ_ERR;
+
+        if ((delta = arena_alloc(tbl->arena, sizeof(struct freeq_delta))) == NULL)
+                return -ENOMEM;
+        delta->keycol = keycol;
+        delta->chained = chained != 0;
+        delta->removed.coltype = tbl->columns[keycol].coltype;
+        delta->removed.name = tbl->columns[keycol].name;
+        tbl->delta = delta;
+        tbl->keycol = keycol;
+
+        if (column_values(&(delta->removed), n) == NULL)
+                return FREEQ_ERR;
+        return decode_block(ctx, tbl, &(delta->removed), p, blen, n, NULL);
+}
+
+/* decodes a frame body, see freeq_table_encode for the layout */
+static int table_decode(struct freeq_ctx *ctx,
+                        struct freeq_decoder *d,
+                        struct freeq_table **t,
+                        GStringChunk *strchnk,
+                        uint8_t flags,
+                        struct freeq_dict *dict)
+{
+        uint64_t v, serial, numrows, numcols, blen, namelen, idlen;
+        const char *name, *identity;
+        const uint8_t *p;
+        struct freeq_decoder lens;
+        struct freeq_table *tbl;
+        struct freeq_column *cols;
+        size_t strbytes = 0;
+
+        if (!decoder_view(d, &name, &namelen) ||
+            !decoder_view(d, &identity, &idlen) ||
+            !decoder_varint(d, &serial) ||
+            !decoder_varint(d, &numrows) ||
+            !decoder_varint(d, &numcols) ||
+            numcols > FREEQ_MAX_COLUMNS ||
+            numrows > FREEQ_FRAME_MAX)
+        {
+                err(ctx, "truncated or invalid table header\n");
+                return FREEQ_ERR;
+        }
+        dbg(ctx, "name %.*s identity %.*s numrows %" PRIu64 " numcols %" PRIu64 "\n",
+            (int)namelen, name, (int)idlen, identity, numrows, numcols);
+
+        if ((flags & FREEQ_FRAME_DICT) && dict == NULL)
+        {
+                err(ctx, "table %.*s refers to a stream dictionary\n", (int)namelen, name);
+                return FREEQ_ERR;
+        }
+        if (!(flags & FREEQ_FRAME_DICT))
+                dict = NULL;
+
+        if ((tbl = table_new(ctx, numcols, strchnk, strchnk == NULL)) == NULL)
+        {
+                dbg(ctx, "table_new failed!\n");
+                return -ENOMEM;
+        }
+
+        cols = tbl->columns;
+        tbl->name = arena_strndup(tbl->arena, name, namelen);
+        tbl->identity = arena_strndup(tbl->arena, identity, idlen);
+        tbl->serial = serial;
+
+        if ((p = decoder_bytes(d, numcols)) == NULL)
+                goto truncated;
+        for (int i = 0; i < numcols; i++)
+                cols[i].coltype = p[i];
+
+        for (int i = 0; i < numcols; i++)
+                if ((cols[i].name = decoder_vstr(d, tbl->arena)) == NULL)
+                        goto truncated;
+
+        /* the column blocks start after the table of block lengths,
+         * walk it once to find them */
+        lens = *d;
+        blen = 0;
+        for (int i = 0; i < numcols; i++)
+        {
+                if (!decoder_varint(d, &v) || v > FREEQ_FRAME_MAX)
+                        goto truncated;
+                blen += v;
+                if (cols[i].coltype == FREEQ_COL_STRING)
+                        strbytes += v + MIN(v, numrows);
+        }
+        if (blen > (uint64_t)(d->end - d->p))
+                goto truncated;
+
+        /* a string block holds at most its own length in string
+         * bytes, plus a terminator per row, so a chunk of that size
+         * takes every string of the frame in one allocation */
+        if (strchnk == NULL && strbytes > 0)
+        {
+                g_string_chunk_free(tbl->strings);
+                tbl->strings = g_string_chunk_new(strbytes);
+        }
+
+        for (int i = 0; i < numcols; i++)
+        {
+                decoder_varint(&lens, &blen);
+                if ((p = decoder_bytes(d, blen)) == NULL)
+                        goto truncated;
+
+                /* columns of a type we don't know about are skipped.
+                 * every cell takes at least a byte, check that before
+                 * sizing the column by a row count off the wire */
+                if (coltype_width(cols[i].coltype) == 0)
+                        continue;
+                if (blen < numrows)
+                        goto truncated;
+                column_values(&(cols[i]), numrows);
+                if (decode_block(ctx, tbl, &(cols[i]), p, blen, numrows, dict))
+                {
+                        err(ctx, "column %s of %s is corrupt\n", cols[i].name, tbl->name);
+                        goto fail;
+                }
+        }
+
+        if ((flags & FREEQ_FRAME_DELTA) && delta_decode(ctx, d, tbl))
+        {
+                err(ctx, "removed keys of %s are corrupt\n", tbl->name);
+                goto fail;
+        }
+
+        tbl->numrows = numrows;
+        *t = tbl;
+        return 0;
+
+truncated:
+        err(ctx, "truncated column header for %s\n", tbl->name);
+fail:
+        freeq_table_unref(tbl);
+        return FREEQ_ERR;
+}
+
+/*
+ * codecs
+ *
+ * the contexts are kept per thread, freeqd compresses results on
+ * every worker at once
+ */
+#ifdef HAVE_ZSTD
+static GPrivate zstd_cctx = G_PRIVATE_INIT((GDestroyNotify)ZSTD_freeCCtx);
+static GPrivate zstd_dctx = G_PRIVATE_INIT((GDestroyNotify)ZSTD_freeDCtx);
+#endif
+
+/* appends @src compressed with @codec to @out, false if that didn't
+ * work.  @name picks the zstd dictionary */
+static bool codec_compress(struct freeq_ctx *ctx,
+                           uint8_t codec,
+                           const char *name,
+                           const uint8_t *src,
+                           size_t len,
+                           GByteArray *out)
+{
+        guint at = out->len;
+        size_t n = 0;
+
+        switch (codec)
+        {
+#ifdef HAVE_LZ4
+        case FREEQ_CODEC_LZ4:
+                g_byte_array_set_size(out, at + LZ4_compressBound(len));
+                n = LZ4_compress_default((const char *)src, (char *)out->data + at, len, out->len - at);
+                break;
+#endif
+#ifdef HAVE_ZSTD
+        case FREEQ_CODEC_ZSTD:
+        {
+                ZSTD_CCtx *cctx = g_private_get(&zstd_cctx);
+                ZSTD_CDict *cdict = NULL;
+
+                if (cctx == NULL)
+                {
+                        cctx = ZSTD_createCCtx();
+                        g_private_set(&zstd_cctx, cctx);
+                }
+                ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+                ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, ctx->codec_level);
+                /* big frames are cut up between threads, a libzstd
+                 * built without them just says no */
+                if (len >= FREEQ_COMPRESS_PARALLEL)
+                        ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, MIN(g_get_num_processors(), 4));
+                if (ctx->cdicts && name && (cdict = g_hash_table_lookup(ctx->cdicts, name)))
+                        ZSTD_CCtx_refCDict(cctx, cdict);
+
+                g_byte_array_set_size(out, at + ZSTD_compressBound(len));
+                n = ZSTD_compress2(cctx, out->data + at, out->len - at, src, len);
+                if (ZSTD_isError(n))
+                {
+                        dbg(ctx, "zstd: %s\n", ZSTD_getErrorName(n));
+                        n = 0;
+                }
+                break;
+        }
+#endif
+        default:
+                break;
+        }
+
+        g_byte_array_set_size(out, at + n);
+        return n > 0;
+}
+
+/* fills @dst with exactly @rawlen bytes from @src, or fails */
+static bool codec_decompress(struct freeq_ctx *ctx,
+                             uint8_t codec,
+                             const uint8_t *src,
+                             size_t len,
+                             uint8_t *dst,
+                             size_t rawlen)
+{
+        switch (codec)
+        {
+#ifdef HAVE_LZ4
+        case FREEQ_CODEC_LZ4:
+                return LZ4_decompress_safe((const char *)src, (char *)dst, len, rawlen) == (int)rawlen;
+#endif
+#ifdef HAVE_ZSTD
+        case FREEQ_CODEC_ZSTD:
+        {
+                ZSTD_DCtx *dctx = g_private_get(&zstd_dctx);
+                ZSTD_DDict *ddict = NULL;
+                unsigned id = ZSTD_getDictID_fromFrame(src, len);
+                size_t n;
+
+                if (id != 0 && (ctx->ddicts == NULL ||
+                                (ddict = g_hash_table_lookup(ctx->ddicts, GUINT_TO_POINTER(id))) == NULL))
+                {
+                        err(ctx, "frame needs zstd dictionary %u\n", id);
+                        return false;
+                }
+                if (dctx == NULL)
+                {
+                        dctx = ZSTD_createDCtx();
+                        g_private_set(&zstd_dctx, dctx);
+                }
+                n = ddict ? ZSTD_decompress_usingDDict(dctx, dst, rawlen, src, len, ddict) :
+                            ZSTD_decompressDCtx(dctx, dst, rawlen, src, len);
+                return !ZSTD_isError(n) && n == rawlen;
+        }
+#endif
+        default:
+                err(ctx, "frame compressed with codec %d, which we don't have\n", codec);
+                return false;
+        }
+}
+
+/**
+ * freeq_frame_compress:
+ * @ctx: freeq library context
+ * @frame: holds one frame from @start to its end
+ * @start: offset of the frame in @frame
+ * @codec: FREEQ_CODEC_* to compress with
+ *
+ * Compress the body of an encoded frame in place.  Bodies under
+ * FREEQ_COMPRESS_MIN bytes, and ones the codec doesn't make smaller,
+ * are left as they are.  The receiver must have said it reads @codec.
+ *
+ * Returns: 0 on success, FREEQ_ERR if @codec isn't built in
+ **/
+FREEQ_EXPORT int freeq_frame_compress(struct freeq_ctx *ctx, GByteArray *frame, guint start, uint8_t codec)
+{
+        struct freeq_decoder d;
+        const char *name;
+        uint64_t namelen;
+        char *key = NULL;
+        uint8_t *h = frame->data + start;
+        uint8_t flags = h[5];
+        uint32_t blen, crc;
+        GByteArray *z;
+        bool ok;
+
+        if (codec > 7 || !(freeq_codecs() & (1 << codec)))
+                return FREEQ_ERR;
+        memcpy(&blen, h + 8, sizeof(blen));
+        blen = GUINT32_FROM_BE(blen);
+        if (codec == FREEQ_CODEC_NONE || h[6] != FREEQ_CODEC_NONE || blen < FREEQ_COMPRESS_MIN)
+                return 0;
+
+        /* dictionaries go by table name, which the body starts with */
+        decoder_init_mem(&d, h + FREEQ_FRAME_HEADER_LEN, blen);
+        if (decoder_view(&d, &name, &namelen))
+                key = g_strndup(name, namelen);
+
+        z = g_byte_array_sized_new(blen / 2 + 16);
+        bytes_varint(z, blen);
+        ok = codec_compress(ctx, codec, key, h + FREEQ_FRAME_HEADER_LEN, blen, z) && z->len < blen;
+        g_free(key);
+
+        if (ok)
+        {
+                dbg(ctx, "frame body compressed from %u to %u bytes\n", blen, z->len);
+                g_byte_array_set_size(frame, start + FREEQ_FRAME_HEADER_LEN);
+                g_byte_array_append(frame, z->data, z->len);
+                h = frame->data + start;
+                frame_header(h, flags, z->len);
+                h[6] = codec;
+                if (flags & FREEQ_FRAME_CRC32C)
+                {
+                        crc = GUINT32_TO_BE(crc32c(0, z->data, z->len));
+                        g_byte_array_append(frame, (const guint8 *)&crc, sizeof(crc));
+                }
+        }
+        g_byte_array_free(z, TRUE);
+        return 0;
+}
+
+/* a compressed body is decompressed into a buffer kept with @d */
+static int frame_inflate(struct freeq_ctx *ctx,
+                         struct freeq_decoder *d,
+                         struct freeq_decoder *body,
+                         uint8_t codec,
+                         const uint8_t *p,
+                         uint32_t len)
+{
+        struct freeq_decoder z;
+        uint64_t rawlen;
+
+        decoder_init_mem(&z, p, len);
+        if (!decoder_varint(&z, &rawlen) || rawlen == 0 || rawlen > FREEQ_FRAME_MAX)
+        {
+                err(ctx, "compressed frame has a bad length\n");
+                return FREEQ_ERR;
+        }
+
+        free(d->inflated);
+        if ((d->inflated = malloc(rawlen)) == NULL)
+                return -ENOMEM;
+        if (!codec_decompress(ctx, codec, z.p, z.end - z.p, d->inflated, rawlen))
+        {
+                err(ctx, "unable to decompress frame\n");
+                return FREEQ_ERR;
+        }
+        decoder_init_mem(body, d->inflated, rawlen);
+        return 0;
+}
+
+/* reads one frame off @d and leaves @body pointing at its payload.
+ * @codecs, if given, gets byte 7 of the prefix */
+static int frame_read(struct freeq_ctx *ctx,
+                      struct freeq_decoder *d,
+                      struct freeq_decoder *body,
+                      uint8_t *flags,
+                      uint8_t *codecs)
+{
+        const uint8_t *h;
+        uint32_t len, crc;
+        uint8_t codec;
+        size_t avail;
+
+        if ((avail = decoder_fill(d, FREEQ_FRAME_HEADER_LEN)) == 0)
+                return FREEQ_EOF;
+
+        if ((h = decoder_bytes(d, FREEQ_FRAME_HEADER_LEN)) == NULL)
+        {
+                err(ctx, "truncated frame header (%zu bytes)\n", avail);
+                return FREEQ_ERR;
+        }
+
+        if (memcmp(h, FREEQ_FRAME_MAGIC, 4) != 0)
+        {
+                err(ctx, "bad frame magic\n");
+                return FREEQ_ERR;
+        }
+
+        if (h[4] != FREEQ_FRAME_VERSION)
+        {
+                err(ctx, "unsupported frame version %d\n", h[4]);
+                return FREEQ_ERR;
+        }
+
+        *flags = h[5];
+        codec = h[6];
+        if (codecs)
+                *codecs = h[7];
+        memcpy(&len, h + 8, sizeof(len));
+        len = GUINT32_FROM_BE(len);
+        if (len > FREEQ_FRAME_MAX)
+        {
+                err(ctx, "frame length %u exceeds limit\n", len);
+                return FREEQ_ERR;
+        }
+
+        /* h is invalid once the decoder refills */
+        if ((h = decoder_bytes(d, len + (*flags & FREEQ_FRAME_CRC32C ? 4 : 0))) == NULL)
+        {
+                err(ctx, "truncated frame, expected %u bytes\n", len);
+                return FREEQ_ERR;
+        }
+
+        if (*flags & FREEQ_FRAME_CRC32C)
+        {
+                memcpy(&crc, h + len, sizeof(crc));
+                if (GUINT32_FROM_BE(crc) != crc32c(0, h, len))
+                {
+                        err(ctx, "frame checksum mismatch\n");
+                        return FREEQ_ERR;
+                }
+        }
+
+        if (codec != FREEQ_CODEC_NONE)
+                return frame_inflate(ctx, d, body, codec, h, len);
+        decoder_init_mem(body, h, len);
+        return 0;
+}
+
+/**
+ * freeq_table_bio_read:
+ * @ctx: freeq library context
+ * @t: returns the decoded table
+ * @b: BIO to read from
+ * @strchnk: string chunk to intern strings in, or NULL for a private one
+ *
+ * Read one table frame from @b.  Nothing past the end of the frame is
+ * consumed, so several tables can be sent over one stream.
+ *
+ * Returns: 0 on success, FREEQ_EOF if the stream ended cleanly before
+ * a frame, FREEQ_ERR on truncated or corrupt input
+ **/
+FREEQ_EXPORT int freeq_table_bio_read(ctx, t, b, strchnk)
+struct freeq_ctx *ctx;
+struct freeq_table **t;
+GStringChunk *strchnk;
+BIO *b;
+{
+        return freeq_table_bio_read_dict(ctx, t, b, strchnk, NULL, NULL);
+}
+
+/**
+ * freeq_table_bio_read_dict:
+ * @ctx: freeq library context
+ * @t: returns the decoded table
+ * @b: BIO to read from
+ * @strchnk: string chunk to intern strings in, or NULL for a private one
+ * @dict: string dictionary of the stream, or NULL
+ * @flags: returns the flags of the frame, 0 if none was read, may be NULL
+ *
+ * Like freeq_table_bio_read(), but also accepts tables whose strings
+ * refer to ones sent earlier on the same stream.  A sender that set
+ * FREEQ_FRAME_ACK in @flags expects freeq_bio_write_ack() once the
+ * table has been taken care of.
+ *
+ * Returns: 0 on success, FREEQ_EOF if the stream ended cleanly before
+ * a frame, FREEQ_ERR on truncated or corrupt input
+ **/
+FREEQ_EXPORT int freeq_table_bio_read_dict(struct freeq_ctx *ctx,
+                                           struct freeq_table **t,
+                                           BIO *b,
+                                           GStringChunk *strchnk,
+                                           struct freeq_dict *dict,
+                                           uint8_t *flags)
+{
+        struct freeq_decoder d, body;
+        uint8_t f = 0;
+        int err;
+
+        if (!(err = decoder_init_bio(&d, b)))
+        {
+                if (!(err = frame_read(ctx, &d, &body, &f, NULL)))
+                        err = table_decode(ctx, &body, t, strchnk, f, dict);
+                decoder_free(&d);
+        }
+        if (flags)
+                *flags = f;
+        return err;
+}
+
+/**
+ * freeq_result_bio_read:
+ * @ctx: freeq library context
+ * @t: returns the result
+ * @b: BIO the query was sent on
+ *
+ * Read the result of a query, putting together the frames flagged
+ * FREEQ_FRAME_MORE it is split into.  A result that ends in an error
+ * frame fails, with the server's message logged.
+ *
+ * Returns: 0 on success, FREEQ_ERR if the query failed or the input
+ * is truncated or corrupt
+ **/
+FREEQ_EXPORT int freeq_result_bio_read(struct freeq_ctx *ctx, struct freeq_table **t, BIO *b)
+{
+        struct freeq_table *res = NULL, *part;
+        freeq_str_t msg = { NULL, 0 };
+        uint8_t flags;
+        int err;
+
+        *t = NULL;
+        do {
+                /* later chunks decode straight into the strings of
+                 * the first */
+                if ((err = freeq_table_bio_read_dict(ctx, &part, b, res ? res->strings : NULL, NULL, &flags)))
+                        goto fail;
+
+                if (flags & FREEQ_FRAME_ERROR)
+                {
+                        if (part->numcols > 0 && part->numrows > 0 &&
+                            part->columns[0].coltype == FREEQ_COL_STRING)
+                                msg = freeq_column_string(&part->columns[0], 0);
+                        err(ctx, "query failed: %.*s\n", (int)msg.len, msg.str ? msg.str : "");
+                        freeq_table_unref(part);
+                        err = FREEQ_ERR;
+                        goto fail;
+                }
+
+                if (res == NULL)
+                        res = part;
+                else
+                {
+                        err = freeq_table_append_rows(ctx, res, part);
+                        freeq_table_unref(part);
+                        if (err)
+                                goto fail;
+                }
+        } while (flags & FREEQ_FRAME_MORE);
+
+        *t = res;
+        return 0;
+
+fail:
+        if (res != NULL)
+                freeq_table_unref(res);
+        return err == FREEQ_EOF ? FREEQ_ERR : err;
+}
+
+/* an ack is a frame with FREEQ_FRAME_ACK set and no body, byte 7
+ * lists the codecs its sender reads */
+static int ack_write(struct freeq_ctx *ctx, BIO *b, uint8_t codecs)
+{
+        uint8_t hdr[FREEQ_FRAME_HEADER_LEN];
+
+        frame_header(hdr, FREEQ_FRAME_ACK, 0);
+        hdr[7] = codecs;
+        if (BIO_write(b, hdr, sizeof(hdr)) != sizeof(hdr) || BIO_flush(b) <= 0)
+        {
+                err(ctx, "unable to write ack\n");
+                return FREEQ_ERR;
+        }
+        return 0;
+}
+
+/* a peer that read the table but couldn't take it answers with an
+ * error frame instead, the stream stays usable */
+static int ack_read(struct freeq_ctx *ctx, BIO *b, uint8_t *codecs)
+{
+        struct freeq_decoder d, body;
+        struct freeq_table *t;
+        freeq_str_t msg = { NULL, 0 };
+        uint8_t flags, peer;
+        int err;
+
+        if ((err = decoder_init_bio(&d, b)))
+                return err;
+        if ((err = frame_read(ctx, &d, &body, &flags, &peer)))
+                ;
+        else if (flags & FREEQ_FRAME_ERROR)
+        {
+                if ((err = table_decode(ctx, &body, &t, NULL, flags, NULL)) == 0)
+                {
+                        if (t->numcols > 0 && t->numrows > 0 &&
+                            t->columns[0].coltype == FREEQ_COL_STRING)
+                                msg = freeq_column_string(&t->columns[0], 0);
+                        err(ctx, "table refused: %.*s\n", (int)msg.len, msg.str ? msg.str : "");
+                        freeq_table_unref(t);
+                        err = FREEQ_REFUSED;
+                }
+        }
+        else if (!(flags & FREEQ_FRAME_ACK) || body.p != body.end)
+        {
+                err(ctx, "expected an ack, got flags %#x\n", flags);
+                err = FREEQ_ERR;
+        }
+        else if (codecs)
+                *codecs = peer;
+        decoder_free(&d);
+        return err;
+}
+
+/**
+ * freeq_bio_write_ack:
+ * @ctx: freeq library context
+ * @b: BIO to write to
+ *
+ * Acknowledge the last table read from @b.  The acknowledgement is a
+ * frame with FREEQ_FRAME_ACK set and no body, and tells the peer
+ * which codecs it may compress the following tables with.
+ *
+ * Returns: 0 on success
+ **/
+FREEQ_EXPORT int freeq_bio_write_ack(struct freeq_ctx *ctx, BIO *b)
+{
+        return ack_write(ctx, b, freeq_codecs());
+}
+
+/**
+ * freeq_bio_read_ack:
+ * @ctx: freeq library context
+ * @b: BIO to read from
+ *
+ * Wait for the peer to acknowledge a table sent with FREEQ_FRAME_ACK.
+ * A peer that read the table but couldn't take it answers with an
+ * error frame, see freeq_error_encode(), whose message is logged.
+ *
+ * Returns: 0 once acknowledged, FREEQ_REFUSED if the peer answered
+ * with an error frame, FREEQ_EOF if the peer closed the stream
+ * instead, FREEQ_ERR otherwise
+ **/
+FREEQ_EXPORT int freeq_bio_read_ack(struct freeq_ctx *ctx, BIO *b)
+{
+        return ack_read(ctx, b, NULL);
+}
+
+/**
+ * freeq_bio_write_offer:
+ * @ctx: freeq library context
+ * @b: BIO to write to
+ * @codecs: codecs the result may be compressed with, bit 1 << codec
+ *
+ * Ask for a compressed query result.  Sent ahead of the query, the
+ * offer is an ack that no table came before.
+ *
+ * Returns: 0 on success
+ **/
+FREEQ_EXPORT int freeq_bio_write_offer(struct freeq_ctx *ctx, BIO *b, uint8_t codecs)
+{
+        return ack_write(ctx, b, codecs & freeq_codecs());
+}
+
+/**
+ * freeq_table_mem_read:
+ * @ctx: freeq library context
+ * @t: returns the decoded table
+ * @buf: one encoded frame, as produced by freeq_table_encode
+ * @len: length of @buf
+ * @strchnk: string chunk to intern strings in, or NULL for a private one
+ * @dict: string dictionary of the stream, or NULL
+ *
+ * Decode a table frame that is already in memory.
+ *
+ * Returns: 0 on success
+ **/
+FREEQ_EXPORT int freeq_table_mem_read(struct freeq_ctx *ctx,
+                                      struct freeq_table **t,
+                                      const void *buf,
+                                      size_t len,
+                                      GStringChunk *strchnk,
+                                      struct freeq_dict *dict)
+{
+        struct freeq_decoder d, body;
+        uint8_t flags;
+        int err;
+
+        decoder_init_mem(&d, buf, len);
+        if ((err = frame_read(ctx, &d, &body, &flags, NULL)) == 0)
+                err = table_decode(ctx, &body, t, strchnk, flags, dict);
+        decoder_free(&d);
+        return err == FREEQ_EOF ? FREEQ_ERR : err;
+}
+
+int conn_cleanup(void)
+{
+    int i;
+    if (!mutex_buf)
+        return 0;
+    CRYPTO_set_id_callback(NULL);
+    CRYPTO_set_locking_callback(NULL);
+    for (i = 0; i < CRYPTO_num_locks(); i++)
+        pthread_mutex_destroy(&(mutex_buf[i]));
+    free(mutex_buf);
+    mutex_buf = NULL;
+    return 1;
+}
+
+/*
+ * column encoder
+ *
+ * each column is encoded into its own buffer so that the frame can
+ * carry the byte length of every column ahead of the data.
+ */
+struct column_encoder {
+        freeq_coltype_t coltype;
+        GByteArray *buf;
+        uint64_t prev;
+        uint32_t row;
+        struct string_dict *dict;
+        struct string_dict own;
+};
+
+/* string columns use @dict if given, otherwise a dictionary private
+ * to this frame.  its strings are remembered by pointer unless @copy
+ * is set because the caller's buffer won't outlive the row */
+static void column_encoder_init(struct column_encoder *e,
+                                freeq_coltype_t coltype,
+                                bool copy,
+                                struct string_dict *dict)
+{
+        e->coltype = coltype;
+        e->buf = g_byte_array_new();
+        e->prev = 0;
+        e->row = 0;
+        string_dict_init(&e->own, copy && dict == NULL);
+        e->dict = dict ? dict : &e->own;
+}
+
+static void column_encoder_clear(struct column_encoder *e)
+{
+        g_byte_array_free(e->buf, TRUE);
+        string_dict_clear(&e->own);
+}
+
+/* a new string is sent as its length and bytes, a repeat as -(id + 1) */
+static void encode_string(struct column_encoder *e, const char *s, uint32_t len)
+{
+        int64_t id;
+
+        if (s == NULL || len == 0)
+        {
+                bytes_varint(e->buf, 0);
+                return;
+        }
+
+        if ((id = string_dict_lookup(e->dict, s, len)) >= 0)
+        {
+                bytes_varintsigned(e->buf, -id - 1);
+                return;
+        }
+
+        bytes_varintsigned(e->buf, len);
+        g_byte_array_append(e->buf, (const guint8 *)s, len);
+        string_dict_add(e->dict, s, len);
+}
+
+static inline void encode_number(struct column_encoder *e, int64_t num)
+{
+        bytes_varintsigned(e->buf, (int64_t)((uint64_t)num - e->prev));
+        e->prev = num;
+}
+
+static void column_encoder_cell(struct column_encoder *e, struct freeq_column *col, uint32_t i)
+{
+        freeq_str_t sv;
+
+        switch (e->coltype)
+        {
+        case FREEQ_COL_STRING:
+                sv = freeq_column_string(col, i);
+                encode_string(e, sv.str, sv.len);
+                break;
+        case FREEQ_COL_NUMBER:
+        case FREEQ_COL_TIME:
+                encode_number(e, freeq_column_number(col, i));
+                break;
+        case FREEQ_COL_DOUBLE:
+                bytes_varint(e->buf, encode_double(freeq_column_double(col, i), &e->prev));
+                break;
+        case FREEQ_COL_IPV4ADDR:
+                bytes_varint(e->buf, freeq_column_ipv4(col, i));
+                break;
+        case FREEQ_COL_IPV6ADDR:
+                g_byte_array_append(e->buf, (const guint8 *)&freeq_column_ipv6(col, i),
+                                    sizeof(struct in6_addr));
+                break;
+        default:
+                break;
+        }
+        e->row++;
+}
+
+/* appends a complete frame to @out, see freeq_table_encode */
+static void frame_encode(GByteArray *out,
+                         const char *name,
+                         const char *identity,
+                         uint32_t serial,
+                         uint32_t numrows,
+                         int numcols,
+                         struct column_encoder enc[],
+                         const char *colnames[],
+                         const GByteArray *trailer,
+                         uint8_t flags)
+{
+        guint start = out->len;
+        uint8_t hdr[FREEQ_FRAME_HEADER_LEN] = { 0 };
+        uint32_t blen, crc;
+
+        g_byte_array_append(out, hdr, sizeof(hdr));
+
+        bytes_vstr(out, name);
+        bytes_vstr(out, identity);
+        bytes_varint(out, serial);
+        bytes_varint(out, numrows);
+        bytes_varint(out, numcols);
+        for (int j = 0; j < numcols; j++)
+                g_byte_array_append(out, &enc[j].coltype, 1);
+        for (int j = 0; j < numcols; j++)
+                bytes_vstr(out, colnames[j]);
+        for (int j = 0; j < numcols; j++)
+                bytes_varint(out, enc[j].buf->len);
+        for (int j = 0; j < numcols; j++)
+                g_byte_array_append(out, enc[j].buf->data, enc[j].buf->len);
+        if (trailer != NULL)
+                g_byte_array_append(out, trailer->data, trailer->len);
+
+        blen = out->len - start - FREEQ_FRAME_HEADER_LEN;
+        frame_header(hdr, flags, blen);
+        memcpy(out->data + start, hdr, sizeof(hdr));
+
+        if (flags & FREEQ_FRAME_CRC32C)
+        {
+                crc = crc32c(0, out->data + start + FREEQ_FRAME_HEADER_LEN,
+                             out->len - start - FREEQ_FRAME_HEADER_LEN);
+                crc = GUINT32_TO_BE(crc);
+                g_byte_array_append(out, (const guint8 *)&crc, sizeof(crc));
+        }
+}
+
+/* copy a short-lived row cell to the column of a result chunk */
+static void result_cell(struct column_encoder *e, sqlite4_stmt *pStmt, int j)
+{
+        const char *val;
+        int slen = 0;
+
+        switch (e->coltype)
+        {
+        case FREEQ_COL_STRING:
+                val = (const char *)sqlite4_column_text(pStmt, j, &slen);
+                encode_string(e, val, val ? slen : 0);
+                break;
+        case FREEQ_COL_NUMBER:
+                encode_number(e, sqlite4_column_int64(pStmt, j));
+                break;
+        case FREEQ_COL_DOUBLE:
+                bytes_varint(e->buf, encode_double(sqlite4_column_double(pStmt, j), &e->prev));
+                break;
+        default:
+                break;
+        }
+        e->row++;
+}
+
+/* start the next chunk, dropping the strings remembered by the last */
+static void result_reset(struct column_encoder enc[], int numcols)
+{
+        for (int j = 0; j < numcols; j++)
+        {
+                freeq_coltype_t ctype = enc[j].coltype;
+                column_encoder_clear(&enc[j]);
+                column_encoder_init(&enc[j], ctype, true, NULL);
+        }
+}
+
+/**
+ * freeq_sqlite_encode:
+ * @ctx: freeq library context
+ * @pStmt: prepared statement, not yet stepped
+ * @chunkrows: most rows per frame, 0 for FREEQ_RESULT_CHUNK_ROWS
+ * @emit: called with every frame of the result
+ * @arg: passed to @emit
+ *
+ * Step @pStmt and hand its rows to @emit as they are produced, in
+ * frames of at most @chunkrows rows or roughly
+ * FREEQ_RESULT_CHUNK_BYTES of column data.  Every frame stands
+ * alone, its string dictionary only covers its own rows, and all but
+ * the last carry FREEQ_FRAME_MORE.  Memory use is bounded by the
+ * chunk, not the result.
+ *
+ * @emit may block to apply backpressure, and returns nonzero to stop
+ * the query, e.g. because the client went away.  A statement that
+ * fails is reported to @emit as an error frame, see
+ * freeq_error_encode().  @pStmt is not finalized.
+ *
+ * Returns: 0 once the last frame has been emitted, FREEQ_ERR if the
+ * statement failed or @emit stopped it
+ **/
+FREEQ_EXPORT int freeq_sqlite_encode(struct freeq_ctx *ctx,
+                                     sqlite4_stmt *pStmt,
+                                     uint32_t chunkrows,
+                                     freeq_emit_fn emit,
+                                     void *arg)
+{
+        GByteArray *out;
+        int numcols, rc, err = FREEQ_OK;
+        uint32_t numrows = 0;
+        size_t bytes;
+
+        if (chunkrows == 0)
+                chunkrows = FREEQ_RESULT_CHUNK_ROWS;
+
+        out = g_byte_array_new();
+
+        /* column type is unset until the query has been
+         * stepped once */
+        rc = sqlite4_step(pStmt);
+        if (rc != SQLITE4_ROW && rc != SQLITE4_DONE)
+        {
+                dbg(ctx, "first step of query failed (%d)\n", rc);
+                freeq_error_encode(ctx, sqlite4_errmsg(sqlite4_db_handle(pStmt)), out);
+                emit(ctx, out->data, out->len, arg);
+                g_byte_array_free(out, TRUE);
+                return FREEQ_ERR;
+        }
+
+        numcols = sqlite4_column_count(pStmt);
+        dbg(ctx, "response will include %d columns\n", numcols);
+
+        struct column_encoder enc[numcols];
+        const char *colnames[numcols];
+
+        for (int j = 0; j < numcols; j++)
+        {
+                freeq_coltype_t ctype;
+                switch (rc == SQLITE4_ROW ? sqlite4_column_type(pStmt, j) : SQLITE4_NULL)
+                {
+                case SQLITE4_INTEGER:
+                        ctype = FREEQ_COL_NUMBER;
+                        break;
+                case SQLITE4_FLOAT:
+                        ctype = FREEQ_COL_DOUBLE;
+                        break;
+                case SQLITE4_TEXT:
+                        ctype = FREEQ_COL_STRING;
+                        break;
+                default:
+                        ctype = FREEQ_COL_NULL;
+                }
+                column_encoder_init(&enc[j], ctype, true, NULL);
+                colnames[j] = sqlite4_column_name(pStmt, j);
+        }
+
+        while (rc == SQLITE4_ROW)
+        {
+                bytes = 0;
+                for (int j = 0; j < numcols; j++)
+                {
+                        result_cell(&enc[j], pStmt, j);
+                        bytes += enc[j].buf->len;
+                }
+                numrows++;
+
+                rc = sqlite4_step(pStmt);
+                if (rc != SQLITE4_ROW ||
+                    (numrows < chunkrows && bytes < FREEQ_RESULT_CHUNK_BYTES))
+                        continue;
+
+                frame_encode(out, "result", "identity", 0, numrows, numcols,
+                             enc, colnames, NULL, ctx->frame_flags | FREEQ_FRAME_MORE);
+                dbg(ctx, "result chunk %u rows %u bytes\n", numrows, out->len);
+                if (emit(ctx, out->data, out->len, arg))
+                {
+                        dbg(ctx, "result stream cancelled\n");
+                        err = FREEQ_ERR;
+                        goto out;
+                }
+                g_byte_array_set_size(out, 0);
+                result_reset(enc, numcols);
+                numrows = 0;
+        }
+
+        if (rc != SQLITE4_DONE)
+        {
+                /* the rows already sent stand, the error frame
+                 * ends the result in place of the last chunk */
+                dbg(ctx, "query failed after some rows (%d)\n", rc);
+                freeq_error_encode(ctx, sqlite4_errmsg(sqlite4_db_handle(pStmt)), out);
+                err = FREEQ_ERR;
+        }
+        else
+                frame_encode(out, "result", "identity", 0, numrows, numcols,
+                             enc, colnames, NULL, ctx->frame_flags);
+
+        dbg(ctx, "result frame %u rows %u bytes\n", numrows, out->len);
+        if (emit(ctx, out->data, out->len, arg))
+                err = FREEQ_ERR;
+
+out:
+        g_byte_array_free(out, TRUE);
+        for (int j = 0; j < numcols; j++)
+                column_encoder_clear(&enc[j]);
+        return err;
+}
+
+static int bio_emit(struct freeq_ctx *ctx, const uint8_t *buf, size_t len, void *arg)
+{
+        BIO *b = (BIO *)arg;
+
+        if (BIO_write(b, buf, len) != (int)len)
+        {
+                err(ctx, "short write of result frame\n");
+                return FREEQ_ERR;
+        }
+        return FREEQ_OK;
+}
+
+/**
+ * freeq_sqlite_to_bio:
+ * @freeqctx: freeq library context
+ * @b: BIO the result is written to
+ * @pStmt: prepared statement, not yet stepped
+ *
+ * Write the result of @pStmt to @b as it is produced, see
+ * freeq_sqlite_encode(), and finalize @pStmt.
+ *
+ * Returns: 0 on success
+ **/
+FREEQ_EXPORT int freeq_sqlite_to_bio(struct freeq_ctx *freeqctx, BIO *b, sqlite4_stmt *pStmt)
+{
+        int err;
+
+        err = freeq_sqlite_encode(freeqctx, pStmt, 0, bio_emit, b);
+        if (BIO_flush(b) < 0)
+        {
+                err(freeqctx, "Error flushing BIO");
+                err = FREEQ_ERR;
+        }
+
+        sqlite4_finalize(pStmt);
+        return err;
+}
+
+/**
+ * freeq_error_encode:
+ * @ctx: freeq library context
+ * @errmsg: what went wrong
+ * @out: byte array the frame is appended to
+ *
+ * Append an error frame to @out: a table named "error" with a single
+ * string column and row holding @errmsg, flagged FREEQ_FRAME_ERROR.
+ * An error frame ends a result.
+ *
+ * Returns: 0 on success
+ **/
+FREEQ_EXPORT int freeq_error_encode(struct freeq_ctx *ctx, const char *errmsg, GByteArray *out)
+{
+        struct column_encoder enc;
+        const char *colnames[] = { "error" };
+
+        if (errmsg == NULL)
+                errmsg = "unknown error";
+
+        column_encoder_init(&enc, FREEQ_COL_STRING, false, NULL);
+        encode_string(&enc, errmsg, strlen(errmsg));
+        frame_encode(out, "error", ctx->identity, 0, 1, 1, &enc, colnames, NULL,
+                     ctx->frame_flags | FREEQ_FRAME_ERROR);
+        column_encoder_clear(&enc);
+        return 0;
+}
+
+/**
+ * freeq_error_write_sock:
+ * @ctx: freeq library context
+ * @errmsg: what went wrong
+ * @b: BIO the frame is written to
+ *
+ * Write an error frame, see freeq_error_encode(), to @b.
+ *
+ * Returns: 0 on success
+ **/
+FREEQ_EXPORT int freeq_error_write_sock(struct freeq_ctx *ctx, const char *errmsg, BIO *b)
+{
+        GByteArray *out = g_byte_array_new();
+        int err = FREEQ_OK;
+
+        freeq_error_encode(ctx, errmsg, out);
+        dbg(ctx, "generated error table, sending...\n");
+        if (BIO_write(b, out->data, out->len) != (int)out->len || BIO_flush(b) < 0)
+        {
+                err(ctx, "unable to write error frame\n");
+                err = FREEQ_ERR;
+        }
+        g_byte_array_free(out, TRUE);
+        return err;
+}
+
+/* the removed keys are a column block of their own, with strings
+ * numbered from scratch rather than from the stream dictionary */
+static void delta_encode(GByteArray *out, struct freeq_delta *delta)
+{
+        struct freeq_column *removed = &(delta->removed);
+        uint32_t n = removed->values ? removed->values->len : 0;
+        struct column_encoder enc;
+
+        column_encoder_init(&enc, removed->coltype, false, NULL);
+        for (uint32_t i = 0; i < n; i++)
+                column_encoder_cell(&enc, removed, i);
+
+        bytes_varint(out, delta->keycol);
+        bytes_varint(out, delta->chained);
+        bytes_varint(out, n);
+        bytes_varint(out, enc.buf->len);
+        g_byte_array_append(out, enc.buf->data, enc.buf->len);
+        column_encoder_clear(&enc);
+}
+
+static int table_encode(struct freeq_ctx *ctx,
+                        struct freeq_table *t,
+                        GByteArray *out,
+                        uint8_t flags,
+                        struct freeq_dict *dict,
+                        struct freeq_delta *delta)
+{
+        struct column_encoder enc[t->numcols];
+        const char *colnames[t->numcols];
+        GByteArray *trailer = NULL;
+
+        for (int j = 0; j < t->numcols; j++)
+        {
+                struct freeq_column *col = &(t->columns[j]);
+                column_encoder_init(&enc[j], col->coltype, false,
+                                    dict && col->coltype == FREEQ_COL_STRING ?
+                                    freeq_dict_column(dict, t->name, col->name) : NULL);
+                colnames[j] = col->name;
+                if (col->values == NULL)
+                        continue;
+                for (uint32_t i = 0; i < t->numrows; i++)
+                        column_encoder_cell(&enc[j], col, i);
+                dbg(ctx, "column %s is %u bytes\n", col->name, enc[j].buf->len);
+        }
+
+        if (dict)
+                flags |= FREEQ_FRAME_DICT;
+        if (delta)
+        {
+                trailer = g_byte_array_new();
+                delta_encode(trailer, delta);
+                flags |= FREEQ_FRAME_DELTA;
+        }
+        frame_encode(out, t->name, ctx->identity, t->serial, t->numrows,
+                     t->numcols, enc, colnames, trailer, flags);
+
+        if (trailer)
+                g_byte_array_free(trailer, TRUE);
+
+        for (int j = 0; j < t->numcols; j++)
+                column_encoder_clear(&enc[j]);
+        return 0;
+}
+
+/**
+ * freeq_table_encode:
+ * @ctx: freeq library context
+ * @t: table to encode
+ * @out: byte array the frame is appended to
+ * @flags: FREEQ_FRAME_* flags
+ * @dict: string dictionary of the stream, or NULL
+ *
+ * Append @t to @out as a single frame.  After the frame prefix the
+ * body holds the table name, the sender identity, serial, row count,
+ * column count, one coltype byte per column, the column names, the
+ * byte length of every column block and then the column blocks
+ * themselves, each carrying every row of one column.  Integers are
+ * varints, strings a varint length followed by the bytes.
+ *
+ * With @dict, strings already sent earlier on the stream are sent as
+ * references and the frame is flagged FREEQ_FRAME_DICT.  The frame
+ * must then be delivered, the receiver's dictionary is only in step
+ * with @dict if it decodes every frame encoded with it.
+ *
+ * A table made by freeq_table_delta() is flagged FREEQ_FRAME_DELTA,
+ * and its key column and removed keys follow the column blocks.
+ *
+ * Returns: 0 on success
+ **/
+FREEQ_EXPORT int freeq_table_encode(struct freeq_ctx *ctx,
+                                    struct freeq_table *t,
+                                    GByteArray *out,
+                                    uint8_t flags,
+                                    struct freeq_dict *dict)
+{
+        return table_encode(ctx, t, out, flags, dict, t->delta);
+}
+
+/**
+ * freeq_table_encode_chunks:
+ * @ctx: freeq library context
+ * @t: table to encode
+ * @chunkrows: most rows per frame, 0 for FREEQ_RESULT_CHUNK_ROWS
+ * @emit: called with every frame of the table
+ * @arg: passed to @emit
+ *
+ * Hand @t to @emit as a result in frames of at most @chunkrows rows
+ * or roughly FREEQ_RESULT_CHUNK_BYTES of column data, the way
+ * freeq_sqlite_encode() does.  Every frame stands alone and all but
+ * the last carry FREEQ_FRAME_MORE.  @emit may block and returns
+ * nonzero to stop.
+ *
+ * Returns: 0 once the last frame has been emitted, FREEQ_ERR if
+ * @emit stopped it
+ **/
+FREEQ_EXPORT int freeq_table_encode_chunks(struct freeq_ctx *ctx,
+                                           struct freeq_table *t,
+                                           uint32_t chunkrows,
+                                           freeq_emit_fn emit,
+                                           void *arg)
+{
+        struct column_encoder enc[t->numcols];
+        const char *colnames[t->numcols];
+        GByteArray *out = g_byte_array_new();
+        uint32_t i = 0, numrows;
+        size_t bytes;
+        int err = FREEQ_OK;
+
+        if (chunkrows == 0)
+                chunkrows = FREEQ_RESULT_CHUNK_ROWS;
+        for (int j = 0; j < t->numcols; j++)
+                colnames[j] = t->columns[j].name;
+
+        /* an empty table is still one frame */
+        do {
+                for (int j = 0; j < t->numcols; j++)
+                        column_encoder_init(&enc[j], t->columns[j].coltype, false, NULL);
+                for (numrows = 0, bytes = 0;
+                     i < t->numrows && numrows < chunkrows && bytes < FREEQ_RESULT_CHUNK_BYTES;
+                     i++, numrows++)
+                {
+                        bytes = 0;
+                        for (int j = 0; j < t->numcols; j++)
+                        {
+                                if (t->columns[j].values != NULL)
+                                        column_encoder_cell(&enc[j], &(t->columns[j]), i);
+                                bytes += enc[j].buf->len;
+                        }
+                }
+
+                frame_encode(out, t->name, ctx->identity, t->serial, numrows, t->numcols, enc, colnames,
+                             NULL, ctx->frame_flags | (i < t->numrows ? FREEQ_FRAME_MORE : 0));
+                for (int j = 0; j < t->numcols; j++)
+                        column_encoder_clear(&enc[j]);
+                dbg(ctx, "result chunk %u rows %u bytes\n", numrows, out->len);
+                if (emit(ctx, out->data, out->len, arg))
+                {
+                        dbg(ctx, "result stream cancelled\n");
+                        err = FREEQ_ERR;
+                        break;
+                }
+                g_byte_array_set_size(out, 0);
+        } while (i < t->numrows);
+
+        g_byte_array_free(out, TRUE);
+        return err;
+}
+
+static int table_bio_write(struct freeq_ctx *ctx,
+                           struct freeq_table *t,
+                           BIO *b,
+                           uint8_t flags,
+                           struct freeq_dict *dict,
+                           struct freeq_delta *delta,
+                           uint8_t codec)
+{
+        GByteArray *out;
+        int err = 0;
+
+        out = g_byte_array_new();
+        table_encode(ctx, t, out, flags, dict, delta);
+        freeq_frame_compress(ctx, out, 0, codec);
+        dbg(ctx, "table %s frame is %u bytes\n", t->name, out->len);
+
+        if (BIO_write(b, out->data, out->len) != (int)out->len)
+        {
+                err(ctx, "short write of table %s\n", t->name);
+                err = FREEQ_ERR;
+        }
+        else if (BIO_flush(b) <= 0)
+        {
+                err(ctx, "unable to flush table %s\n", t->name);
+                err = FREEQ_ERR;
+        }
+        g_byte_array_free(out, TRUE);
+        return err;
+}
+
+/**
+ * freeq_table_bio_write:
+ * @ctx: freeq library context
+ * @t: table to send
+ * @b: BIO to write to
+ *
+ * Write @t to @b as one frame using the context's frame flags.
+ *
+ * Returns: 0 on success
+ **/
+FREEQ_EXPORT int freeq_table_bio_write(ctx, t, b)
+struct freeq_ctx *ctx;
+struct freeq_table *t;
+BIO *b;
+{
+        return freeq_table_bio_write_dict(ctx, t, b, NULL);
+}
+
+/**
+ * freeq_table_bio_write_dict:
+ * @ctx: freeq library context
+ * @t: table to send
+ * @b: BIO to write to
+ * @dict: string dictionary of the stream, or NULL
+ *
+ * Write @t to @b as one frame, see freeq_table_encode().
+ *
+ * Returns: 0 on success
+ **/
+FREEQ_EXPORT int freeq_table_bio_write_dict(struct freeq_ctx *ctx,
+                                            struct freeq_table *t,
+                                            BIO *b,
+                                            struct freeq_dict *dict)
+{
+        return table_bio_write(ctx, t, b, ctx->frame_flags, dict, t->delta, ctx->codec);
+}
+
+/*
+ * inter-report deltas
+ *
+ * most rows of a table an agent reports every few seconds are the
+ * same as in its last report.  with a key column declared the table
+ * can go as the rows that were added or changed since the last one
+ * of its name on the stream, plus the keys of the rows that went
+ * away, and the receiver rebuilds the whole table from the one it
+ * kept.  like the string dictionary this is state of the stream,
+ * both ends start over when it is reopened.
+ */
+
+/* open addressing index of rows by the value of one column */
+struct key_index {
+        const struct freeq_column *col;
+        uint32_t *slots;        /* row + 1, 0 for an empty slot */
+        uint32_t mask;
+};
+
+static guint cell_hash(const struct freeq_column *c, uint32_t i)
+{
+        const guint8 *p;
+        guint w, h = 2166136261u;
+
+        if (c->coltype == FREEQ_COL_STRING)
+                return str_hash(&freeq_column_string(c, i));
+        w = g_array_get_element_size(c->values);
+        p = (const guint8 *)c->values->data + (size_t)i * w;
+        for (guint k = 0; k < w; k++)
+                h = (h ^ p[k]) * 16777619u;
+        return h;
+}
+
+static bool cell_equal(const struct freeq_column *a, uint32_t i,
+                       const struct freeq_column *b, uint32_t k)
+{
+        const freeq_str_t *x, *y;
+        guint w;
+
+        if (a->coltype == FREEQ_COL_STRING)
+        {
+                x = &freeq_column_string(a, i);
+                y = &freeq_column_string(b, k);
+                return x->len == y->len && (x->len == 0 || memcmp(x->str, y->str, x->len) == 0);
+        }
+        w = g_array_get_element_size(a->values);
+        return memcmp(a->values->data + (size_t)i * w, b->values->data + (size_t)k * w, w) == 0;
+}
+
+static bool row_equal(struct freeq_table *a, uint32_t i, struct freeq_table *b, uint32_t k)
+{
+        for (uint32_t j = 0; j < a->numcols; j++)
+                if (a->columns[j].values != NULL && !cell_equal(&(a->columns[j]), i, &(b->columns[j]), k))
+                        return false;
+        return true;
+}
 
-        int64_t prev[tbl->numcols];
-        memset(prev, 0, tbl->numcols * sizeof(int64_t));
+/* fails if two rows share a key */
+static bool key_index_init(struct key_index *ix, const struct freeq_column *col, uint32_t numrows)
+{
+        uint64_t size = 16;
+        guint h;
 
-        int i = 0;
-        /* you know you're done when the buffer is < buflen dumbass */
-        while (more)
-        {
-                for (int j = 0; j < tbl->numcols; j++)
-                {
-                        r.i = 0;
-                        if (tbl->columns[j].coltype != FREEQ_COL_NULL)
-                        {
-                                read = BIO_read_varint(b, &(r.s));
-                                if (read == 0)
-                                {
-                                        more = 0;
-                                        break;
-                                }
-                                pos += read;
-                        }
+        while (size < (uint64_t)numrows * 2)
+                size <<= 1;
+        ix->col = col;
+        ix->mask = size - 1;
+        ix->slots = g_new0(uint32_t, size);
 
-                        switch (tbl->columns[j].coltype) {
-                        case FREEQ_COL_STRING:
-                                dezigzag32(&(r.s));
-                                slen = r.i;
-                                //dbg(ctx, "%d/%d str len %" PRId64 " pos %d\n", i, j, r.i, pos);
-                                if (slen > 0)
-                                {
-                                        pos += BIO_read(b, (char *)&strbuf, slen);
-                                        strbuf[slen] = 0;
-                                        coldata[j] = g_slist_prepend(coldata[j], g_string_chunk_insert_const(tbl->strings, (char *)&strbuf));
-                                }
-                                else if (slen < 0)
-                                {
-                                        dbg(ctx, "negative offset %d list length is %d, value at offset is %s\n",
-                                            slen, g_slist_length(coldata[j]), (char *)g_slist_nth_data(coldata[j], -slen -1));
-                                        coldata[j] = g_slist_prepend(coldata[j], (char *)g_slist_nth_data(coldata[j], -slen -1));
-                                }
-                                else
-                                {
-                                        dbg(ctx, "%d/%d empty string %d pos %d\n",i,j,slen, pos);
-                                        coldata[j] = g_slist_prepend(coldata[j], NULL);
-                                        //dbg(ctx, "string %s pos %d\n", coldata[j]->data, buf.p);
-                                }
-                                dbg(ctx, "%d/%d str %s pos %d\n",i,j, (char *)coldata[j]->data, pos);
-                                break;
-                        case FREEQ_COL_NUMBER:
-                                dezigzag64(&(r.s));
-                                //dbg(ctx, "prev[%d]: %" PRIu64" \n", j, prev[j]);
-                                dbg(ctx, "%d/%d value raw %" PRId64 " delta %" PRId64 " pos %d\n",
-                                           i, j,          r.i,               prev[j] + r.i, pos);
-                                prev[j] = prev[j] + r.i;
-                                coldata[j] = g_slist_prepend(coldata[j], GINT_TO_POINTER(prev[j]));
-                                break;
-                        case FREEQ_COL_IPV4ADDR:
-                                break;
-                        case FREEQ_COL_TIME:
-                                break;
-                        default:
-                                break;
-                        }
-                }
-                if (more)
-                        i++;
+        for (uint32_t i = 0; i < numrows; i++)
+        {
+                for (h = cell_hash(col, i) & ix->mask; ix->slots[h]; h = (h + 1) & ix->mask)
+                        if (cell_equal(col, ix->slots[h] - 1, col, i))
+                                return false;
+                ix->slots[h] = i + 1;
         }
+        return true;
+}
 
-        for (int i = 0; i < tbl->numcols; i++)
-                tbl->columns[i].data = g_slist_concat(tbl->columns[i].data,
-                                                      g_slist_reverse(coldata[i]));
+/* the row whose key equals row @i of @col, -1 if there is none */
+static int64_t key_index_find(const struct key_index *ix, const struct freeq_column *col, uint32_t i)
+{
+        for (guint h = cell_hash(col, i) & ix->mask; ix->slots[h]; h = (h + 1) & ix->mask)
+                if (cell_equal(ix->col, ix->slots[h] - 1, col, i))
+                        return ix->slots[h] - 1;
+        return -1;
+}
 
-        dbg(ctx, "%d rows\n", i);
-        tbl->numrows = i;
-        *t = tbl;
-        return 0;
+static void key_index_clear(struct key_index *ix)
+{
+        g_free(ix->slots);
 }
 
-int conn_cleanup(void)
+/**
+ * freeq_table_set_key:
+ * @table: table to be sent
+ * @col: index of a column no two rows share a value of, -1 for none
+ *
+ * Let freeq_conn_send() send @table as the rows that changed since
+ * the last table of the same name it sent.
+ **/
+FREEQ_EXPORT void freeq_table_set_key(struct freeq_table *table, int col)
 {
-    int i;
-    if (!mutex_buf)
-        return 0;
-    CRYPTO_set_id_callback(NULL);
-    CRYPTO_set_locking_callback(NULL);
-    for (i = 0; i < CRYPTO_num_locks(); i++)
-        pthread_mutex_destroy(&(mutex_buf[i]));
-    free(mutex_buf);
-    mutex_buf = NULL;
-    return 1;
+        if (col >= 0 && (uint32_t)col < table->numcols &&
+            coltype_width(table->columns[col].coltype) > 0)
+                table->keycol = col;
+        else
+                table->keycol = -1;
 }
 
-FREEQ_EXPORT int freeq_sqlite_to_bio(struct freeq_ctx *freeqctx, BIO *b, sqlite4_stmt *pStmt)
+/**
+ * freeq_table_delta:
+ * @ctx: freeq library context
+ * @prev: the last table of the same name the receiver has
+ * @table: table to send, with a key column set
+ * @delta: returns the rows of @table that differ from @prev
+ *
+ * Find the rows of @table whose key is not in @prev, or whose other
+ * columns changed, and the keys of @prev that are no longer in
+ * @table.  The result shares the strings of @table and @prev, and
+ * must be encoded before either is released.
+ *
+ * Returns: 0 on success, FREEQ_ERR if @table has to be sent whole,
+ * because it doesn't match @prev, has duplicate keys or most of it
+ * changed anyway
+ **/
+FREEQ_EXPORT int freeq_table_delta(struct freeq_ctx *ctx,
+                                   struct freeq_table *prev,
+                                   struct freeq_table *table,
+                                   struct freeq_table **delta)
 {
-        int err;
-        int numcols = 0;
-        const char zero = 0;
-        int slen = 0;
-        int pos = 0;
-        gchar *val;
+        struct key_index pix, tix;
+        struct freeq_column *pkey, *tkey;
+        struct freeq_delta *dd;
+        struct freeq_table *d;
+        bool unique;
+        int64_t r;
+        int err = FREEQ_ERR;
+
+        if (table->keycol < 0 || prev->keycol != table->keycol || !table_same_shape(prev, table))
+                return FREEQ_ERR;
+        pkey = &(prev->columns[table->keycol]);
+        tkey = &(table->columns[table->keycol]);
+        if (pkey->values == NULL || tkey->values == NULL)
+                return FREEQ_ERR;
 
-        /* column type is unset until the query has been
-         * stepped once */
-        if (sqlite4_step(pStmt) != SQLITE4_ROW)
+        /* both indexes are built, so both can be cleared */
+        unique = key_index_init(&pix, pkey, prev->numrows);
+        if (!key_index_init(&tix, tkey, table->numrows) || !unique)
         {
-                dbg(freeqctx, "repsonse from first step was not SQLITE4_ROW...");
-                //freeq_error_write_sock(freeqctx, sqlite4_errmsg(pDb), b);
-                sqlite4_finalize(pStmt);
-                pthread_exit(NULL);
+                dbg(ctx, "%s has duplicate keys\n", table->name);
+                goto out;
         }
 
-        numcols = sqlite4_column_count(pStmt);
-        dbg(freeqctx, "response will include %d columns\n", numcols);
-
-        int ctypes[numcols];
-        GHashTable *strtbls[numcols];
-        uint64_t prev[numcols];
-        memset(prev, 0, sizeof(prev));
-        memset(strtbls, 0, sizeof(strtbls));
-
-        for (int j = 0; j < numcols; j++)
+        if ((d = table_like(ctx, table, table->strings, false)) == NULL ||
+            (dd = arena_alloc(d->arena, sizeof(struct freeq_delta))) == NULL)
         {
-                switch (sqlite4_column_type(pStmt, j))
-                {
-                case SQLITE4_INTEGER:
-                        ctypes[j] = FREEQ_COL_NUMBER;
-                        break;
-                case SQLITE4_TEXT:
-                        ctypes[j] = FREEQ_COL_STRING;
-                        break;
-                default:
-                        ctypes[j] = FREEQ_COL_NULL;
-                }
+                freeq_table_unref(d);
+                err = -ENOMEM;
+                goto out;
+        }
+        dd->keycol = table->keycol;
+        dd->chained = true;
+        dd->removed.coltype = tkey->coltype;
+        dd->removed.name = tkey->name;
+        d->delta = dd;
+        column_values(&(dd->removed), 0);
+
+        for (uint32_t i = 0; i < table->numrows; i++)
+                if ((r = key_index_find(&pix, tkey, i)) < 0 || !row_equal(prev, r, table, i))
+                        row_append(d, table, i, false);
+
+        for (uint32_t i = 0; i < prev->numrows; i++)
+                if (key_index_find(&tix, pkey, i) < 0)
+                        g_array_append_vals(dd->removed.values,
+                                            pkey->values->data + (size_t)i * g_array_get_element_size(pkey->values), 1);
+
+        if ((uint64_t)d->numrows + dd->removed.values->len > table->numrows / 2)
+        {
+                dbg(ctx, "%u of %u rows of %s changed, not worth a delta\n",
+                    d->numrows + dd->removed.values->len, table->numrows, table->name);
+                freeq_table_unref(d);
+                goto out;
         }
 
-        pos += BIO_write_vstr(b, (char *)"result");
-        dbg(freeqctx, "name result pos %d\n", pos);
-
-        pos += BIO_write_vstr(b, "identity");
-        dbg(freeqctx, "identity identity post %d\n", pos);
+        *delta = d;
+        err = 0;
+out:
+        key_index_clear(&pix);
+        key_index_clear(&tix);
+        return err;
+}
 
-        pos += BIO_write_varint32(b, numcols);
-        dbg(freeqctx, "numcols %d pos %d\n", numcols, pos);
+/**
+ * freeq_table_apply_delta:
+ * @ctx: freeq library context
+ * @base: the last table of the same name read from the stream
+ * @delta: keyed table just read from the stream
+ * @table: returns the whole table @delta stands for
+ *
+ * Rebuild the table the sender had from @base and the changes in
+ * @delta.  The rows of @base that @delta neither replaces nor removes
+ * come first, then the rows of @delta.  @delta gives its strings to
+ * the result, if it owns them, and must not be used afterwards other
+ * than to release it.  A keyed table that doesn't depend on an
+ * earlier one is returned as it is, and @base may then be NULL.
+ *
+ * Returns: 0 on success, FREEQ_ERR if @delta doesn't apply to @base
+ **/
+FREEQ_EXPORT int freeq_table_apply_delta(struct freeq_ctx *ctx,
+                                         struct freeq_table *base,
+                                         struct freeq_table *delta,
+                                         struct freeq_table **table)
+{
+        struct key_index dix, rix;
+        struct freeq_delta *dd = delta->delta;
+        struct freeq_column *bkey;
+        struct freeq_table *t;
+        GStringChunk *strings;
+        bool unique, own = delta->destroy_data;
+        int err = FREEQ_ERR;
 
-        for (int j=0; j < numcols; j++)
+        if (dd == NULL)
+                return FREEQ_ERR;
+        if (!dd->chained)
         {
-                if (ctypes[j] == FREEQ_COL_STRING) {
-                        strtbls[j] = g_hash_table_new_full(g_str_hash,
-                                                           g_str_equal,
-                                                           NULL,
-                                                           NULL);
-                }
+                *table = freeq_table_ref(delta);
+                return 0;
         }
-
-        for (int j=0; j < numcols; j++)
+        if (base == NULL || !table_same_shape(base, delta) ||
+            (bkey = &(base->columns[dd->keycol]))->values == NULL ||
+            delta->columns[dd->keycol].values == NULL)
         {
-                pos += BIO_write(b,
-                                 (char *)&(ctypes[j]),
-                                 sizeof(freeq_coltype_t));
-                dbg(freeqctx, "coltype for %d is %d, pos %d\n", j,
-                    ctypes[j], pos);
+                err(ctx, "%s from %s is a delta to a table we don't have\n",
+                    delta->name, delta->identity);
+                return FREEQ_ERR;
         }
 
-        for (int j=0; j < numcols; j++)
+        unique = key_index_init(&dix, &(delta->columns[dd->keycol]), delta->numrows);
+        if (!key_index_init(&rix, &(dd->removed), dd->removed.values->len) || !unique)
         {
-                const char *name = sqlite4_column_name(pStmt, j);
-                pos += BIO_write_vstr(b, name);
+                err(ctx, "%s from %s has duplicate keys\n", delta->name, delta->identity);
+                goto out;
         }
-        int i = 0;
-        do
+
+        /* the changed rows already live in delta's chunk, only the
+         * rows kept from base need their strings copied */
+        strings = own ? delta->strings : NULL;
+        if ((t = table_like(ctx, delta, strings, true)) == NULL)
         {
-                for (int j = 0; j < numcols; j++)
-                {
-                        uint64_t num = 0;
-                        switch (ctypes[j])
-                        {
-                        case FREEQ_COL_STRING:
-                                val = (gchar *)sqlite4_column_text(pStmt, j, &slen);
-                                if (val == NULL)
-                                {
-                                        pos += BIO_write(b, &zero, 1);
-                                        break;
-                                }
-                                if (g_hash_table_contains(strtbls[j], val))
-                                {
-                                        unsigned int idx = GPOINTER_TO_INT(g_hash_table_lookup(strtbls[j], val));
-                                        slen = idx - i;
-                                        pos += BIO_write_varintsigned32(b, slen);
-                                        dbg(freeqctx, "%d/%d str %s len %d pos %d\n",i,j,val,slen, pos);
-                                        g_hash_table_replace(strtbls[j], val, GINT_TO_POINTER(i));
-                                }
-                                else
-                                {
-                                        g_hash_table_insert(strtbls[j], val, GINT_TO_POINTER(i));
-                                        pos += BIO_write_varintsigned32(b, slen);
-                                        pos += BIO_write(b, val, slen);
-                                        dbg(freeqctx, "%d/%d str %s len %d pos %d\n", i,j,val, slen, pos);
-                                }
-                                break;
-                        case FREEQ_COL_NUMBER:
-                                num = sqlite4_column_int(pStmt, j);
-                                pos += BIO_write_varintsigned(b, (int64_t)num - prev[j]);
-                                dbg(freeqctx, "%d/%d value raw %" PRId64 " delta %" PRId64 " pos %d\n",
-                                    i,j, num, (int64_t)num-prev[j], pos);
-                                prev[j] = num;
-                                break;
-                        default:
-                                break;
-                        }
-                }
-                i++;
+                err = -ENOMEM;
+                goto out;
         }
-        while (SQLITE4_ROW == sqlite4_step(pStmt));
+        if (own)
+                delta->strings = NULL;
 
-        if ((err = BIO_flush(b)) < 0)
-                err(freeqctx, "Error flushing BIO");
+        for (uint32_t i = 0; i < base->numrows; i++)
+                if (key_index_find(&dix, bkey, i) < 0 && key_index_find(&rix, bkey, i) < 0)
+                        row_append(t, base, i, true);
+        for (uint32_t i = 0; i < delta->numrows; i++)
+                row_append(t, delta, i, !own);
 
-        for (int j = 0; j < numcols; j++)
-                if (ctypes[j] == FREEQ_COL_STRING)
-                        g_hash_table_destroy(strtbls[j]);
+        dbg(ctx, "%s from %s: %u rows changed, %u removed, %u in all\n", delta->name,
+            delta->identity, delta->numrows, dd->removed.values->len, t->numrows);
+        *table = t;
+        err = 0;
+out:
+        key_index_clear(&dix);
+        key_index_clear(&rix);
+        return err;
+}
 
-        sqlite4_finalize(pStmt);
-        return FREEQ_OK;
+static void conn_close(struct freeq_conn *c, bool clean)
+{
+        if (c->ssl == NULL)
+                return;
+        /* openssl retires the session of a connection that wasn't
+         * shut down, but a dropped connection says nothing about the
+         * session so keep it resumable */
+        if (clean)
+                SSL_shutdown(c->ssl);
+        else
+                SSL_set_shutdown(c->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        BIO_free_all(c->bio);
+        SSL_free(c->ssl);
+        freeq_dict_free(c->dict);
+        g_hash_table_destroy(c->sent);
+        c->partial = false;
+        c->bio = NULL;
+        c->ssl = NULL;
+        c->dict = NULL;
+        c->sent = NULL;
 }
 
-FREEQ_EXPORT int freeq_table_sendto_ssl(struct freeq_ctx *freeqctx, struct freeq_table *t)
+/* waits 1, 2, 4 ... seconds up to FREEQ_CONN_BACKOFF_MAX between
+ * attempts, jittered so a fleet of agents doesn't reconnect in step */
+static void conn_failed(struct freeq_conn *c)
 {
-        BIO     *conn;
-        SSL     *ssl;
-        long    err;
-        const char *server = "localhost";
+        unsigned int delay;
+
+        c->failures++;
+        delay = MIN(FREEQ_CONN_BACKOFF_MAX, 1u << MIN(c->failures - 1, 6));
+        c->retry_at = time(NULL) + delay / 2 + rand() % (delay / 2 + 1);
+        dbg(c->ctx, "connection to %s failed %u times, next attempt in %ld seconds\n",
+            c->server, c->failures, (long)(c->retry_at - time(NULL)));
+}
+
+static int conn_open(struct freeq_conn *c)
+{
+        struct freeq_ctx *ctx = c->ctx;
+        BIO *conn, *ssl_bio;
+        long err;
 
-        conn = BIO_new_connect("localhost:13001");
+        conn = BIO_new_connect(c->server);
         if (!conn)
         {
-                err(freeqctx, "Error creating connection BIO");
+                err(ctx, "Error creating connection BIO");
                 return FREEQ_ERR;
         }
 
         if (BIO_do_connect(conn) <= 0)
         {
-                err(freeqctx, "Error connecting to remote machine\n");
+                err(ctx, "Error connecting to %s\n", c->server);
+                BIO_free(conn);
                 return FREEQ_ERR;
         }
 
-        ssl = SSL_new(freeqctx->sslctx);
-        SSL_set_bio(ssl, conn, conn);
-        if (SSL_connect(ssl) <= 0)
+        c->ssl = SSL_new(ctx->sslctx);
+        SSL_set_app_data(c->ssl, c);
+        SSL_set_bio(c->ssl, conn, conn);
+        if (c->session)
+                SSL_set_session(c->ssl, c->session);
+
+        if (SSL_connect(c->ssl) <= 0)
         {
-                err(freeqctx, "Error connecting SSL object");
-                return FREEQ_ERR;
+                err(ctx, "Error connecting SSL object");
+                goto fail;
         }
 
-        if ((err = post_connection_check(freeqctx, ssl, server)) != X509_V_OK)
+        if ((err = post_connection_check(ctx, c->ssl, c->host)) != X509_V_OK)
         {
-                err(freeqctx, "peer certificate: %s\n",
+                err(ctx, "peer certificate: %s\n",
                     X509_verify_cert_error_string(err));
-                int_error("Error checking SSL object after connection");
-                return FREEQ_ERR;
+                goto fail;
         }
 
-        BIO  *buf_io, *ssl_bio;
-        buf_io = BIO_new(BIO_f_buffer());
-        ssl_bio = BIO_new(BIO_f_ssl());
-        BIO_set_ssl(ssl_bio, ssl, BIO_CLOSE);
-        BIO_push(buf_io, ssl_bio);
+        dbg(ctx, "ssl connection to %s established, session %s\n", c->server,
+            SSL_session_reused(c->ssl) ? "resumed" : "new");
 
-        dbg(freeqctx, "ssl connection established\n");
+        c->bio = BIO_new(BIO_f_buffer());
+        ssl_bio = BIO_new(BIO_f_ssl());
+        BIO_set_ssl(ssl_bio, c->ssl, BIO_NOCLOSE);
+        BIO_push(c->bio, ssl_bio);
+        freeq_dict_new(&c->dict);
+        c->sent = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                        (GDestroyNotify)freeq_table_unref);
+        c->peer_codecs = 1 << FREEQ_CODEC_NONE;
+        return 0;
 
-        /* because we SSL_free below there's no point in calling
-           SSL_clear here however it might make sense to cache these
-           objects when we're publishing more than one table */
-        if (freeq_table_bio_write(freeqctx, t, buf_io))
+fail:
+        /* don't offer a session the server just turned down */
+        if (c->session)
         {
-                dbg(freeqctx, "bio_wrap returned zero\n");
-                SSL_clear(ssl);
+                SSL_SESSION_free(c->session);
+                c->session = NULL;
         }
-        else
-        {
-                dbg(freeqctx, "bio_wrap returned non-zero\n");
-                SSL_shutdown(ssl);
-        }
-
-        dbg(freeqctx, "ssl connection closed normally\n");
-        SSL_free(ssl);
-        return 0;
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+        return FREEQ_ERR;
 }
 
-FREEQ_EXPORT int freeq_table_bio_write(ctx, t, b)
-struct freeq_ctx *ctx;
-struct freeq_table *t;
-BIO *b;
+/**
+ * freeq_conn_new:
+ * @ctx: freeq library context
+ * @server: host:port of the aggregator, NULL for FREEQ_SERVER_DEFAULT
+ * @conn: returns the new connection
+ *
+ * Create a publisher connection.  Nothing is connected until the
+ * first table is sent.
+ *
+ * Returns: 0 on success
+ **/
+FREEQ_EXPORT int freeq_conn_new(struct freeq_ctx *ctx, const char *server, struct freeq_conn **conn)
 {
-        int i = 0;
-        gchar *val;
-        int slen = 0;
-        unsigned int pos = 0;
-        const char zero = 0;
+        struct freeq_conn *c;
+        const char *port;
 
-        // use a union here
-        GHashTable *strtbls[t->numcols];
-        uint64_t prev[t->numcols];
+        c = calloc(1, sizeof(struct freeq_conn));
+        if (!c)
+                return -ENOMEM;
 
-        memset(prev, 0, sizeof(prev));
-        GSList *colnxt[t->numcols];
+        c->ctx = freeq_ref(ctx);
+        c->server = strdup(server ? server : FREEQ_SERVER_DEFAULT);
+        port = strrchr(c->server, ':');
+        c->host = port ? strndup(c->server, port - c->server) : strdup(c->server);
+        c->codec = ctx->codec;
+        *conn = c;
+        return 0;
+}
 
-        slen = strlen(t->name);
-        pos += BIO_write_varint32(b, slen);
-        pos += BIO_write(b, (const char *)t->name, slen);
-        dbg(ctx, "name %s write %d\n", t->name, pos);
+/**
+ * freeq_conn_free:
+ * @conn: publisher connection
+ *
+ * Close the connection and release it.
+ **/
+FREEQ_EXPORT void freeq_conn_free(struct freeq_conn *conn)
+{
+        if (conn == NULL)
+                return;
+        conn_close(conn, true);
+        if (conn->session)
+                SSL_SESSION_free(conn->session);
+        freeq_unref(conn->ctx);
+        free(conn->server);
+        free(conn->host);
+        free(conn);
+}
 
-        slen = strlen(ctx->identity);
-        pos += BIO_write_varint32(b, slen);
-        pos += BIO_write(b, (const char *)ctx->identity, slen);
-        dbg(ctx, "identity %s write %d\n", t->identity, pos);
+/* a keyed table goes as the changes since the last one of its name
+ * the server acknowledged on this connection, if that is smaller.
+ * the parts of a table always go whole */
+static int conn_write(struct freeq_conn *c, struct freeq_table *t, bool more)
+{
+        struct freeq_ctx *ctx = c->ctx;
+        uint8_t flags = ctx->frame_flags | FREEQ_FRAME_ACK | (more ? FREEQ_FRAME_MORE : 0);
+        uint8_t codec = c->peer_codecs & (1 << c->codec) ? c->codec : FREEQ_CODEC_NONE;
+        struct freeq_delta whole = { 0 };
+        struct freeq_table *prev, *d;
+        int err;
 
-        pos += BIO_write_varint32(b, t->numcols);
-        dbg(ctx, "numcols %d write %d\n", t->numcols, pos);
+        if (t->keycol < 0 || more || c->partial)
+                return table_bio_write(ctx, t, c->bio, flags, c->dict, NULL, codec);
 
-        for (i=0; i < t->numcols; i++)
+        prev = g_hash_table_lookup(c->sent, t->name);
+        if (prev != NULL && freeq_table_delta(ctx, prev, t, &d) == 0)
         {
-                pos += BIO_write(b, (char *)&(t->columns[i].coltype), sizeof(freeq_coltype_t));
-                dbg(ctx, "coltype for %d is %d, pos %d\n", i, t->columns[i].coltype, pos);
+                dbg(ctx, "sending %u of %u rows of %s\n", d->numrows, t->numrows, t->name);
+                err = table_bio_write(ctx, d, c->bio, flags, c->dict, d->delta, codec);
+                freeq_table_unref(d);
+                return err;
         }
 
-        for (i=0; i < t->numcols; i++)
-        {
-                slen = strlen(t->columns[i].name);
-                pos += BIO_write_varint32(b, slen);
-                pos += BIO_write(b, (const char *)t->columns[i].name, slen);
-                dbg(ctx, "colname for %d is %s, pos %d\n", i, t->columns[i].name, pos);
-        }
-        dbg(ctx, "colnames, pos %d\n", pos);
+        whole.keycol = t->keycol;
+        whole.removed.coltype = t->columns[t->keycol].coltype;
+        return table_bio_write(ctx, t, c->bio, flags, c->dict, &whole, codec);
+}
 
-        for (i=0; i < t->numcols; i++)
-        {
-                if (t->columns[i].coltype == FREEQ_COL_STRING)
-                        strtbls[i] = g_hash_table_new_full(g_str_hash,
-                                                           g_str_equal,
-                                                           NULL,
-                                                           NULL);
-                colnxt[i] = t->columns[i].data;
-        }
+/**
+ * freeq_conn_set_compression:
+ * @conn: publisher connection
+ * @codec: FREEQ_CODEC_* to compress tables with
+ *
+ * Compress the tables sent over @conn with @codec rather than the
+ * context's codec.  Until the server has acknowledged a table, and
+ * with servers that can't read @codec, tables go uncompressed.
+ *
+ * Returns: 0 on success, FREEQ_ERR if @codec isn't built in
+ **/
+FREEQ_EXPORT int freeq_conn_set_compression(struct freeq_conn *conn, uint8_t codec)
+{
+        if (codec > 7 || !(freeq_codecs() & (1 << codec)))
+                return FREEQ_ERR;
+        conn->codec = codec;
+        return 0;
+}
 
-        for (i = 0; i < t->numrows; i++)
+static int conn_send(struct freeq_conn *conn, struct freeq_table *t, bool more)
+{
+        struct freeq_ctx *ctx = conn->ctx;
+        struct freeq_table *sent;
+        bool whole = !more && !conn->partial;
+        bool fresh = false, lost;
+        int err;
+
+        for (;;)
         {
-                for (int j = 0; j < t->numcols; j++)
+                if (conn->ssl == NULL)
                 {
-                        uint64_t num = 0;
-                        switch (t->columns[j].coltype)
+                        if (time(NULL) < conn->retry_at)
                         {
-                        case FREEQ_COL_STRING:
-                                val = colnxt[j]->data;
-                                slen = strlen(val);
-                                if ((val == NULL) || (slen == 0)) {
-                                        pos += BIO_write(b, &zero, 1);
-                                        dbg(ctx, "%d/%d string empty pos %d\n", i, j, pos);
-                                        break;
-                                }
-
-                                if (g_hash_table_contains(strtbls[j], val))
-                                {
-                                        unsigned int idx = GPOINTER_TO_INT(g_hash_table_lookup(strtbls[j], val));
-                                        slen = idx - i;
-                                        pos += BIO_write_varintsigned32(b, slen);
-                                        dbg(ctx, "%d/%d str %s len %d pos %d\n",i,j,val,slen, pos);
-                                        g_hash_table_replace(strtbls[j], val, GINT_TO_POINTER(i));
-                                }
-                                else
-                                {
-                                        g_hash_table_insert(strtbls[j], val, GINT_TO_POINTER(i));
-                                        pos += BIO_write_varintsigned32(b, slen);
-                                        pos += BIO_write(b, val, slen);
-                                        dbg(ctx, "%d/%d str %s len %d pos %d\n", i,j,val, slen, pos);
-                                }
-                                break;
-                        case FREEQ_COL_NUMBER:
-                                num = GPOINTER_TO_INT(colnxt[j]->data);
-                                pos += BIO_write_varintsigned(b, (int64_t)num - prev[j]);
-                                dbg(ctx, "prev[%d]: %" PRIu64 "\n", j, prev[j]);
-                                dbg(ctx, "%d/%d value raw %" PRId64 " delta %" PRId64 " pos %d\n",
-                                    i,j, num, (int64_t)num-prev[j], pos);
-                                prev[j] = num;
-                                break;
-                        case FREEQ_COL_IPV4ADDR:
-                                break;
-                        case FREEQ_COL_TIME:
-                                break;
-                        default:
-                                //dbg(ctx, "coltype %d not yet implemented\n", col->coltype);
-                                break;
+                                dbg(ctx, "not sending %s, backing off\n", t->name);
+                                return FREEQ_ERR;
+                        }
+                        if (conn_open(conn))
+                        {
+                                conn_failed(conn);
+                                return FREEQ_ERR;
                         }
-                        colnxt[j] = g_slist_next(colnxt[j]);
+                        fresh = true;
                 }
-        }
 
-        for (i = 0; i < t->numcols; i++)
-                if (t->columns[i].coltype == FREEQ_COL_STRING)
-                        g_hash_table_destroy(strtbls[i]);
+                if ((err = conn_write(conn, t, more)) == 0)
+                        err = ack_read(ctx, conn->bio, &conn->peer_codecs);
+                if (err == FREEQ_REFUSED)
+                {
+                        /* the server dropped the table but kept the
+                         * connection, it no longer has the one a
+                         * delta would be against */
+                        conn->failures = 0;
+                        conn->partial = false;
+                        g_hash_table_remove(conn->sent, t->name);
+                        return FREEQ_REFUSED;
+                }
+                if (err == 0)
+                {
+                        conn->failures = 0;
+                        conn->partial = more;
+                        if (!whole)
+                                g_hash_table_remove(conn->sent, t->name);
+                        else if (t->keycol >= 0 && freeq_table_copy(ctx, t, &sent) == 0)
+                                g_hash_table_replace(conn->sent, g_strdup(t->name), sent);
+                        return 0;
+                }
 
+                /* the parts sent so far went with the connection */
+                lost = conn->partial;
+                conn_close(conn, false);
+                if (fresh)
+                {
+                        conn_failed(conn);
+                        return FREEQ_ERR;
+                }
+                if (lost)
+                {
+                        err(ctx, "connection to %s went away in the middle of %s\n", conn->server, t->name);
+                        return FREEQ_ERR;
+                }
+                dbg(ctx, "connection to %s went away, reconnecting\n", conn->server);
+        }
+}
 
+/**
+ * freeq_conn_send:
+ * @conn: publisher connection
+ * @t: table to send
+ *
+ * Send @t and wait for the server to acknowledge it, connecting first
+ * if needed.  A connection that turns out to have been dropped since
+ * the last send is replaced once.  While the server is unreachable
+ * sends fail straight away until the backoff delay has passed.
+ *
+ * If @t has a key column, set with freeq_table_set_key(), a copy is
+ * kept and the next table of the same name only carries the rows
+ * that changed since.
+ *
+ * After freeq_conn_send_more() @t is the last part of the table.
+ *
+ * Returns: 0 once the server has the table, FREEQ_REFUSED if it read
+ * the table but couldn't take it, FREEQ_ERR if it didn't get it
+ **/
+FREEQ_EXPORT int freeq_conn_send(struct freeq_conn *conn, struct freeq_table *t)
+{
+        return conn_send(conn, t, false);
+}
 
-        BIO_flush(b);
-        return 0;
+/**
+ * freeq_conn_send_more:
+ * @conn: publisher connection
+ * @t: rows of a table too large to send at once
+ *
+ * Send @t as part of a table and wait for the server to acknowledge
+ * it.  Parts of the same name and columns follow, the last one with
+ * freeq_conn_send(), and the server takes the table once it has them
+ * all.  Until then nothing else can go over @conn, a caller giving up
+ * on a table halfway frees the connection.
+ *
+ * If the connection drops after the first part, the table has to be
+ * sent again from its start.
+ *
+ * Returns: 0 once the server has the part
+ **/
+FREEQ_EXPORT int freeq_conn_send_more(struct freeq_conn *conn, struct freeq_table *t)
+{
+        return conn_send(conn, t, true);
 }
 
+/**
+ * freeq_table_sendto_ssl:
+ * @freeqctx: freeq library context
+ * @t: table to send
+ *
+ * Send a single table to the default server over a connection of
+ * its own.  Agents publishing repeatedly should keep a freeq_conn.
+ *
+ * Returns: 0 on success
+ **/
+FREEQ_EXPORT int freeq_table_sendto_ssl(struct freeq_ctx *freeqctx, struct freeq_table *t)
+{
+        struct freeq_conn *conn;
+        int err;
+
+        if ((err = freeq_conn_new(freeqctx, NULL, &conn)))
+                return err;
+        err = freeq_conn_send(conn, t);
+        freeq_conn_free(conn);
+        return err;
+}
 
 FREEQ_EXPORT void freeq_table_print(struct freeq_ctx *ctx, struct freeq_table *t, FILE *of)
 {
-        GSList *colp[t->numcols];
-
-        memset(colp, 0, t->numcols * sizeof(GSList *) );
-        for (int j = 0; j < t->numcols; j++)
-                colp[j] = t->columns[j].data;
+        char abuf[INET6_ADDRSTRLEN];
+        freeq_str_t sv;
 
         //fprintf(of, "%s\n", t->identity);
         fprintf(of, "%d\n", t->serial);
@@ -1423,19 +4287,33 @@ FREEQ_EXPORT void freeq_table_print(struct freeq_ctx *ctx, struct freeq_table *t
         {
                 for (uint32_t j=0; j < t->numcols; j++)
                 {
-                        switch (t->columns[j].coltype)
+                        struct freeq_column *col = &(t->columns[j]);
+                        switch (col->coltype)
                         {
                         case FREEQ_COL_STRING:
-                                fprintf(of, "%s", colp[j]->data == NULL ? "null" : (char *)colp[j]->data);
+                                sv = freeq_column_string(col, i);
+                                if (sv.str == NULL)
+                                        fprintf(of, "null");
+                                else
+                                        fprintf(of, "%.*s", (int)sv.len, sv.str);
                                 break;
                         case FREEQ_COL_NUMBER:
-                                fprintf(of, "%d", GPOINTER_TO_INT(colp[j]->data));
+                        case FREEQ_COL_TIME:
+                                fprintf(of, "%" PRId64, freeq_column_number(col, i));
+                                break;
+                        case FREEQ_COL_DOUBLE:
+                                fprintf(of, "%.17g", freeq_column_double(col, i));
+                                break;
+                        case FREEQ_COL_IPV4ADDR:
+                                fprintf(of, "%s", inet_ntop(AF_INET, &freeq_column_ipv4(col, i), abuf, sizeof(abuf)));
+                                break;
+                        case FREEQ_COL_IPV6ADDR:
+                                fprintf(of, "%s", inet_ntop(AF_INET6, &freeq_column_ipv6(col, i), abuf, sizeof(abuf)));
                                 break;
                         default:
                                 break;
                         }
                         fprintf(of, CSEP(j, t));
-                        colp[j] = g_slist_next(colp[j]);
                 }
         }
 }
@@ -0,0 +1,1123 @@
+/*
+  freeqd in-memory query engine
+
+  Copyright (C) 2011 Someone <someone@example.com>
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+
+#include "freeq/libfreeq.h"
+#include "libfreeq-private.h"
+#include "query.h"
+
+typedef enum {
+        AGG_NONE,
+        AGG_COUNT,
+        AGG_SUM,
+        AGG_MIN,
+        AGG_MAX
+} agg_t;
+
+typedef enum {
+        OP_EQ,
+        OP_NE,
+        OP_LT,
+        OP_LE,
+        OP_GT,
+        OP_GE
+} op_t;
+
+struct query_item {
+        char *name;             /* source column, NULL for count(*) */
+        char *label;            /* result column */
+        agg_t agg;
+        int col;
+};
+
+struct query_filter {
+        char *name;
+        op_t op;
+        bool is_str;
+        bool is_int;            /* num holds the literal exactly */
+        int64_t num;
+        double dbl;
+        char *str;
+        uint32_t len;
+        int col;
+};
+
+struct freeq_query {
+        char *table;
+        bool star;
+        bool aggregate;
+        GArray *items;          /* struct query_item */
+        GArray *filters;        /* struct query_filter */
+        char *group;
+        char *order;
+        bool desc;
+        uint32_t limit;
+};
+
+/*
+ * parser
+ */
+typedef enum {
+        TOK_END,
+        TOK_IDENT,
+        TOK_NUMBER,
+        TOK_STRING,
+        TOK_PUNCT
+} tok_t;
+
+struct lexer {
+        const char *p;
+        tok_t type;
+        const char *s;
+        size_t len;
+};
+
+static void lex_next(struct lexer *l)
+{
+        const char *p = l->p;
+
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+                p++;
+
+        l->s = p;
+        if (*p == 0)
+        {
+                l->type = TOK_END;
+                l->len = 0;
+        }
+        else if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || *p == '_')
+        {
+                while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+                       (*p >= '0' && *p <= '9') || *p == '_')
+                        p++;
+                l->type = TOK_IDENT;
+        }
+        else if ((*p >= '0' && *p <= '9') || (*p == '-' && p[1] >= '0' && p[1] <= '9'))
+        {
+                p++;
+                while ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E')
+                        p++;
+                l->type = TOK_NUMBER;
+        }
+        else if (*p == '\'')
+        {
+                /* '' inside a literal is a quote, unescaped by the
+                 * caller */
+                for (p++; *p != 0; p++)
+                {
+                        if (*p == '\'' && p[1] == '\'')
+                                p++;
+                        else if (*p == '\'')
+                                break;
+                }
+                if (*p == '\'')
+                        p++;
+                l->type = TOK_STRING;
+        }
+        else
+        {
+                if ((p[0] == '<' && (p[1] == '=' || p[1] == '>')) ||
+                    (p[0] == '>' && p[1] == '=') ||
+                    (p[0] == '!' && p[1] == '='))
+                        p += 2;
+                else
+                        p++;
+                l->type = TOK_PUNCT;
+        }
+        l->len = p - l->s;
+        l->p = p;
+}
+
+static bool lex_is(struct lexer *l, const char *word)
+{
+        return (l->type == TOK_IDENT || l->type == TOK_PUNCT) &&
+                strlen(word) == l->len &&
+                strncasecmp(l->s, word, l->len) == 0;
+}
+
+static bool lex_accept(struct lexer *l, const char *word)
+{
+        if (!lex_is(l, word))
+                return false;
+        lex_next(l);
+        return true;
+}
+
+static char *lex_ident(struct lexer *l)
+{
+        char *s;
+
+        if (l->type != TOK_IDENT)
+                return NULL;
+        s = strndup(l->s, l->len);
+        lex_next(l);
+        return s;
+}
+
+static const char *agg_names[] = { NULL, "count", "sum", "min", "max" };
+
+static int parse_item(struct lexer *l, struct query_item *it)
+{
+        memset(it, 0, sizeof(*it));
+        it->col = -1;
+
+        for (agg_t a = AGG_COUNT; a <= AGG_MAX; a++)
+        {
+                struct lexer save = *l;
+                if (!lex_accept(l, agg_names[a]))
+                        continue;
+                if (!lex_accept(l, "("))
+                {
+                        /* a column that happens to be called count */
+                        *l = save;
+                        break;
+                }
+                it->agg = a;
+                if (a == AGG_COUNT && lex_accept(l, "*"))
+                        it->name = NULL;
+                else if ((it->name = lex_ident(l)) == NULL)
+                        return FREEQ_ERR;
+                if (!lex_accept(l, ")"))
+                        return FREEQ_ERR;
+                it->label = it->name ?
+                        g_strdup_printf("%s(%s)", agg_names[a], it->name) :
+                        g_strdup_printf("%s(*)", agg_names[a]);
+                break;
+        }
+
+        if (it->agg == AGG_NONE)
+        {
+                if ((it->name = lex_ident(l)) == NULL)
+                        return FREEQ_ERR;
+                it->label = g_strdup(it->name);
+        }
+
+        if (lex_accept(l, "as"))
+        {
+                char *label = lex_ident(l);
+                if (label == NULL)
+                        return FREEQ_ERR;
+                g_free(it->label);
+                it->label = g_strdup(label);
+                free(label);
+        }
+        return 0;
+}
+
+static int parse_filter(struct lexer *l, struct query_filter *f)
+{
+        static const char *ops[] = { "=", "!=", "<", "<=", ">", ">=" };
+        char *end;
+
+        memset(f, 0, sizeof(*f));
+        f->col = -1;
+        if ((f->name = lex_ident(l)) == NULL)
+                return FREEQ_ERR;
+
+        if (lex_accept(l, "<>"))
+                f->op = OP_NE;
+        else
+        {
+                op_t op;
+                for (op = OP_EQ; op <= OP_GE; op++)
+                        if (lex_accept(l, ops[op]))
+                                break;
+                if (op > OP_GE)
+                        return FREEQ_ERR;
+                f->op = op;
+        }
+
+        if (l->type == TOK_NUMBER)
+        {
+                errno = 0;
+                f->num = strtoll(l->s, &end, 10);
+                f->is_int = end == l->s + l->len && errno == 0;
+                f->dbl = strtod(l->s, &end);
+                if (end != l->s + l->len)
+                        return FREEQ_ERR;
+        }
+        else if (l->type == TOK_STRING && l->len >= 2 && l->s[l->len - 1] == '\'')
+        {
+                GString *s = g_string_sized_new(l->len);
+                for (size_t i = 1; i < l->len - 1; i++)
+                {
+                        g_string_append_c(s, l->s[i]);
+                        if (l->s[i] == '\'')
+                                i++;
+                }
+                f->is_str = true;
+                f->len = s->len;
+                f->str = g_string_free(s, FALSE);
+        }
+        else
+                return FREEQ_ERR;
+
+        lex_next(l);
+        return 0;
+}
+
+/**
+ * freeq_query_free:
+ * @query: parsed query
+ *
+ * Release @query and everything it owns.
+ **/
+void freeq_query_free(struct freeq_query *query)
+{
+        if (query == NULL)
+                return;
+
+        for (guint i = 0; i < query->items->len; i++)
+        {
+                struct query_item *it = &g_array_index(query->items, struct query_item, i);
+                free(it->name);
+                g_free(it->label);
+        }
+        for (guint i = 0; i < query->filters->len; i++)
+        {
+                struct query_filter *f = &g_array_index(query->filters, struct query_filter, i);
+                free(f->name);
+                g_free(f->str);
+        }
+        g_array_free(query->items, TRUE);
+        g_array_free(query->filters, TRUE);
+        free(query->table);
+        free(query->group);
+        free(query->order);
+        free(query);
+}
+
+/**
+ * freeq_query_parse:
+ * @ctx: freeq library context
+ * @sql: query text
+ * @query: pointer to the parsed query
+ *
+ * Parse @sql for the in-memory engine.
+ *
+ * Returns: 0 on success, FREEQ_ERR if @sql is outside the supported
+ * subset
+ **/
+int freeq_query_parse(struct freeq_ctx *ctx, const char *sql, struct freeq_query **query)
+{
+        struct freeq_query *q;
+        struct lexer l = { sql };
+        struct query_item it;
+        struct query_filter f;
+        bool plain = false;
+
+        q = calloc(1, sizeof(struct freeq_query));
+        if (q == NULL)
+                return -ENOMEM;
+        q->items = g_array_new(FALSE, TRUE, sizeof(struct query_item));
+        q->filters = g_array_new(FALSE, TRUE, sizeof(struct query_filter));
+
+        lex_next(&l);
+        if (!lex_accept(&l, "select"))
+                goto fail;
+
+        if (lex_accept(&l, "*"))
+                q->star = true;
+        else
+        {
+                do {
+                        int res = parse_item(&l, &it);
+                        g_array_append_val(q->items, it);
+                        if (res)
+                                goto fail;
+                        if (it.agg != AGG_NONE)
+                                q->aggregate = true;
+                        else
+                                plain = true;
+                } while (lex_accept(&l, ","));
+        }
+
+        if (!lex_accept(&l, "from") || (q->table = lex_ident(&l)) == NULL)
+                goto fail;
+
+        if (lex_accept(&l, "where"))
+        {
+                do {
+                        int res = parse_filter(&l, &f);
+                        g_array_append_val(q->filters, f);
+                        if (res)
+                                goto fail;
+                } while (lex_accept(&l, "and"));
+        }
+
+        if (lex_accept(&l, "group"))
+        {
+                if (!lex_accept(&l, "by") || (q->group = lex_ident(&l)) == NULL)
+                        goto fail;
+                q->aggregate = true;
+        }
+
+        if (lex_accept(&l, "order"))
+        {
+                if (!lex_accept(&l, "by") || (q->order = lex_ident(&l)) == NULL)
+                        goto fail;
+                if (lex_accept(&l, "desc"))
+                        q->desc = true;
+                else
+                        lex_accept(&l, "asc");
+        }
+
+        if (lex_accept(&l, "limit"))
+        {
+                char *end;
+                long long n;
+
+                if (l.type != TOK_NUMBER)
+                        goto fail;
+                n = strtoll(l.s, &end, 10);
+                if (end != l.s + l.len || n <= 0 || n > UINT32_MAX)
+                        goto fail;
+                q->limit = n;
+                lex_next(&l);
+        }
+
+        lex_accept(&l, ";");
+        if (l.type != TOK_END)
+                goto fail;
+
+        /* an aggregate query can only name the grouping column
+         * outside an aggregate */
+        if (q->aggregate)
+        {
+                if (q->star)
+                        goto fail;
+                for (guint i = 0; plain && i < q->items->len; i++)
+                {
+                        struct query_item *p = &g_array_index(q->items, struct query_item, i);
+                        if (p->agg == AGG_NONE &&
+                            (q->group == NULL || strcasecmp(p->name, q->group) != 0))
+                                goto fail;
+                }
+        }
+
+        *query = q;
+        return 0;
+
+fail:
+        dbg(ctx, "query not supported in memory near '%.20s'\n", l.s);
+        freeq_query_free(q);
+        return FREEQ_ERR;
+}
+
+/**
+ * freeq_query_table:
+ * @query: parsed query
+ *
+ * Returns: the name of the table @query reads
+ **/
+const char *freeq_query_table(struct freeq_query *query)
+{
+        return query->table;
+}
+
+/*
+ * execution
+ *
+ * a scan holds the selection vector, the indices of the rows still
+ * in play.  it starts as the rows of every live segment, in order,
+ * and each filter compacts it with one pass over a column array.
+ * grouping maps each selected row to a group id, and every aggregate
+ * is then a single loop accumulating into an array indexed by group.
+ */
+struct scan {
+        struct freeq_table *t;
+        struct freeq_column host;       /* sender identity of each row */
+        bool has_host;
+        uint32_t *sel;
+        uint32_t n;
+};
+
+static int find_column(struct scan *s, const char *name)
+{
+        for (uint32_t i = 0; i < s->t->numcols; i++)
+                if (strcasecmp(s->t->columns[i].name, name) == 0)
+                        return s->t->columns[i].values != NULL ? (int)i : -1;
+        if (strcasecmp(name, "host") == 0)
+                return s->t->numcols;
+        return -1;
+}
+
+static const struct freeq_column *scan_column(struct scan *s, int col)
+{
+        return col == (int)s->t->numcols ? &s->host : &s->t->columns[col];
+}
+
+struct sender {
+        const char *identity;
+        struct freeq_segment *seg;
+};
+
+static int sender_cmp(const void *a, const void *b)
+{
+        const struct freeq_segment *x = ((const struct sender *)a)->seg;
+        const struct freeq_segment *y = ((const struct sender *)b)->seg;
+        return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* fill the selection with every live row and, since rows only know
+ * their sender through the segment they're in, the host column */
+static void scan_init(struct scan *s, struct freeq_table *t)
+{
+        static const char unknown[] = "";
+        uint32_t n = 0;
+
+        memset(s, 0, sizeof(*s));
+        s->t = t;
+        s->sel = malloc(sizeof(uint32_t) * (t->numrows ? t->numrows : 1));
+        s->host.coltype = FREEQ_COL_STRING;
+        s->host.name = "host";
+        s->host.values = g_array_sized_new(FALSE, TRUE, sizeof(freeq_str_t), t->numrows);
+        g_array_set_size(s->host.values, t->numrows);
+
+        if (t->senders == NULL)
+        {
+                freeq_str_t id = { t->identity ? t->identity : unknown, 0 };
+                id.len = strlen(id.str);
+                for (uint32_t i = 0; i < t->numrows; i++)
+                {
+                        s->sel[n++] = i;
+                        freeq_column_string(&s->host, i) = id;
+                }
+        }
+        else
+        {
+                guint nseg = g_hash_table_size(t->senders);
+                struct sender *segs = malloc(sizeof(struct sender) * (nseg ? nseg : 1));
+                GHashTableIter iter;
+                gpointer key, val;
+                guint k = 0;
+
+                g_hash_table_iter_init(&iter, t->senders);
+                while (g_hash_table_iter_next(&iter, &key, &val))
+                {
+                        segs[k].identity = key;
+                        segs[k].seg = val;
+                        k++;
+                }
+                qsort(segs, nseg, sizeof(struct sender), sender_cmp);
+
+                for (k = 0; k < nseg; k++)
+                {
+                        struct freeq_segment *seg = segs[k].seg;
+                        freeq_str_t id = { segs[k].identity, strlen(segs[k].identity) };
+                        for (uint32_t i = seg->start; i < seg->start + seg->numrows; i++)
+                        {
+                                s->sel[n++] = i;
+                                freeq_column_string(&s->host, i) = id;
+                        }
+                }
+                free(segs);
+        }
+        s->n = n;
+}
+
+static void scan_clear(struct scan *s)
+{
+        free(s->sel);
+        g_array_free(s->host.values, TRUE);
+}
+
+static inline int str_cmp(freeq_str_t a, const char *b, uint32_t blen)
+{
+        int c;
+
+        if (a.str == NULL)
+                return blen ? -1 : 0;
+        c = memcmp(a.str, b, MIN(a.len, blen));
+        return c ? c : (a.len > blen) - (a.len < blen);
+}
+
+#define FILTER_LOOP(cond)                                       \
+        for (uint32_t i = 0; i < s->n; i++)                     \
+        {                                                       \
+                uint32_t r = s->sel[i];                         \
+                s->sel[k] = r;                                  \
+                k += (cond);                                    \
+        }
+
+#define FILTER_OPS(x, y)                                        \
+        switch (f->op)                                          \
+        {                                                       \
+        case OP_EQ: FILTER_LOOP((x) == (y)); break;             \
+        case OP_NE: FILTER_LOOP((x) != (y)); break;             \
+        case OP_LT: FILTER_LOOP((x) < (y)); break;              \
+        case OP_LE: FILTER_LOOP((x) <= (y)); break;             \
+        case OP_GT: FILTER_LOOP((x) > (y)); break;              \
+        case OP_GE: FILTER_LOOP((x) >= (y)); break;             \
+        }
+
+static int scan_filter(struct scan *s, const struct query_filter *f)
+{
+        const struct freeq_column *c = scan_column(s, f->col);
+        uint32_t k = 0;
+
+        if (s->n == 0)
+                return 0;
+
+        switch (c->coltype)
+        {
+        case FREEQ_COL_NUMBER:
+        case FREEQ_COL_TIME:
+        {
+                const int64_t *v = (const int64_t *)c->values->data;
+                const int64_t x = f->num;
+                const double d = f->dbl;
+                if (f->is_str)
+                        return FREEQ_ERR;
+                /* 2.5, or a literal past the range of a number,
+                 * compares as a double, as it does in sqlite */
+                if (f->is_int)
+                {
+                        FILTER_OPS(v[r], x);
+                }
+                else
+                {
+                        FILTER_OPS((double)v[r], d);
+                }
+                break;
+        }
+        case FREEQ_COL_DOUBLE:
+        {
+                const double *v = (const double *)c->values->data;
+                const double x = f->dbl;
+                if (f->is_str)
+                        return FREEQ_ERR;
+                FILTER_OPS(v[r], x);
+                break;
+        }
+        case FREEQ_COL_STRING:
+        {
+                const freeq_str_t *v = (const freeq_str_t *)c->values->data;
+                if (!f->is_str)
+                        return FREEQ_ERR;
+                FILTER_OPS(str_cmp(v[r], f->str, f->len), 0);
+                break;
+        }
+        default:
+                return FREEQ_ERR;
+        }
+
+        s->n = k;
+        return 0;
+}
+
+/* rows of a column ordered by value, for ORDER BY */
+struct order {
+        const struct freeq_column *col;
+        bool desc;
+};
+
+static int row_cmp(const struct order *o, uint32_t a, uint32_t b)
+{
+        const struct freeq_column *c = o->col;
+        int r;
+
+        switch (c->coltype)
+        {
+        case FREEQ_COL_NUMBER:
+        case FREEQ_COL_TIME:
+                r = (freeq_column_number(c, a) > freeq_column_number(c, b)) -
+                        (freeq_column_number(c, a) < freeq_column_number(c, b));
+                break;
+        case FREEQ_COL_DOUBLE:
+                r = (freeq_column_double(c, a) > freeq_column_double(c, b)) -
+                        (freeq_column_double(c, a) < freeq_column_double(c, b));
+                break;
+        case FREEQ_COL_STRING:
+        {
+                freeq_str_t y = freeq_column_string(c, b);
+                r = str_cmp(freeq_column_string(c, a), y.str ? y.str : "", y.len);
+                break;
+        }
+        default:
+                r = 0;
+        }
+        return o->desc ? -r : r;
+}
+
+static int row_qsort_cmp(const void *a, const void *b, void *arg)
+{
+        return row_cmp(arg, *(const uint32_t *)a, *(const uint32_t *)b);
+}
+
+static void heap_sift(const struct order *o, uint32_t *h, uint32_t n, uint32_t i)
+{
+        for (;;)
+        {
+                uint32_t l = 2 * i + 1, r = l + 1, m = i, t;
+                if (l < n && row_cmp(o, h[l], h[m]) > 0)
+                        m = l;
+                if (r < n && row_cmp(o, h[r], h[m]) > 0)
+                        m = r;
+                if (m == i)
+                        return;
+                t = h[i]; h[i] = h[m]; h[m] = t;
+                i = m;
+        }
+}
+
+/* sort rows[0..n) by o and return how many to keep.  with a limit
+ * only the best @limit rows are kept, found with a heap holding the
+ * worst of them at the root, in O(n log limit) */
+static uint32_t order_rows(const struct order *o, uint32_t *rows, uint32_t n, uint32_t limit)
+{
+        if (limit == 0 || limit >= n)
+        {
+                qsort_r(rows, n, sizeof(uint32_t), row_qsort_cmp, (void *)o);
+                return n;
+        }
+
+        for (uint32_t i = limit / 2; i-- > 0; )
+                heap_sift(o, rows, limit, i);
+        for (uint32_t i = limit; i < n; i++)
+        {
+                if (row_cmp(o, rows[i], rows[0]) < 0)
+                {
+                        rows[0] = rows[i];
+                        heap_sift(o, rows, limit, 0);
+                }
+        }
+        qsort_r(rows, limit, sizeof(uint32_t), row_qsort_cmp, (void *)o);
+        return limit;
+}
+
+static void column_gather(struct freeq_column *dst, const struct freeq_column *src,
+                          const uint32_t *rows, uint32_t n)
+{
+        guint width;
+
+        dst->coltype = src->coltype;
+        if (src->values == NULL)
+                return;
+        width = g_array_get_element_size(src->values);
+        dst->values = g_array_sized_new(FALSE, FALSE, width, n);
+        g_array_set_size(dst->values, n);
+        for (uint32_t i = 0; i < n; i++)
+                memcpy(dst->values->data + (size_t)i * width,
+                       src->values->data + (size_t)rows[i] * width,
+                       width);
+}
+
+/*
+ * grouping
+ *
+ * open addressing over the group keys, each group remembers the
+ * first row it was seen in and keys are compared through it.
+ */
+struct groups {
+        const struct freeq_column *key;
+        uint32_t *slots;        /* group id + 1, 0 is empty */
+        uint32_t mask;
+        GArray *first;          /* uint32_t row per group */
+};
+
+static guint64 key_hash(const struct freeq_column *c, uint32_t row)
+{
+        guint64 h;
+
+        switch (c->coltype)
+        {
+        case FREEQ_COL_STRING:
+        {
+                freeq_str_t s = freeq_column_string(c, row);
+                h = 14695981039346656037ULL;
+                for (uint32_t i = 0; i < s.len; i++)
+                        h = (h ^ (uint8_t)s.str[i]) * 1099511628211ULL;
+                return h;
+        }
+        default:
+                memcpy(&h, c->values->data + (size_t)row * 8, 8);
+                h ^= h >> 33;
+                h *= 0xff51afd7ed558ccdULL;
+                h ^= h >> 33;
+                return h;
+        }
+}
+
+static bool key_equal(const struct freeq_column *c, uint32_t a, uint32_t b)
+{
+        struct order o = { c, false };
+        return row_cmp(&o, a, b) == 0;
+}
+
+static void groups_grow(struct groups *g)
+{
+        uint32_t cap = g->slots ? (g->mask + 1) * 2 : 64;
+
+        free(g->slots);
+        g->slots = calloc(cap, sizeof(uint32_t));
+        g->mask = cap - 1;
+        for (uint32_t id = 0; id < g->first->len; id++)
+        {
+                uint32_t row = g_array_index(g->first, uint32_t, id);
+                uint32_t i = key_hash(g->key, row) & g->mask;
+                while (g->slots[i])
+                        i = (i + 1) & g->mask;
+                g->slots[i] = id + 1;
+        }
+}
+
+static uint32_t groups_lookup(struct groups *g, uint32_t row)
+{
+        uint32_t i, id;
+
+        if ((g->first->len + 1) * 2 > g->mask + 1)
+                groups_grow(g);
+
+        for (i = key_hash(g->key, row) & g->mask; g->slots[i]; i = (i + 1) & g->mask)
+        {
+                id = g->slots[i] - 1;
+                if (key_equal(g->key, g_array_index(g->first, uint32_t, id), row))
+                        return id;
+        }
+
+        id = g->first->len;
+        g_array_append_val(g->first, row);
+        g->slots[i] = id + 1;
+        return id;
+}
+
+/* fill dst with one aggregate per group, gid maps each selected row
+ * to its group */
+static int aggregate(struct scan *s, const struct query_item *it,
+                     const uint32_t *gid, uint32_t ngroups, const int64_t *counts,
+                     struct freeq_column *dst)
+{
+        const struct freeq_column *c = it->name ? scan_column(s, it->col) : NULL;
+        bool dbl = c && c->coltype == FREEQ_COL_DOUBLE;
+
+        /* only the one group of a query without GROUP BY can be
+         * empty, and the sum, min or max of no rows is NULL as it
+         * is in sqlite */
+        if (it->agg != AGG_COUNT && ngroups == 1 && counts[0] == 0)
+        {
+                dst->coltype = FREEQ_COL_NULL;
+                return 0;
+        }
+
+        dst->coltype = dbl ? FREEQ_COL_DOUBLE : FREEQ_COL_NUMBER;
+        dst->values = g_array_sized_new(FALSE, TRUE, 8, ngroups);
+        g_array_set_size(dst->values, ngroups);
+
+        if (it->agg == AGG_COUNT)
+        {
+                int64_t *acc = (int64_t *)dst->values->data;
+                if (c == NULL || c->coltype != FREEQ_COL_STRING)
+                        memcpy(acc, counts, sizeof(int64_t) * ngroups);
+                else
+                {
+                        const freeq_str_t *v = (const freeq_str_t *)c->values->data;
+                        for (uint32_t i = 0; i < s->n; i++)
+                                acc[gid[i]] += v[s->sel[i]].str != NULL;
+                }
+                return 0;
+        }
+
+        if (c->coltype == FREEQ_COL_NUMBER || c->coltype == FREEQ_COL_TIME)
+        {
+                const int64_t *v = (const int64_t *)c->values->data;
+                int64_t *acc = (int64_t *)dst->values->data;
+                int64_t init = it->agg == AGG_MIN ? INT64_MAX : it->agg == AGG_MAX ? INT64_MIN : 0;
+
+                for (uint32_t g = 0; g < ngroups; g++)
+                        acc[g] = init;
+                switch (it->agg)
+                {
+                case AGG_SUM:
+                        for (uint32_t i = 0; i < s->n; i++)
+                                acc[gid[i]] = (int64_t)((uint64_t)acc[gid[i]] + (uint64_t)v[s->sel[i]]);
+                        break;
+                case AGG_MIN:
+                        for (uint32_t i = 0; i < s->n; i++)
+                                acc[gid[i]] = MIN(acc[gid[i]], v[s->sel[i]]);
+                        break;
+                case AGG_MAX:
+                        for (uint32_t i = 0; i < s->n; i++)
+                                acc[gid[i]] = MAX(acc[gid[i]], v[s->sel[i]]);
+                        break;
+                default:
+                        break;
+                }
+                return 0;
+        }
+
+        if (dbl)
+        {
+                const double *v = (const double *)c->values->data;
+                double *acc = (double *)dst->values->data;
+                double init = it->agg == AGG_MIN ? INFINITY : it->agg == AGG_MAX ? -INFINITY : 0;
+
+                for (uint32_t g = 0; g < ngroups; g++)
+                        acc[g] = init;
+                switch (it->agg)
+                {
+                case AGG_SUM:
+                        for (uint32_t i = 0; i < s->n; i++)
+                                acc[gid[i]] += v[s->sel[i]];
+                        break;
+                case AGG_MIN:
+                        for (uint32_t i = 0; i < s->n; i++)
+                                acc[gid[i]] = MIN(acc[gid[i]], v[s->sel[i]]);
+                        break;
+                case AGG_MAX:
+                        for (uint32_t i = 0; i < s->n; i++)
+                                acc[gid[i]] = MAX(acc[gid[i]], v[s->sel[i]]);
+                        break;
+                default:
+                        break;
+                }
+                return 0;
+        }
+
+        return FREEQ_ERR;
+}
+
+static struct freeq_table *result_new(struct freeq_ctx *ctx, uint32_t numcols)
+{
+        struct freeq_table *r;
+
+        if (freeq_table_new_fromcols(ctx, "result", numcols, &r, NULL, true))
+                return NULL;
+        return r;
+}
+
+static int run_select(struct freeq_ctx *ctx, struct freeq_query *q, struct scan *s, struct freeq_table **result)
+{
+        struct freeq_table *r;
+        struct order o;
+        uint32_t ncols, n = s->n;
+        int ocol = -1;
+
+        ncols = q->star ? s->t->numcols : q->items->len;
+
+        if (q->order != NULL)
+        {
+                for (guint i = 0; !q->star && i < q->items->len; i++)
+                {
+                        struct query_item *it = &g_array_index(q->items, struct query_item, i);
+                        if (strcasecmp(it->label, q->order) == 0)
+                                ocol = it->col;
+                }
+                if (ocol < 0 && (ocol = find_column(s, q->order)) < 0)
+                        return FREEQ_ERR;
+                o.col = scan_column(s, ocol);
+                o.desc = q->desc;
+                n = order_rows(&o, s->sel, s->n, q->limit);
+        }
+        else if (q->limit && q->limit < n)
+                n = q->limit;
+
+        if ((r = result_new(ctx, ncols)) == NULL)
+                return -ENOMEM;
+
+        for (uint32_t j = 0; j < ncols; j++)
+        {
+                int col = j;
+                const char *label;
+
+                if (!q->star)
+                {
+                        struct query_item *it = &g_array_index(q->items, struct query_item, j);
+                        col = it->col;
+                        label = it->label;
+                }
+                else
+                        label = s->t->columns[j].name;
+
+                r->columns[j].name = freeq_table_strdup(r, label);
+                column_gather(&r->columns[j], scan_column(s, col), s->sel, n);
+        }
+        r->numrows = n;
+        *result = r;
+        return 0;
+}
+
+static int run_aggregate(struct freeq_ctx *ctx, struct freeq_query *q, struct scan *s, struct freeq_table **result)
+{
+        struct freeq_table *r, *sorted;
+        struct groups g;
+        uint32_t *gid, *rows, ngroups, n;
+        int64_t *counts;
+        int gcol = -1, res = 0;
+
+        memset(&g, 0, sizeof(g));
+        gid = malloc(sizeof(uint32_t) * (s->n ? s->n : 1));
+        g.first = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+
+        if (q->group != NULL)
+        {
+                if ((gcol = find_column(s, q->group)) < 0)
+                {
+                        res = FREEQ_ERR;
+                        goto out;
+                }
+                g.key = scan_column(s, gcol);
+                for (uint32_t i = 0; i < s->n; i++)
+                        gid[i] = groups_lookup(&g, s->sel[i]);
+                ngroups = g.first->len;
+        }
+        else
+        {
+                /* the whole selection is one group, even when empty */
+                memset(gid, 0, sizeof(uint32_t) * s->n);
+                ngroups = 1;
+        }
+
+        counts = calloc(ngroups, sizeof(int64_t));
+        for (uint32_t i = 0; i < s->n; i++)
+                counts[gid[i]]++;
+
+        if ((r = result_new(ctx, q->items->len)) == NULL)
+        {
+                free(counts);
+                res = -ENOMEM;
+                goto out;
+        }
+        r->numrows = ngroups;
+
+        for (guint j = 0; j < q->items->len; j++)
+        {
+                struct query_item *it = &g_array_index(q->items, struct query_item, j);
+                r->columns[j].name = freeq_table_strdup(r, it->label);
+                if (it->agg == AGG_NONE)
+                        column_gather(&r->columns[j], g.key,
+                                      (uint32_t *)g.first->data, ngroups);
+                else if (aggregate(s, it, gid, ngroups, counts, &r->columns[j]))
+                        res = FREEQ_ERR;
+        }
+        free(counts);
+
+        if (res)
+        {
+                freeq_table_unref(r);
+                goto out;
+        }
+
+        n = ngroups;
+        rows = malloc(sizeof(uint32_t) * (ngroups ? ngroups : 1));
+        for (uint32_t i = 0; i < ngroups; i++)
+                rows[i] = i;
+
+        if (q->order != NULL)
+        {
+                struct order o = { NULL, q->desc };
+                for (guint j = 0; j < q->items->len; j++)
+                {
+                        struct query_item *it = &g_array_index(q->items, struct query_item, j);
+                        if (strcasecmp(it->label, q->order) == 0 ||
+                            (it->agg == AGG_NONE && strcasecmp(it->name, q->order) == 0))
+                                o.col = &r->columns[j];
+                }
+                if (o.col == NULL)
+                {
+                        free(rows);
+                        freeq_table_unref(r);
+                        res = FREEQ_ERR;
+                        goto out;
+                }
+                n = order_rows(&o, rows, ngroups, q->limit);
+        }
+        else if (q->limit && q->limit < n)
+                n = q->limit;
+
+        if (q->order != NULL || n < ngroups)
+        {
+                sorted = result_new(ctx, r->numcols);
+                for (uint32_t j = 0; j < r->numcols; j++)
+                {
+                        sorted->columns[j].name = freeq_table_strdup(sorted, r->columns[j].name);
+                        column_gather(&sorted->columns[j], &r->columns[j], rows, n);
+                }
+                sorted->numrows = n;
+                freeq_table_unref(r);
+                r = sorted;
+        }
+        free(rows);
+        *result = r;
+
+out:
+        free(gid);
+        free(g.slots);
+        g_array_free(g.first, TRUE);
+        return res;
+}
+
+/**
+ * freeq_query_run:
+ * @ctx: freeq library context
+ * @query: parsed query
+ * @table: table to scan
+ * @result: pointer to the result table
+ *
+ * Run @query against @table.  String cells in the result point into
+ * @table, so unless @table no longer changes, as in a sealed
+ * generation, a merged table's read lock has to be held from before
+ * the scan until the result has been sent and released.
+ *
+ * Returns: 0 on success, FREEQ_ERR if @query doesn't fit @table
+ **/
+int freeq_query_run(struct freeq_ctx *ctx,
+                    struct freeq_query *q,
+                    struct freeq_table *table,
+                    struct freeq_table **result)
+{
+        struct scan s;
+        int res = 0;
+
+        scan_init(&s, table);
+
+        for (guint i = 0; i < q->items->len && !res; i++)
+        {
+                struct query_item *it = &g_array_index(q->items, struct query_item, i);
+                if (it->name != NULL && (it->col = find_column(&s, it->name)) < 0)
+                        res = FREEQ_ERR;
+        }
+
+        for (guint i = 0; i < q->filters->len && !res; i++)
+        {
+                struct query_filter *f = &g_array_index(q->filters, struct query_filter, i);
+                if ((f->col = find_column(&s, f->name)) < 0)
+                        res = FREEQ_ERR;
+                else
+                        res = scan_filter(&s, f);
+        }
+
+        if (res)
+                dbg(ctx, "query doesn't fit table %s\n", table->name);
+        else if (q->aggregate)
+                res = run_aggregate(ctx, q, &s, result);
+        else
+                res = run_select(ctx, q, &s, result);
+
+        scan_clear(&s);
+        return res;
+}
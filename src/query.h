@@ -0,0 +1,62 @@
+/*
+  freeqd in-memory query engine
+
+  Copyright (C) 2011 Someone <someone@example.com>
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _FREEQ_QUERY_H_
+#define _FREEQ_QUERY_H_
+
+#include <freeq/libfreeq.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * freeq_query
+ *
+ * queries answered straight from a generation's merged tables.  the
+ * accepted language is the subset of SQL dashboards use:
+ *
+ *   SELECT * | item [, item ...] FROM table
+ *     [WHERE column op literal [AND ...]]
+ *     [GROUP BY column]
+ *     [ORDER BY column [ASC | DESC]]
+ *     [LIMIT n]
+ *
+ * where an item is a column or count/sum/min/max of one, optionally
+ * followed by AS label.  a column called host, when the table has
+ * none of its own, is the identity of the sender each row came from.
+ * anything outside the subset fails to parse, and the caller should
+ * fall back to sqlite.
+ */
+struct freeq_query;
+
+int freeq_query_parse(struct freeq_ctx *ctx, const char *sql, struct freeq_query **query);
+const char *freeq_query_table(struct freeq_query *query);
+int freeq_query_run(struct freeq_ctx *ctx,
+		    struct freeq_query *query,
+		    struct freeq_table *table,
+		    struct freeq_table **result);
+void freeq_query_free(struct freeq_query *query);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
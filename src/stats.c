@@ -0,0 +1,502 @@
+/*
+  freeqd runtime statistics
+
+  Copyright (C) 2011 Someone <someone@example.com>
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "freeq/libfreeq.h"
+#include "libfreeq-private.h"
+#include "stats.h"
+
+struct hist {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t buckets[FREEQ_HIST_BUCKETS];
+};
+
+struct table_stat {
+        uint64_t tables;
+        uint64_t rows;
+        uint64_t bytes;
+        struct hist publish;
+};
+
+/* one per thread that has counted anything.  shards outlive their
+ * threads so nothing counted is lost when a thread goes away */
+struct shard {
+        GMutex lock;
+        uint64_t counters[FREEQ_STAT_COUNTERS];
+        struct hist hists[FREEQ_HIST_COUNT];
+        GHashTable *tables;     /* table name to struct table_stat */
+};
+
+struct snapshot {
+        uint64_t counters[FREEQ_STAT_COUNTERS];
+        struct hist hists[FREEQ_HIST_COUNT];
+        int64_t gauges[FREEQ_GAUGE_COUNT];
+        GHashTable *tables;
+};
+
+struct stat_name {
+        const char *metric;
+        const char *key;        /* prometheus label name, or NULL */
+        const char *label;
+};
+
+/* entries with the same metric must be next to each other */
+static const struct stat_name counter_names[FREEQ_STAT_COUNTERS] = {
+        [FREEQ_STAT_ACCEPTED_AGG]     = { "connections_accepted", "kind", "agg" },
+        [FREEQ_STAT_ACCEPTED_SQL]     = { "connections_accepted", "kind", "sql" },
+        [FREEQ_STAT_HANDSHAKE_FAILED] = { "handshakes_failed", NULL, "" },
+        [FREEQ_STAT_DECODE_FAILED]    = { "tables_rejected", "reason", "decode" },
+        [FREEQ_STAT_MERGE_FAILED]     = { "tables_rejected", "reason", "merge" },
+        [FREEQ_STAT_QUERIES_MEMORY]   = { "queries", "engine", "memory" },
+        [FREEQ_STAT_QUERIES_SQLITE]   = { "queries", "engine", "sqlite" },
+        [FREEQ_STAT_QUERIES_FAILED]   = { "queries_failed", NULL, "" },
+        [FREEQ_STAT_GENERATIONS]      = { "generations_published", NULL, "" },
+};
+
+static const char *hist_names[FREEQ_HIST_COUNT] = {
+        [FREEQ_HIST_HANDSHAKE]  = "tls_handshake_us",
+        [FREEQ_HIST_MERGE_WAIT] = "merge_lock_wait_us",
+        [FREEQ_HIST_MERGE]      = "merge_us",
+        [FREEQ_HIST_QUERY]      = "query_us",
+        [FREEQ_HIST_PUBLISH]    = "publish_us",
+};
+
+static const char *gauge_names[FREEQ_GAUGE_COUNT] = {
+        [FREEQ_GAUGE_CONNECTIONS]       = "connections_open",
+        [FREEQ_GAUGE_WORKERS]           = "workers",
+        [FREEQ_GAUGE_WORKERS_BUSY]      = "workers_busy",
+        [FREEQ_GAUGE_GENERATION_AGE]    = "generation_age_seconds",
+        [FREEQ_GAUGE_GENERATION_TABLES] = "generation_tables",
+        [FREEQ_GAUGE_GENERATION_ROWS]   = "generation_rows",
+};
+
+static GMutex shards_lock;
+static GPtrArray *shards;
+static GPrivate local_shard;
+static int64_t gauges[FREEQ_GAUGE_COUNT];
+
+/* table names with stats of their own, in any shard */
+static GMutex names_lock;
+static GHashTable *names;
+
+static struct shard *shard_get(void)
+{
+        struct shard *s = g_private_get(&local_shard);
+
+        if (s != NULL)
+                return s;
+
+        s = calloc(1, sizeof(struct shard));
+        g_mutex_init(&s->lock);
+        s->tables = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
+
+        g_mutex_lock(&shards_lock);
+        if (shards == NULL)
+                shards = g_ptr_array_new();
+        g_ptr_array_add(shards, s);
+        g_mutex_unlock(&shards_lock);
+
+        g_private_set(&local_shard, s);
+        return s;
+}
+
+static struct table_stat *table_stat(GHashTable *tables, const char *name)
+{
+        struct table_stat *ts = g_hash_table_lookup(tables, name);
+
+        if (ts == NULL)
+        {
+                ts = calloc(1, sizeof(struct table_stat));
+                g_hash_table_insert(tables, g_strdup(name), ts);
+        }
+        return ts;
+}
+
+/* a name first seen once FREEQ_STATS_TABLES_MAX others have been is
+ * counted as FREEQ_STATS_OTHER, so senders making up table names
+ * can't grow the stats without bound */
+static struct table_stat *shard_table_stat(struct shard *s, const char *name)
+{
+        struct table_stat *ts = g_hash_table_lookup(s->tables, name);
+
+        if (ts != NULL)
+                return ts;
+
+        g_mutex_lock(&names_lock);
+        if (names == NULL)
+                names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        if (!g_hash_table_contains(names, name))
+        {
+                if (g_hash_table_size(names) < FREEQ_STATS_TABLES_MAX)
+                        g_hash_table_add(names, g_strdup(name));
+                else
+                        name = FREEQ_STATS_OTHER;
+        }
+        g_mutex_unlock(&names_lock);
+        return table_stat(s->tables, name);
+}
+
+static void hist_add(struct hist *h, gint64 usecs)
+{
+        uint64_t v = usecs > 0 ? (uint64_t)usecs : 0;
+        int b = v ? 64 - __builtin_clzll(v) : 0;
+
+        h->buckets[MIN(b, FREEQ_HIST_BUCKETS - 1)]++;
+        h->count++;
+        h->sum += v;
+        if (v > h->max)
+                h->max = v;
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+        for (int i = 0; i < FREEQ_HIST_BUCKETS; i++)
+                dst->buckets[i] += src->buckets[i];
+        dst->count += src->count;
+        dst->sum += src->sum;
+        if (src->max > dst->max)
+                dst->max = src->max;
+}
+
+/* upper end of the bucket the q quantile falls in, no more than the
+ * largest value seen */
+static uint64_t hist_quantile(const struct hist *h, double q)
+{
+        uint64_t want, seen = 0;
+
+        if (h->count == 0)
+                return 0;
+
+        want = (uint64_t)(q * h->count);
+        if (want < 1)
+                want = 1;
+        for (int i = 0; i < FREEQ_HIST_BUCKETS; i++)
+        {
+                seen += h->buckets[i];
+                if (seen >= want)
+                        return MIN(i ? (UINT64_C(1) << i) - 1 : 0, h->max);
+        }
+        return h->max;
+}
+
+void freeq_stats_count(freeq_stat_t stat, uint64_t n)
+{
+        struct shard *s = shard_get();
+
+        g_mutex_lock(&s->lock);
+        s->counters[stat] += n;
+        g_mutex_unlock(&s->lock);
+}
+
+void freeq_stats_observe(freeq_hist_t hist, gint64 usecs)
+{
+        struct shard *s = shard_get();
+
+        g_mutex_lock(&s->lock);
+        hist_add(&s->hists[hist], usecs);
+        g_mutex_unlock(&s->lock);
+}
+
+void freeq_stats_decoded(const char *table, uint32_t rows, size_t bytes)
+{
+        struct shard *s = shard_get();
+        struct table_stat *ts;
+
+        g_mutex_lock(&s->lock);
+        ts = shard_table_stat(s, table);
+        ts->tables++;
+        ts->rows += rows;
+        ts->bytes += bytes;
+        g_mutex_unlock(&s->lock);
+}
+
+void freeq_stats_published(const char *table, gint64 usecs)
+{
+        struct shard *s = shard_get();
+
+        g_mutex_lock(&s->lock);
+        hist_add(&shard_table_stat(s, table)->publish, usecs);
+        g_mutex_unlock(&s->lock);
+}
+
+void freeq_stats_gauge_set(freeq_gauge_t gauge, int64_t value)
+{
+        __atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+void freeq_stats_gauge_add(freeq_gauge_t gauge, int64_t delta)
+{
+        __atomic_add_fetch(&gauges[gauge], delta, __ATOMIC_RELAXED);
+}
+
+static void snapshot_take(struct snapshot *snap)
+{
+        GHashTableIter iter;
+        gpointer key, val;
+
+        memset(snap, 0, sizeof(struct snapshot));
+        snap->tables = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
+
+        g_mutex_lock(&shards_lock);
+        for (guint i = 0; shards != NULL && i < shards->len; i++)
+        {
+                struct shard *s = g_ptr_array_index(shards, i);
+
+                g_mutex_lock(&s->lock);
+                for (int c = 0; c < FREEQ_STAT_COUNTERS; c++)
+                        snap->counters[c] += s->counters[c];
+                for (int h = 0; h < FREEQ_HIST_COUNT; h++)
+                        hist_merge(&snap->hists[h], &s->hists[h]);
+
+                g_hash_table_iter_init(&iter, s->tables);
+                while (g_hash_table_iter_next(&iter, &key, &val))
+                {
+                        struct table_stat *src = val;
+                        struct table_stat *dst = table_stat(snap->tables, key);
+                        dst->tables += src->tables;
+                        dst->rows += src->rows;
+                        dst->bytes += src->bytes;
+                        hist_merge(&dst->publish, &src->publish);
+                }
+                g_mutex_unlock(&s->lock);
+        }
+        g_mutex_unlock(&shards_lock);
+
+        for (int g = 0; g < FREEQ_GAUGE_COUNT; g++)
+                snap->gauges[g] = __atomic_load_n(&gauges[g], __ATOMIC_RELAXED);
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b)
+{
+        return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* table names in a stable order */
+static GPtrArray *snapshot_names(struct snapshot *snap)
+{
+        GPtrArray *names = g_ptr_array_new();
+        GHashTableIter iter;
+        gpointer key;
+
+        g_hash_table_iter_init(&iter, snap->tables);
+        while (g_hash_table_iter_next(&iter, &key, NULL))
+                g_ptr_array_add(names, key);
+        g_ptr_array_sort(names, compare_names);
+        return names;
+}
+
+static void stats_row(struct freeq_table *t, const char *metric, const char *label,
+                      uint64_t count, const struct hist *h)
+{
+        freeq_table_append_string(t, 0, metric, -1);
+        freeq_table_append_string(t, 1, label, -1);
+        freeq_table_append_number(t, 2, count);
+        freeq_table_append_number(t, 3, h ? h->sum : 0);
+        freeq_table_append_number(t, 4, h ? hist_quantile(h, 0.50) : 0);
+        freeq_table_append_number(t, 5, h ? hist_quantile(h, 0.99) : 0);
+        freeq_table_append_number(t, 6, h ? h->max : 0);
+        freeq_table_end_row(t);
+}
+
+/**
+ * freeq_stats_table:
+ * @ctx: freeq library context
+ * @table: returns the new table
+ *
+ * Add up every thread's statistics into a new freeq_stats table.
+ *
+ * Returns: 0 on success
+ **/
+int freeq_stats_table(struct freeq_ctx *ctx, struct freeq_table **table)
+{
+        freeq_coltype_t coltypes[] = { FREEQ_COL_STRING, FREEQ_COL_STRING,
+                                       FREEQ_COL_NUMBER, FREEQ_COL_NUMBER,
+                                       FREEQ_COL_NUMBER, FREEQ_COL_NUMBER,
+                                       FREEQ_COL_NUMBER };
+        const char *colnames[] = { "metric", "label", "count", "sum", "p50", "p99", "max" };
+        struct snapshot snap;
+        struct freeq_table *t;
+        GPtrArray *names;
+        int err;
+
+        if ((err = freeq_table_new_empty(ctx, "freeq_stats", 7, coltypes, colnames, &t)))
+                return err;
+
+        snapshot_take(&snap);
+
+        for (int c = 0; c < FREEQ_STAT_COUNTERS; c++)
+                stats_row(t, counter_names[c].metric, counter_names[c].label, snap.counters[c], NULL);
+        for (int g = 0; g < FREEQ_GAUGE_COUNT; g++)
+                stats_row(t, gauge_names[g], "", snap.gauges[g], NULL);
+        for (int h = 0; h < FREEQ_HIST_COUNT; h++)
+                stats_row(t, hist_names[h], "", snap.hists[h].count, &snap.hists[h]);
+
+        names = snapshot_names(&snap);
+        for (guint i = 0; i < names->len; i++)
+        {
+                const char *name = g_ptr_array_index(names, i);
+                struct table_stat *ts = g_hash_table_lookup(snap.tables, name);
+
+                if (ts->tables > 0)
+                {
+                        stats_row(t, "tables_decoded", name, ts->tables, NULL);
+                        stats_row(t, "rows_decoded", name, ts->rows, NULL);
+                        stats_row(t, "bytes_decoded", name, ts->bytes, NULL);
+                }
+                if (ts->publish.count > 0)
+                        stats_row(t, "table_publish_us", name, ts->publish.count, &ts->publish);
+        }
+        g_ptr_array_free(names, TRUE);
+        g_hash_table_destroy(snap.tables);
+
+        *table = t;
+        return 0;
+}
+
+/* a label value with \, " and newlines escaped */
+static void text_label(GString *out, const char *key, const char *value)
+{
+        g_string_append_printf(out, "%s=\"", key);
+        for (const char *p = value; *p; p++)
+        {
+                if (*p == '\\' || *p == '"')
+                        g_string_append_c(out, '\\');
+                if (*p == '\n')
+                        g_string_append(out, "\\n");
+                else
+                        g_string_append_c(out, *p);
+        }
+        g_string_append_c(out, '"');
+}
+
+static void text_hist(GString *out, const char *name, const struct hist *h)
+{
+        uint64_t seen = 0;
+
+        g_string_append_printf(out, "# TYPE freeqd_%s histogram\n", name);
+        for (int i = 0; i < FREEQ_HIST_BUCKETS - 1; i++)
+        {
+                seen += h->buckets[i];
+                g_string_append_printf(out, "freeqd_%s_bucket{le=\"%" PRIu64 "\"} %" PRIu64 "\n",
+                                       name, i ? (UINT64_C(1) << i) - 1 : 0, seen);
+        }
+        g_string_append_printf(out, "freeqd_%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, h->count);
+        g_string_append_printf(out, "freeqd_%s_sum %" PRIu64 "\n", name, h->sum);
+        g_string_append_printf(out, "freeqd_%s_count %" PRIu64 "\n", name, h->count);
+}
+
+/**
+ * freeq_stats_text:
+ *
+ * Add up every thread's statistics in the Prometheus text format.
+ * Per table publish times are summaries, the rest of the latencies
+ * histograms with the power of two buckets they are kept in.
+ *
+ * Returns: the text, to be released with g_string_free()
+ **/
+GString *freeq_stats_text(void)
+{
+        static const struct { const char *metric; size_t offset; } table_counters[] = {
+                { "tables_decoded", offsetof(struct table_stat, tables) },
+                { "rows_decoded", offsetof(struct table_stat, rows) },
+                { "bytes_decoded", offsetof(struct table_stat, bytes) },
+        };
+        GString *out = g_string_sized_new(4096);
+        struct snapshot snap;
+        GPtrArray *names;
+        const char *last = NULL;
+
+        snapshot_take(&snap);
+
+        for (int c = 0; c < FREEQ_STAT_COUNTERS; c++)
+        {
+                const struct stat_name *n = &counter_names[c];
+                if (last == NULL || strcmp(last, n->metric) != 0)
+                        g_string_append_printf(out, "# TYPE freeqd_%s_total counter\n", n->metric);
+                last = n->metric;
+                g_string_append_printf(out, "freeqd_%s_total", n->metric);
+                if (n->key != NULL)
+                {
+                        g_string_append_c(out, '{');
+                        text_label(out, n->key, n->label);
+                        g_string_append_c(out, '}');
+                }
+                g_string_append_printf(out, " %" PRIu64 "\n", snap.counters[c]);
+        }
+
+        for (int g = 0; g < FREEQ_GAUGE_COUNT; g++)
+                g_string_append_printf(out, "# TYPE freeqd_%s gauge\nfreeqd_%s %" PRId64 "\n",
+                                       gauge_names[g], gauge_names[g], snap.gauges[g]);
+
+        for (int h = 0; h < FREEQ_HIST_COUNT; h++)
+                text_hist(out, hist_names[h], &snap.hists[h]);
+
+        names = snapshot_names(&snap);
+        for (size_t k = 0; k < G_N_ELEMENTS(table_counters); k++)
+        {
+                g_string_append_printf(out, "# TYPE freeqd_%s_total counter\n", table_counters[k].metric);
+                for (guint i = 0; i < names->len; i++)
+                {
+                        const char *name = g_ptr_array_index(names, i);
+                        struct table_stat *ts = g_hash_table_lookup(snap.tables, name);
+                        if (ts->tables == 0)
+                                continue;
+                        g_string_append_printf(out, "freeqd_%s_total{", table_counters[k].metric);
+                        text_label(out, "table", name);
+                        g_string_append_printf(out, "} %" PRIu64 "\n",
+                                               *(uint64_t *)((char *)ts + table_counters[k].offset));
+                }
+        }
+
+        g_string_append(out, "# TYPE freeqd_table_publish_us summary\n");
+        for (guint i = 0; i < names->len; i++)
+        {
+                const char *name = g_ptr_array_index(names, i);
+                struct table_stat *ts = g_hash_table_lookup(snap.tables, name);
+
+                if (ts->publish.count == 0)
+                        continue;
+                for (int q = 0; q < 2; q++)
+                {
+                        g_string_append(out, "freeqd_table_publish_us{");
+                        text_label(out, "table", name);
+                        g_string_append_printf(out, ",quantile=\"%s\"} %" PRIu64 "\n",
+                                               q ? "0.99" : "0.5",
+                                               hist_quantile(&ts->publish, q ? 0.99 : 0.50));
+                }
+                g_string_append(out, "freeqd_table_publish_us_sum{");
+                text_label(out, "table", name);
+                g_string_append_printf(out, "} %" PRIu64 "\n", ts->publish.sum);
+                g_string_append(out, "freeqd_table_publish_us_count{");
+                text_label(out, "table", name);
+                g_string_append_printf(out, "} %" PRIu64 "\n", ts->publish.count);
+        }
+
+        g_ptr_array_free(names, TRUE);
+        g_hash_table_destroy(snap.tables);
+        return out;
+}
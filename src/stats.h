@@ -0,0 +1,102 @@
+/*
+  freeqd runtime statistics
+
+  Copyright (C) 2011 Someone <someone@example.com>
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _FREEQ_STATS_H_
+#define _FREEQ_STATS_H_
+
+#include <freeq/libfreeq.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * freeq_stats
+ *
+ * counters and latency histograms kept by the threads that do the
+ * work.  each thread updates a shard of its own, under a lock only a
+ * reader ever contends for, and readers add the shards up.  gauges
+ * are few and set rather than counted, they are plain atomics.
+ *
+ * histograms are of microseconds in power of two buckets, bucket i
+ * counting values below 2^i.
+ *
+ * everything counts from the start of the process.  a snapshot comes
+ * either as the freeq_stats table, one row per metric and label:
+ *
+ *   metric, label, count, sum, p50, p99, max
+ *
+ * where a counter or gauge only has count, or as text in the
+ * Prometheus exposition format.
+ *
+ * per table stats are labelled with the first FREEQ_STATS_TABLES_MAX
+ * table names seen, any other table counts as FREEQ_STATS_OTHER.
+ */
+typedef enum {
+        FREEQ_STAT_ACCEPTED_AGG,
+        FREEQ_STAT_ACCEPTED_SQL,
+        FREEQ_STAT_HANDSHAKE_FAILED,
+        FREEQ_STAT_DECODE_FAILED,
+        FREEQ_STAT_MERGE_FAILED,
+        FREEQ_STAT_QUERIES_MEMORY,
+        FREEQ_STAT_QUERIES_SQLITE,
+        FREEQ_STAT_QUERIES_FAILED,
+        FREEQ_STAT_GENERATIONS,
+        FREEQ_STAT_COUNTERS
+} freeq_stat_t;
+
+typedef enum {
+        FREEQ_HIST_HANDSHAKE,
+        FREEQ_HIST_MERGE_WAIT,
+        FREEQ_HIST_MERGE,
+        FREEQ_HIST_QUERY,
+        FREEQ_HIST_PUBLISH,
+        FREEQ_HIST_COUNT
+} freeq_hist_t;
+
+typedef enum {
+        FREEQ_GAUGE_CONNECTIONS,
+        FREEQ_GAUGE_WORKERS,
+        FREEQ_GAUGE_WORKERS_BUSY,
+        FREEQ_GAUGE_GENERATION_AGE,
+        FREEQ_GAUGE_GENERATION_TABLES,
+        FREEQ_GAUGE_GENERATION_ROWS,
+        FREEQ_GAUGE_COUNT
+} freeq_gauge_t;
+
+#define FREEQ_HIST_BUCKETS 32
+#define FREEQ_STATS_TABLES_MAX 256
+#define FREEQ_STATS_OTHER "(other)"
+
+void freeq_stats_count(freeq_stat_t stat, uint64_t n);
+void freeq_stats_observe(freeq_hist_t hist, gint64 usecs);
+void freeq_stats_decoded(const char *table, uint32_t rows, size_t bytes);
+void freeq_stats_published(const char *table, gint64 usecs);
+void freeq_stats_gauge_set(freeq_gauge_t gauge, int64_t value);
+void freeq_stats_gauge_add(freeq_gauge_t gauge, int64_t delta);
+
+int freeq_stats_table(struct freeq_ctx *ctx, struct freeq_table **table);
+GString *freeq_stats_text(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
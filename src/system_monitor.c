@@ -1,3 +1,33 @@
+/*
+ * system_monitor - reports this host's processes and resources to freeq
+ *
+ * takes one sample and sends it, or with -i stays up and sends a
+ * sample every interval over one connection, building each into the
+ * same tables.  a sample is:
+ *
+ *   procnothread2  a row per process, keyed by pid
+ *   cpustat        a row per cpu and one for them all, from /proc/stat
+ *   meminfo        one row, from /proc/meminfo
+ *   diskstats      a row per disk that has done any io
+ *   netdev         a row per network interface
+ *   netsnmp        a row per protocol counter, from /proc/net/snmp
+ *
+ * counters are kept from one sample to the next so the columns are
+ * rates over the interval; a process seen for the first time is
+ * measured from its start, anything else from boot.
+ *
+ * procnothread2 replaces procnothread, whose pcpu was a number and a
+ * lifetime average and which had no rate columns.  the new columns go
+ * under a new name so freeqd doesn't refuse them while older agents
+ * still send procnothread, and sqlite keeps the two apart.
+ *
+ * /proc is read a little at a time: each sample reads every process's
+ * stat, status and io files, its ids are parsed from status only when
+ * the process is new or /proc shows its owner changed.  the files the
+ * other tables come from stay open and are read whole with pread into
+ * buffers that only grow, and parsed where they lie.
+ */
+
 #include <config.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -5,12 +35,18 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdbool.h>
 #include <time.h>
+#include <inttypes.h>
 #include <assert.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
 
 #include "freeq/libfreeq.h"
 #include "libfreeq-private.h"
-#include <proc/readproc.h>
 
 /* control */
 #include "control/stralloc.h"
@@ -18,11 +54,11 @@
 #include "control/control.h"
 #include "control/qsutil.h"
 
-freeq_coltype_t coltypes[] = {
+static freeq_coltype_t coltypes[] = {
         FREEQ_COL_STRING, /* machineip */
         FREEQ_COL_STRING, /* command */
         FREEQ_COL_NUMBER, /* pid */
-        FREEQ_COL_NUMBER, /* pcpu */
+        FREEQ_COL_DOUBLE, /* pcpu */
         FREEQ_COL_NUMBER, /* state */
         FREEQ_COL_NUMBER, /* priority */
         FREEQ_COL_NUMBER, /* nice */
@@ -31,10 +67,16 @@ freeq_coltype_t coltypes[] = {
         FREEQ_COL_NUMBER, /* euid */
         FREEQ_COL_NUMBER, /* egid */
         FREEQ_COL_NUMBER, /* ruid */
-        FREEQ_COL_NUMBER  /* rgid */
+        FREEQ_COL_NUMBER, /* rgid */
+        FREEQ_COL_NUMBER, /* utime_ms */
+        FREEQ_COL_NUMBER, /* stime_ms */
+        FREEQ_COL_NUMBER, /* read_bps */
+        FREEQ_COL_NUMBER, /* write_bps */
+        FREEQ_COL_DOUBLE, /* vcsw_ps */
+        FREEQ_COL_DOUBLE  /* ivcsw_ps */
 };
 
-const char *colnames[] = {
+static const char *colnames[] = {
         "machineip",
         "command",
         "pid",
@@ -47,101 +89,968 @@ const char *colnames[] = {
         "euid",
         "egid",
         "ruid",
-        "rgid"
+        "rgid",
+        "utime_ms",
+        "stime_ms",
+        "read_bps",
+        "write_bps",
+        "vcsw_ps",
+        "ivcsw_ps"
+};
+
+#define NUMCOLS (sizeof(colnames) / sizeof(colnames[0]))
+
+/* what is kept of a process from one sample to the next, pid 0 is
+ * an empty slot */
+struct procinfo {
+        pid_t pid;
+        int64_t starttime;      /* clock ticks after boot, tells a reused pid apart */
+        uid_t owner;            /* of its /proc directory when the ids were read */
+        gid_t group;
+        int64_t euid, egid, ruid, rgid;
+        int64_t utime, stime;   /* clock ticks */
+        int64_t read_bytes, write_bytes;
+        int64_t vcsw, ivcsw;
+};
+
+/*
+ * processes by pid, open addressed with linear probing.  a sample
+ * builds a new table from the previous one rather than deleting the
+ * processes that went, the two swap afterwards and keep their slots.
+ */
+struct pidtable {
+        struct procinfo *slots;
+        uint32_t mask;
+        uint32_t used;
+};
+
+/* the fields of /proc/pid/stat a sample uses */
+struct procstat {
+        const char *comm;
+        int commlen;
+        char state;
+        int64_t utime, stime;
+        int64_t priority, nice;
+        int64_t starttime;
+        int64_t vsize, rss;
+};
+
+/* a file below /proc kept open across samples */
+struct procfile {
+        int fd;
+        char *buf;
+        size_t size;
+};
+
+/* the counters of each row of a table by the row's name, rows
+ * usually come in the same order so a row's index is tried first */
+#define ROWNAME_MAX 48
+#define COUNTERS_MAX 16
+
+struct rowset {
+        int numrows;
+        int cap;
+        char (*names)[ROWNAME_MAX];
+        int64_t *values;
+};
+
+struct counters {
+        int width;
+        struct rowset last, next;
+};
+
+struct monitor;
+struct collector;
+typedef void (*collect_fn)(struct monitor *m, struct collector *c, double now);
+
+/* a table built from one /proc file */
+struct collector {
+        const char *path;
+        struct procfile file;
+        struct counters counters;
+        struct freeq_table *table;
+        collect_fn collect;
+};
+
+#define COLLECTORS 5
+
+struct monitor {
+        struct freeq_ctx *ctx;
+        struct freeq_conn *conn;
+        const char *identity;
+        struct freeq_table *procs;
+        struct pidtable seen, next;
+        struct collector collectors[COLLECTORS];
+        double uptime;          /* seconds after boot of the last sample */
+        DIR *proc;
+        int64_t pagesize;
+        int64_t hz;
+        char stat[1024];
+        char status[8192];
+};
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s [-i seconds] [-s host:port]\n"
+                "  -i seconds      keep running, sampling every interval\n"
+                "  -s host:port    aggregator (" FREEQ_SERVER_DEFAULT ")\n",
+                prog);
+}
+
+/* reads /proc/@path into @buf, nul terminated, and the owner of the
+ * file into @st if given */
+static ssize_t proc_read(struct monitor *m, const char *path, char *buf, size_t size, struct stat *st)
+{
+        ssize_t n;
+        int fd;
+
+        if ((fd = openat(dirfd(m->proc), path, O_RDONLY | O_CLOEXEC)) < 0)
+                return -1;
+        if (st != NULL && fstat(fd, st) < 0)
+        {
+                close(fd);
+                return -1;
+        }
+        n = read(fd, buf, size - 1);
+        close(fd);
+        if (n < 0)
+                return -1;
+        buf[n] = '\0';
+        return n;
+}
+
+/* the command is between the first '(' and the last ')', it may hold
+ * either; the numbered fields follow, state being the third */
+static int parse_stat(char *buf, struct procstat *s)
+{
+        char *lparen = strchr(buf, '('), *rparen = strrchr(buf, ')'), *p;
+        int64_t f[25];
+
+        if (lparen == NULL || rparen == NULL || rparen < lparen ||
+            rparen[1] == '\0' || rparen[2] == '\0')
+                return -1;
+        s->comm = lparen + 1;
+        s->commlen = rparen - lparen - 1;
+        s->state = rparen[2];
+
+        p = rparen + 3;
+        for (int k = 4; k <= 24; k++)
+        {
+                char *end;
+                f[k] = strtoll(p, &end, 10);
+                if (end == p)
+                        return -1;
+                p = end;
+        }
+        s->utime = f[14];
+        s->stime = f[15];
+        s->priority = f[18];
+        s->nice = f[19];
+        s->starttime = f[22];
+        s->vsize = f[23];
+        s->rss = f[24];
+        return 0;
+}
+
+/* the real and effective ids from a Uid: or Gid: line of status */
+static void parse_ids(const char *buf, const char *tag, int64_t *real, int64_t *effective)
+{
+        const char *p = strstr(buf, tag);
+        char *end;
+
+        *real = *effective = -1;
+        if (p == NULL)
+                return;
+        p += strlen(tag);
+        *real = strtoll(p, &end, 10);
+        *effective = strtoll(end, NULL, 10);
+}
+
+/* the number on the line starting with @tag, -1 if there's none */
+static int64_t parse_field(const char *buf, const char *tag)
+{
+        const char *p = strstr(buf, tag);
+
+        if (p == NULL)
+                return -1;
+        return strtoll(p + strlen(tag), NULL, 10);
+}
+
+/* context switches are read every sample, the ids only when @ids */
+static void read_status(struct monitor *m, const char *pid, struct procinfo *p, bool ids,
+                        int64_t *vcsw, int64_t *ivcsw)
+{
+        char path[32];
+
+        *vcsw = *ivcsw = -1;
+        snprintf(path, sizeof(path), "%s/status", pid);
+        if (proc_read(m, path, m->status, sizeof(m->status), NULL) < 0)
+        {
+                if (ids)
+                        p->ruid = p->euid = p->rgid = p->egid = -1;
+                return;
+        }
+        if (ids)
+        {
+                parse_ids(m->status, "\nUid:", &p->ruid, &p->euid);
+                parse_ids(m->status, "\nGid:", &p->rgid, &p->egid);
+        }
+        *vcsw = parse_field(m->status, "\nvoluntary_ctxt_switches:");
+        *ivcsw = parse_field(m->status, "\nnonvoluntary_ctxt_switches:");
+}
+
+/* the bytes that went to and from storage, only readable by the
+ * process's owner and root */
+static void read_io(struct monitor *m, const char *pid, int64_t *rd, int64_t *wr)
+{
+        char path[32];
+
+        *rd = *wr = -1;
+        snprintf(path, sizeof(path), "%s/io", pid);
+        if (proc_read(m, path, m->status, sizeof(m->status), NULL) < 0)
+                return;
+        *rd = parse_field(m->status, "\nread_bytes:");
+        *wr = parse_field(m->status, "\nwrite_bytes:");
+}
+
+/* growth of a counter, 0 if either reading is missing */
+static int64_t counter_delta(int64_t now, int64_t before)
+{
+        if (now < 0 || before < 0 || now < before)
+                return 0;
+        return now - before;
+}
+
+static double rate(int64_t delta, double secs)
+{
+        return secs > 0 ? delta / secs : 0;
+}
+
+static struct procinfo *pidtable_slot(struct pidtable *t, pid_t pid)
+{
+        uint32_t i = ((uint32_t)pid * 2654435761u) & t->mask;
+
+        while (t->slots[i].pid != 0 && t->slots[i].pid != pid)
+                i = (i + 1) & t->mask;
+        return &t->slots[i];
+}
+
+/* empties @t, keeping at most half of it in use for @n processes */
+static void pidtable_reset(struct pidtable *t, uint32_t n)
+{
+        uint32_t size = 256;
+
+        while (size < n * 2)
+                size *= 2;
+        if (t->slots == NULL || size > t->mask + 1)
+        {
+                g_free(t->slots);
+                t->slots = g_new0(struct procinfo, size);
+                t->mask = size - 1;
+        }
+        else
+                memset(t->slots, 0, (t->mask + 1) * sizeof(struct procinfo));
+        t->used = 0;
+}
+
+static void pidtable_grow(struct pidtable *t)
+{
+        struct pidtable n = { 0 };
+
+        pidtable_reset(&n, t->mask + 1);
+        for (uint32_t i = 0; i <= t->mask; i++)
+        {
+                if (t->slots[i].pid == 0)
+                        continue;
+                *pidtable_slot(&n, t->slots[i].pid) = t->slots[i];
+                n.used++;
+        }
+        g_free(t->slots);
+        *t = n;
+}
+
+/* seconds after boot, 0 if /proc/uptime can't be read */
+static double uptime(struct monitor *m)
+{
+        if (proc_read(m, "uptime", m->stat, sizeof(m->stat), NULL) <= 0)
+                return 0;
+        return strtod(m->stat, NULL);
+}
+
+static void sample_procs(struct monitor *m, double now)
+{
+        struct freeq_table *tbl = m->procs;
+        struct pidtable swap;
+        struct dirent *d;
+
+        freeq_table_clear(tbl);
+        pidtable_reset(&m->next, m->seen.used);
+        rewinddir(m->proc);
+
+        /* memory sizes are sent in bytes, the columns are 64 bits
+         * wide so there's no need to scale them down */
+        while ((d = readdir(m->proc)) != NULL)
+        {
+                struct procinfo *p, *last;
+                struct procstat s;
+                struct stat st;
+                char path[32];
+                int64_t vcsw, ivcsw, rd, wr, du, ds;
+                double secs;
+                bool fresh;
+                pid_t pid;
+
+                if (!isdigit((unsigned char)d->d_name[0]))
+                        continue;
+                pid = atoi(d->d_name);
+
+                /* gone since the directory was listed */
+                snprintf(path, sizeof(path), "%s/stat", d->d_name);
+                if (proc_read(m, path, m->stat, sizeof(m->stat), &st) <= 0 ||
+                    parse_stat(m->stat, &s) < 0)
+                        continue;
+
+                /* counters of a process not in the last sample are
+                 * taken from zero at its start */
+                last = pidtable_slot(&m->seen, pid);
+                p = pidtable_slot(&m->next, pid);
+                fresh = last->pid != pid || last->starttime != s.starttime;
+                if (fresh)
+                {
+                        memset(p, 0, sizeof(*p));
+                        p->pid = pid;
+                        p->starttime = s.starttime;
+                        secs = now - (double)s.starttime / m->hz;
+                }
+                else
+                {
+                        *p = *last;
+                        secs = now - m->uptime;
+                }
+                if (now <= 0)
+                        secs = 0;
+                else if (secs < 1.0 / m->hz)
+                        secs = 1.0 / m->hz;
+
+                if (fresh || p->owner != st.st_uid || p->group != st.st_gid)
+                {
+                        p->owner = st.st_uid;
+                        p->group = st.st_gid;
+                        read_status(m, d->d_name, p, true, &vcsw, &ivcsw);
+                }
+                else
+                        read_status(m, d->d_name, p, false, &vcsw, &ivcsw);
+                read_io(m, d->d_name, &rd, &wr);
+
+                du = counter_delta(s.utime, p->utime);
+                ds = counter_delta(s.stime, p->stime);
+
+                freeq_table_append_string(tbl, 0, m->identity, -1);
+                freeq_table_append_string(tbl, 1, s.comm, s.commlen);
+                freeq_table_append_number(tbl, 2, pid);
+                freeq_table_append_double(tbl, 3, rate((du + ds) * 100, secs) / m->hz);
+                freeq_table_append_number(tbl, 4, s.state);
+                freeq_table_append_number(tbl, 5, s.priority);
+                freeq_table_append_number(tbl, 6, s.nice);
+                freeq_table_append_number(tbl, 7, s.rss * m->pagesize);
+                freeq_table_append_number(tbl, 8, s.vsize);
+                freeq_table_append_number(tbl, 9, p->euid);
+                freeq_table_append_number(tbl, 10, p->egid);
+                freeq_table_append_number(tbl, 11, p->ruid);
+                freeq_table_append_number(tbl, 12, p->rgid);
+                freeq_table_append_number(tbl, 13, du * 1000 / m->hz);
+                freeq_table_append_number(tbl, 14, ds * 1000 / m->hz);
+                freeq_table_append_number(tbl, 15, rate(counter_delta(rd, p->read_bytes), secs));
+                freeq_table_append_number(tbl, 16, rate(counter_delta(wr, p->write_bytes), secs));
+                freeq_table_append_double(tbl, 17, rate(counter_delta(vcsw, p->vcsw), secs));
+                freeq_table_append_double(tbl, 18, rate(counter_delta(ivcsw, p->ivcsw), secs));
+                freeq_table_end_row(tbl);
+
+                p->utime = s.utime;
+                p->stime = s.stime;
+                p->read_bytes = rd;
+                p->write_bytes = wr;
+                p->vcsw = vcsw;
+                p->ivcsw = ivcsw;
+                if (++m->next.used * 2 > m->next.mask + 1)
+                        pidtable_grow(&m->next);
+        }
+
+        swap = m->seen;
+        m->seen = m->next;
+        m->next = swap;
+}
+
+/* reads the whole of @f into its buffer, nul terminated, growing the
+ * buffer when the file no longer fits */
+static ssize_t procfile_read(struct procfile *f)
+{
+        size_t len = 0;
+        ssize_t n;
+
+        for (;;)
+        {
+                n = pread(f->fd, f->buf + len, f->size - len - 1, len);
+                if (n < 0)
+                        return -1;
+                if (n == 0)
+                        break;
+                len += n;
+                if (len == f->size - 1)
+                {
+                        f->size *= 2;
+                        f->buf = g_realloc(f->buf, f->size);
+                }
+        }
+        f->buf[len] = '\0';
+        return len;
+}
+
+/* the next line of the buffer at @p, nul terminated in place, or NULL
+ * at the end */
+static char *next_line(char **p)
+{
+        char *line = *p, *nl;
+
+        if (*line == '\0')
+                return NULL;
+        if ((nl = strchr(line, '\n')) != NULL)
+        {
+                *nl = '\0';
+                *p = nl + 1;
+        }
+        else
+                *p = line + strlen(line);
+        return line;
+}
+
+/* the next blank separated word at @p, and its length */
+static const char *next_word(char **p, int *len)
+{
+        char *w = *p, *e;
+
+        while (*w == ' ' || *w == '\t')
+                w++;
+        for (e = w; *e != '\0' && *e != ' ' && *e != '\t'; e++)
+                ;
+        *len = e - w;
+        *p = e;
+        return *len > 0 ? w : NULL;
+}
+
+/* up to @n numbers from @p, the ones missing are 0; returns how many
+ * there were */
+static int parse_numbers(char **p, int64_t *v, int n)
+{
+        int i;
+
+        for (i = 0; i < n; i++)
+        {
+                char *end;
+                v[i] = strtoll(*p, &end, 10);
+                if (end == *p)
+                        break;
+                *p = end;
+        }
+        for (int k = i; k < n; k++)
+                v[k] = 0;
+        return i;
+}
+
+static bool rowset_match(const struct rowset *r, int i, const char *name, int len)
+{
+        return strncmp(r->names[i], name, len) == 0 && r->names[i][len] == '\0';
+}
+
+static const int64_t *rowset_find(const struct rowset *r, int width, int hint, const char *name, int len)
+{
+        if (hint < r->numrows && rowset_match(r, hint, name, len))
+                return &r->values[hint * width];
+        for (int i = 0; i < r->numrows; i++)
+                if (rowset_match(r, i, name, len))
+                        return &r->values[i * width];
+        return NULL;
+}
+
+static void rowset_add(struct rowset *r, int width, const char *name, int len, const int64_t *values)
+{
+        if (r->numrows == r->cap)
+        {
+                r->cap = r->cap ? r->cap * 2 : 16;
+                r->names = g_realloc(r->names, r->cap * sizeof(*r->names));
+                r->values = g_renew(int64_t, r->values, r->cap * width);
+        }
+        len = MIN(len, ROWNAME_MAX - 1);
+        memcpy(r->names[r->numrows], name, len);
+        r->names[r->numrows][len] = '\0';
+        memcpy(&r->values[r->numrows * width], values, width * sizeof(int64_t));
+        r->numrows++;
+}
+
+/* the growth of each of @values since the row called @name was last
+ * seen, returning the seconds it grew over; a row that wasn't in the
+ * last sample counts from boot */
+static double counters_delta(struct counters *c, const char *name, int len,
+                             const int64_t *values, int64_t *delta, double now, double since)
+{
+        const int64_t *last = rowset_find(&c->last, c->width, c->next.numrows, name, len);
+
+        for (int i = 0; i < c->width; i++)
+                delta[i] = counter_delta(values[i], last ? last[i] : 0);
+        rowset_add(&c->next, c->width, name, len, values);
+        return last && since > 0 ? now - since : now;
+}
+
+static void counters_swap(struct counters *c)
+{
+        struct rowset swap = c->last;
+
+        c->last = c->next;
+        c->next = swap;
+        c->next.numrows = 0;
+}
+
+static void counters_free(struct counters *c)
+{
+        g_free(c->last.names);
+        g_free(c->last.values);
+        g_free(c->next.names);
+        g_free(c->next.values);
+}
+
+static freeq_coltype_t cpu_coltypes[] = {
+        FREEQ_COL_STRING, FREEQ_COL_STRING,
+        FREEQ_COL_DOUBLE, FREEQ_COL_DOUBLE, FREEQ_COL_DOUBLE, FREEQ_COL_DOUBLE,
+        FREEQ_COL_DOUBLE, FREEQ_COL_DOUBLE, FREEQ_COL_DOUBLE, FREEQ_COL_DOUBLE
+};
+
+static const char *cpu_colnames[] = {
+        "machineip", "cpu",
+        "user", "nice", "system", "idle", "iowait", "irq", "softirq", "steal"
+};
+
+/* percent of each cpu's time in each state, guest time is already
+ * counted as user time so it's left out */
+static void collect_cpus(struct monitor *m, struct collector *c, double now)
+{
+        struct freeq_table *tbl = c->table;
+        char *p = c->file.buf, *line;
+
+        while ((line = next_line(&p)) != NULL)
+        {
+                int64_t v[8], delta[8], total = 0;
+                const char *name;
+                int len;
+
+                if (strncmp(line, "cpu", 3) != 0)
+                        continue;
+                name = next_word(&line, &len);
+                parse_numbers(&line, v, 8);
+                counters_delta(&c->counters, name, len, v, delta, now, m->uptime);
+                for (int i = 0; i < 8; i++)
+                        total += delta[i];
+
+                freeq_table_append_string(tbl, 0, m->identity, -1);
+                freeq_table_append_string(tbl, 1, name, len);
+                for (int i = 0; i < 8; i++)
+                        freeq_table_append_double(tbl, 2 + i, total > 0 ? delta[i] * 100.0 / total : 0);
+                freeq_table_end_row(tbl);
+        }
+}
+
+/* meminfo fields and their columns, in bytes */
+static const struct {
+        const char *field;
+        const char *column;
+} memfields[] = {
+        { "MemTotal", "mem_total" },
+        { "MemFree", "mem_free" },
+        { "MemAvailable", "mem_available" },
+        { "Buffers", "buffers" },
+        { "Cached", "cached" },
+        { "SwapCached", "swap_cached" },
+        { "Active", "active" },
+        { "Inactive", "inactive" },
+        { "Dirty", "dirty" },
+        { "Writeback", "writeback" },
+        { "AnonPages", "anon_pages" },
+        { "Mapped", "mapped" },
+        { "Shmem", "shmem" },
+        { "Slab", "slab" },
+        { "SReclaimable", "sreclaimable" },
+        { "SwapTotal", "swap_total" },
+        { "SwapFree", "swap_free" },
+        { "Committed_AS", "committed_as" },
+};
+
+#define MEMFIELDS (sizeof(memfields) / sizeof(memfields[0]))
+
+/* fields the kernel doesn't have are -1 */
+static void collect_memory(struct monitor *m, struct collector *c, double now)
+{
+        struct freeq_table *tbl = c->table;
+        char *p = c->file.buf, *line;
+        int64_t v[MEMFIELDS];
+
+        for (size_t i = 0; i < MEMFIELDS; i++)
+                v[i] = -1;
+
+        while ((line = next_line(&p)) != NULL)
+        {
+                char *colon = strchr(line, ':'), *unit;
+                int len;
+
+                if (colon == NULL)
+                        continue;
+                len = colon - line;
+                for (size_t i = 0; i < MEMFIELDS; i++)
+                {
+                        if (strncmp(memfields[i].field, line, len) != 0 || memfields[i].field[len] != '\0')
+                                continue;
+                        v[i] = strtoll(colon + 1, &unit, 10);
+                        if (strstr(unit, "kB") != NULL)
+                                v[i] *= 1024;
+                        break;
+                }
+        }
+
+        freeq_table_append_string(tbl, 0, m->identity, -1);
+        for (size_t i = 0; i < MEMFIELDS; i++)
+                freeq_table_append_number(tbl, 1 + i, v[i]);
+        freeq_table_end_row(tbl);
+}
+
+static freeq_coltype_t disk_coltypes[] = {
+        FREEQ_COL_STRING, FREEQ_COL_STRING,
+        FREEQ_COL_DOUBLE, FREEQ_COL_NUMBER, FREEQ_COL_DOUBLE, FREEQ_COL_NUMBER,
+        FREEQ_COL_DOUBLE, FREEQ_COL_NUMBER
+};
+
+static const char *disk_colnames[] = {
+        "machineip", "device",
+        "reads_ps", "read_bps", "writes_ps", "write_bps",
+        "util", "inflight"
 };
 
-void
-freeproctab(proc_t ** tab)
+/* util is the percent of the interval the disk was busy.  devices
+ * that never did any io, unused loop and ram disks, are left out */
+static void collect_disks(struct monitor *m, struct collector *c, double now)
 {
-        proc_t** p;
-        for(p = tab; *p; p++)
-                freeproc(*p);
-        free(tab);
+        struct freeq_table *tbl = c->table;
+        char *p = c->file.buf, *line;
+
+        while ((line = next_line(&p)) != NULL)
+        {
+                int64_t f[11], v[5], delta[5];
+                const char *name;
+                double secs;
+                int len;
+
+                parse_numbers(&line, f, 2);
+                if ((name = next_word(&line, &len)) == NULL ||
+                    parse_numbers(&line, f, 11) < 11)
+                        continue;
+                if (f[0] == 0 && f[4] == 0)
+                        continue;
+
+                /* reads, sectors read, writes, sectors written, ms
+                 * doing io; sectors are 512 bytes whatever the disk */
+                v[0] = f[0];
+                v[1] = f[2];
+                v[2] = f[4];
+                v[3] = f[6];
+                v[4] = f[9];
+                secs = counters_delta(&c->counters, name, len, v, delta, now, m->uptime);
+
+                freeq_table_append_string(tbl, 0, m->identity, -1);
+                freeq_table_append_string(tbl, 1, name, len);
+                freeq_table_append_double(tbl, 2, rate(delta[0], secs));
+                freeq_table_append_number(tbl, 3, rate(delta[1] * 512, secs));
+                freeq_table_append_double(tbl, 4, rate(delta[2], secs));
+                freeq_table_append_number(tbl, 5, rate(delta[3] * 512, secs));
+                freeq_table_append_double(tbl, 6, MIN(100.0, rate(delta[4], secs) / 10));
+                freeq_table_append_number(tbl, 7, f[8]);
+                freeq_table_end_row(tbl);
+        }
 }
 
-void
-procnothread(struct freeq_ctx *ctx, const char *machineip)
+static freeq_coltype_t net_coltypes[] = {
+        FREEQ_COL_STRING, FREEQ_COL_STRING,
+        FREEQ_COL_NUMBER, FREEQ_COL_DOUBLE, FREEQ_COL_DOUBLE, FREEQ_COL_DOUBLE,
+        FREEQ_COL_NUMBER, FREEQ_COL_DOUBLE, FREEQ_COL_DOUBLE, FREEQ_COL_DOUBLE
+};
+
+static const char *net_colnames[] = {
+        "machineip", "interface",
+        "rx_bps", "rx_pps", "rx_errs_ps", "rx_drop_ps",
+        "tx_bps", "tx_pps", "tx_errs_ps", "tx_drop_ps"
+};
+
+/* two header lines, then the interface name, a colon that may touch
+ * the first number, eight receive and eight transmit counters */
+static void collect_nets(struct monitor *m, struct collector *c, double now)
 {
-        struct freeq_table *tbl;
-        proc_t proc_info;
+        struct freeq_table *tbl = c->table;
+        char *p = c->file.buf, *line;
+
+        while ((line = next_line(&p)) != NULL)
+        {
+                char *colon = strchr(line, ':'), *name = line;
+                int64_t f[16], v[8], delta[8];
+                double secs;
+                int len;
+
+                if (colon == NULL)
+                        continue;
+                while (*name == ' ')
+                        name++;
+                len = colon - name;
+                line = colon + 1;
+                if (parse_numbers(&line, f, 16) < 16)
+                        continue;
+
+                /* bytes, packets, errors and drops each way */
+                for (int i = 0; i < 4; i++)
+                {
+                        v[i] = f[i];
+                        v[4 + i] = f[8 + i];
+                }
+                secs = counters_delta(&c->counters, name, len, v, delta, now, m->uptime);
+
+                freeq_table_append_string(tbl, 0, m->identity, -1);
+                freeq_table_append_string(tbl, 1, name, len);
+                for (int i = 0; i < 8; i++)
+                {
+                        if (i % 4 == 0)
+                                freeq_table_append_number(tbl, 2 + i, rate(delta[i], secs));
+                        else
+                                freeq_table_append_double(tbl, 2 + i, rate(delta[i], secs));
+                }
+                freeq_table_end_row(tbl);
+        }
+}
+
+static freeq_coltype_t snmp_coltypes[] = {
+        FREEQ_COL_STRING, FREEQ_COL_STRING, FREEQ_COL_STRING,
+        FREEQ_COL_NUMBER, FREEQ_COL_DOUBLE
+};
+
+static const char *snmp_colnames[] = {
+        "machineip", "protocol", "counter", "value", "rate_ps"
+};
+
+/* each protocol is a line of counter names followed by a line of
+ * their values, both starting with "Proto:".  a few are gauges, such
+ * as Tcp CurrEstab, their value is what to look at */
+static void collect_snmp(struct monitor *m, struct collector *c, double now)
+{
+        struct freeq_table *tbl = c->table;
+        char *p = c->file.buf, *names, *values;
+
+        while ((names = next_line(&p)) != NULL && (values = next_line(&p)) != NULL)
+        {
+                char *colon = strchr(names, ':');
+                const char *proto = names, *counter;
+                int plen, clen;
+
+                if (colon == NULL || strncmp(names, values, colon - names + 1) != 0)
+                        continue;
+                plen = colon - names;
+                names = colon + 1;
+                values += plen + 1;
+
+                while ((counter = next_word(&names, &clen)) != NULL)
+                {
+                        char key[ROWNAME_MAX];
+                        int64_t v, delta;
+                        double secs;
+                        int klen;
+
+                        if (parse_numbers(&values, &v, 1) < 1)
+                                break;
+                        klen = snprintf(key, sizeof(key), "%.*s.%.*s", plen, proto, clen, counter);
+                        secs = counters_delta(&c->counters, key, MIN(klen, ROWNAME_MAX - 1),
+                                              &v, &delta, now, m->uptime);
+
+                        freeq_table_append_string(tbl, 0, m->identity, -1);
+                        freeq_table_append_string(tbl, 1, proto, plen);
+                        freeq_table_append_string(tbl, 2, counter, clen);
+                        freeq_table_append_number(tbl, 3, v);
+                        freeq_table_append_double(tbl, 4, rate(delta, secs));
+                        freeq_table_end_row(tbl);
+                }
+        }
+}
+
+static int collector_init(struct monitor *m, struct collector *c, const char *name, const char *path,
+                          int numcols, freeq_coltype_t *coltypes, const char **colnames,
+                          int keycol, int width, collect_fn collect)
+{
+        int err;
+
+        memset(c, 0, sizeof(*c));
+        c->path = path;
+        c->collect = collect;
+        c->counters.width = width;
+        if ((c->file.fd = openat(dirfd(m->proc), path, O_RDONLY | O_CLOEXEC)) < 0)
+        {
+                info(m->ctx, "unable to open /proc/%s, not sending %s\n", path, name);
+                return 0;
+        }
+        c->file.size = 16384;
+        c->file.buf = g_malloc(c->file.size);
+
+        err = freeq_table_new_empty(m->ctx, name, numcols, coltypes, colnames, &c->table);
+        if (err < 0)
+        {
+                err(m->ctx, "unable to create table\n");
+                return err;
+        }
+        freeq_table_set_key(c->table, keycol);
+        return 0;
+}
+
+static void collector_free(struct collector *c)
+{
+        if (c->file.fd > 0)
+                close(c->file.fd);
+        g_free(c->file.buf);
+        counters_free(&c->counters);
+        freeq_table_unref(c->table);
+}
+
+static int monitor_init(struct monitor *m, struct freeq_ctx *ctx, const char *identity, const char *server)
+{
+        freeq_coltype_t mem_coltypes[1 + MEMFIELDS];
+        const char *mem_colnames[1 + MEMFIELDS];
         int err;
 
-        GSList *machineips = NULL,
-                *cmds = NULL,
-                *pids = NULL,
-                *pcpu = NULL,
-                *state = NULL,
-                *priority = NULL,
-                *nice = NULL,
-                *rss = NULL,
-                *vsize = NULL,
-                *euid = NULL,
-                *egid = NULL,
-                *ruid = NULL,
-                *rgid = NULL;
-
-        PROCTAB* proc = openproc(PROC_FILLMEM | PROC_FILLSTAT | PROC_FILLSTATUS);
-        memset(&proc_info, 0, sizeof(proc_info));
-
-        while (readproc(proc, &proc_info) != NULL) {
-                cmds        =  g_slist_append(cmds,        strdup(proc_info.cmd));
-                pids        =  g_slist_append(pids,        GINT_TO_POINTER(proc_info.ppid));
-                pcpu        =  g_slist_append(pcpu,        GINT_TO_POINTER(proc_info.pcpu));
-                state       =  g_slist_append(state,       GINT_TO_POINTER(proc_info.state));
-                priority    =  g_slist_append(priority,    GINT_TO_POINTER(proc_info.priority));
-                nice        =  g_slist_append(nice,        GINT_TO_POINTER(proc_info.nice));
-                rss         =  g_slist_append(rss,         GINT_TO_POINTER(proc_info.rss));
-                vsize       =  g_slist_append(vsize,       GINT_TO_POINTER(proc_info.vsize));
-                euid        =  g_slist_append(euid,        GINT_TO_POINTER(proc_info.euid));
-                egid        =  g_slist_append(egid,        GINT_TO_POINTER(proc_info.egid));
-                ruid        =  g_slist_append(ruid,        GINT_TO_POINTER(proc_info.ruid));
-                rgid        =  g_slist_append(rgid,        GINT_TO_POINTER(proc_info.rgid));
-                machineips  =  g_slist_append(machineips,  (char *)machineip);
-        }
-
-        err = freeq_table_new(ctx,
-                              "procnothread",
-                              13,
-                              (freeq_coltype_t *)&coltypes,
-                              (const char **)&colnames,
-                              &tbl,
-                              0,
-                              machineips,
-                              cmds,
-                              pids,
-                              pcpu,
-                              state,
-                              priority,
-                              nice,
-                              rss,
-                              vsize,
-                              euid,
-                              egid,
-                              ruid,
-                              rgid);
+        memset(m, 0, sizeof(*m));
+        m->ctx = ctx;
+        m->identity = identity;
+        m->pagesize = sysconf(_SC_PAGESIZE);
+        m->hz = sysconf(_SC_CLK_TCK);
 
+        if ((m->proc = opendir("/proc")) == NULL)
+        {
+                err(ctx, "unable to open /proc\n");
+                return FREEQ_ERR;
+        }
 
+        err = freeq_table_new_empty(ctx,
+                                    "procnothread2",
+                                    NUMCOLS,
+                                    (freeq_coltype_t *)&coltypes,
+                                    (const char **)&colnames,
+                                    &m->procs);
         if (err < 0)
         {
                 err(ctx, "unable to create table\n");
-                exit(EXIT_FAILURE);
+                return err;
+        }
+        freeq_table_set_key(m->procs, 2);
+
+        mem_coltypes[0] = FREEQ_COL_STRING;
+        mem_colnames[0] = "machineip";
+        for (size_t i = 0; i < MEMFIELDS; i++)
+        {
+                mem_coltypes[1 + i] = FREEQ_COL_NUMBER;
+                mem_colnames[1 + i] = memfields[i].column;
         }
-        //freeq_table_print(ctx, tbl, stdout);
-        err = freeq_table_sendto_ssl(ctx, tbl);
-        dbg(ctx, "freeq_table_sendto_ssl returned %d\n", err);
 
-        freeq_table_unref(tbl);
-        closeproc(proc);
-        freeq_unref(ctx);
+        if ((err = collector_init(m, &m->collectors[0], "cpustat", "stat",
+                                  10, cpu_coltypes, cpu_colnames, 1, 8, collect_cpus)) ||
+            (err = collector_init(m, &m->collectors[1], "meminfo", "meminfo",
+                                  1 + MEMFIELDS, mem_coltypes, mem_colnames, -1, 0, collect_memory)) ||
+            (err = collector_init(m, &m->collectors[2], "diskstats", "diskstats",
+                                  8, disk_coltypes, disk_colnames, 1, 5, collect_disks)) ||
+            (err = collector_init(m, &m->collectors[3], "netdev", "net/dev",
+                                  10, net_coltypes, net_colnames, 1, 8, collect_nets)) ||
+            (err = collector_init(m, &m->collectors[4], "netsnmp", "net/snmp",
+                                  5, snmp_coltypes, snmp_colnames, -1, 1, collect_snmp)))
+                return err;
+
+        pidtable_reset(&m->seen, 0);
+        return freeq_conn_new(ctx, server, &m->conn);
+}
+
+static void monitor_free(struct monitor *m)
+{
+        freeq_conn_free(m->conn);
+        freeq_table_unref(m->procs);
+        for (int i = 0; i < COLLECTORS; i++)
+                collector_free(&m->collectors[i]);
+        g_free(m->seen.slots);
+        g_free(m->next.slots);
+        if (m->proc != NULL)
+                closedir(m->proc);
+}
+
+/* every table goes out even if one fails, the first failure is
+ * returned */
+static int monitor_sample(struct monitor *m)
+{
+        double now = uptime(m);
+        int err, ret;
+
+        sample_procs(m, now);
+        ret = freeq_conn_send(m->conn, m->procs);
+        dbg(m->ctx, "freeq_conn_send returned %d for %u processes\n", ret, m->procs->numrows);
+
+        for (int i = 0; i < COLLECTORS; i++)
+        {
+                struct collector *c = &m->collectors[i];
+
+                if (c->table == NULL)
+                        continue;
+                freeq_table_clear(c->table);
+                if (procfile_read(&c->file) < 0)
+                {
+                        err(m->ctx, "unable to read /proc/%s\n", c->path);
+                        continue;
+                }
+                c->collect(m, c, now);
+                counters_swap(&c->counters);
+
+                err = freeq_conn_send(m->conn, c->table);
+                dbg(m->ctx, "freeq_conn_send returned %d for %s\n", err, c->table->name);
+                if (err && !ret)
+                        ret = err;
+        }
+
+        m->uptime = now;
+        return ret;
 }
 
 int
 main(int argc, char *argv[])
 {
         struct freeq_ctx *ctx;
-        int err;
+        struct monitor m;
+        char *server = NULL;
+        int interval = 0;
+        gint64 next, now, step;
+        int err, o;
         static stralloc identity = {0};
 
+        while ((o = getopt(argc, argv, "i:s:h")) != -1)
+        {
+                switch (o)
+                {
+                case 'i': interval = atoi(optarg); break;
+                case 's': server = optarg; break;
+                default:
+                        usage(argv[0]);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (interval < 0 || optind < argc)
+        {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+
         err = freeq_new(&ctx, "system_monitor", NULL, FREEQ_CLIENT);
         if (err < 0)
                 exit(EXIT_FAILURE);
@@ -157,7 +1066,43 @@ main(int argc, char *argv[])
         freeq_set_identity(ctx, identity.s);
         freeq_set_log_priority(ctx, 10);
 
-        procnothread(ctx, identity.s);
+        if (monitor_init(&m, ctx, identity.s, server))
+                exit(EXIT_FAILURE);
+
+        if (interval == 0)
+        {
+                err = monitor_sample(&m);
+                monitor_free(&m);
+                freeq_unref(ctx);
+                return err ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+
+        /* a dropped connection shows up as a failed send, not a signal.
+         * the first sample is at a random point of the interval so a
+         * fleet started together doesn't report in step */
+        signal(SIGPIPE, SIG_IGN);
+        srand(getpid() ^ time(NULL));
+        step = (gint64)interval * G_USEC_PER_SEC;
+        next = g_get_monotonic_time() + (gint64)(rand() % (interval * 1000)) * 1000;
+
+        for (;;)
+        {
+                now = g_get_monotonic_time();
+                if (next > now)
+                        g_usleep(next - now);
+
+                /* failures are logged, the next sample tries again */
+                monitor_sample(&m);
+
+                next += step;
+                now = g_get_monotonic_time();
+                if (next <= now)
+                {
+                        info(ctx, "sample took longer than the interval, skipping %" PRId64 "\n",
+                             (now - next) / step + 1);
+                        next += ((now - next) / step + 1) * step;
+                }
+        }
 
         return EXIT_SUCCESS;
 }
@@ -3,294 +3,743 @@
 
 #include <freeq/libfreeq.h>
 #include "libfreeq-private.h"
+#include "csv.h"
 
 #include <glib.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <poll.h>
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <assert.h>
 
-#include "freeq/libfreeq.h"
-#include "libfreeq-private.h"
-
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 
-char * trim(char *s) {
-        while (*s == ' ')
-                s++;
-        size_t len = strlen(s);
+/*
+ * input files
+ *
+ *   serial
+ *   table name
+ *   column names
+ *   column types: string, number, time, ipv4_addr, ipv6_addr, double or null
+ *   one row per line after that
+ *
+ * fields are separated by tabs if the column names are, by commas
+ * otherwise, and may be quoted, see csv.h.  blank lines are skipped.
+ *
+ * files in a spool are read through a buffer rather than mapped, a
+ * script truncating them while they are mapped would turn into a
+ * SIGBUS.  every chunk of input the rows are sent as a part of the
+ * table and forgotten, so a file doesn't have to fit in tblsend's
+ * memory, or in one frame.  freeqd does hold the whole
+ * table once it has all the parts, and drops a connection sending
+ * more than it is willing to hold.
+ */
+#define CHUNK_MB_DEFAULT 16
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s [-s host:port] [-d delimiter] [-c megabytes] file...\n"
+                "       %s [-s host:port] [-d delimiter] [-c megabytes] -w directory\n"
+                "  -s host:port    aggregator (" FREEQ_SERVER_DEFAULT ")\n"
+                "  -d delimiter    field separator, by default tab or comma\n"
+                "  -c megabytes    input sent per part of a table (%d)\n"
+                "  -w directory    keep running, sending the files dropped in directory\n",
+                prog, prog, CHUNK_MB_DEFAULT);
+}
 
-        if (len && ((s[len-1] == '\n') || (s[len-1] == '\r'))) {
-                s[len-1] = '\0';
+static int append_field(struct csv_reader *rd, struct freeq_table *tbl, int col, struct csv_field *f)
+{
+        char buf[INET6_ADDRSTRLEN + 64];
+        struct in6_addr a6;
+        uint32_t a4;
+        int64_t nval;
+        double dval;
+        char *end;
+
+        switch (tbl->columns[col].coltype) {
+        case FREEQ_COL_STRING:
+                freeq_table_append_string(tbl, col, f->s, f->len);
+                return 0;
+        case FREEQ_COL_NUMBER:
+        case FREEQ_COL_TIME:
+                csv_trim(f);
+                if (!csv_number(f, &nval))
+                        break;
+                freeq_table_append_number(tbl, col, nval);
+                return 0;
+        case FREEQ_COL_DOUBLE:
+                csv_trim(f);
+                if (!csv_cstr(f, buf, sizeof(buf)))
+                        break;
+                dval = strtod(buf, &end);
+                if (*end != '\0')
+                        break;
+                freeq_table_append_double(tbl, col, dval);
+                return 0;
+        case FREEQ_COL_IPV4ADDR:
+                csv_trim(f);
+                if (!csv_cstr(f, buf, sizeof(buf)) || inet_pton(AF_INET, buf, &a4) != 1)
+                        break;
+                freeq_table_append_ipv4(tbl, col, a4);
+                return 0;
+        case FREEQ_COL_IPV6ADDR:
+                csv_trim(f);
+                if (!csv_cstr(f, buf, sizeof(buf)) || inet_pton(AF_INET6, buf, &a6) != 1)
+                        break;
+                freeq_table_append_ipv6(tbl, col, &a6);
+                return 0;
+        default:
+                return 0;
         }
-        return s;
+
+        err(rd->ctx, "%s:%lu: column %s: can't parse '%.*s'\n", rd->fn, rd->line,
+            tbl->columns[col].name, (int)MIN(f->len, 64), f->s);
+        return -1;
 }
 
-int countcols(FILE *f)
+int readserial(struct csv_reader *rd, int *serial)
 {
-        char *lbuf = NULL;
-        char *p;
-        ssize_t r=0;
-        size_t rn=0;
-        int n = -1;
+        int64_t v;
 
-        if ((r = getline(&lbuf, &rn, f)) > 0)
+        csv_expect(rd, 1);
+        rd->delim = '\n';
+        if (csv_read_fields(rd) != 1)
+                return -1;
+        csv_trim(&rd->fields[0]);
+        if (!csv_number(&rd->fields[0], &v) || v < 0 || v > UINT32_MAX)
+                return -1;
+        *serial = v;
+        return 0;
+}
+
+int readname(struct csv_reader *rd, char **name)
+{
+        csv_expect(rd, 1);
+        rd->delim = '\n';
+        if (csv_read_fields(rd) != 1)
+                return -1;
+        csv_trim(&rd->fields[0]);
+        if (rd->fields[0].len == 0)
+                return -1;
+        *name = g_strndup(rd->fields[0].s, rd->fields[0].len);
+        return 0;
+}
+
+/* the column names decide the separator, unless one was given, and
+ * how many columns the table has */
+int readcolnames(struct csv_reader *rd, char delim, const char *name, struct freeq_table **tbl)
+{
+        const char *rec, *end;
+        int n;
+
+        /* a name can't be found quoted after a tab before the
+         * separator is known, which only matters if it holds a newline */
+        rd->delim = delim ? delim : ',';
+        do {
+                if (csv_next(rd, &rec, &end) != 1)
+                        return -1;
+        } while (rec == end);
+
+        rd->delim = delim ? delim : memchr(rec, '\t', end - rec) ? '\t' : ',';
+        csv_expect(rd, FREEQ_MAX_COLUMNS);
+        if ((n = csv_split(rd, rec, end)) < 0)
+                return -1;
+
+        if (freeq_table_new_fromcols(rd->ctx, name, n, tbl, NULL, true) < 0)
+                return -1;
+        for (int j = 0; j < n; j++)
         {
-                n = 1;
-                p = lbuf;
-                while (*p) n += *(p++) == ',';
+                char *colname;
+                csv_trim(&rd->fields[j]);
+                colname = g_strndup(rd->fields[j].s, rd->fields[j].len);
+                (*tbl)->columns[j].name = freeq_table_strdup(*tbl, colname);
+                g_free(colname);
         }
+        csv_expect(rd, n);
+        return 0;
+}
 
-        fseek(f, -r, SEEK_CUR);
-        free(lbuf);
-        return n;
+freeq_coltype_t coltype_from_str(const char *tok, size_t len)
+{
+        static const struct {
+                const char *name;
+                freeq_coltype_t coltype;
+        } types[] = {
+                { "null", FREEQ_COL_NULL },
+                { "string", FREEQ_COL_STRING },
+                { "number", FREEQ_COL_NUMBER },
+                { "time", FREEQ_COL_TIME },
+                { "ipv4_addr", FREEQ_COL_IPV4ADDR },
+                { "ipv6_addr", FREEQ_COL_IPV6ADDR },
+                { "double", FREEQ_COL_DOUBLE },
+        };
+
+        for (size_t i = 0; i < G_N_ELEMENTS(types); i++)
+                if (strlen(types[i].name) == len && strncasecmp(tok, types[i].name, len) == 0)
+                        return types[i].coltype;
+        return -1;
 }
 
-int readserial(FILE *f, int *serial)
+int readcoltypes(struct csv_reader *rd, struct freeq_table *tbl)
 {
-        size_t r = 0;
-        char *lbuf = NULL;
-        int res = 0;
+        if (csv_read_fields(rd) != (int)tbl->numcols)
+        {
+                err(rd->ctx, "%s:%lu: expected %u column types\n", rd->fn, rd->line, tbl->numcols);
+                return -1;
+        }
 
-        if (getline(&lbuf, &r, f))
+        for (uint32_t j = 0; j < tbl->numcols; j++)
         {
-                if (sscanf(trim(lbuf), "%d", serial) != 1)
-                        res = -1;
-        } else {
-                res = -1;
+                csv_trim(&rd->fields[j]);
+                tbl->columns[j].coltype = coltype_from_str(rd->fields[j].s, rd->fields[j].len);
+                if (tbl->columns[j].coltype == 255)
+                {
+                        err(rd->ctx, "%s:%lu: unknown column type '%.*s'\n", rd->fn, rd->line,
+                            (int)rd->fields[j].len, rd->fields[j].s);
+                        return -1;
+                }
         }
-        free(lbuf);
-        return res;
+        return 0;
 }
 
-int readname(FILE *f, char **name)
+/* parses the rows straight into the column builders.  every @chunk
+ * bytes of input the table so far goes as a part and is cleared.
+ * returns FREEQ_ERR if the server didn't get the table, FREEQ_REFUSED
+ * if it got the table but couldn't take it and -EINVAL if the file
+ * can't be read as one */
+int readcoldata(struct csv_reader *rd, struct freeq_conn *conn, struct freeq_table *tbl, size_t chunk)
 {
-        size_t n = 0;
-        ssize_t r = 0;
-        char *lbuf = NULL;
+        size_t start = rd->offset + rd->pos;
+        int n;
 
-        int res = 0;
-        if ((r = getline(&lbuf, &n, f)) > 0)
+        while ((n = csv_read_fields(rd)) > 0)
         {
-                *name = strdup(trim(lbuf));
-        } else {
-                res = -1;
+                for (int j = 0; j < (int)tbl->numcols; j++)
+                {
+                        struct csv_field none = { NULL, 0 };
+                        if (append_field(rd, tbl, j, j < n ? &rd->fields[j] : &none))
+                                return -EINVAL;
+                }
+                freeq_table_end_row(tbl);
+                if (rd->offset + rd->pos - start < chunk)
+                        continue;
+
+                dbg(rd->ctx, "sending %u rows of %s, up to line %lu\n", tbl->numrows, tbl->name, rd->line);
+                if (freeq_conn_send_more(conn, tbl))
+                        return FREEQ_ERR;
+                freeq_table_clear(tbl);
+                csv_release(rd);
+                start = rd->offset + rd->pos;
         }
-        return res;
-}
+        if (n < 0)
+                return -EINVAL;
 
+        if ((n = freeq_conn_send(conn, tbl)) == FREEQ_REFUSED)
+                return n;
+        return n ? FREEQ_ERR : 0;
+}
 
-int readcolnames(FILE *f, struct freeq_table *tbl)
+/* opens @fn, mapping it if @map, and reads its header into a new
+ * table for the rows to go in.  returns -ENOENT if the file has gone
+ * and -EINVAL if it doesn't start like a table */
+int tbl_open(struct freeq_ctx *ctx, struct csv_reader *rd, const char *fn, char delim, bool map,
+             struct freeq_table **tbl)
 {
-        char *lbuf = NULL;
-        char *p = NULL;
-        size_t r = 0;
-        ssize_t n = 0;
+        int serial;
+        char *tblname = NULL;
+        int err;
 
-        n = getline(&lbuf, &r, f);
-        if (n < 1)
-                return -1;
+        if ((err = csv_open(rd, ctx, fn, map)))
+                return err;
 
-        p = lbuf;
-        for (int j = 0; j < tbl->numcols; j++)
-                tbl->columns[j].name = strdup(trim(strtok(j == 0 ? p : NULL, ",")));
+        err = -EINVAL;
+        if (readserial(rd, &serial)) {
+                err(ctx, "%s: invalid serial\n", fn);
+                goto fail;
+        }
+        dbg(ctx, "serial is %d\n", serial);
 
-        free(lbuf);
+        if (readname(rd, &tblname)) {
+                err(ctx, "%s: invalid table name\n", fn);
+                goto fail;
+        }
+        dbg(ctx, "name is %s\n", tblname);
+
+        if (readcolnames(rd, delim, tblname, tbl) != 0) {
+                err(ctx, "%s: invalid column names\n", fn);
+                goto fail;
+        }
+        (*tbl)->serial = serial;
+        g_free(tblname);
+        dbg(ctx, "%u columns\n", (*tbl)->numcols);
+
+        if (readcoltypes(rd, *tbl) != 0)
+        {
+                freeq_table_unref(*tbl);
+                csv_close(rd);
+                return -EINVAL;
+        }
         return 0;
+
+fail:
+        g_free(tblname);
+        csv_close(rd);
+        return err;
 }
 
-int readcoldata(FILE *f, struct freeq_table *tbl)
+int pubtbl(struct freeq_ctx *ctx, struct freeq_conn *conn, const char *fn, char delim, size_t chunk)
 {
-        size_t r;
-        char *tok;
-        char *lbuf = NULL;
-        bool err;
-        uint64_t nval;
-
-        GSList **coldata = calloc(sizeof(GSList *), tbl->numcols);
-        if (coldata == NULL)
-        {
-                dbg(tbl->ctx, "unable to allocate coldata lists\n");
-                return -ENOMEM;
-        }
+        struct csv_reader rd;
+        struct freeq_table *tbl;
+        int err;
+
+        freeq_set_identity(ctx, fn);
+        if ((err = tbl_open(ctx, &rd, fn, delim, true, &tbl)))
+                return err;
+
+        if ((err = readcoldata(&rd, conn, tbl, chunk)) == 0)
+                info(ctx, "sent %s from %s\n", tbl->name, fn);
+
+        freeq_table_unref(tbl);
+        csv_close(&rd);
+        return err;
+}
+
+/*
+ * spool mode
+ *
+ * scripts drop tables into a directory and carry on, tblsend sends
+ * them over one connection and deletes each file once the server has
+ * merged it.  files are picked up when they are closed after writing
+ * or moved in, names starting with a dot are left alone so a file can
+ * be written under one and renamed into place.
+ *
+ * while the server is slow or away files pile up.  of the files for
+ * one table only the one with the highest serial, the newest of those
+ * if several share it, is worth sending, the rest are deleted unsent.
+ * so is a file arriving late with a serial no higher than the one
+ * last sent for its table.
+ *
+ * a file that can't be read as a table is renamed to end in .bad.  so
+ * is a file the server has refused SPOOL_REFUSALS_MAX times, it is
+ * tried again after SPOOL_RETRY_MS, twice that after the next
+ * refusal and so on, in case the server's mind changes.
+ */
+#define SPOOL_RETRY_MS 1000
+#define SPOOL_REFUSALS_MAX 5
+
+struct spool {
+        struct freeq_ctx *ctx;
+        struct freeq_conn *conn;
+        const char *server;
+        char delim;
+        size_t chunk;
+        int fd;                 /* inotify */
+        GHashTable *pending;    /* names of files not sent yet */
+        GHashTable *sent;       /* table name to the serial last sent */
+        GHashTable *refused;    /* file name to struct refusal */
+};
+
+struct refusal {
+        int count;
+        gint64 retry;           /* not before, monotonic */
+};
+
+struct spoolfile {
+        char *fn;
+        char *table;
+        uint32_t serial;
+        struct timespec mtime;
+};
+
+static bool spool_ignored(const char *fn)
+{
+        return fn[0] == '.' || g_str_has_suffix(fn, ".bad");
+}
+
+/* a file written again is a new table, whatever was refused before */
+static void spool_add(struct spool *sp, const char *fn)
+{
+        if (spool_ignored(fn))
+                return;
+        g_hash_table_add(sp->pending, g_strdup(fn));
+        g_hash_table_remove(sp->refused, fn);
+}
+
+static void spool_scan(struct spool *sp)
+{
+        struct dirent *de;
+        DIR *d;
 
-        while (getline(&lbuf, &r, f) > 0 && !err)
+        if ((d = opendir(".")) == NULL)
         {
-                for (int j = 0; j < tbl->numcols; j++)
-                {
-                        tok = strtok(j == 0 ? lbuf : NULL, ",");
-                        switch (tbl->columns[j].coltype) {
-                        case FREEQ_COL_STRING:
-                                coldata[j] = g_slist_prepend(coldata[j], strdup(tok));
-                                break;
-                        case FREEQ_COL_NUMBER:
-                                if (sscanf(tok, "%lu", &nval) != 1)
-                                        err = 1;
-                                else
-                                        coldata[j] = g_slist_prepend(coldata[j], GUINT_TO_POINTER(nval));
-                                break;
-                        default:
-                                break;
-                        }
-                }
-                tbl->numrows++;
+                err(sp->ctx, "unable to read the spool directory: %s\n", strerror(errno));
+                return;
         }
+        while ((de = readdir(d)) != NULL)
+                if (de->d_type == DT_REG || de->d_type == DT_UNKNOWN)
+                        spool_add(sp, de->d_name);
+        closedir(d);
+}
 
-        if (err)
+/* takes in what inotify has queued, without waiting for more */
+static void spool_events(struct spool *sp)
+{
+        char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        const struct inotify_event *ev;
+        ssize_t n;
+
+        while ((n = read(sp->fd, buf, sizeof(buf))) > 0)
         {
-                for (int j = 0; j < tbl->numcols; j++)
+                for (char *p = buf; p < buf + n; p += sizeof(*ev) + ev->len)
                 {
-                        if (coldata[j] != NULL)
-                                g_slist_free_full(coldata[j], g_free);
-                        return -1;
+                        ev = (const struct inotify_event *)p;
+                        if (ev->mask & IN_Q_OVERFLOW)
+                                spool_scan(sp);
+                        else if (ev->len > 0 && !(ev->mask & IN_ISDIR))
+                                spool_add(sp, ev->name);
                 }
-        } else {
-                for (int j = 0; j < tbl->numcols; j++)
-                        tbl->columns[j].data = g_slist_reverse(coldata[j]);
         }
+}
 
-        free(lbuf);
-        return 0;
+static void spoolfile_free(struct spoolfile *f)
+{
+        g_free(f->fn);
+        g_free(f->table);
+        g_free(f);
 }
 
-freeq_coltype_t coltype_from_str(const char *tok)
+static void spool_done(struct spool *sp, const char *fn)
 {
-        if (strcasecmp(tok, "null") == 0)
-                return FREEQ_COL_NULL;
-        else if (strcasecmp(tok, "string") == 0)
-                return FREEQ_COL_STRING;
-        else if (strcasecmp(tok, "number") == 0)
-                return FREEQ_COL_NUMBER;
-        else if (strcasecmp(tok, "time") == 0)
-                return FREEQ_COL_TIME;
-        else if (strcasecmp(tok, "ipv4_addr") == 0)
-                return FREEQ_COL_IPV4ADDR;
-        else if (strcasecmp(tok, "ipv6_addr") == 0)
-                return FREEQ_COL_IPV6ADDR;
-        else
-                return -1;
+        g_hash_table_remove(sp->pending, fn);
+        g_hash_table_remove(sp->refused, fn);
 }
 
-int readcoltypes(FILE *f, struct freeq_table *tbl)
+static void spool_reject(struct spool *sp, const char *fn, const char *why)
 {
-        size_t r;
-        char *lbuf = NULL;
-        char *tok;
+        char *bad = g_strconcat(fn, ".bad", NULL);
+
+        err(sp->ctx, "%s %s, renaming it to %s\n", fn, why, bad);
+        /* rather than trying it again forever */
+        if (rename(fn, bad) != 0 && errno != ENOENT)
+                unlink(fn);
+        g_free(bad);
+        spool_done(sp, fn);
+}
 
-        if (getline(&lbuf, &r, f) < 1)
-                return -1;
+/* the header of a pending file, NULL if there is nothing to send */
+static struct spoolfile *spool_header(struct spool *sp, const char *fn)
+{
+        struct spoolfile *f;
+        struct freeq_table *tbl;
+        struct csv_reader rd;
+        int err;
 
-        for (int j = 0; j < tbl->numcols; j++)
+        if ((err = tbl_open(sp->ctx, &rd, fn, sp->delim, false, &tbl)))
         {
-                tok = trim(strtok(j == 0 ? lbuf : NULL, ","));
-
-                tbl->columns[j].coltype = coltype_from_str(tok);
-                if (tbl->columns[j].coltype == 255)
-                        return -1;
+                if (err == -EINVAL)
+                        spool_reject(sp, fn, "isn't a table");
+                else
+                        spool_done(sp, fn);
+                return NULL;
         }
 
-        if ((tok = strtok(NULL, ",")) != NULL)
-                fprintf(stderr, "too many columns, tok %s\n", tok);
+        f = g_new0(struct spoolfile, 1);
+        f->fn = g_strdup(fn);
+        f->table = g_strdup(tbl->name);
+        f->serial = tbl->serial;
+        f->mtime = rd.st.st_mtim;
+        freeq_table_unref(tbl);
+        csv_close(&rd);
+        return f;
+}
+
+static bool spoolfile_newer(const struct spoolfile *a, const struct spoolfile *b)
+{
+        if (a->serial != b->serial)
+                return a->serial > b->serial;
+        if (a->mtime.tv_sec != b->mtime.tv_sec)
+                return a->mtime.tv_sec > b->mtime.tv_sec;
+        return a->mtime.tv_nsec >= b->mtime.tv_nsec;
+}
 
-        free(lbuf);
-        return 0;
+static gint spoolfile_cmp(gconstpointer a, gconstpointer b)
+{
+        const struct spoolfile *fa = *(struct spoolfile * const *)a;
+        const struct spoolfile *fb = *(struct spoolfile * const *)b;
+
+        if (fa->mtime.tv_sec != fb->mtime.tv_sec)
+                return fa->mtime.tv_sec < fb->mtime.tv_sec ? -1 : 1;
+        if (fa->mtime.tv_nsec != fb->mtime.tv_nsec)
+                return fa->mtime.tv_nsec < fb->mtime.tv_nsec ? -1 : 1;
+        return strcmp(fa->fn, fb->fn);
 }
 
-void pubtbl(const char *fn)
+/* sends one file, which is deleted once the server has merged it
+ * unless it has been replaced in the meantime.  returns FREEQ_ERR if
+ * the server couldn't be reached and FREEQ_REFUSED if it didn't take
+ * the table */
+static int spool_send(struct spool *sp, struct spoolfile *f)
 {
-        struct freeq_ctx *ctx;
         struct freeq_table *tbl;
-        int numcols=1;
-        int serial;
-        char *tblname;
+        struct csv_reader rd;
+        struct stat st;
         int err;
-        GStringChunk *strchnk;
 
-        err = freeq_new(&ctx, "system_monitor", "tblsend", FREEQ_CLIENT);
-        if (err < 0)
-                exit(EXIT_FAILURE);
+        if ((err = tbl_open(sp->ctx, &rd, f->fn, sp->delim, false, &tbl)))
+        {
+                if (err == -EINVAL)
+                        spool_reject(sp, f->fn, "isn't a table");
+                else
+                        spool_done(sp, f->fn);
+                return 0;
+        }
 
-        freeq_set_identity(ctx, fn);
-        freeq_set_log_priority(ctx, 10);
+        err = readcoldata(&rd, sp->conn, tbl, sp->chunk);
+        if (err == 0)
+        {
+                info(sp->ctx, "sent %s serial %u from %s\n", f->table, f->serial, f->fn);
+                g_hash_table_replace(sp->sent, g_strdup(f->table), GUINT_TO_POINTER(f->serial));
+                if (stat(f->fn, &st) == 0 && st.st_ino == rd.st.st_ino && st.st_dev == rd.st.st_dev)
+                {
+                        unlink(f->fn);
+                        spool_done(sp, f->fn);
+                }
+        }
+        else if (err == -EINVAL)
+        {
+                /* the server may hold some of its parts */
+                spool_reject(sp, f->fn, "isn't a table");
+                freeq_conn_free(sp->conn);
+                freeq_conn_new(sp->ctx, sp->server, &sp->conn);
+                err = 0;
+        }
 
-        dbg(ctx, "created context, opening file %s\n", fn);
-        FILE *f = fopen(fn, "r");
-        if (f == NULL)
-                exit(EXIT_FAILURE);
+        freeq_table_unref(tbl);
+        csv_close(&rd);
+        return err;
+}
 
-        dbg(ctx, "reading serial\n");
-        if (readserial(f, &serial)) {
-                err(ctx, "invalid serial\n");
-                exit(EXIT_FAILURE);
+/* counts a refusal of @f, which is given up on after the last one */
+static void spool_refused(struct spool *sp, struct spoolfile *f)
+{
+        struct refusal *r = g_hash_table_lookup(sp->refused, f->fn);
+
+        if (r == NULL)
+        {
+                r = g_new0(struct refusal, 1);
+                g_hash_table_insert(sp->refused, g_strdup(f->fn), r);
         }
+        if (++r->count >= SPOOL_REFUSALS_MAX)
+        {
+                spool_reject(sp, f->fn, "was refused too often");
+                return;
+        }
+        r->retry = g_get_monotonic_time() + ((gint64)SPOOL_RETRY_MS << (r->count - 1)) * 1000;
+        info(sp->ctx, "%s was refused, trying it again in %dms\n", f->fn, SPOOL_RETRY_MS << (r->count - 1));
+}
 
-        dbg(ctx, "serial is %d\n", serial);
-        if (readname(f, &tblname))
-                exit(EXIT_FAILURE);
-        dbg(ctx, "name is %s\n", tblname);
+/* sends the newest file of each table, oldest first, and drops the
+ * files it supersedes.  a refused file doesn't hold up the others.
+ * returns FREEQ_ERR if files are left over */
+static int spool_flush(struct spool *sp)
+{
+        GHashTable *latest = g_hash_table_new(g_str_hash, g_str_equal);
+        GPtrArray *files = g_ptr_array_new_with_free_func((GDestroyNotify)spoolfile_free);
+        GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+        struct spoolfile *f, *prev, *stale;
+        struct refusal *r;
+        GHashTableIter it;
+        gpointer fn, serial;
+        bool refused = false;
+        int err = 0;
+
+        /* reading the headers can take files off the pending set */
+        g_hash_table_iter_init(&it, sp->pending);
+        while (g_hash_table_iter_next(&it, &fn, NULL))
+                g_ptr_array_add(names, g_strdup(fn));
+
+        for (guint i = 0; i < names->len; i++)
+        {
+                if ((f = spool_header(sp, g_ptr_array_index(names, i))) == NULL)
+                        continue;
+                prev = g_hash_table_lookup(latest, f->table);
+                if (g_hash_table_lookup_extended(sp->sent, f->table, NULL, &serial) &&
+                    f->serial <= GPOINTER_TO_UINT(serial))
+                        stale = f;
+                else if (prev != NULL && spoolfile_newer(prev, f))
+                        stale = f;
+                else
+                {
+                        g_hash_table_replace(latest, f->table, f);
+                        stale = prev;
+                }
+                if (stale == NULL)
+                        continue;
 
-        numcols = countcols(f);
-        dbg(ctx, "%d columns\n", numcols);
+                info(sp->ctx, "dropping %s, %s serial %u is stale\n", stale->fn, stale->table, stale->serial);
+                unlink(stale->fn);
+                spool_done(sp, stale->fn);
+                spoolfile_free(stale);
+        }
 
-        strchnk = g_string_chunk_new(64);
-        err = freeq_table_new_fromcols(ctx,
-                                       tblname,
-                                       numcols,
-                                       &tbl,
-                                       strchnk,
-                                       true);
-        if (err < 0)
-                exit(EXIT_FAILURE);
+        g_hash_table_iter_init(&it, latest);
+        while (g_hash_table_iter_next(&it, NULL, (gpointer *)&f))
+                g_ptr_array_add(files, f);
+        g_ptr_array_sort(files, spoolfile_cmp);
+        for (guint i = 0; i < files->len && err == 0; i++)
+        {
+                f = g_ptr_array_index(files, i);
+                if ((r = g_hash_table_lookup(sp->refused, f->fn)) != NULL &&
+                    g_get_monotonic_time() < r->retry)
+                {
+                        refused = true;
+                        continue;
+                }
+                if ((err = spool_send(sp, f)) == FREEQ_REFUSED)
+                {
+                        spool_refused(sp, f);
+                        refused = true;
+                        err = 0;
+                }
+        }
 
-        tbl->serial = serial;
-        dbg(ctx, "allocated table, serial %d\n", serial);
-        if (readcolnames(f, tbl) != 0)
-                exit(EXIT_FAILURE);
+        g_hash_table_destroy(latest);
+        g_ptr_array_free(files, TRUE);
+        g_ptr_array_free(names, TRUE);
+        return err || refused ? FREEQ_ERR : 0;
+}
 
-        dbg(ctx, "got column names\n");
-        if (readcoltypes(f, tbl) != 0)
-                exit(EXIT_FAILURE);
+static int spool_run(struct spool *sp, const char *dir)
+{
+        struct pollfd pfd;
+        int err;
 
-        dbg(ctx, "got column types\n");
+        if (chdir(dir) != 0)
+        {
+                err(sp->ctx, "unable to use %s as the spool: %s\n", dir, strerror(errno));
+                return -1;
+        }
+        if ((sp->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 ||
+            inotify_add_watch(sp->fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        {
+                err(sp->ctx, "unable to watch %s: %s\n", dir, strerror(errno));
+                return -1;
+        }
+        sp->pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        sp->sent = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        sp->refused = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+        /* files dropped while nobody was watching */
+        spool_scan(sp);
+
+        /* what arrives while a batch is being sent makes the next one.
+         * files the server didn't take are tried again every so often,
+         * the connection backs off on its own while it is away */
+        pfd.fd = sp->fd;
+        pfd.events = POLLIN;
+        for (;;)
+        {
+                err = g_hash_table_size(sp->pending) > 0 ? spool_flush(sp) : 0;
+                if (poll(&pfd, 1, err ? SPOOL_RETRY_MS : -1) < 0 && errno != EINTR)
+                {
+                        err(sp->ctx, "poll: %s\n", strerror(errno));
+                        return -1;
+                }
+                spool_events(sp);
+        }
+}
 
-        if (readcoldata(f, tbl) != 0)
+int
+main (int argc, char *argv[])
+{
+        struct freeq_ctx *ctx;
+        struct freeq_conn *conn;
+        struct spool sp;
+        const char *server = NULL;
+        const char *spooldir = NULL;
+        static char hostname[256];
+        char delim = 0;
+        int chunkmb = CHUNK_MB_DEFAULT;
+        int failed = 0;
+        int err, o;
+
+        while ((o = getopt(argc, argv, "s:d:c:w:h")) != -1)
+        {
+                switch (o)
+                {
+                case 's': server = optarg; break;
+                case 'd': delim = strcmp(optarg, "\\t") == 0 ? '\t' : optarg[0]; break;
+                case 'c': chunkmb = atoi(optarg); break;
+                case 'w': spooldir = optarg; break;
+                default:
+                        usage(argv[0]);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        /* a part has to fit a frame, and a column of one digit
+         * numbers takes up four times the input they came from */
+        if ((optind == argc) == (spooldir == NULL) ||
+            chunkmb < 1 || chunkmb > FREEQ_FRAME_MAX / (1024 * 1024) / 8 ||
+            delim == '"' || delim == '\n' || delim == '\r')
         {
-                freeq_table_unref(tbl);
+                usage(argv[0]);
                 exit(EXIT_FAILURE);
         }
 
-        //freeq_table_print(ctx, tbl, stdout);
+        err = freeq_new(&ctx, "system_monitor", "tblsend", FREEQ_CLIENT);
+        if (err < 0)
+                exit(EXIT_FAILURE);
+        freeq_set_log_priority(ctx, 10);
 
-        freeq_table_sendto_ssl(ctx, tbl);
+        if (freeq_conn_new(ctx, server, &conn))
+                exit(EXIT_FAILURE);
 
-        /* BIO *out, *in; */
-        /* out = BIO_new_file("poop2.txt", "w"); */
-        /* freeq_table_bio_write(ctx, tbl, out); */
-        /* BIO_free(out); */
+        /* a dropped connection shows up as a failed send */
+        signal(SIGPIPE, SIG_IGN);
 
-        /* in = BIO_new_file("poop2.txt", "r"); */
-        /* freeq_table_bio_read(ctx, &t2, in, NULL); */
-        /* BIO_free(in); */
+        /* the tables in a spool are this host's, a newer one replaces
+         * what it sent before whatever file it came in */
+        if (spooldir != NULL)
+        {
+                if (gethostname(hostname, sizeof(hostname) - 1) == 0)
+                        freeq_set_identity(ctx, hostname);
+                memset(&sp, 0, sizeof(sp));
+                sp.ctx = ctx;
+                sp.conn = conn;
+                sp.server = server;
+                sp.delim = delim;
+                sp.chunk = (size_t)chunkmb * 1024 * 1024;
+                spool_run(&sp, spooldir);
+                exit(EXIT_FAILURE);
+        }
 
-        /* freeq_table_print(ctx, t2, stdout); */
+        /* a file that fails partway may leave parts of its table
+         * with the server, the next file starts on a new connection */
+        for (int i = optind; i < argc; i++)
+        {
+                if (pubtbl(ctx, conn, argv[i], delim, (size_t)chunkmb * 1024 * 1024) == 0)
+                        continue;
+                failed++;
+                freeq_conn_free(conn);
+                if (freeq_conn_new(ctx, server, &conn))
+                        exit(EXIT_FAILURE);
+        }
 
-        freeq_table_unref(tbl);
-        //freeq_table_unref(t2);
+        freeq_conn_free(conn);
         freeq_unref(ctx);
-}
-
-int
-main (int argc, char *argv[])
-{
-  //const char *node_name = _("unknown");
-        const char *fn = "foo";
-  pubtbl(fn);
-  return EXIT_SUCCESS;
-
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,352 @@
+/*
+ * bench_table - microbenchmarks for table construction and the wire codec
+ *
+ * builds synthetic tables for a matrix of row counts, column mixes and
+ * string cardinalities, and times the table and frame calls on each.
+ * one tab separated line is printed per measurement, after a header:
+ *
+ *   case  op  codec  rows  iters  ns_per_row  bytes_per_row
+ *
+ * so two runs can be joined on case/op/codec to spot regressions.
+ * varint lines are per value rather than per row.  the frame codec is
+ * whatever the context picks up from FREEQ_COMPRESS.
+ *
+ * usage: bench_table [-t seconds] [case-substring]
+ */
+
+#include <config.h>
+#include "src/freeq/libfreeq.h"
+#include "src/libfreeq-private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+
+struct mix {
+	const char *name;
+	int numcols;
+	freeq_coltype_t coltypes[4];
+	const char *colnames[4];
+};
+
+static const struct mix mixes[] = {
+	{ "num", 4,
+	  { FREEQ_COL_NUMBER, FREEQ_COL_NUMBER, FREEQ_COL_NUMBER, FREEQ_COL_TIME },
+	  { "pid", "rss", "vsize", "ts" } },
+	{ "str", 4,
+	  { FREEQ_COL_STRING, FREEQ_COL_STRING, FREEQ_COL_STRING, FREEQ_COL_STRING },
+	  { "cmd", "user", "state", "tty" } },
+	{ "mixed", 4,
+	  { FREEQ_COL_NUMBER, FREEQ_COL_STRING, FREEQ_COL_IPV4ADDR, FREEQ_COL_TIME },
+	  { "pid", "cmd", "addr", "ts" } },
+};
+
+static const int rowcounts[] = { 100, 10000, 100000 };
+
+/* distinct strings per string column, 0 meaning every row differs */
+static const int cardinalities[] = { 16, 0 };
+
+static double mintime = 0.2;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *codec_name(uint8_t codec)
+{
+	switch (codec)
+	{
+	case FREEQ_CODEC_LZ4:
+		return "lz4";
+	case FREEQ_CODEC_ZSTD:
+		return "zstd";
+	default:
+		return "none";
+	}
+}
+
+static void report(const char *name, const char *op, uint8_t codec,
+		   long rows, long iters, double secs, double bytes)
+{
+	printf("%s\t%s\t%s\t%ld\t%ld\t%.1f\t%.2f\n",
+	       name, op, codec_name(codec), rows, iters,
+	       secs * 1e9 / ((double)rows * iters),
+	       bytes / rows);
+}
+
+/* the same synthetic value for cell (row, col) whichever way the
+ * table is built */
+static int64_t cell_number(int row, int col)
+{
+	return (int64_t)row * 7919 + col * 1000003;
+}
+
+static const char *cell_string(char *buf, size_t n, int row, int col, int card)
+{
+	int v = card ? (row * 31 + col) % card : row;
+	snprintf(buf, n, "%c-value-%d", 'a' + col, v);
+	return buf;
+}
+
+/* the columns as freeq_table_new takes them; string cells point into
+ * one arena the caller frees */
+static GSList **mix_lists(const struct mix *m, int rows, int card, char **arena)
+{
+	GSList **lists = calloc(m->numcols, sizeof(GSList *));
+	char *s = *arena = malloc((size_t)rows * m->numcols * 32);
+
+	for (int c = 0; c < m->numcols; c++)
+	{
+		for (int r = rows - 1; r >= 0; r--)
+		{
+			gpointer v;
+			switch (m->coltypes[c])
+			{
+			case FREEQ_COL_STRING:
+				v = (gpointer)cell_string(s, 32, r, c, card);
+				s += 32;
+				break;
+			case FREEQ_COL_IPV4ADDR:
+				v = GUINT_TO_POINTER(htonl(0x0a000000 | (r & 0xffff)));
+				break;
+			default:
+				v = (gpointer)(intptr_t)cell_number(r, c);
+				break;
+			}
+			lists[c] = g_slist_prepend(lists[c], v);
+		}
+	}
+	return lists;
+}
+
+static struct freeq_table *mix_table(struct freeq_ctx *ctx, const struct mix *m, int rows, int card)
+{
+	struct freeq_table *t;
+	char buf[32];
+
+	freeq_table_new_empty(ctx, m->name, m->numcols,
+			      (freeq_coltype_t *)m->coltypes,
+			      (const char **)m->colnames, &t);
+	for (int r = 0; r < rows; r++)
+	{
+		for (int c = 0; c < m->numcols; c++)
+		{
+			switch (m->coltypes[c])
+			{
+			case FREEQ_COL_STRING:
+				freeq_table_append_string(t, c, cell_string(buf, sizeof buf, r, c, card), -1);
+				break;
+			case FREEQ_COL_IPV4ADDR:
+				freeq_table_append_ipv4(t, c, htonl(0x0a000000 | (r & 0xffff)));
+				break;
+			case FREEQ_COL_TIME:
+				freeq_table_append_time(t, c, cell_number(r, c));
+				break;
+			default:
+				freeq_table_append_number(t, c, cell_number(r, c));
+				break;
+			}
+		}
+		freeq_table_end_row(t);
+	}
+	return t;
+}
+
+static void bench_new(struct freeq_ctx *ctx, const char *name, const struct mix *m, int rows, int card)
+{
+	GSList **lists;
+	char *arena;
+	long iters = 0;
+	double start = now(), secs;
+
+	lists = mix_lists(m, rows, card, &arena);
+	do {
+		struct freeq_table *t;
+		GSList **l = lists;
+		freeq_table_new(ctx, m->name, m->numcols,
+				(freeq_coltype_t *)m->coltypes,
+				(const char **)m->colnames, &t, false,
+				l[0], l[1], l[2], l[3]);
+		freeq_table_unref(t);
+		iters++;
+	} while ((secs = now() - start) < mintime);
+	report(name, "new", FREEQ_CODEC_NONE, rows, iters, secs, 0);
+
+	for (int c = 0; c < m->numcols; c++)
+		g_slist_free(lists[c]);
+	free(lists);
+	free(arena);
+}
+
+static void bench_append(struct freeq_ctx *ctx, const char *name, const struct mix *m, int rows, int card)
+{
+	long iters = 0;
+	double start = now(), secs;
+
+	do {
+		freeq_table_unref(mix_table(ctx, m, rows, card));
+		iters++;
+	} while ((secs = now() - start) < mintime);
+	report(name, "append", FREEQ_CODEC_NONE, rows, iters, secs, 0);
+}
+
+static void bench_frames(struct freeq_ctx *ctx, const char *name, struct freeq_table *t)
+{
+	uint8_t codec = freeq_get_compression(ctx);
+	BIO *b = BIO_new(BIO_s_mem());
+	char *data;
+	long len, iters = 0;
+	double start, secs;
+
+	start = now();
+	do {
+		(void)BIO_reset(b);
+		freeq_table_bio_write(ctx, t, b);
+		iters++;
+	} while ((secs = now() - start) < mintime);
+	len = BIO_get_mem_data(b, &data);
+	report(name, "bio_write", codec, t->numrows, iters, secs, len);
+
+	iters = 0;
+	start = now();
+	do {
+		struct freeq_table *r;
+		BIO *in = BIO_new_mem_buf(data, len);
+		if (freeq_table_bio_read(ctx, &r, in, NULL) == 0)
+			freeq_table_unref(r);
+		BIO_free(in);
+		iters++;
+	} while ((secs = now() - start) < mintime);
+	report(name, "bio_read", codec, t->numrows, iters, secs, len);
+
+	BIO_free(b);
+}
+
+static void bench_print(struct freeq_ctx *ctx, const char *name, struct freeq_table *t)
+{
+	FILE *of = fopen("/dev/null", "w");
+	long iters = 0;
+	double start = now(), secs;
+
+	do {
+		freeq_table_print(ctx, t, of);
+		iters++;
+	} while ((secs = now() - start) < mintime);
+	report(name, "print", FREEQ_CODEC_NONE, t->numrows, iters, secs, 0);
+	fclose(of);
+}
+
+/* values spread over all varint lengths, the small ones most common
+ * as they are in real tables */
+static void bench_varint(const char *filter)
+{
+	enum { N = 65536 };
+	static uint64_t values[N];
+	BIO *b = BIO_new(BIO_s_mem());
+	char *data;
+	long len, iters = 0;
+	double start, secs;
+
+	if (filter && !strstr("varint", filter))
+		return;
+
+	for (int i = 0; i < N; i++)
+		values[i] = (uint64_t)(i * 2654435761u) >> (i % 8 ? 24 : i % 5 * 8);
+
+	start = now();
+	do {
+		(void)BIO_reset(b);
+		for (int i = 0; i < N; i++)
+			BIO_write_varint(b, values[i]);
+		iters++;
+	} while ((secs = now() - start) < mintime);
+	len = BIO_get_mem_data(b, &data);
+	report("varint", "encode", FREEQ_CODEC_NONE, N, iters, secs, len);
+
+	iters = 0;
+	start = now();
+	do {
+		struct longlong v;
+		BIO *in = BIO_new_mem_buf(data, len);
+		for (int i = 0; i < N; i++)
+			BIO_read_varint(in, &v);
+		BIO_free(in);
+		iters++;
+	} while ((secs = now() - start) < mintime);
+	report("varint", "decode", FREEQ_CODEC_NONE, N, iters, secs, len);
+
+	BIO_free(b);
+}
+
+int main(int argc, char **argv)
+{
+	struct freeq_ctx *ctx;
+	const char *filter = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:")) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			mintime = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds] [case-substring]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		filter = argv[optind];
+
+	if (freeq_new(&ctx, "bench_table", "bench", FREEQ_CLIENT))
+		return 1;
+	freeq_set_log_priority(ctx, 0);
+
+	printf("case\top\tcodec\trows\titers\tns_per_row\tbytes_per_row\n");
+
+	for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++)
+	{
+		const struct mix *m = &mixes[i];
+		for (size_t j = 0; j < sizeof(rowcounts) / sizeof(rowcounts[0]); j++)
+		{
+			for (size_t k = 0; k < sizeof(cardinalities) / sizeof(cardinalities[0]); k++)
+			{
+				int rows = rowcounts[j], card = cardinalities[k];
+				struct freeq_table *t;
+				char name[64];
+
+				/* the cardinality only matters with strings */
+				if (k && strcmp(m->name, "num") == 0)
+					continue;
+
+				if (card)
+					snprintf(name, sizeof name, "%s/%d/card%d", m->name, rows, card);
+				else
+					snprintf(name, sizeof name, "%s/%d/unique", m->name, rows);
+				if (filter && !strstr(name, filter))
+					continue;
+
+				bench_new(ctx, name, m, rows, card);
+				bench_append(ctx, name, m, rows, card);
+				t = mix_table(ctx, m, rows, card);
+				bench_frames(ctx, name, t);
+				bench_print(ctx, name, t);
+				freeq_table_unref(t);
+				fflush(stdout);
+			}
+		}
+	}
+
+	bench_varint(filter);
+
+	freeq_unref(ctx);
+	return 0;
+}
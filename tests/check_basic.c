@@ -10,7 +10,9 @@
 const char *identity = "identity";
 const char *appname = "appname";
 const char *colnames[] = { "one", "two" };
-freeq_coltype_t test_coltypes[] = { 1, 2 };
+freeq_coltype_t test_coltypes[] = { FREEQ_COL_NUMBER, FREEQ_COL_STRING };
+
+#include "tests/fixtures.h"
 
 char buf[4096];
 typedef union {
@@ -21,7 +23,7 @@ typedef union {
 START_TEST (test_freeq_new)
 {
 	struct freeq_ctx *ctx;
-	ck_assert_int_eq(freeq_new(&ctx, appname, identity), 0);
+	ck_assert_int_eq(freeq_new(&ctx, appname, identity, FREEQ_CLIENT), 0);
 	freeq_unref(ctx);
 }
 END_TEST
@@ -29,7 +31,7 @@ END_TEST
 START_TEST (test_freeq_ctx_val)
 {
 	struct freeq_ctx *ctx;
-	freeq_new(&ctx, appname, identity);
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
 	ck_assert_ptr_ne(ctx, NULL);
 	freeq_unref(ctx);
 }
@@ -38,7 +40,7 @@ END_TEST
 START_TEST (test_freeq_ctx_identity)
 {
 	struct freeq_ctx *ctx;
-	freeq_new(&ctx, appname, identity);
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
 	ck_assert_ptr_eq(freeq_get_identity(ctx), identity);
 	freeq_unref(ctx);
 }
@@ -47,7 +49,7 @@ END_TEST
 START_TEST (test_freeq_ctx_default_identity)
 {
 	struct freeq_ctx *ctx;
-	freeq_new(&ctx, appname, NULL);
+	freeq_new(&ctx, appname, NULL, FREEQ_CLIENT);
 	ck_assert_ptr_ne(freeq_get_identity(ctx), NULL);
 	ck_assert_str_eq(freeq_get_identity(ctx), "unknown");
 	freeq_unref(ctx);
@@ -57,7 +59,7 @@ END_TEST
 START_TEST (test_freeq_unref)
 {
 	struct freeq_ctx *ctx;
-	freeq_new(&ctx, appname, identity);
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
 	ctx = freeq_unref(ctx);
 	ck_assert_ptr_eq(ctx, NULL);
 }
@@ -66,7 +68,7 @@ END_TEST
 START_TEST (test_freeq_log_priority_default)
 {
 	struct freeq_ctx *ctx;
-	freeq_new(&ctx, appname, identity);
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
 	ck_assert_int_eq(freeq_get_log_priority(ctx), 3);
 	freeq_unref(ctx);
 }
@@ -75,7 +77,7 @@ END_TEST
 START_TEST (test_freeq_log_priority_nondefault)
 {
 	struct freeq_ctx *ctx;
-	freeq_new(&ctx, appname, identity);
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
 	freeq_set_log_priority(ctx, 4);
 	ck_assert_int_eq(freeq_get_log_priority(ctx), 4);
 	freeq_unref(ctx);
@@ -96,7 +98,7 @@ START_TEST (test_freeq_table_new_retcode)
 	data_two = g_slist_append(data_two, "one");
 	data_two = g_slist_append(data_two, "two");
 
-	freeq_new(&ctx, appname, identity);
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
 	v = freeq_table_new(ctx,
 			    "foo",
 			    2,
@@ -116,7 +118,7 @@ START_TEST (test_freeq_table_new_ptr_nullcol)
 {
 	struct freeq_ctx *ctx;
 	struct freeq_table *t;
-	freeq_new(&ctx, appname, identity);
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
 	freeq_set_log_priority(ctx, 10);
 	freeq_table_new(ctx,
 			"foo",
@@ -144,7 +146,7 @@ START_TEST (test_freeq_table_new_ptr)
 	data_two = g_slist_append(data_two, "one");
 	data_two = g_slist_append(data_two, "two");
 
-	freeq_new(&ctx, appname, identity);
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
 	freeq_table_new(ctx,
 			"foo",
 			2,
@@ -295,6 +297,159 @@ START_TEST (test_varint_u64)
 }
 END_TEST
 
+START_TEST (test_freeq_table_merge)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *m, *t;
+	freeq_str_t sv;
+
+	freeq_new(&ctx, appname, identity, FREEQ_SERVER);
+
+	t = sender_table(ctx, "a", 3, 0);
+	ck_assert_int_eq(freeq_table_new_merge(ctx, t, NULL, &m), 0);
+	ck_assert_int_eq(freeq_table_merge(ctx, m, t), 0);
+	freeq_table_unref(t);
+
+	t = sender_table(ctx, "b", 2, 10);
+	ck_assert_int_eq(freeq_table_merge(ctx, m, t), 0);
+	freeq_table_unref(t);
+	ck_assert_int_eq(m->numrows, 5);
+	ck_assert_int_eq(g_hash_table_size(m->senders), 2);
+
+	/* strings outlive the table they arrived in */
+	sv = freeq_column_string(&m->columns[1], 4);
+	ck_assert_int_eq(sv.len, 3);
+	ck_assert(memcmp(sv.str, "b11", 3) == 0);
+
+	/* a replaced segment stays until the dead rows outnumber
+	 * the live ones */
+	t = sender_table(ctx, "b", 1, 20);
+	ck_assert_int_eq(freeq_table_merge(ctx, m, t), 0);
+	freeq_table_unref(t);
+	ck_assert_int_eq(m->numrows, 6);
+	ck_assert_int_eq(m->deadrows, 2);
+
+	t = sender_table(ctx, "a", 1, 30);
+	ck_assert_int_eq(freeq_table_merge(ctx, m, t), 0);
+	freeq_table_unref(t);
+	ck_assert_int_eq(m->numrows, 2);
+	ck_assert_int_eq(m->deadrows, 0);
+	ck_assert_int_eq(freeq_column_number(&m->columns[0], 0), 20);
+	ck_assert_int_eq(freeq_column_number(&m->columns[0], 1), 30);
+	sv = freeq_column_string(&m->columns[1], 1);
+	ck_assert(memcmp(sv.str, "a30", 3) == 0);
+
+	/* tables of a different shape are refused */
+	freeq_table_new_empty(ctx, "foo", 1, test_coltypes, colnames, &t);
+	t->identity = freeq_table_strdup(t, "c");
+	ck_assert_int_ne(freeq_table_merge(ctx, m, t), 0);
+	freeq_table_unref(t);
+
+	freeq_table_unref(m);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_freeq_table_clear)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *m, *t;
+	freeq_str_t sv;
+
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
+
+	/* a cleared table builds the next report in the same columns */
+	t = sender_table(ctx, "a", 100, 0);
+	ck_assert_int_eq(freeq_table_clear(t), 0);
+	ck_assert_int_eq(t->numrows, 0);
+	ck_assert_int_eq(t->columns[0].values->len, 0);
+	ck_assert_int_eq(t->columns[1].values->len, 0);
+
+	freeq_table_append_number(t, 0, 7);
+	freeq_table_append_string(t, 1, "again", -1);
+	freeq_table_end_row(t);
+	ck_assert_int_eq(t->numrows, 1);
+	ck_assert_int_eq(freeq_column_number(&t->columns[0], 0), 7);
+	sv = freeq_column_string(&t->columns[1], 0);
+	ck_assert_int_eq(sv.len, 5);
+	ck_assert(memcmp(sv.str, "again", 5) == 0);
+
+	/* merged tables aren't the caller's to clear */
+	ck_assert_int_eq(freeq_table_new_merge(ctx, t, NULL, &m), 0);
+	ck_assert_int_ne(freeq_table_clear(m), 0);
+
+	freeq_table_unref(m);
+	freeq_table_unref(t);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_freeq_table_append_rows)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *m, *a, *b;
+	freeq_str_t sv;
+
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
+
+	/* the second part's strings are copied, the first part can go */
+	a = sender_table(ctx, "a", 2, 0);
+	b = sender_table(ctx, "a", 3, 2);
+	ck_assert_int_eq(freeq_table_append_rows(ctx, a, b), 0);
+	freeq_table_unref(b);
+	ck_assert_int_eq(a->numrows, 5);
+	ck_assert_int_eq(a->columns[1].values->len, 5);
+	ck_assert_int_eq(freeq_column_number(&a->columns[0], 4), 4);
+	sv = freeq_column_string(&a->columns[1], 4);
+	ck_assert_int_eq(sv.len, 2);
+	ck_assert(memcmp(sv.str, "a4", 2) == 0);
+
+	/* a table never grows past 2^32 rows */
+	b = sender_table(ctx, "a", 3, 5);
+	a->numrows = UINT32_MAX - 1;
+	ck_assert_int_ne(freeq_table_append_rows(ctx, a, b), 0);
+	a->numrows = 5;
+	freeq_table_unref(b);
+
+	/* only to a table of the same columns, and not a merged one */
+	freeq_table_new_empty(ctx, "foo", 1, test_coltypes, colnames, &b);
+	ck_assert_int_ne(freeq_table_append_rows(ctx, a, b), 0);
+	ck_assert_int_eq(freeq_table_new_merge(ctx, a, NULL, &m), 0);
+	ck_assert_int_ne(freeq_table_append_rows(ctx, m, a), 0);
+
+	freeq_table_unref(m);
+	freeq_table_unref(b);
+	freeq_table_unref(a);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_freeq_generation_ref)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *m, *t;
+	freeq_generation_t *gen;
+
+	freeq_new(&ctx, appname, identity, FREEQ_SERVER);
+	ck_assert_int_eq(freeq_generation_new(&gen), 0);
+
+	t = sender_table(ctx, "a", 3, 0);
+	freeq_table_new_merge(ctx, t, gen->strings, &m);
+	freeq_table_merge(ctx, m, t);
+	freeq_table_unref(t);
+	g_hash_table_insert(gen->tables, g_strdup(m->name), m);
+
+	/* a reader keeps the tables alive after the owner lets go */
+	ck_assert_ptr_eq(freeq_generation_ref(gen), gen);
+	freeq_generation_unref(gen);
+	ck_assert_int_eq(gen->refcount, 1);
+	ck_assert_int_eq(m->numrows, 3);
+	freeq_generation_unref(gen);
+
+	freeq_unref(ctx);
+}
+END_TEST
+
 Suite *
 freeq_basic_suite (void)
 {
@@ -310,6 +465,10 @@ freeq_basic_suite (void)
 	tcase_add_test(tc_core, test_freeq_table_new_retcode);
 	tcase_add_test(tc_core, test_freeq_table_new_ptr_nullcol);
 	tcase_add_test(tc_core, test_freeq_table_new_ptr);
+	tcase_add_test(tc_core, test_freeq_table_merge);
+	tcase_add_test(tc_core, test_freeq_table_clear);
+	tcase_add_test(tc_core, test_freeq_table_append_rows);
+	tcase_add_test(tc_core, test_freeq_generation_ref);
 	tcase_add_test (tc_core, test_varint_32);
 	tcase_add_test (tc_core, test_varint_u32);
 	tcase_add_test (tc_core, test_varint_64);
@@ -0,0 +1,152 @@
+#include <check.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "src/freeq/libfreeq.h"
+#include "libfreeq-private.h"
+#include "src/csv.h"
+
+const char *appname = "appname";
+
+/* @len bytes of @s in a new file, read comma separated, mapped if
+ * @map.  the file goes once it is open */
+static void
+open_str(struct freeq_ctx *ctx, struct csv_reader *rd, const char *s, size_t len, bool map)
+{
+	char fn[] = "/tmp/check_csv.XXXXXX";
+	int fd;
+
+	fd = mkstemp(fn);
+	ck_assert_int_ge(fd, 0);
+	ck_assert_int_eq(write(fd, s, len), len);
+	close(fd);
+
+	ck_assert_int_eq(csv_open(rd, ctx, fn, map), 0);
+	unlink(fn);
+	rd->fn = "test";
+	rd->delim = ',';
+	csv_expect(rd, 8);
+}
+
+/* the next record starts on @line and holds the @n fields following */
+static void
+expect(struct csv_reader *rd, unsigned long line, int n, ...)
+{
+	va_list ap;
+
+	ck_assert_int_eq(csv_read_fields(rd), n);
+	ck_assert_uint_eq(rd->line, line);
+	va_start(ap, n);
+	for (int i = 0; i < n; i++)
+	{
+		const char *s = va_arg(ap, const char *);
+		ck_assert_uint_eq(rd->fields[i].len, strlen(s));
+		ck_assert(memcmp(rd->fields[i].s, s, rd->fields[i].len) == 0);
+	}
+	va_end(ap);
+}
+
+/* run mapped and read */
+START_TEST (test_csv_quoting)
+{
+	struct freeq_ctx *ctx;
+	struct csv_reader rd;
+	const char s[] =
+		"a,\"b,c\",d\n"
+		"\"x\ny\",z\r\n"
+		"next,\"say \"\"hi\"\"\",2\n"
+		"\n"
+		"ab\"cd,e\n"
+		"\"\",\"\"\"\"\n"
+		"last,1";
+
+	freeq_new(&ctx, appname, NULL, FREEQ_SERVER);
+	open_str(ctx, &rd, s, sizeof(s) - 1, _i);
+	expect(&rd, 1, 3, "a", "b,c", "d");
+	expect(&rd, 2, 2, "x\ny", "z");
+	expect(&rd, 4, 3, "next", "say \"hi\"", "2");
+	expect(&rd, 6, 2, "ab\"cd", "e");
+	expect(&rd, 7, 2, "", "\"");
+	expect(&rd, 8, 2, "last", "1");
+	ck_assert_int_eq(csv_read_fields(&rd), 0);
+	csv_close(&rd);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_csv_malformed)
+{
+	struct freeq_ctx *ctx;
+	struct csv_reader rd;
+	const char trailing[] = "\"ab\"cd,e\n";
+	const char unterminated[] = "a,\"b\nc\n";
+
+	freeq_new(&ctx, appname, NULL, FREEQ_SERVER);
+	open_str(ctx, &rd, trailing, sizeof(trailing) - 1, _i);
+	ck_assert_int_lt(csv_read_fields(&rd), 0);
+	csv_close(&rd);
+
+	open_str(ctx, &rd, unterminated, sizeof(unterminated) - 1, _i);
+	ck_assert_int_lt(csv_read_fields(&rd), 0);
+	csv_close(&rd);
+	freeq_unref(ctx);
+}
+END_TEST
+
+/* a quoted field far longer than the window, read rather than mapped */
+START_TEST (test_csv_window_growth)
+{
+	struct freeq_ctx *ctx;
+	struct csv_reader rd;
+	const size_t n = 3 * CSV_BUF_SIZE / 4;
+	GString *in = g_string_new("head,1\n\"");
+	GString *want = g_string_new(NULL);
+
+	for (size_t i = 0; i < n; i++)
+	{
+		g_string_append(in, i % 64 ? "a\"\"" : "\n");
+		g_string_append(want, i % 64 ? "a\"" : "\n");
+	}
+	g_string_append(in, "\",2\ntail,3\n");
+
+	freeq_new(&ctx, appname, NULL, FREEQ_SERVER);
+	open_str(ctx, &rd, in->str, in->len, false);
+	expect(&rd, 1, 2, "head", "1");
+	expect(&rd, 2, 2, want->str, "2");
+	/* one line for each newline in the field, and the one ending it */
+	expect(&rd, 2 + n / 64 + 1, 2, "tail", "3");
+	ck_assert_int_eq(csv_read_fields(&rd), 0);
+	csv_close(&rd);
+	freeq_unref(ctx);
+	g_string_free(in, TRUE);
+	g_string_free(want, TRUE);
+}
+END_TEST
+
+Suite *
+freeq_csv_suite (void)
+{
+	Suite *s = suite_create("freeq_csv");
+	TCase *tc_core = tcase_create("Core");
+	tcase_add_loop_test(tc_core, test_csv_quoting, 0, 2);
+	tcase_add_loop_test(tc_core, test_csv_malformed, 0, 2);
+	tcase_add_test(tc_core, test_csv_window_growth);
+
+	suite_add_tcase(s, tc_core);
+	return s;
+}
+
+int
+main (void)
+{
+	int number_failed;
+	Suite *s = freeq_csv_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -5,6 +5,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <inttypes.h>
 
 const char *identity = "identity";
 const char *appname = "appname";
@@ -38,7 +39,7 @@ freeq_coltype_t test_coltypes[] = { FREEQ_COL_NUMBER, FREEQ_COL_STRING };
 /* 	data_two = g_slist_append(data_two, "one"); */
 /* 	data_two = g_slist_append(data_two, "two"); */
 	
-/* 	freeq_new(&ctx, appname, identity); */
+/* 	freeq_new(&ctx, appname, identity, FREEQ_CLIENT); */
 /* 	freeq_table_new(ctx, */
 /* 			"foo", */
 /* 			2, */
@@ -94,32 +95,41 @@ bool compare_tables(struct freeq_table *t1, struct freeq_table *t2)
 			return false;		
 		fprintf(stderr, "%d: name matches\n", i);
 
-		GSList *c1 = t1->columns[i].data;
-		GSList *c2 = t2->columns[i].data;
-		while (c1 != NULL) {
-			switch (t1->columns[i].coltype) {
+		if (t1->numrows != t2->numrows)
+			return false;
+
+		struct freeq_column *c1 = &(t1->columns[i]);
+		struct freeq_column *c2 = &(t2->columns[i]);
+		for (uint32_t r = 0; r < t1->numrows; r++) {
+			switch (c1->coltype) {
 			case FREEQ_COL_STRING:
-				if (strcmp(c1->data, c2->data) != 0) {
-					fprintf(stderr, "got %s should be %s\n", c1->data, c2->data);
+				if (freeq_column_string(c1, r).len != freeq_column_string(c2, r).len ||
+				    memcmp(freeq_column_string(c1, r).str, freeq_column_string(c2, r).str,
+					   freeq_column_string(c1, r).len) != 0) {
+					fprintf(stderr, "got %s should be %s\n",
+						freeq_column_string(c1, r).str, freeq_column_string(c2, r).str);
 					return false;
 				}
 				break;
 			case FREEQ_COL_NUMBER:
-				if (c1->data != c2->data) {
-					fprintf(stderr, "got %d should be %d\n", GPOINTER_TO_INT(c1->data), GPOINTER_TO_INT(c2->data));
+				if (freeq_column_number(c1, r) != freeq_column_number(c2, r)) {
+					fprintf(stderr, "got %" PRId64 " should be %" PRId64 "\n",
+						freeq_column_number(c1, r), freeq_column_number(c2, r));
+					return false;
+				}
+				break;
+			case FREEQ_COL_DOUBLE:
+				if (freeq_column_double(c1, r) != freeq_column_double(c2, r)) {
+					fprintf(stderr, "got %g should be %g\n",
+						freeq_column_double(c1, r), freeq_column_double(c2, r));
 					return false;
 				}
 				break;
 			default:
 				break;
 			}
-
-			c1 = g_slist_next(c1);
-			c2 = g_slist_next(c2);
 		}
 		fprintf(stderr, "%d: data matches\n", i);
-		if (c2 != NULL)
-			return false;
 		fprintf(stderr, "column %d ok\n", i);
 	}
 	fprintf(stderr, "everything matches\n");
@@ -152,7 +162,7 @@ START_TEST (test_freeq_write_read_bio)
 	data_two = g_slist_append(data_two, "one");
 	data_two = g_slist_append(data_two, "two");
 	
-	freeq_new(&ctx, appname, identity);
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
 	freeq_table_new(ctx,
 			"foo",
 			2,
@@ -164,16 +174,12 @@ START_TEST (test_freeq_write_read_bio)
 			data_two);
 	
 	t->numrows = 8;
-	BIO *out, *in;
-	out = BIO_new_file("poop2.txt", "w");
+	BIO *mem = BIO_new(BIO_s_mem());
 
 	freeq_set_log_priority(ctx, 10);
-	freeq_table_bio_write(ctx, t, out);
-	BIO_free(out);
-
-	in = BIO_new_file("poop2.txt", "r");	
-	freeq_table_bio_read(ctx, &t2, in, NULL);
-	BIO_free(in);
+	freeq_table_bio_write(ctx, t, mem);
+	freeq_table_bio_read(ctx, &t2, mem, NULL);
+	BIO_free(mem);
 
 	freeq_table_print(ctx, t2, stdout);
 	fprintf(stderr, "done printing\n");
@@ -188,6 +194,605 @@ START_TEST (test_freeq_write_read_bio)
 }
 END_TEST
 
+START_TEST (test_freeq_builder_write_read_bio)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *t = 0, *t2 = 0;
+	const char *names[] = { "num", "str" };
+	const char *strs[] = { "alpha", "beta", "alpha", NULL, "beta" };
+
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
+	ck_assert_int_eq(freeq_table_new_empty(ctx, "built", 2, test_coltypes, names, &t), 0);
+
+	for (int i = 0; i < 5; i++) {
+		freeq_table_append_number(t, 0, (int64_t)i * 0x100000000LL - 7);
+		freeq_table_append_string(t, 1, strs[i], -1);
+		freeq_table_end_row(t);
+	}
+	ck_assert_int_eq(t->numrows, 5);
+
+	BIO *mem = BIO_new(BIO_s_mem());
+	freeq_table_bio_write(ctx, t, mem);
+	freeq_table_bio_read(ctx, &t2, mem, NULL);
+	BIO_free(mem);
+
+	ck_assert(compare_tables(t, t2));
+	ck_assert_ptr_eq(freeq_column_string(&(t2->columns[1]), 3).str, NULL);
+
+	freeq_table_unref(t);
+	freeq_table_unref(t2);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_freeq_wide_numbers_write_read_bio)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *t = 0, *t2 = 0;
+	const char *names[] = { "bytes", "ratio" };
+	freeq_coltype_t types[] = { FREEQ_COL_NUMBER, FREEQ_COL_DOUBLE };
+	const int64_t bytes[] = { INT64_MAX, 0, -1, 0x7fffffffLL + 1, INT64_MIN };
+	const double ratios[] = { 0.25, 0.5, 1e300, -3.75, 0.1 };
+
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
+	freeq_table_new_empty(ctx, "wide", 2, types, names, &t);
+	for (int i = 0; i < 5; i++) {
+		freeq_table_append_number(t, 0, bytes[i]);
+		freeq_table_append_double(t, 1, ratios[i]);
+		freeq_table_end_row(t);
+	}
+
+	BIO *mem = BIO_new(BIO_s_mem());
+	freeq_table_bio_write(ctx, t, mem);
+	freeq_table_bio_read(ctx, &t2, mem, NULL);
+	BIO_free(mem);
+
+	ck_assert(compare_tables(t, t2));
+	ck_assert(freeq_column_number(&(t2->columns[0]), 0) == INT64_MAX);
+
+	freeq_table_unref(t);
+	freeq_table_unref(t2);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_freeq_mem_read)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *t = 0, *t2 = 0;
+	const char *names[] = { "num", "str" };
+	char *buf;
+	long len;
+
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
+	freeq_table_new_empty(ctx, "mem", 2, test_coltypes, names, &t);
+	for (int i = 0; i < 1000; i++) {
+		freeq_table_append_number(t, 0, i * i);
+		freeq_table_append_string(t, 1, i % 3 ? "x" : "yy", -1);
+		freeq_table_end_row(t);
+	}
+
+	BIO *mem = BIO_new(BIO_s_mem());
+	freeq_table_bio_write(ctx, t, mem);
+	len = BIO_get_mem_data(mem, &buf);
+	ck_assert_int_eq(freeq_table_mem_read(ctx, &t2, buf, len, NULL, NULL), 0);
+	ck_assert_int_eq(t2->numrows, 1000);
+	ck_assert(compare_tables(t, t2));
+	BIO_free(mem);
+
+	freeq_table_unref(t);
+	freeq_table_unref(t2);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_freeq_string_views)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *t = 0, *t2 = 0;
+	const char *names[] = { "num", "str" };
+	char big[4096];
+	freeq_str_t sv;
+	char *buf;
+	long len;
+
+	/* strings are views, embedded nuls and long strings survive */
+	memset(big, 'z', sizeof(big));
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
+	freeq_table_new_empty(ctx, "views", 2, test_coltypes, names, &t);
+	freeq_table_append_number(t, 0, 1);
+	freeq_table_append_string(t, 1, "a\0b", 3);
+	freeq_table_end_row(t);
+	freeq_table_append_number(t, 0, 2);
+	freeq_table_append_string(t, 1, big, sizeof(big));
+	freeq_table_end_row(t);
+
+	BIO *mem = BIO_new(BIO_s_mem());
+	freeq_table_bio_write(ctx, t, mem);
+	len = BIO_get_mem_data(mem, &buf);
+	ck_assert_int_eq(freeq_table_mem_read(ctx, &t2, buf, len, NULL, NULL), 0);
+	BIO_free(mem);
+
+	sv = freeq_column_string(&t2->columns[1], 0);
+	ck_assert_int_eq(sv.len, 3);
+	ck_assert(memcmp(sv.str, "a\0b", 3) == 0);
+	sv = freeq_column_string(&t2->columns[1], 1);
+	ck_assert_int_eq(sv.len, sizeof(big));
+	ck_assert(memcmp(sv.str, big, sizeof(big)) == 0);
+
+	freeq_table_unref(t);
+	freeq_table_unref(t2);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_freeq_frames)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *t = 0, *t2 = 0, *t3 = 0;
+	const char *names[] = { "num", "str" };
+	char *buf, *copy;
+	long len;
+
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
+	freeq_table_new_empty(ctx, "frames", 2, test_coltypes, names, &t);
+	for (int i = 0; i < 100; i++) {
+		freeq_table_append_number(t, 0, i);
+		freeq_table_append_string(t, 1, i % 2 ? "odd" : "even", -1);
+		freeq_table_end_row(t);
+	}
+
+	/* two tables back to back on one stream, then a clean EOF */
+	BIO *mem = BIO_new(BIO_s_mem());
+	freeq_table_bio_write(ctx, t, mem);
+	freeq_table_bio_write(ctx, t, mem);
+	len = BIO_get_mem_data(mem, &buf);
+	copy = malloc(len);
+	memcpy(copy, buf, len);
+
+	ck_assert_int_eq(freeq_table_bio_read(ctx, &t2, mem, NULL), 0);
+	ck_assert(compare_tables(t, t2));
+	ck_assert_int_eq(freeq_table_bio_read(ctx, &t3, mem, NULL), 0);
+	ck_assert(compare_tables(t, t3));
+	ck_assert_int_eq(freeq_table_bio_read(ctx, &t3, mem, NULL), FREEQ_EOF);
+	freeq_table_unref(t2);
+	freeq_table_unref(t3);
+	BIO_free(mem);
+
+	/* one frame is half the buffer; cutting it short is an error */
+	ck_assert_int_eq(freeq_table_mem_read(ctx, &t2, copy, len / 2 - 1, NULL, NULL), FREEQ_ERR);
+
+	/* a flipped bit in the body fails the checksum */
+	copy[len / 4] ^= 0x10;
+	ck_assert_int_eq(freeq_table_mem_read(ctx, &t2, copy, len / 2, NULL, NULL), FREEQ_ERR);
+
+	free(copy);
+	freeq_table_unref(t);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_freeq_stream_dict)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *t = 0, *t2 = 0;
+	struct freeq_dict *wdict, *rdict;
+	const char *names[] = { "num", "str" };
+	char sbuf[32];
+	long first, second;
+	char *buf;
+
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
+	freeq_table_new_empty(ctx, "dict", 2, test_coltypes, names, &t);
+	for (int i = 0; i < 500; i++) {
+		snprintf(sbuf, sizeof(sbuf), "process-%d", i);
+		freeq_table_append_number(t, 0, i);
+		freeq_table_append_string(t, 1, sbuf, -1);
+		freeq_table_end_row(t);
+	}
+
+	freeq_dict_new(&wdict);
+	freeq_dict_new(&rdict);
+
+	BIO *mem = BIO_new(BIO_s_mem());
+	freeq_table_bio_write_dict(ctx, t, mem, wdict);
+	first = BIO_get_mem_data(mem, &buf);
+	freeq_table_bio_write_dict(ctx, t, mem, wdict);
+	second = BIO_get_mem_data(mem, &buf) - first;
+
+	/* every string of the second table was sent with the first */
+	ck_assert(second < first / 2);
+
+	for (int n = 0; n < 2; n++) {
+		ck_assert_int_eq(freeq_table_bio_read_dict(ctx, &t2, mem, NULL, rdict, NULL), 0);
+		ck_assert(compare_tables(t, t2));
+		freeq_table_unref(t2);
+	}
+	BIO_free(mem);
+
+	/* a string repeated within a frame is a reference to its first
+	 * row, and the table holds one copy for both */
+	freeq_table_unref(t);
+	freeq_table_new_empty(ctx, "dict", 2, test_coltypes, names, &t);
+	for (int i = 0; i < 3; i++) {
+		freeq_table_append_number(t, 0, i);
+		freeq_table_append_string(t, 1, i == 1 ? "other" : "again", -1);
+		freeq_table_end_row(t);
+	}
+	mem = BIO_new(BIO_s_mem());
+	freeq_table_bio_write_dict(ctx, t, mem, wdict);
+	ck_assert_int_eq(freeq_table_bio_read_dict(ctx, &t2, mem, NULL, rdict, NULL), 0);
+	ck_assert(compare_tables(t, t2));
+	ck_assert_ptr_eq(freeq_column_string(&t2->columns[1], 0).str,
+			 freeq_column_string(&t2->columns[1], 2).str);
+	freeq_table_unref(t2);
+	BIO_free(mem);
+
+	/* without the dictionary the references can't be resolved */
+	mem = BIO_new(BIO_s_mem());
+	freeq_table_bio_write_dict(ctx, t, mem, wdict);
+	ck_assert_int_eq(freeq_table_bio_read(ctx, &t2, mem, NULL), FREEQ_ERR);
+	BIO_free(mem);
+
+	freeq_dict_free(wdict);
+	freeq_dict_free(rdict);
+	freeq_table_unref(t);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_freeq_ack)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *t = 0, *t2 = 0;
+	const char *names[] = { "num", "str" };
+	uint8_t flags;
+
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
+	freeq_table_new_empty(ctx, "ack", 2, test_coltypes, names, &t);
+	freeq_table_append_number(t, 0, 1);
+	freeq_table_append_string(t, 1, "one", -1);
+	freeq_table_end_row(t);
+
+	BIO *mem = BIO_new(BIO_s_mem());
+	freeq_set_frame_flags(ctx, FREEQ_FRAME_CRC32C | FREEQ_FRAME_ACK);
+	freeq_table_bio_write(ctx, t, mem);
+	ck_assert_int_eq(freeq_table_bio_read_dict(ctx, &t2, mem, NULL, NULL, &flags), 0);
+	ck_assert(flags & FREEQ_FRAME_ACK);
+	ck_assert(compare_tables(t, t2));
+
+	/* an ack is not a table, and a table is not an ack */
+	ck_assert_int_eq(freeq_bio_write_ack(ctx, mem), 0);
+	ck_assert_int_eq(freeq_bio_read_ack(ctx, mem), 0);
+	ck_assert_int_eq(freeq_bio_read_ack(ctx, mem), FREEQ_EOF);
+	freeq_table_bio_write(ctx, t, mem);
+	ck_assert_int_eq(freeq_bio_read_ack(ctx, mem), FREEQ_ERR);
+	BIO_free(mem);
+
+	/* a refusal is an error frame in place of the ack, and leaves
+	 * the stream where the next ack can be read */
+	mem = BIO_new(BIO_s_mem());
+	ck_assert_int_eq(freeq_error_write_sock(ctx, "table merge failed", mem), 0);
+	ck_assert_int_eq(freeq_bio_write_ack(ctx, mem), 0);
+	ck_assert_int_eq(freeq_bio_read_ack(ctx, mem), FREEQ_REFUSED);
+	ck_assert_int_eq(freeq_bio_read_ack(ctx, mem), 0);
+	BIO_free(mem);
+
+	freeq_table_unref(t);
+	freeq_table_unref(t2);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_freeq_error_frame)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *t2 = 0;
+	freeq_str_t sv;
+	uint8_t flags;
+
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
+
+	BIO *mem = BIO_new(BIO_s_mem());
+	ck_assert_int_eq(freeq_error_write_sock(ctx, "no such table: foo", mem), 0);
+	ck_assert_int_eq(freeq_table_bio_read_dict(ctx, &t2, mem, NULL, NULL, &flags), 0);
+	ck_assert(flags & FREEQ_FRAME_ERROR);
+	ck_assert(!(flags & FREEQ_FRAME_MORE));
+	ck_assert_str_eq(t2->name, "error");
+	ck_assert_int_eq(t2->numcols, 1);
+	ck_assert_int_eq(t2->numrows, 1);
+	sv = freeq_column_string(&t2->columns[0], 0);
+	ck_assert_int_eq(sv.len, strlen("no such table: foo"));
+	ck_assert(memcmp(sv.str, "no such table: foo", sv.len) == 0);
+	BIO_free(mem);
+
+	freeq_table_unref(t2);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_freeq_result_read)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *chunk = 0, *t2 = 0;
+	const char *names[] = { "pid", "cmd" };
+	GByteArray *out = g_byte_array_new();
+	char sbuf[32];
+	freeq_str_t sv;
+	BIO *mem;
+
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
+
+	/* three chunks of 10 rows, the last one without MORE */
+	for (int c = 0; c < 3; c++) {
+		freeq_table_new_empty(ctx, "result", 2, test_coltypes, names, &chunk);
+		for (int i = c * 10; i < c * 10 + 10; i++) {
+			snprintf(sbuf, sizeof(sbuf), "process-%d", i);
+			freeq_table_append_number(chunk, 0, i);
+			freeq_table_append_string(chunk, 1, sbuf, -1);
+			freeq_table_end_row(chunk);
+		}
+		ck_assert_int_eq(freeq_table_encode(ctx, chunk, out,
+						     c < 2 ? FREEQ_FRAME_MORE : 0, NULL), 0);
+		freeq_table_unref(chunk);
+	}
+	mem = BIO_new(BIO_s_mem());
+	BIO_write(mem, out->data, out->len);
+	ck_assert_int_eq(freeq_result_bio_read(ctx, &t2, mem), 0);
+	ck_assert_int_eq(t2->numrows, 30);
+	ck_assert_int_eq(freeq_column_number(&t2->columns[0], 29), 29);
+	sv = freeq_column_string(&t2->columns[1], 25);
+	ck_assert_int_eq(sv.len, strlen("process-25"));
+	ck_assert(memcmp(sv.str, "process-25", sv.len) == 0);
+	freeq_table_unref(t2);
+	BIO_free(mem);
+
+	/* a chunk and then an error fails the whole result */
+	g_byte_array_set_size(out, 0);
+	freeq_table_new_empty(ctx, "result", 2, test_coltypes, names, &chunk);
+	freeq_table_append_number(chunk, 0, 1);
+	freeq_table_append_string(chunk, 1, "one", -1);
+	freeq_table_end_row(chunk);
+	freeq_table_encode(ctx, chunk, out, FREEQ_FRAME_MORE, NULL);
+	freeq_table_unref(chunk);
+	freeq_error_encode(ctx, "no such table: foo", out);
+	mem = BIO_new(BIO_s_mem());
+	BIO_write(mem, out->data, out->len);
+	ck_assert_int_ne(freeq_result_bio_read(ctx, &t2, mem), 0);
+	ck_assert(t2 == NULL);
+	BIO_free(mem);
+
+	/* so does a result cut short */
+	g_byte_array_set_size(out, 0);
+	freeq_table_new_empty(ctx, "result", 2, test_coltypes, names, &chunk);
+	freeq_table_encode(ctx, chunk, out, FREEQ_FRAME_MORE, NULL);
+	freeq_table_unref(chunk);
+	mem = BIO_new(BIO_s_mem());
+	BIO_write(mem, out->data, out->len);
+	ck_assert_int_ne(freeq_result_bio_read(ctx, &t2, mem), 0);
+	BIO_free(mem);
+
+	g_byte_array_free(out, TRUE);
+	freeq_unref(ctx);
+}
+END_TEST
+
+static int
+mem_emit(struct freeq_ctx *ctx, const uint8_t *buf, size_t len, void *arg)
+{
+	BIO_write((BIO *)arg, buf, len);
+	return 0;
+}
+
+START_TEST (test_freeq_table_encode_chunks)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *t, *t2 = 0;
+	const char *names[] = { "pid", "cmd" };
+	char sbuf[32];
+	BIO *mem;
+
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
+	freeq_table_new_empty(ctx, "result", 2, test_coltypes, names, &t);
+
+	/* an empty table is one frame, and so an empty result */
+	mem = BIO_new(BIO_s_mem());
+	ck_assert_int_eq(freeq_table_encode_chunks(ctx, t, 10, mem_emit, mem), 0);
+	ck_assert_int_eq(freeq_result_bio_read(ctx, &t2, mem), 0);
+	ck_assert_int_eq(t2->numrows, 0);
+	ck_assert_int_eq(BIO_pending(mem), 0);
+	freeq_table_unref(t2);
+	BIO_free(mem);
+
+	/* 25 rows go as two chunks of 10 and one of 5 */
+	for (int i = 0; i < 25; i++) {
+		snprintf(sbuf, sizeof(sbuf), "process-%d", i % 3);
+		freeq_table_append_number(t, 0, i);
+		freeq_table_append_string(t, 1, sbuf, -1);
+		freeq_table_end_row(t);
+	}
+	mem = BIO_new(BIO_s_mem());
+	ck_assert_int_eq(freeq_table_encode_chunks(ctx, t, 10, mem_emit, mem), 0);
+	ck_assert_int_eq(freeq_result_bio_read(ctx, &t2, mem), 0);
+	ck_assert_int_eq(BIO_pending(mem), 0);
+	ck_assert(compare_tables(t, t2));
+	freeq_table_unref(t2);
+	BIO_free(mem);
+
+	freeq_table_unref(t);
+	freeq_unref(ctx);
+}
+END_TEST
+
+/* a frame of one number column n with a single one byte cell, but
+ * claiming @numrows rows */
+static size_t
+oversized_frame(uint8_t *buf, uint64_t numrows)
+{
+	uint8_t *p = buf + FREEQ_FRAME_HEADER_LEN;
+	uint32_t len;
+
+	*p++ = 1; *p++ = 'x';		/* name */
+	*p++ = 0;			/* identity */
+	*p++ = 0;			/* serial */
+	do {
+		*p++ = (numrows & 0x7f) | (numrows > 0x7f ? 0x80 : 0);
+		numrows >>= 7;
+	} while (numrows > 0);
+	*p++ = 1;			/* numcols */
+	*p++ = FREEQ_COL_NUMBER;
+	*p++ = 1; *p++ = 'n';
+	*p++ = 1;			/* block length */
+	*p++ = 0;			/* the block */
+
+	len = p - buf - FREEQ_FRAME_HEADER_LEN;
+	memset(buf, 0, FREEQ_FRAME_HEADER_LEN);
+	memcpy(buf, FREEQ_FRAME_MAGIC, 4);
+	buf[4] = FREEQ_FRAME_VERSION;
+	buf[8] = len >> 24; buf[9] = len >> 16; buf[10] = len >> 8; buf[11] = len;
+	return p - buf;
+}
+
+START_TEST (test_freeq_decode_numrows)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *t2 = 0;
+	uint8_t buf[64];
+	size_t len;
+
+	freeq_new(&ctx, appname, identity, FREEQ_SERVER);
+
+	len = oversized_frame(buf, 1);
+	ck_assert_int_eq(freeq_table_mem_read(ctx, &t2, buf, len, NULL, NULL), 0);
+	ck_assert_int_eq(t2->numrows, 1);
+	freeq_table_unref(t2);
+
+	/* neither a row count past 32 bits nor one the blocks are too
+	 * short for gets as far as allocating the columns */
+	len = oversized_frame(buf, (1ULL << 32) + 1);
+	ck_assert_int_ne(freeq_table_mem_read(ctx, &t2, buf, len, NULL, NULL), 0);
+	len = oversized_frame(buf, 100000000);
+	ck_assert_int_ne(freeq_table_mem_read(ctx, &t2, buf, len, NULL, NULL), 0);
+
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_freeq_delta)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *prev = 0, *next = 0, *few = 0, *d = 0, *d2 = 0, *full = 0;
+	const char *names[] = { "pid", "cmd" };
+	char sbuf[32];
+	uint8_t flags;
+
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
+	freeq_table_new_empty(ctx, "delta", 2, test_coltypes, names, &prev);
+	freeq_table_new_empty(ctx, "delta", 2, test_coltypes, names, &next);
+	freeq_table_new_empty(ctx, "delta", 2, test_coltypes, names, &few);
+	for (int i = 0; i < 102; i++) {
+		snprintf(sbuf, sizeof(sbuf), "process-%d", i);
+		if (i < 100) {
+			freeq_table_append_number(prev, 0, i);
+			freeq_table_append_string(prev, 1, sbuf, -1);
+			freeq_table_end_row(prev);
+		}
+		if (i < 10) {
+			freeq_table_append_number(few, 0, i);
+			freeq_table_append_string(few, 1, sbuf, -1);
+			freeq_table_end_row(few);
+		}
+		/* 50 goes away, 98 and 99 change, 100 and 101 are new */
+		if (i == 50)
+			continue;
+		if (i == 98 || i == 99)
+			snprintf(sbuf, sizeof(sbuf), "renamed-%d", i);
+		freeq_table_append_number(next, 0, i);
+		freeq_table_append_string(next, 1, sbuf, -1);
+		freeq_table_end_row(next);
+	}
+
+	/* nothing to diff against without a key */
+	ck_assert_int_eq(freeq_table_delta(ctx, prev, next, &d), FREEQ_ERR);
+	freeq_table_set_key(prev, 0);
+	freeq_table_set_key(next, 0);
+	freeq_table_set_key(few, 0);
+	ck_assert_int_eq(freeq_table_delta(ctx, few, next, &d), FREEQ_ERR);
+	ck_assert_int_eq(freeq_table_delta(ctx, prev, next, &d), 0);
+	ck_assert_int_eq(d->numrows, 4);
+
+	BIO *mem = BIO_new(BIO_s_mem());
+	freeq_table_bio_write(ctx, d, mem);
+	ck_assert_int_eq(freeq_table_bio_read_dict(ctx, &d2, mem, NULL, NULL, &flags), 0);
+	ck_assert(flags & FREEQ_FRAME_DELTA);
+	ck_assert_int_eq(d2->numrows, 4);
+	BIO_free(mem);
+
+	/* unchanged rows come from the base, in its order, then the
+	 * changed ones */
+	ck_assert_int_eq(freeq_table_apply_delta(ctx, NULL, d2, &full), FREEQ_ERR);
+	ck_assert_int_eq(freeq_table_apply_delta(ctx, prev, d2, &full), 0);
+	ck_assert(compare_tables(next, full));
+
+	freeq_table_unref(d);
+	freeq_table_unref(d2);
+	freeq_table_unref(full);
+	freeq_table_unref(few);
+	freeq_table_unref(prev);
+	freeq_table_unref(next);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_freeq_compression)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *t = 0, *t2 = 0;
+	const char *names[] = { "pid", "cmd" };
+	char sbuf[128];
+	GByteArray *plain, *frame;
+
+	freeq_new(&ctx, appname, identity, FREEQ_CLIENT);
+	freeq_table_new_empty(ctx, "compress", 2, test_coltypes, names, &t);
+	for (int i = 0; i < 2000; i++) {
+		snprintf(sbuf, sizeof(sbuf), "/usr/lib/jvm/java-11/bin/java -Xmx%dm -jar /opt/app/worker-%d.jar", i % 7, i);
+		freeq_table_append_number(t, 0, i);
+		freeq_table_append_string(t, 1, sbuf, -1);
+		freeq_table_end_row(t);
+	}
+
+	plain = g_byte_array_new();
+	freeq_table_encode(ctx, t, plain, freeq_get_frame_flags(ctx), NULL);
+	ck_assert_int_eq(freeq_frame_compress(ctx, plain, 0, 7), FREEQ_ERR);
+
+	/* every codec this build has makes the frame smaller and reads
+	 * back to the same table */
+	for (uint8_t codec = FREEQ_CODEC_LZ4; codec <= FREEQ_CODEC_ZSTD; codec++) {
+		if (!(freeq_codecs() & (1 << codec))) {
+			ck_assert_int_eq(freeq_set_compression(ctx, codec, 0), FREEQ_ERR);
+			continue;
+		}
+		frame = g_byte_array_new();
+		freeq_table_encode(ctx, t, frame, freeq_get_frame_flags(ctx), NULL);
+		ck_assert_int_eq(freeq_frame_compress(ctx, frame, 0, codec), 0);
+		ck_assert_int_eq(frame->data[6], codec);
+		ck_assert(frame->len < plain->len / 2);
+
+		ck_assert_int_eq(freeq_table_mem_read(ctx, &t2, frame->data, frame->len, NULL, NULL), 0);
+		ck_assert(compare_tables(t, t2));
+		freeq_table_unref(t2);
+
+		/* a codec the reader doesn't know is an error */
+		frame->data[6] = 7;
+		ck_assert_int_eq(freeq_table_mem_read(ctx, &t2, frame->data, frame->len, NULL, NULL), FREEQ_ERR);
+		g_byte_array_free(frame, TRUE);
+	}
+
+	g_byte_array_free(plain, TRUE);
+	freeq_table_unref(t);
+	freeq_unref(ctx);
+}
+END_TEST
 
 /* START_TEST (test_freeq_col_pack_unpack_check_data) */
 /* { */
@@ -196,7 +801,7 @@ END_TEST
 /* 	int data[10] = {0,1,2,3,4,5,6,7,8,9}; */
 /* 	msgpack_sbuffer sbuf; */
 	
-/* 	freeq_new(&ctx, appname, identity); */
+/* 	freeq_new(&ctx, appname, identity, FREEQ_CLIENT); */
 /* 	freeq_table_new_from_string(ctx, "foo", &t); */
 /* 	freeq_table_column_new(ctx, t, "bar", FREEQ_COL_NUMBER, &data, 10); */
 	
@@ -234,7 +839,7 @@ END_TEST
 /* 	//int data[10] = {0,1,2,3,4,5,6,7,8,9}; */
 /* 	msgpack_sbuffer sbuf; */
 	
-/* 	freeq_new(&ctx, appname, identity); */
+/* 	freeq_new(&ctx, appname, identity, FREEQ_CLIENT); */
 /* 	freeq_table_new_from_string(ctx, "foo", &t); */
 /* 	freeq_table_column_new(ctx, t, "bar", FREEQ_COL_NUMBER, &data, 10);	 */
 
@@ -254,6 +859,19 @@ freeq_basic_suite (void)
 	TCase *tc_core = tcase_create("Core");
 	/* tcase_add_test(tc_core, test_freeq_col_pack_unpack); */
 	tcase_add_test(tc_core, test_freeq_write_read_bio);
+	tcase_add_test(tc_core, test_freeq_builder_write_read_bio);
+	tcase_add_test(tc_core, test_freeq_wide_numbers_write_read_bio);
+	tcase_add_test(tc_core, test_freeq_mem_read);
+	tcase_add_test(tc_core, test_freeq_string_views);
+	tcase_add_test(tc_core, test_freeq_frames);
+	tcase_add_test(tc_core, test_freeq_stream_dict);
+	tcase_add_test(tc_core, test_freeq_ack);
+	tcase_add_test(tc_core, test_freeq_error_frame);
+	tcase_add_test(tc_core, test_freeq_result_read);
+	tcase_add_test(tc_core, test_freeq_table_encode_chunks);
+	tcase_add_test(tc_core, test_freeq_decode_numrows);
+	tcase_add_test(tc_core, test_freeq_delta);
+	tcase_add_test(tc_core, test_freeq_compression);
 	/*tcase_add_test(tc_core, test_freeq_col_pack_unpack_check_data);
 	tcase_add_test(tc_core, test_freeq_col_pack_something);*/
 
@@ -0,0 +1,208 @@
+#include <check.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "src/freeq/libfreeq.h"
+#include "libfreeq-private.h"
+#include "src/query.h"
+
+const char *appname = "appname";
+const char *colnames[] = { "pid", "cmd", "cpu" };
+freeq_coltype_t test_coltypes[] = { FREEQ_COL_NUMBER, FREEQ_COL_STRING, FREEQ_COL_DOUBLE };
+
+#include "tests/fixtures.h"
+
+/* hosts a, b and c report 2, 4 and 6 processes */
+static struct freeq_table *
+merged_table(struct freeq_ctx *ctx)
+{
+	struct freeq_table *m, *t;
+	const char *hosts[] = { "a", "b", "c" };
+
+	for (int i = 0; i < 3; i++)
+	{
+		t = sender_table(ctx, hosts[i], 2 * (i + 1), 100 * i);
+		if (i == 0)
+			freeq_table_new_merge(ctx, t, NULL, &m);
+		freeq_table_merge(ctx, m, t);
+		freeq_table_unref(t);
+	}
+	return m;
+}
+
+static struct freeq_table *
+run(struct freeq_ctx *ctx, struct freeq_table *t, const char *sql)
+{
+	struct freeq_query *q;
+	struct freeq_table *r = NULL;
+
+	ck_assert_int_eq(freeq_query_parse(ctx, sql, &q), 0);
+	ck_assert_str_eq(freeq_query_table(q), "foo");
+	ck_assert_int_eq(freeq_query_run(ctx, q, t, &r), 0);
+	freeq_query_free(q);
+	return r;
+}
+
+START_TEST (test_query_parse_unsupported)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_query *q;
+
+	freeq_new(&ctx, appname, NULL, FREEQ_SERVER);
+	ck_assert_int_ne(freeq_query_parse(ctx, "SELECT * FROM a JOIN b", &q), 0);
+	ck_assert_int_ne(freeq_query_parse(ctx, "SELECT pid FROM foo WHERE pid IN (1, 2)", &q), 0);
+	ck_assert_int_ne(freeq_query_parse(ctx, "SELECT cmd, count(*) FROM foo GROUP BY host", &q), 0);
+	ck_assert_int_ne(freeq_query_parse(ctx, "DELETE FROM foo", &q), 0);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_query_filter)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *m, *r;
+	freeq_str_t sv;
+
+	freeq_new(&ctx, appname, NULL, FREEQ_SERVER);
+	m = merged_table(ctx);
+
+	r = run(ctx, m, "select pid, host from foo where cmd > 'b' and cmd != 'b101' and pid < 202");
+	ck_assert_int_eq(r->numcols, 2);
+	ck_assert_str_eq(r->columns[1].name, "host");
+	ck_assert_int_eq(r->numrows, 5);
+	ck_assert_int_eq(freeq_column_number(&r->columns[0], 0), 100);
+	ck_assert_int_eq(freeq_column_number(&r->columns[0], 1), 102);
+	ck_assert_int_eq(freeq_column_number(&r->columns[0], 4), 201);
+	sv = freeq_column_string(&r->columns[1], 4);
+	ck_assert(sv.len == 1 && sv.str[0] == 'c');
+	freeq_table_unref(r);
+
+	r = run(ctx, m, "SELECT * FROM foo WHERE cpu > 1.2 ORDER BY pid DESC LIMIT 2;");
+	ck_assert_int_eq(r->numcols, 3);
+	ck_assert_int_eq(r->numrows, 2);
+	ck_assert_int_eq(freeq_column_number(&r->columns[0], 0), 205);
+	ck_assert_int_eq(freeq_column_number(&r->columns[0], 1), 204);
+	freeq_table_unref(r);
+
+	/* a number column against a literal that isn't an integer */
+	r = run(ctx, m, "select pid from foo where pid < 1.5");
+	ck_assert_int_eq(r->numrows, 2);
+	freeq_table_unref(r);
+	r = run(ctx, m, "select pid from foo where pid = 1.5");
+	ck_assert_int_eq(r->numrows, 0);
+	freeq_table_unref(r);
+	r = run(ctx, m, "select pid from foo where pid > 1e300");
+	ck_assert_int_eq(r->numrows, 0);
+	freeq_table_unref(r);
+	r = run(ctx, m, "select pid from foo where pid < 99999999999999999999");
+	ck_assert_int_eq(r->numrows, 12);
+	freeq_table_unref(r);
+
+	freeq_table_unref(m);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_query_group_by_host)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *m, *r;
+	freeq_str_t sv;
+
+	freeq_new(&ctx, appname, NULL, FREEQ_SERVER);
+	m = merged_table(ctx);
+
+	r = run(ctx, m, "select host, count(*) as n, sum(pid), max(cpu) from foo "
+		"group by host order by n desc limit 2");
+	ck_assert_int_eq(r->numrows, 2);
+	ck_assert_str_eq(r->columns[1].name, "n");
+	ck_assert_str_eq(r->columns[2].name, "sum(pid)");
+	ck_assert_int_eq(r->columns[3].coltype, FREEQ_COL_DOUBLE);
+	sv = freeq_column_string(&r->columns[0], 0);
+	ck_assert(sv.len == 1 && sv.str[0] == 'c');
+	ck_assert_int_eq(freeq_column_number(&r->columns[1], 0), 6);
+	ck_assert_int_eq(freeq_column_number(&r->columns[2], 0), 1215);
+	ck_assert(freeq_column_double(&r->columns[3], 0) == 102.5);
+	ck_assert_int_eq(freeq_column_number(&r->columns[1], 1), 4);
+	freeq_table_unref(r);
+
+	/* without GROUP BY the selection is a single group, and the
+	 * sum, min or max of none of its rows is NULL */
+	r = run(ctx, m, "select count(*), min(pid), sum(cpu) as s from foo where pid > 1000 order by s");
+	ck_assert_int_eq(r->numrows, 1);
+	ck_assert_int_eq(freeq_column_number(&r->columns[0], 0), 0);
+	ck_assert_int_eq(r->columns[1].coltype, FREEQ_COL_NULL);
+	ck_assert_int_eq(r->columns[2].coltype, FREEQ_COL_NULL);
+	freeq_table_unref(r);
+
+	freeq_table_unref(m);
+	freeq_unref(ctx);
+}
+END_TEST
+
+/* what a sealed generation's tables look like once the publisher
+ * has compacted them */
+START_TEST (test_query_compacted)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *m, *t, *r;
+	freeq_str_t sv;
+
+	freeq_new(&ctx, appname, NULL, FREEQ_SERVER);
+	m = merged_table(ctx);
+
+	/* b reports again, leaving its first 4 rows dead between a's
+	 * and c's */
+	t = sender_table(ctx, "b", 1, 500);
+	ck_assert_int_eq(freeq_table_merge(ctx, m, t), 0);
+	freeq_table_unref(t);
+	ck_assert_int_eq(m->numrows, 13);
+	freeq_table_compact(m);
+	ck_assert_int_eq(m->numrows, 9);
+
+	r = run(ctx, m, "select pid, cmd, host from foo where pid >= 200 order by pid");
+	ck_assert_int_eq(r->numrows, 7);
+	ck_assert_int_eq(freeq_column_number(&r->columns[0], 0), 200);
+	sv = freeq_column_string(&r->columns[1], 0);
+	ck_assert(sv.len == 4 && memcmp(sv.str, "c200", 4) == 0);
+	sv = freeq_column_string(&r->columns[1], 6);
+	ck_assert(sv.len == 4 && memcmp(sv.str, "b500", 4) == 0);
+	sv = freeq_column_string(&r->columns[2], 6);
+	ck_assert(sv.len == 1 && sv.str[0] == 'b');
+	freeq_table_unref(r);
+
+	r = run(ctx, m, "select count(*) from foo where cmd < 'c'");
+	ck_assert_int_eq(freeq_column_number(&r->columns[0], 0), 3);
+	freeq_table_unref(r);
+
+	freeq_table_unref(m);
+	freeq_unref(ctx);
+}
+END_TEST
+
+Suite *
+freeq_query_suite (void)
+{
+	Suite *s = suite_create("freeq_query");
+	TCase *tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, test_query_parse_unsupported);
+	tcase_add_test(tc_core, test_query_filter);
+	tcase_add_test(tc_core, test_query_group_by_host);
+	tcase_add_test(tc_core, test_query_compacted);
+
+	suite_add_tcase(s, tc_core);
+	return s;
+}
+
+int
+main (void)
+{
+	int number_failed;
+	Suite *s = freeq_query_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,174 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "src/freeq/libfreeq.h"
+#include "libfreeq-private.h"
+#include "src/stats.h"
+
+const char *appname = "appname";
+
+/* row of the freeq_stats table for metric and label, -1 if none */
+static int
+stats_row(struct freeq_table *t, const char *metric, const char *label)
+{
+	for (uint32_t i = 0; i < t->numrows; i++)
+	{
+		freeq_str_t m = freeq_column_string(&t->columns[0], i);
+		freeq_str_t l = freeq_column_string(&t->columns[1], i);
+		if (m.len == strlen(metric) && memcmp(m.str, metric, m.len) == 0 &&
+		    l.len == strlen(label) && (l.len == 0 || memcmp(l.str, label, l.len) == 0))
+			return i;
+	}
+	return -1;
+}
+
+static void *
+count_thread(void *arg)
+{
+	for (int i = 0; i < 1000; i++)
+	{
+		freeq_stats_count(FREEQ_STAT_ACCEPTED_AGG, 1);
+		freeq_stats_observe(FREEQ_HIST_QUERY, i < 990 ? 100 : 5000);
+	}
+	freeq_stats_decoded("procs", 10, 200);
+	return NULL;
+}
+
+START_TEST (test_stats_threads)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *t;
+	pthread_t threads[4];
+	int row;
+
+	freeq_new(&ctx, appname, NULL, FREEQ_SERVER);
+	for (int i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, count_thread, NULL);
+	for (int i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+	freeq_stats_gauge_add(FREEQ_GAUGE_CONNECTIONS, 3);
+	freeq_stats_gauge_add(FREEQ_GAUGE_CONNECTIONS, -1);
+
+	/* every thread's shard is added up */
+	ck_assert_int_eq(freeq_stats_table(ctx, &t), 0);
+	ck_assert_str_eq(t->name, "freeq_stats");
+	ck_assert_int_eq(t->numcols, 7);
+
+	row = stats_row(t, "connections_accepted", "agg");
+	ck_assert(row >= 0);
+	ck_assert_int_eq(freeq_column_number(&t->columns[2], row), 4000);
+
+	row = stats_row(t, "connections_open", "");
+	ck_assert(row >= 0);
+	ck_assert_int_eq(freeq_column_number(&t->columns[2], row), 2);
+
+	/* 99% of the samples are 100us, so both quantiles are the top
+	 * of their bucket and only the max shows the slow ones */
+	row = stats_row(t, "query_us", "");
+	ck_assert(row >= 0);
+	ck_assert_int_eq(freeq_column_number(&t->columns[2], row), 4000);
+	ck_assert_int_eq(freeq_column_number(&t->columns[3], row), 4 * (990 * 100 + 10 * 5000));
+	ck_assert_int_eq(freeq_column_number(&t->columns[4], row), 127);
+	ck_assert_int_eq(freeq_column_number(&t->columns[5], row), 127);
+	ck_assert_int_eq(freeq_column_number(&t->columns[6], row), 5000);
+
+	row = stats_row(t, "rows_decoded", "procs");
+	ck_assert(row >= 0);
+	ck_assert_int_eq(freeq_column_number(&t->columns[2], row), 40);
+
+	freeq_table_unref(t);
+	freeq_unref(ctx);
+}
+END_TEST
+
+START_TEST (test_stats_text)
+{
+	GString *text;
+
+	freeq_stats_decoded("we\"ird", 3, 100);
+	freeq_stats_observe(FREEQ_HIST_PUBLISH, 0);
+	freeq_stats_observe(FREEQ_HIST_PUBLISH, 3000);
+	freeq_stats_published("we\"ird", 700);
+
+	text = freeq_stats_text();
+	ck_assert(strstr(text->str, "# TYPE freeqd_connections_accepted_total counter\n"
+			 "freeqd_connections_accepted_total{kind=\"agg\"} ") != NULL);
+	ck_assert(strstr(text->str, "freeqd_rows_decoded_total{table=\"we\\\"ird\"} 3\n") != NULL);
+
+	/* buckets are cumulative */
+	ck_assert(strstr(text->str, "freeqd_publish_us_bucket{le=\"0\"} 1\n") != NULL);
+	ck_assert(strstr(text->str, "freeqd_publish_us_bucket{le=\"2047\"} 1\n") != NULL);
+	ck_assert(strstr(text->str, "freeqd_publish_us_bucket{le=\"4095\"} 2\n") != NULL);
+	ck_assert(strstr(text->str, "freeqd_publish_us_bucket{le=\"+Inf\"} 2\n") != NULL);
+	ck_assert(strstr(text->str, "freeqd_publish_us_sum 3000\n") != NULL);
+
+	ck_assert(strstr(text->str, "freeqd_table_publish_us{table=\"we\\\"ird\",quantile=\"0.5\"} 700\n") != NULL);
+	g_string_free(text, TRUE);
+}
+END_TEST
+
+START_TEST (test_stats_table_names)
+{
+	struct freeq_ctx *ctx;
+	struct freeq_table *t;
+	char name[16];
+	int labelled = 0, row;
+
+	freeq_new(&ctx, appname, NULL, FREEQ_SERVER);
+	for (int i = 0; i < FREEQ_STATS_TABLES_MAX + 10; i++)
+	{
+		snprintf(name, sizeof(name), "t%d", i);
+		freeq_stats_decoded(name, 1, 10);
+	}
+	/* a name that got a label keeps it */
+	freeq_stats_decoded("t0", 1, 10);
+
+	ck_assert_int_eq(freeq_stats_table(ctx, &t), 0);
+	for (uint32_t i = 0; i < t->numrows; i++)
+	{
+		freeq_str_t m = freeq_column_string(&t->columns[0], i);
+		if (m.len == strlen("rows_decoded") && memcmp(m.str, "rows_decoded", m.len) == 0)
+			labelled++;
+	}
+	ck_assert_int_eq(labelled, FREEQ_STATS_TABLES_MAX + 1);
+
+	row = stats_row(t, "rows_decoded", "t0");
+	ck_assert(row >= 0);
+	ck_assert_int_eq(freeq_column_number(&t->columns[2], row), 2);
+	row = stats_row(t, "rows_decoded", FREEQ_STATS_OTHER);
+	ck_assert(row >= 0);
+	ck_assert(freeq_column_number(&t->columns[2], row) >= 10);
+
+	freeq_table_unref(t);
+	freeq_unref(ctx);
+}
+END_TEST
+
+Suite *
+freeq_stats_suite (void)
+{
+	Suite *s = suite_create("freeq_stats");
+	TCase *tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, test_stats_threads);
+	tcase_add_test(tc_core, test_stats_text);
+	tcase_add_test(tc_core, test_stats_table_names);
+
+	suite_add_tcase(s, tc_core);
+	return s;
+}
+
+int
+main (void)
+{
+	int number_failed;
+	Suite *s = freeq_stats_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
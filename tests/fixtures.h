@@ -0,0 +1,47 @@
+#ifndef _FREEQ_TESTS_FIXTURES_H_
+#define _FREEQ_TESTS_FIXTURES_H_
+
+/*
+ * tables shared by the check suites.  a suite defines colnames and
+ * test_coltypes before including this, and sender_table() builds the
+ * table foo in those columns.
+ */
+
+/* the rows @sender reports, numbered from @base: a number column
+ * holds the row number, a string column the sender followed by it
+ * and a double column half of it */
+static struct freeq_table *
+sender_table(struct freeq_ctx *ctx, const char *sender, int rows, int base)
+{
+	const int numcols = sizeof(test_coltypes) / sizeof(test_coltypes[0]);
+	struct freeq_table *t;
+	char s[16];
+
+	freeq_table_new_empty(ctx, "foo", numcols, test_coltypes, colnames, &t);
+	t->identity = freeq_table_strdup(t, sender);
+	for (int i = 0; i < rows; i++)
+	{
+		for (int j = 0; j < numcols; j++)
+		{
+			switch (test_coltypes[j])
+			{
+			case FREEQ_COL_NUMBER:
+				freeq_table_append_number(t, j, base + i);
+				break;
+			case FREEQ_COL_STRING:
+				snprintf(s, sizeof(s), "%s%d", sender, base + i);
+				freeq_table_append_string(t, j, s, -1);
+				break;
+			case FREEQ_COL_DOUBLE:
+				freeq_table_append_double(t, j, 0.5 * (base + i));
+				break;
+			default:
+				break;
+			}
+		}
+		freeq_table_end_row(t);
+	}
+	return t;
+}
+
+#endif